@@ -0,0 +1,31 @@
+/* agg.h
+
+   Aggregation kernels (count/sum/min/max) over packed integer arrays,
+   shared by the time-series store and the server's aggregate queries.
+
+*/
+
+#ifndef AGG_H
+#define AGG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Running aggregate. Merge partial results with agg_merge().
+typedef struct aggresult {
+  int64_t count;
+  int64_t sum;
+  int64_t min;
+  int64_t max;
+} AggResult;
+
+// reset 'r' to the empty aggregate.
+void agg_init(AggResult *r);
+
+// fold 'n' packed values (each offset by 'bias') into 'r'.
+void agg_reduce_i32(AggResult *r, const int32_t *v, size_t n, int64_t bias);
+
+// fold the partial aggregate 'o' into 'r'.
+void agg_merge(AggResult *r, const AggResult *o);
+
+#endif
@@ -1,4 +1,6 @@
 #include "utils.h"
+#include "kvclient.h"
+#include "loadgen.h"
 #include <pthread.h>
 
 #define SERVER_PORT     6767
@@ -10,16 +12,29 @@
 #define PUT_MODE           2
 #define USER_MODE          3
 #define BOTH_MODE          4
+#define SCAN_MODE          5
+#define LOAD_MODE          6
+#define SATURATE_MODE      7
 #define THREAD_NUM         10
 
 struct sockaddr_in server_addr;                        // server_addr: The server address.
 
+KVClient *kv = NULL;                                   // -b: Sessions shared by the threads.
+
 int get_station, 
     put_station = 0;
 
 pthread_mutex_t put_mutx = PTHREAD_MUTEX_INITIALIZER,
                 get_mutx = PTHREAD_MUTEX_INITIALIZER,
-                socket_mutx = PTHREAD_MUTEX_INITIALIZER;
+                print_mutx = PTHREAD_MUTEX_INITIALIZER;   // -o/-s on several servers: one reply line at a time.
+
+// Definition of a request to one of several servers (-o/-s with a list of servers).
+typedef struct shardtalk {
+  struct sockaddr_in addr;
+  char label[MAXHOSTNAMELEN + 16];     // "host:port", the prefix of its reply lines.
+  char request[BUF_SIZE];
+  pthread_t tid;
+} ShardTalk;
 
 
 /**
@@ -30,15 +45,49 @@ void print_usage() {
   fprintf(stderr, "Usage: client [OPTION]...\n\n");
   fprintf(stderr, "Available Options:\n");
   fprintf(stderr, "-h:             Print this help message.\n");
-  fprintf(stderr, "-a <address>:   Specify the server address or hostname.\n");
+  fprintf(stderr, "-a <address>:   Specify the server address or hostname, or a list of servers\n");
+  fprintf(stderr, "                host[:port],host[:port],... that the keys are spread over by consistent hashing.\n");
+  fprintf(stderr, "-P <port>:      Specify the server port (default %d).\n", SERVER_PORT);
   fprintf(stderr, "-o <operation>: Send a single operation to the server.\n");
   fprintf(stderr, "                <operation>:\n");
   fprintf(stderr, "                PUT:key:value\n");
   fprintf(stderr, "                GET:key\n");
+  fprintf(stderr, "                DELETE:key\n");
+  fprintf(stderr, "                MGET:key1,key2,...\n");
+  fprintf(stderr, "                INCR:key[:delta], DECR:key[:delta]\n");
+  fprintf(stderr, "                CAS:key:expected:new (expected empty: only if missing)\n");
+  fprintf(stderr, "                APPEND:key:suffix\n");
+  fprintf(stderr, "                SCAN\n");
+  fprintf(stderr, "                RANGE:lo:hi\n");
+  fprintf(stderr, "                PREFIX:prefix\n");
+  fprintf(stderr, "                TSAGG:key[:from_ms[:to_ms]]\n");
+  fprintf(stderr, "                AGG:SUM|MIN|MAX|AVG|COUNT[:prefix]\n");
+  fprintf(stderr, "                STATUS\n");
+  fprintf(stderr, "                TRACE\n");
+  fprintf(stderr, "                HOTKEYS\n");
+  fprintf(stderr, "                QUEUES\n");
+  fprintf(stderr, "                COMPACT\n");
+  fprintf(stderr, "                WATCH:key or WATCH:prefix*[:window_ms] (prints the changes until interrupted)\n");
   fprintf(stderr, "-i <count>:     Specify the number of iterations.\n");
   fprintf(stderr, "-g:             Repeatedly send GET operations.\n");
   fprintf(stderr, "-p:             Repeatedly send PUT operations.\n");
   fprintf(stderr, "-b:             Repeatedly send both PUT and GET operations.\n");
+  fprintf(stderr, "-s:             Retrieve all key/value pairs with a single SCAN.\n");
+  fprintf(stderr, "-L:             Open-loop load test; prints throughput and latency percentiles.\n");
+  fprintf(stderr, "                -R <req/s>:  Target request rate (default 1000).\n");
+  fprintf(stderr, "                -T <secs>:   Duration (default 10).\n");
+  fprintf(stderr, "                -c <conns>:  Connections, per server (default 4).\n");
+  fprintf(stderr, "                -k <keys>:   Keyspace size (default 10000).\n");
+  fprintf(stderr, "                -D <dist>:   uniform, zipf[:theta] or hotspot[:hot_keys[:hot_ops]] (default uniform).\n");
+  fprintf(stderr, "                -m <r:w>:    Read:write ratio (default 90:10).\n");
+  fprintf(stderr, "                -V <bytes>:  Value size (default 16, at most %d).\n", LOAD_MAX_VALUE_SIZE);
+  fprintf(stderr, "                -C <file>:   Also append the results to this CSV file.\n");
+  fprintf(stderr, "                -S <seed>:   Fixed random seed, for repeatable runs (default: from the clock).\n");
+  fprintf(stderr, "-E:             Saturation test: epoll threads keep many requests in flight (closed loop).\n");
+  fprintf(stderr, "                Takes -T, -c, -k, -D, -m, -V, -C and -S as above, and:\n");
+  fprintf(stderr, "                -t <threads>: Driver threads (default 2).\n");
+  fprintf(stderr, "                -q <depth>:   Requests in flight per connection (default 16).\n");
+  fprintf(stderr, "                -O <file>:    Write every request's send/receive timestamps to this CSV file.\n");
 }
 
 /**
@@ -70,8 +119,10 @@ void talk(const struct sockaddr_in server_addr, char *buffer) {
   do {
     memset(rcv_buffer, 0, BUF_SIZE);
     numbytes = read_str_from_socket(socket_fd, rcv_buffer, BUF_SIZE);
-    if (numbytes != 0)
+    if (numbytes != 0) {
       printf("%s", rcv_buffer); // print to stdout
+      fflush(stdout);           // A WATCH prints changes as they come.
+    }
   } while (numbytes > 0);
   printf("\n");
       
@@ -79,6 +130,140 @@ void talk(const struct sockaddr_in server_addr, char *buffer) {
   close(socket_fd);
 }
 
+/**
+ * @name set_server_addr - Resolves a server's address.
+ * @param host: Server address or hostname.
+ * @param port: Server port.
+ * @param addr: The address to fill in.
+ *
+ * @return
+ */
+void set_server_addr(const char *host, int port, struct sockaddr_in *addr) {
+  struct hostent *host_info;
+
+  // get the host (server) info
+  if ((host_info = gethostbyname(host)) == NULL) {
+    ERROR("gethostbyname()");
+  }
+
+  // create socket adress of server (type, IP-adress and port number)
+  bzero(addr, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr = *((struct in_addr*)host_info->h_addr);
+  addr->sin_port = htons(port);
+}
+
+/**
+ * @name talk_shard - Sends a message to one of several servers and prints the response, each line prefixed with
+ *                    the server.
+ * @param arg: The ShardTalk.
+ *
+ * @return
+ */
+void *talk_shard(void *arg) {
+  ShardTalk *st = (ShardTalk *) arg;
+  char rcv_buffer[BUF_SIZE], *line, *next;
+  int socket_fd, numbytes;
+
+  if ((socket_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1 ||
+      connect(socket_fd, (struct sockaddr*) &st->addr, sizeof(st->addr)) == -1) {
+    fprintf(stderr, "[%s] Error: Cannot connect.\n", st->label);
+    if (socket_fd != -1)
+      close(socket_fd);
+    return NULL;
+  }
+  write_str_to_socket(socket_fd, st->request, strlen(st->request));
+
+  do {
+    memset(rcv_buffer, 0, BUF_SIZE);
+    numbytes = read_str_from_socket(socket_fd, rcv_buffer, BUF_SIZE);
+    if (numbytes != 0) {
+      pthread_mutex_lock(&print_mutx);
+      for (line = rcv_buffer; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        if (*next)
+          next++;
+        printf("[%s] %.*s%s", st->label, (int) (next - line), line, (next[-1] == '\n') ? "" : "\n");
+      }
+      fflush(stdout);
+      pthread_mutex_unlock(&print_mutx);
+    }
+  } while (numbytes > 0);
+
+  close(socket_fd);
+  return NULL;
+}
+
+/**
+ * @name talk_shards - Sends a message that isn't about a single key to every server, in parallel, and prints the
+ *                     responses as they come.
+ * @param shards: The servers.
+ * @param buffer: The message. An MGET only gets the keys of each server (and only the servers with some).
+ *
+ * @return
+ */
+void talk_shards(const KVShards *shards, const char *buffer) {
+  int num = kv_shards_count(shards), k, shard, port, len, table = 0;
+  char *keys, *key, *save;
+  const char *host, *mget;
+  ShardTalk *st;
+
+  // The request itself, after an "@table:".
+  if (buffer[0] == '@' && (mget = strchr(buffer, ':')))
+    table = mget + 1 - buffer;
+  mget = strncmp(buffer + table, "MGET:", 5) ? NULL : buffer + table + 5;
+
+  if (!(st = (ShardTalk *) calloc(num, sizeof(ShardTalk))))
+    ERROR("calloc()");
+  for (k = 0; k < num; k++) {
+    host = kv_shards_endpoint(shards, k, &port);
+    set_server_addr(host, port, &st[k].addr);
+    snprintf(st[k].label, sizeof(st[k].label), "%s:%d", host, port);
+    if (!mget)
+      snprintf(st[k].request, sizeof(st[k].request), "%s", buffer);
+  }
+
+  if (mget) {
+    // Split the keys by server.
+    if (!(keys = strdup(mget)))
+      ERROR("strdup()");
+    for (key = strtok_r(keys, ",", &save); key; key = strtok_r(NULL, ",", &save)) {
+      shard = kv_shards_find(shards, key);
+      len = strlen(st[shard].request);
+      if (!len)
+        len = snprintf(st[shard].request, sizeof(st[shard].request), "%.*sMGET:", table, buffer);
+      snprintf(st[shard].request + len, sizeof(st[shard].request) - len, "%s%s",
+               (st[shard].request[len - 1] == ':') ? "" : ",", key);
+    }
+    free(keys);
+  }
+
+  for (k = 0; k < num; k++) {
+    if (st[k].request[0] && pthread_create(&st[k].tid, NULL, talk_shard, &st[k]))
+      st[k].request[0] = '\0';
+  }
+  for (k = 0; k < num; k++) {
+    if (st[k].request[0])
+      pthread_join(st[k].tid, NULL);
+  }
+  free(st);
+}
+
+/**
+ * @name send_operation - Sends an operation on the shared sessions and prints it with its result.
+ * @param buffer: The operation.
+ *
+ * The threads run their requests in parallel; each prints its operation and result at once.
+ * @return
+ */
+void send_operation(const char *buffer) {
+  char reply[KV_REPLY_SIZE];
+
+  if (kv_request(kv, buffer, reply, sizeof(reply)))
+    ERROR("kv_request()");
+  printf("Operation: %s\nResult: %s\n\n", buffer, reply);
+}
+
 /**
  * @name put_operation - Sends PUT operation reapeatedly via threads.
  * @return
@@ -93,16 +278,14 @@ void *put_operation(){
 
     pthread_mutex_lock(&put_mutx);
     if(put_station > MAX_STATION_ID){
+      pthread_mutex_unlock(&put_mutx);
       break;
     }
     sprintf(buffer, "PUT:station.%d:%d", put_station, value);
     put_station++;
     pthread_mutex_unlock(&put_mutx);
 
-    pthread_mutex_lock(&socket_mutx);
-    printf("Operation: %s\n", buffer);
-    talk(server_addr, buffer);                                                // O Buffer edw, einai Krisimos Poros.
-    pthread_mutex_unlock(&socket_mutx);  
+    send_operation(buffer);
   }
   return NULL;
 }
@@ -117,6 +300,7 @@ void *get_operation(){
   while(1){
     pthread_mutex_lock(&get_mutx);
     if(get_station > MAX_STATION_ID){
+      pthread_mutex_unlock(&get_mutx);
       break;
     }
     // Repeatedly GET.
@@ -124,10 +308,7 @@ void *get_operation(){
     get_station++; 
     pthread_mutex_unlock(&get_mutx);
     
-    pthread_mutex_lock(&socket_mutx);
-    printf("Operation: %s\n", buffer);
-    talk(server_addr, buffer);    
-    pthread_mutex_unlock(&socket_mutx);
+    send_operation(buffer);
   }
   return NULL;
 }
@@ -164,12 +345,19 @@ int main(int argc, char **argv) {
   int mode = 0;
   int option = 0;
   int count = ITER_COUNT;
+  int port = SERVER_PORT;
   char snd_buffer[BUF_SIZE];
-  int station, value;
-  struct hostent *host_info;
+  int station, value, shard;
+  char reply[KV_REPLY_SIZE];
+  KVShards *shards;
+  const char *shard_host;
+  LoadConfig load;
+  char *sep;
   
+  loadgen_defaults(&load);
+
   // Parse user parameters.
-  while ((option = getopt(argc, argv,"i:hgpbo:a:")) != -1) {
+  while ((option = getopt(argc, argv,"i:hgpbsLEo:a:P:R:T:c:k:D:m:V:C:t:q:O:S:")) != -1) {
     switch (option) {
       case 'h':
         print_usage();
@@ -177,30 +365,97 @@ int main(int argc, char **argv) {
       case 'a':
         host = optarg;
         break;
+      case 'P':
+        port = atoi(optarg);
+        break;
       case 'i':
         count = atoi(optarg);
 	break;
       case 'g':
         if (mode) {
-          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -o\n");
+          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -s, -L, -E, -o\n");
           exit(EXIT_FAILURE);
         }
         mode = GET_MODE;
         break;
       case 'p': 
         if (mode) {
-          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -o\n");
+          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -s, -L, -E, -o\n");
           exit(EXIT_FAILURE);
         }
         mode = PUT_MODE;
         break;
       case 'b':         // Both PUT & GET requests
         if (mode) {
-          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -o\n");
+          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -s, -L, -E, -o\n");
           exit(EXIT_FAILURE);
         }
         mode = BOTH_MODE;
         break;
+      case 's':         // All pairs, streamed by the server.
+        if (mode) {
+          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -s, -L, -E, -o\n");
+          exit(EXIT_FAILURE);
+        }
+        mode = SCAN_MODE;
+        break;
+      case 'L':         // Load test.
+        if (mode) {
+          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -s, -L, -E, -o\n");
+          exit(EXIT_FAILURE);
+        }
+        mode = LOAD_MODE;
+        break;
+      case 'E':         // Saturation test.
+        if (mode) {
+          fprintf(stderr, "You can only specify one of the following: -g, -p, -b, -s, -L, -E, -o\n");
+          exit(EXIT_FAILURE);
+        }
+        mode = SATURATE_MODE;
+        break;
+      case 't':
+        load.threads = atoi(optarg);
+        break;
+      case 'q':
+        load.depth = atoi(optarg);
+        break;
+      case 'O':
+        load.timestamps = optarg;
+        break;
+      case 'R':
+        load.rate = atof(optarg);
+        break;
+      case 'T':
+        load.seconds = atoi(optarg);
+        break;
+      case 'c':
+        load.connections = atoi(optarg);
+        break;
+      case 'k':
+        load.keys = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        if (loadgen_parse_dist(&load, optarg)) {
+          fprintf(stderr, "Error: -D expects uniform, zipf[:theta] or hotspot[:hot_keys[:hot_ops]].\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'm':
+        if (!(sep = strchr(optarg, ':')) || atoi(optarg) + atoi(sep + 1) <= 0) {
+          fprintf(stderr, "Error: -m expects <reads:writes>, e.g. 95:5.\n");
+          exit(EXIT_FAILURE);
+        }
+        load.read_pct = 100 * atoi(optarg) / (atoi(optarg) + atoi(sep + 1));
+        break;
+      case 'V':
+        load.value_size = atoi(optarg);
+        break;
+      case 'C':
+        load.csv = optarg;
+        break;
+      case 'S':
+        load.seed = strtoull(optarg, NULL, 10);
+        break;
       case 'o':
         if (mode) {
           fprintf(stderr, "You can only specify one of the following: -r, -w, -o\n");
@@ -217,7 +472,7 @@ int main(int argc, char **argv) {
 
   // Check parameters.
   if (!mode) {
-    fprintf(stderr, "Error: One of -g, -p, -b, -o is required.\n\n");
+    fprintf(stderr, "Error: One of -g, -p, -b, -s, -L, -E, -o is required.\n\n");
     print_usage();
     exit(0);
   }
@@ -227,23 +482,43 @@ int main(int argc, char **argv) {
     exit(0);
   }
   
-  // get the host (server) info
-  if ((host_info = gethostbyname(host)) == NULL) { 
-    ERROR("gethostbyname()"); 
+  if (mode == LOAD_MODE || mode == SATURATE_MODE) {
+    load.host = host;
+    load.port = port;
+    if (mode == SATURATE_MODE)
+      return loadgen_saturate(&load) ? EXIT_FAILURE : 0;
+    return loadgen_run(&load) ? EXIT_FAILURE : 0;
+  }
+
+  if (!(shards = kv_shards_new(host, port))) {
+    fprintf(stderr, "Error: Bad server list %s.\n\n", host);
+    print_usage();
+    exit(0);
   }
-    
-  // create socket adress of server (type, IP-adress and port number)
-  bzero(&server_addr, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr = *((struct in_addr*)host_info->h_addr);
-  server_addr.sin_port = htons(SERVER_PORT);
 
-  if (mode == USER_MODE) {
+  if (mode == USER_MODE || mode == SCAN_MODE) {
     memset(snd_buffer, 0, BUF_SIZE);
-    strncpy(snd_buffer, request, strlen(request));
+    if (mode == USER_MODE)
+      strncpy(snd_buffer, request, strlen(request));
+    else
+      sprintf(snd_buffer, "SCAN");
     printf("Operation: %s\n", snd_buffer);
-    talk(server_addr, snd_buffer);
+
+    // A key's request goes to its server; the others to every server.
+    shard = (kv_shards_count(shards) == 1) ? 0 : kv_shards_route(shards, snd_buffer);
+    if (shard >= 0) {
+      shard_host = kv_shards_endpoint(shards, shard, &port);
+      set_server_addr(shard_host, port, &server_addr);
+      talk(server_addr, snd_buffer);
+    } else {
+      talk_shards(shards, snd_buffer);
+    }
   } else {
+    // -g/-p reuse one persistent session (per server) instead of connecting per request; -b gives each thread one.
+    if (!(kv = kv_open_shards(host, port, (mode == BOTH_MODE) ? THREAD_NUM : 1))) {
+      fprintf(stderr, "Error: Cannot open a session to %s.\n", host);
+      exit(EXIT_FAILURE);
+    }
     while(--count>=0) {
       for (station = 0; station <= MAX_STATION_ID; station++) {
         memset(snd_buffer, 0, BUF_SIZE);
@@ -260,10 +535,15 @@ int main(int argc, char **argv) {
           break;
         }
         printf("Operation: %s\n", snd_buffer);
-        talk(server_addr, snd_buffer);
+        if (kv_request(kv, snd_buffer, reply, sizeof(reply)))
+          ERROR("kv_request()");
+        printf("Result: %s\n\n", reply);
       }
     }
+    if (kv)
+      kv_close(kv);
   }
+  kv_shards_free(shards);
   return 0;
 }
 
@@ -0,0 +1,205 @@
+#!/bin/bash
+# e2e_bench.sh
+#
+#   End-to-end benchmark: starts ./server on a scratch database for every
+#   (workers, queue size) pair, drives it with ./client at every client
+#   concurrency and prints a throughput/latency table.
+#
+#   Every point is a warm-up run followed by RUNS measured runs with a fixed
+#   seed; the table shows their medians and the throughput spread
+#   ((max - min) / median), so a noisy point is visible as such.
+#
+#   With BASELINE set to the summary of a previous release, it exits 1 if
+#   any point lost more than MAX_DROP% of its throughput or its p99 latency
+#   grew by more than MAX_RISE%: a release gate for one Linux box.
+#
+#   Settings (environment):
+#     WORKERS="1 4 10"     server -w values
+#     QUEUES="2 10 64"     server -Q values
+#     IO=2                 server -i (I/O threads)
+#     CLIENTS="1 8 32"     client connections (-c)
+#     MODE=saturate        saturate: closed loop (-E), DEPTH requests in flight per connection,
+#                          driven by THREADS epoll threads (at most one per connection)
+#                          open: open loop (-L) at RATE req/s
+#     DEPTH=1  THREADS=2  RATE=5000   see MODE
+#     SECS=5  RUNS=3       duration of a run, measured runs per point
+#     KEYS=10000  MIX=90:10  DIST=uniform  VALUE=16  SEED=1   workload
+#     PORT=7676            server port (must be free)
+#     CPUS=                server -c cpu list (e.g. 0-3); the client runs on the other cpus
+#     CLIENT_CPUS=         client cpus for taskset (default: none, or the ones not in CPUS)
+#     OUT=e2e              writes OUT.csv (every run) and OUT_summary.csv (the table)
+#     BASELINE=            a previous OUT_summary.csv to compare against
+#     MAX_DROP=10  MAX_RISE=25
+
+WORKERS=${WORKERS:-"1 4 10"}
+QUEUES=${QUEUES:-"2 10 64"}
+IO=${IO:-2}
+CLIENTS=${CLIENTS:-"1 8 32"}
+MODE=${MODE:-saturate}
+DEPTH=${DEPTH:-1}
+THREADS=${THREADS:-2}
+RATE=${RATE:-5000}
+SECS=${SECS:-5}
+RUNS=${RUNS:-3}
+KEYS=${KEYS:-10000}
+MIX=${MIX:-90:10}
+DIST=${DIST:-uniform}
+VALUE=${VALUE:-16}
+SEED=${SEED:-1}
+PORT=${PORT:-7676}
+CPUS=${CPUS:-}
+CLIENT_CPUS=${CLIENT_CPUS:-}
+OUT=${OUT:-e2e}
+BASELINE=${BASELINE:-}
+MAX_DROP=${MAX_DROP:-10}
+MAX_RISE=${MAX_RISE:-25}
+
+cd "$(dirname "$0")" || exit 1
+if [ ! -x ./server ] || [ ! -x ./client ]; then
+  echo "e2e_bench: build ./server and ./client first (make all)" >&2
+  exit 1
+fi
+case $MODE in
+  saturate) LOAD="-E -q $DEPTH -t" ;;      # -t: see run_client.
+  open)     LOAD="-L -R $RATE" ;;
+  *)        echo "e2e_bench: MODE is saturate or open" >&2; exit 1 ;;
+esac
+
+# Client cpus: the ones not given to the server, unless set.
+TASKSET=
+if [ -n "$CPUS" ] && [ -z "$CLIENT_CPUS" ] && command -v nproc >/dev/null; then
+  CLIENT_CPUS=$(awk -v list="$CPUS" -v n="$(nproc)" 'BEGIN {
+    k = split(list, parts, ",")
+    for (i = 1; i <= k; i++) {
+      if (split(parts[i], r, "-") == 2) { for (c = r[1]; c <= r[2]; c++) used[c] = 1 } else used[parts[i]] = 1
+    }
+    for (c = 0; c < n; c++) if (!(c in used)) out = out (out == "" ? "" : ",") c
+    print out
+  }')
+fi
+if [ -n "$CLIENT_CPUS" ] && command -v taskset >/dev/null; then
+  TASKSET="taskset -c $CLIENT_CPUS"
+fi
+
+TMP=$(mktemp -d /tmp/e2e_bench.XXXXXX) || exit 1
+SERVER_PID=
+cleanup() {
+  [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+  rm -rf "$TMP"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+status() {
+  ./client -a 127.0.0.1 -P "$PORT" -o STATUS 2>/dev/null | grep -q "STATUS OK"
+}
+
+if status; then
+  echo "e2e_bench: port $PORT is already in use (set PORT)" >&2
+  exit 1
+fi
+
+# start_server <workers> <queue>: a fresh database, waits until it answers.
+start_server() {
+  rm -f "$TMP"/bench.db*
+  ./server -P "$PORT" -d "$TMP/bench.db" -w "$1" -Q "$2" -i "$IO" ${CPUS:+-c "$CPUS"} >/dev/null 2>"$TMP/server.log" &
+  SERVER_PID=$!
+  for i in $(seq 100); do
+    status && return 0
+    kill -0 "$SERVER_PID" 2>/dev/null || break
+    sleep 0.1
+  done
+  echo "e2e_bench: the server did not start:" >&2
+  tail -3 "$TMP/server.log" >&2
+  exit 1
+}
+
+stop_server() {
+  kill "$SERVER_PID" 2>/dev/null
+  wait "$SERVER_PID" 2>/dev/null
+  SERVER_PID=
+}
+
+# run_client <clients> <secs> <csv>
+run_client() {
+  local load=$LOAD
+
+  [ "$MODE" = saturate ] && load="$LOAD $(( $1 < THREADS ? $1 : THREADS ))"
+  rm -f "$3"
+  $TASKSET ./client -a 127.0.0.1 -P "$PORT" $load -T "$2" -c "$1" -k "$KEYS" -m "$MIX" -D "$DIST" \
+    -V "$VALUE" -S "$SEED" -C "$3" >/dev/null 2>>"$TMP/client.log"
+}
+
+echo "workers,queue_size,clients,run,mode,target_rate,seconds,connections,depth,keys,dist,read_pct,value_size,sent,completed,errors,throughput,p50_us,p90_us,p99_us,p999_us,max_us" > "$OUT.csv"
+
+echo "e2e_bench: mode=$MODE secs=$SECS runs=$RUNS keys=$KEYS mix=$MIX dist=$DIST value=$VALUE${CPUS:+ server_cpus=$CPUS}${TASKSET:+ client_cpus=$CLIENT_CPUS}" >&2
+for w in $WORKERS; do
+  for q in $QUEUES; do
+    start_server "$w" "$q"
+    for c in $CLIENTS; do
+      echo "e2e_bench: workers=$w queue=$q clients=$c" >&2
+      run_client "$c" 1 "$TMP/run.csv"          # Warm-up (and preload), not reported.
+      for r in $(seq "$RUNS"); do
+        if run_client "$c" "$SECS" "$TMP/run.csv" && [ -s "$TMP/run.csv" ]; then
+          echo "$w,$q,$c,$r,$(tail -1 "$TMP/run.csv")" >> "$OUT.csv"
+        else
+          echo "e2e_bench: run $r failed" >&2
+        fi
+      done
+    done
+    stop_server
+  done
+done
+
+# Medians per point.
+awk -F, '
+  function median(list,   v, n, i, j, t) {
+    n = split(list, v, " ")
+    for (i = 2; i <= n; i++)
+      for (j = i; j > 1 && v[j - 1] + 0 > v[j] + 0; j--) { t = v[j]; v[j] = v[j - 1]; v[j - 1] = t }
+    return (n % 2) ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+  }
+  NR > 1 {
+    p = $1 "," $2 "," $3
+    if (!(p in tput)) order[++points] = p
+    tput[p] = tput[p] " " $17; p50[p] = p50[p] " " $18; p99[p] = p99[p] " " $20; p999[p] = p999[p] " " $21
+    errors[p] += $16; runs[p]++
+    if (!(p in lo) || $17 + 0 < lo[p]) lo[p] = $17 + 0
+    if (!(p in hi) || $17 + 0 > hi[p]) hi[p] = $17 + 0
+  }
+  END {
+    print "workers,queue_size,clients,runs,throughput,spread_pct,p50_us,p99_us,p999_us,errors"
+    for (i = 1; i <= points; i++) {
+      p = order[i]; m = median(tput[p])
+      printf "%s,%d,%.1f,%.1f,%s,%s,%s,%d\n", p, runs[p], m, (m > 0) ? 100 * (hi[p] - lo[p]) / m : 0,
+             median(p50[p]), median(p99[p]), median(p999[p]), errors[p]
+    }
+  }' "$OUT.csv" > "$OUT""_summary.csv"
+
+echo
+awk -F, '{ printf "%-8s %-10s %-8s %-5s %-12s %-10s %-9s %-9s %-9s %s\n", $1, $2, $3, $4, $5, $6, $7, $8, $9, $10 }' "$OUT""_summary.csv"
+echo
+echo "e2e_bench: every run in $OUT.csv, the table in ${OUT}_summary.csv" >&2
+
+[ -n "$BASELINE" ] || exit 0
+
+# Gate: the same points of a previous summary.
+awk -F, -v max_drop="$MAX_DROP" -v max_rise="$MAX_RISE" '
+  FNR == 1 { next }
+  NR == FNR { base_tput[$1 "," $2 "," $3] = $5; base_p99[$1 "," $2 "," $3] = $8; next }
+  {
+    p = $1 "," $2 "," $3
+    if (!(p in base_tput)) next
+    if (base_tput[p] > 0 && $5 < base_tput[p] * (1 - max_drop / 100)) {
+      printf "REGRESSION %s: throughput %.1f, baseline %.1f\n", p, $5, base_tput[p]; bad = 1
+    }
+    if (base_p99[p] > 0 && $8 > base_p99[p] * (1 + max_rise / 100)) {
+      printf "REGRESSION %s: p99 %.1f us, baseline %.1f us\n", p, $8, base_p99[p]; bad = 1
+    }
+    compared++
+  }
+  END {
+    if (!compared) { print "e2e_bench: no point in common with the baseline"; exit 1 }
+    if (!bad) printf "e2e_bench: %d points within %s%% throughput / %s%% p99 of the baseline\n", compared, max_drop, max_rise
+    exit bad
+  }' "$BASELINE" "$OUT""_summary.csv"
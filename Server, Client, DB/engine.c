@@ -0,0 +1,762 @@
+/* engine.c
+
+   Storage engines: the kissdb, memory and lsm adapters, and the calls
+   that dispatch to them. See engine.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "kissdb.h"
+#include "memdb.h"
+#include "lsm.h"
+#include "engine.h"
+
+#define ENGINE_MAP_SIZE  (1ULL << 36)   // Address space reserved to map a KISSDB file (read only) as it grows.
+#define COMPACT_MIN_SIZE (1 << 20)      // kissdb: files smaller than this aren't compacted in the background,
+#define COMPACT_WASTE        2          // ... larger ones when 1/COMPACT_WASTE of them is dead records and tombstones,
+#define COMPACT_MAX_TABLES  16          // ... or a key may have to be looked for in this many more hash tables than
+                                        //     after the last compaction (whose chain may be longer than this).
+#define COMPACT_TRIES      500          // Times the swap waits for the SCAN/AGG snapshots to close, 10 ms each.
+
+struct engine {
+  const EngineOps *ops;
+  void *db;
+  unsigned long key_size;
+  unsigned long value_size;
+};
+
+/* Slices: a copy of all pairs, as the memory and lsm engines snapshot them */
+
+// Definition of a copy of all pairs (lsm: in key order).
+typedef struct slice {
+  char *pairs;
+  unsigned long num;
+} Slice;
+
+// Definition of a cursor over records [next, last) of a slice.
+typedef struct slicecursor {
+  EngineCursor base;
+  const char *pairs;
+  unsigned long next, last;
+  unsigned long key_size, value_size;
+} SliceCursor;
+
+static int slice_next(EngineCursor *cur, char *key, char *value) {
+  SliceCursor *c = (SliceCursor *) cur;
+  const char *pair;
+
+  if (c->next >= c->last)
+    return 0;
+  pair = c->pairs + (c->key_size + c->value_size) * c->next++;
+  memcpy(key, pair, c->key_size);
+  memcpy(value, pair + c->key_size, c->value_size);
+  return 1;
+}
+
+static void slice_close(EngineCursor *cur) {
+  free(cur);
+}
+
+static SliceCursor *slice_cursor(const char *pairs, unsigned long first, unsigned long last, unsigned long key_size,
+                                 unsigned long value_size) {
+  SliceCursor *c;
+
+  if (!(c = (SliceCursor *) calloc(1, sizeof(SliceCursor))))
+    return NULL;
+  c->base.next = slice_next;
+  c->base.close = slice_close;
+  c->pairs = pairs;
+  c->next = first;
+  c->last = last;
+  c->key_size = key_size;
+  c->value_size = value_size;
+  return c;
+}
+
+static void slice_release(void *db, void *snap) {
+  (void) db;
+  if (snap)
+    free(((Slice *) snap)->pairs);
+  free(snap);
+}
+
+/* kissdb */
+
+// Definition of the kissdb engine: the file, its lock and its mapping.
+typedef struct kissengine {
+  KISSDB db;
+  pthread_rwlock_t lock;               // GETs share the file, a PUT has it alone.
+  const char *map;                     // The file, mapped read only: values are read in place (NULL: with pread()).
+  char *path;
+  int compact_sec;
+  int stop;
+  unsigned long compactions;           // Under the lock, as the swaps.
+  unsigned long compacted_tables;      // Hash tables the last compaction left (0: none yet).
+  pthread_mutex_t compact_mutx;        // One compaction at a time; guards 'stop'.
+  pthread_cond_t wake;                 // The compactor's sleep, cut short by kiss_close().
+  pthread_t compactor;
+  int has_compactor;
+} KissEngine;
+
+// Definition of a kissdb cursor: a scan of a snapshot, or a range of the ordered index.
+typedef struct kisscursor {
+  EngineCursor base;
+  KissEngine *k;
+  KISSDB_Scan scan;
+  KISSDB_Range range;
+  char bounds[];                       // A range's lo and hi (key_size bytes each).
+} KissCursor;
+
+static void *kiss_compactor(void *arg);
+static void kiss_close(void *db);
+
+static void *kiss_open(const char *path, const EngineConfig *cfg) {
+  char idx[strlen(path) + 8];
+  KissEngine *k;
+
+  if (!(k = (KissEngine *) calloc(1, sizeof(KissEngine))))
+    return NULL;
+  if (!(k->path = strdup(path)) ||
+      KISSDB_open(&k->db, path, KISSDB_OPEN_MODE_RWCREAT, cfg->hash_table_size, cfg->key_size, cfg->value_size)) {
+    fprintf(stderr, "(Error) kiss_open: Cannot open '%s'.\n", path);
+    free(k->path);
+    free(k);
+    return NULL;
+  }
+  pthread_rwlock_init(&k->lock, NULL);
+  pthread_mutex_init(&k->compact_mutx, NULL);
+  pthread_cond_init(&k->wake, NULL);
+
+  // Map the file, so GETs read values in place; the reservation is larger than the file, for the records to come.
+  if ((k->map = (const char *) mmap(NULL, ENGINE_MAP_SIZE, PROT_READ, MAP_SHARED, fileno(k->db.f), 0)) == MAP_FAILED) {
+    fprintf(stderr, "(Warning) kiss_open: Cannot map '%s'; GETs copy their values.\n", path);
+    k->map = NULL;
+  }
+  if (cfg->ordered_index) {
+    // Load (or rebuild) the ordered key index.
+    sprintf(idx, "%s.idx", path);
+    if (KISSDB_Index_open(&k->db, idx)) {
+      fprintf(stderr, "(Error) kiss_open: Cannot open the ordered index '%s'.\n", idx);
+      kiss_close(k);                // No compactor yet: closes the file, unmaps it and frees the locks.
+      return NULL;
+    }
+  }
+  k->compact_sec = cfg->compact_sec;
+  if (k->compact_sec && !pthread_create(&k->compactor, NULL, kiss_compactor, k))
+    k->has_compactor = 1;
+  else if (k->compact_sec)
+    fprintf(stderr, "(Warning) kiss_open: No compaction thread; the file is only compacted on request.\n");
+  return k;
+}
+
+static void kiss_sizes(void *db, unsigned long *key_size, unsigned long *value_size) {
+  *key_size = ((KissEngine *) db)->db.key_size;   // From the file's header.
+  *value_size = ((KissEngine *) db)->db.value_size;
+}
+
+static int kiss_get(void *db, const void *key, void *value) {
+  KissEngine *k = (KissEngine *) db;
+  int rc;
+
+  pthread_rwlock_rdlock(&k->lock);
+  rc = KISSDB_get(&k->db, key, value);
+  pthread_rwlock_unlock(&k->lock);
+  return rc;
+}
+
+static int kiss_put(void *db, const void *key, const void *value) {
+  KissEngine *k = (KissEngine *) db;
+  int rc;
+
+  pthread_rwlock_wrlock(&k->lock);
+  rc = KISSDB_put(&k->db, key, value);
+  pthread_rwlock_unlock(&k->lock);
+  return rc;
+}
+
+static int kiss_del(void *db, const void *key) {
+  KissEngine *k = (KissEngine *) db;
+  int rc;
+
+  pthread_rwlock_wrlock(&k->lock);
+  rc = KISSDB_delete(&k->db, key);
+  pthread_rwlock_unlock(&k->lock);
+  return rc;
+}
+
+static int kiss_get_batch(void *db, const void *keys, void *values, int *results, unsigned long n) {
+  KissEngine *k = (KissEngine *) db;
+  int found;
+
+  pthread_rwlock_rdlock(&k->lock);
+  found = KISSDB_get_batch(&k->db, keys, values, results, n);
+  pthread_rwlock_unlock(&k->lock);
+  return found;
+}
+
+// Snapshots are opened and closed holding the write lock, serialized with the PUTs.
+static void *kiss_snapshot(void *db) {
+  KissEngine *k = (KissEngine *) db;
+  KISSDB_Snapshot *snap;
+  int rc;
+
+  if (!(snap = (KISSDB_Snapshot *) malloc(sizeof(KISSDB_Snapshot))))
+    return NULL;
+  pthread_rwlock_wrlock(&k->lock);
+  rc = KISSDB_Snapshot_open(&k->db, snap);
+  pthread_rwlock_unlock(&k->lock);
+  if (rc) {
+    free(snap);
+    return NULL;
+  }
+  return snap;
+}
+
+static void kiss_release(void *db, void *snap) {
+  KissEngine *k = (KissEngine *) db;
+
+  pthread_rwlock_wrlock(&k->lock);
+  KISSDB_Snapshot_close((KISSDB_Snapshot *) snap);
+  pthread_rwlock_unlock(&k->lock);
+  free(snap);
+}
+
+static int kiss_scan_next(EngineCursor *cur, char *key, char *value) {
+  return KISSDB_Scan_next(&((KissCursor *) cur)->scan, key, value);
+}
+
+static void kiss_scan_close(EngineCursor *cur) {
+  KISSDB_Scan_close(&((KissCursor *) cur)->scan);
+  free(cur);
+}
+
+static EngineCursor *kiss_scan(void *db, void *snap, unsigned long part, unsigned long parts) {
+  KissCursor *c;
+
+  (void) db;
+  if (!(c = (KissCursor *) calloc(1, sizeof(KissCursor))))
+    return NULL;
+  if (KISSDB_Scan_init_snapshot((KISSDB_Snapshot *) snap, &c->scan, part, parts)) {
+    free(c);
+    return NULL;
+  }
+  c->base.next = kiss_scan_next;
+  c->base.close = kiss_scan_close;
+  return &c->base;
+}
+
+// Under the read lock, like a GET: a PUT may reuse a dead record and a compaction moves the values, between loading
+// a key's offset and reading its value.
+static int kiss_range_next(EngineCursor *cur, char *key, char *value) {
+  KissCursor *c = (KissCursor *) cur;
+  int rc;
+
+  pthread_rwlock_rdlock(&c->k->lock);
+  rc = KISSDB_Range_next(&c->range, key, value);
+  pthread_rwlock_unlock(&c->k->lock);
+  return rc;
+}
+
+static void kiss_range_close(EngineCursor *cur) {
+  free(cur);
+}
+
+// Ranges walk the ordered index (natural order: station.9 < station.10), alongside the PUTs.
+static EngineCursor *kiss_range(void *db, const char *lo, const char *hi, unsigned long prefix_len) {
+  KissEngine *k = (KissEngine *) db;
+  unsigned long key_size = k->db.key_size;
+  KissCursor *c;
+  int rc;
+
+  if (!(c = (KissCursor *) calloc(1, sizeof(KissCursor) + 2 * key_size)))
+    return NULL;
+  c->k = k;
+  memcpy(c->bounds, lo, prefix_len ? prefix_len : key_size);
+  if (prefix_len) {
+    rc = KISSDB_Range_init_prefix(&k->db, &c->range, c->bounds, prefix_len);
+  } else {
+    memcpy(c->bounds + key_size, hi, key_size);
+    rc = KISSDB_Range_init(&k->db, &c->range, c->bounds, c->bounds + key_size);
+  }
+  if (rc) {                         // No ordered index.
+    free(c);
+    return NULL;
+  }
+  c->base.next = kiss_range_next;
+  c->base.close = kiss_range_close;
+  return &c->base;
+}
+
+static void kiss_status(void *db, char *str) {
+  KissEngine *k = (KissEngine *) db;
+  KISSDB_Stats st;
+
+  pthread_rwlock_rdlock(&k->lock);
+  KISSDB_stats(&k->db, &st);
+  sprintf(str, "kissdb, %lu keys, %lu tombstones, %lu hash tables of %lu, %lu compactions%s%s", st.live, st.tombstones,
+          st.num_hash_tables, k->db.hash_table_size, k->compactions, k->db.index ? ", ordered index" : "",
+          k->map ? ", mapped" : "");
+  pthread_rwlock_unlock(&k->lock);
+}
+
+/**
+ * @name kiss_compact_now - Compacts the KISSDB file while GETs and PUTs go on (the caller holds compact_mutx).
+ * @param k: The engine.
+ * @param str: Receives how it went.
+ *
+ * Only the start and the swap take the write lock; the copy in between doesn't. After the swap the new file is
+ * mapped where the old one was, so engine_map() stays the same.
+ * @return 0 on Success. -1 on Error.
+ */
+static int kiss_compact_now(KissEngine *k, char *str) {
+  KISSDB_Compaction c;
+  KISSDB_Stats before, after;
+  int rc, tries;
+
+  pthread_rwlock_wrlock(&k->lock);
+  KISSDB_stats(&k->db, &before);
+  rc = KISSDB_Compact_begin(&k->db, &c, k->path);
+  pthread_rwlock_unlock(&k->lock);
+  if (rc) {
+    sprintf(str, "cannot start");
+    return -1;
+  }
+
+  if (KISSDB_Compact_copy(&c)) {
+    pthread_rwlock_wrlock(&k->lock);
+    KISSDB_Compact_abort(&c);
+    pthread_rwlock_unlock(&k->lock);
+    sprintf(str, "cannot write '%s.compact'", k->path);
+    return -1;
+  }
+
+  // Swap it in once no SCAN/AGG snapshot reads the old file.
+  for (tries = 0;; tries++) {
+    pthread_rwlock_wrlock(&k->lock);
+    if ((rc = KISSDB_Compact_finish(&c)) == 1 && tries == COMPACT_TRIES)
+      KISSDB_Compact_abort(&c);
+    if (!rc && k->map &&
+        mmap((void *) k->map, ENGINE_MAP_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED, fileno(k->db.f), 0) == MAP_FAILED) {
+      fprintf(stderr, "(Warning) kiss_compact_now: Cannot map the compacted file; GETs copy their values.\n");
+      munmap((void *) k->map, ENGINE_MAP_SIZE);
+      k->map = NULL;
+    }
+    if (!rc) {
+      KISSDB_stats(&k->db, &after);
+      k->compactions++;
+      k->compacted_tables = after.num_hash_tables;
+    }
+    pthread_rwlock_unlock(&k->lock);
+    if (rc != 1 || tries == COMPACT_TRIES)
+      break;
+    usleep(10000);
+  }
+  if (rc) {
+    sprintf(str, rc == 1 ? "snapshots kept the old file busy" : "cannot swap the file in");
+    return -1;
+  }
+  sprintf(str, "%lu keys, %llu to %llu bytes, %lu to %lu hash tables", after.live, (unsigned long long) before.file_size,
+          (unsigned long long) after.file_size, before.num_hash_tables, after.num_hash_tables);
+  return 0;
+}
+
+// Whether the file is worth compacting: a large share of it dead, or chains of hash tables grown long since the last
+// compaction.
+static int kiss_needs_compact(KissEngine *k) {
+  KISSDB_Stats st;
+  unsigned long tables;
+
+  pthread_rwlock_rdlock(&k->lock);
+  KISSDB_stats(&k->db, &st);
+  tables = k->compacted_tables;
+  pthread_rwlock_unlock(&k->lock);
+  return st.file_size >= COMPACT_MIN_SIZE &&
+         ((st.file_size > st.live_size && (st.file_size - st.live_size) * COMPACT_WASTE > st.file_size) ||
+          st.num_hash_tables > tables + COMPACT_MAX_TABLES);
+}
+
+static void *kiss_compactor(void *arg) {
+  KissEngine *k = (KissEngine *) arg;
+  struct timespec until;
+  char str[128];
+
+  pthread_mutex_lock(&k->compact_mutx);
+  while (!k->stop) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += k->compact_sec;
+    while (!k->stop && pthread_cond_timedwait(&k->wake, &k->compact_mutx, &until) != ETIMEDOUT)
+      ;
+    if (!k->stop && kiss_needs_compact(k)) {
+      if (kiss_compact_now(k, str))
+        fprintf(stderr, "(Warning) kiss_compactor: Compaction failed: %s.\n", str);
+      else
+        fprintf(stderr, "(Info) kiss_compactor: Compacted '%s': %s.\n", k->path, str);
+    }
+  }
+  pthread_mutex_unlock(&k->compact_mutx);
+  return NULL;
+}
+
+static int kiss_compact(void *db, char *str) {
+  KissEngine *k = (KissEngine *) db;
+  int rc;
+
+  pthread_mutex_lock(&k->compact_mutx);
+  rc = kiss_compact_now(k, str);
+  pthread_mutex_unlock(&k->compact_mutx);
+  return rc;
+}
+
+static void kiss_close(void *db) {
+  KissEngine *k = (KissEngine *) db;
+
+  pthread_mutex_lock(&k->compact_mutx);
+  k->stop = 1;
+  pthread_cond_signal(&k->wake);
+  pthread_mutex_unlock(&k->compact_mutx);
+  if (k->has_compactor)
+    pthread_join(k->compactor, NULL);
+  KISSDB_close(&k->db);
+  if (k->map)
+    munmap((void *) k->map, ENGINE_MAP_SIZE);
+  pthread_rwlock_destroy(&k->lock);
+  pthread_mutex_destroy(&k->compact_mutx);
+  pthread_cond_destroy(&k->wake);
+  free(k->path);
+  free(k);
+}
+
+static const char *kiss_map(void *db) {
+  return ((KissEngine *) db)->map;
+}
+
+static int kiss_fd(void *db) {
+  return fileno(((KissEngine *) db)->db.f);
+}
+
+static int kiss_locate(void *db, const void *key, uint64_t *offset) {
+  return KISSDB_locate(&((KissEngine *) db)->db, key, offset);
+}
+
+static void kiss_read_lock(void *db) {
+  pthread_rwlock_rdlock(&((KissEngine *) db)->lock);
+}
+
+static void kiss_read_unlock(void *db) {
+  pthread_rwlock_unlock(&((KissEngine *) db)->lock);
+}
+
+static const EngineOps kissdb_ops = {
+  "kissdb", kiss_open, kiss_sizes, kiss_get, kiss_put, kiss_del, kiss_get_batch, kiss_snapshot, kiss_release, kiss_scan,
+  kiss_range, kiss_status, kiss_compact, kiss_close, kiss_map, kiss_fd, kiss_locate, kiss_read_lock, kiss_read_unlock
+};
+
+/* memory */
+
+static void *mem_open(const char *path, const EngineConfig *cfg) {
+  return memdb_open(path, cfg->hash_table_size, cfg->key_size, cfg->value_size, cfg->snapshot_sec);
+}
+
+static void mem_sizes(void *db, unsigned long *key_size, unsigned long *value_size) {
+  memdb_sizes((MemDB *) db, key_size, value_size);
+}
+
+static int mem_get(void *db, const void *key, void *value) {
+  return memdb_get((MemDB *) db, key, value);
+}
+
+static int mem_put(void *db, const void *key, const void *value) {
+  return memdb_put((MemDB *) db, key, value);   // Locks its stripe only.
+}
+
+static int mem_del(void *db, const void *key) {
+  return memdb_delete((MemDB *) db, key);
+}
+
+static void *mem_snapshot(void *db) {
+  Slice *s;
+
+  if (!(s = (Slice *) calloc(1, sizeof(Slice))))
+    return NULL;
+  if (memdb_copy((MemDB *) db, &s->pairs, &s->num)) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+static void mem_status(void *db, char *str) {
+  (void) db;
+  strcpy(str, "memory");
+}
+
+static void mem_close(void *db) {
+  memdb_close((MemDB *) db);
+}
+
+// The memory engine keeps no key order: no ranges.
+static const EngineOps memory_ops = {
+  "memory", mem_open, mem_sizes, mem_get, mem_put, mem_del, NULL, mem_snapshot, slice_release, NULL, NULL,
+  mem_status, NULL, mem_close, NULL, NULL, NULL, NULL, NULL
+};
+
+/* lsm */
+
+static void *lsm_engine_open(const char *path, const EngineConfig *cfg) {
+  return lsm_open(path, cfg->key_size, cfg->value_size);
+}
+
+static void lsm_engine_sizes(void *db, unsigned long *key_size, unsigned long *value_size) {
+  lsm_sizes((LSM *) db, key_size, value_size);
+}
+
+static int lsm_engine_get(void *db, const void *key, void *value) {
+  return lsm_get((LSM *) db, key, value);
+}
+
+static int lsm_engine_put(void *db, const void *key, const void *value) {
+  return lsm_put((LSM *) db, key, value);
+}
+
+static int lsm_engine_del(void *db, const void *key) {
+  return lsm_delete((LSM *) db, key);
+}
+
+static void *lsm_engine_snapshot(void *db) {
+  Slice *s;
+
+  if (!(s = (Slice *) calloc(1, sizeof(Slice))))
+    return NULL;
+  if (lsm_copy((LSM *) db, &s->pairs, &s->num)) {
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+// Definition of an lsm range cursor.
+typedef struct lsmcursor {
+  EngineCursor base;
+  LSMRange *range;
+} LsmCursor;
+
+static int lsm_cursor_next(EngineCursor *cur, char *key, char *value) {
+  return lsm_range_next(((LsmCursor *) cur)->range, key, value);
+}
+
+static void lsm_cursor_close(EngineCursor *cur) {
+  lsm_range_close(((LsmCursor *) cur)->range);
+  free(cur);
+}
+
+// Ranges merge the memtables and the runs in key order (byte order, unlike kissdb's index), from 'lo' on.
+static EngineCursor *lsm_engine_range(void *db, const char *lo, const char *hi, unsigned long prefix_len) {
+  LsmCursor *c;
+
+  if (!(c = (LsmCursor *) calloc(1, sizeof(LsmCursor))))
+    return NULL;
+  if (!(c->range = lsm_range((LSM *) db, lo, hi, prefix_len))) {
+    free(c);
+    return NULL;
+  }
+  c->base.next = lsm_cursor_next;
+  c->base.close = lsm_cursor_close;
+  return &c->base;
+}
+
+static void lsm_engine_status(void *db, char *str) {
+  unsigned long pairs, flushes, compactions;
+  int runs;
+
+  lsm_stats((LSM *) db, &runs, &pairs, &flushes, &compactions);
+  sprintf(str, "lsm, %d runs (%lu pairs), %lu flushes, %lu compactions", runs, pairs, flushes, compactions);
+}
+
+static void lsm_engine_close(void *db) {
+  lsm_close((LSM *) db);
+}
+
+static const EngineOps lsm_ops = {
+  "lsm", lsm_engine_open, lsm_engine_sizes, lsm_engine_get, lsm_engine_put, lsm_engine_del, NULL, lsm_engine_snapshot, slice_release,
+  NULL, lsm_engine_range, lsm_engine_status, NULL, lsm_engine_close, NULL, NULL, NULL, NULL, NULL
+};
+
+static const EngineOps *engines[] = { &kissdb_ops, &memory_ops, &lsm_ops };
+
+/**
+ * @name engine_open - Opens a storage engine.
+ * @param name: kissdb, memory or lsm.
+ * @param path: Its file (the memory engine's snapshots, the lsm engine's files are named after it).
+ * @param cfg: Its settings.
+ *
+ * @return The engine on Success. NULL on Error.
+ */
+Engine *engine_open(const char *name, const char *path, const EngineConfig *cfg) {
+  const EngineOps *ops = NULL;
+  unsigned long k;
+  Engine *e;
+
+  for (k = 0; k < sizeof(engines) / sizeof(engines[0]); k++) {
+    if (!strcmp(engines[k]->name, name))
+      ops = engines[k];
+  }
+  if (!ops) {
+    fprintf(stderr, "(Error) engine_open: No engine '%s'.\n", name);
+    return NULL;
+  }
+  if (!(e = (Engine *) calloc(1, sizeof(Engine))))
+    return NULL;
+  e->ops = ops;
+  if (!(e->db = ops->open(path, cfg))) {
+    free(e);
+    return NULL;
+  }
+  ops->sizes(e->db, &e->key_size, &e->value_size);
+  return e;
+}
+
+const char *engine_name(Engine *e) {
+  return e->ops->name;
+}
+
+void engine_sizes(Engine *e, unsigned long *key_size, unsigned long *value_size) {
+  *key_size = e->key_size;
+  *value_size = e->value_size;
+}
+
+int engine_get(Engine *e, const void *key, void *value) {
+  return e->ops->get(e->db, key, value);
+}
+
+int engine_put(Engine *e, const void *key, const void *value) {
+  return e->ops->put(e->db, key, value);
+}
+
+int engine_delete(Engine *e, const void *key) {
+  return e->ops->del(e->db, key);
+}
+
+/**
+ * @name engine_get_batch - Gets a batch of keys: in one pass if the engine can (kissdb reads them in file order), else one by one.
+ * @param e: The engine.
+ * @param keys: The keys, key_size bytes apart.
+ * @param values: Receives their values, value_size bytes apart.
+ * @param results: Receives each key's result (0 found, 1 not found, -1 error).
+ * @param n: How many.
+ *
+ * @return The number found. Negative on Error.
+ */
+int engine_get_batch(Engine *e, const void *keys, void *values, int *results, unsigned long n) {
+  unsigned long k;
+  int found = 0;
+
+  if (e->ops->get_batch)
+    return e->ops->get_batch(e->db, keys, values, results, n);
+  for (k = 0; k < n; k++) {
+    results[k] = e->ops->get(e->db, (const char *) keys + e->key_size * k, (char *) values + e->value_size * k);
+    if (results[k] < 0)
+      return -1;
+    found += !results[k];
+  }
+  return found;
+}
+
+void *engine_snapshot(Engine *e) {
+  return e->ops->snapshot(e->db);
+}
+
+void engine_release(Engine *e, void *snap) {
+  e->ops->release(e->db, snap);
+}
+
+/**
+ * @name engine_scan - Opens a cursor over one partition of a snapshot.
+ * @param e: The engine.
+ * @param snap: The snapshot (engine_snapshot()).
+ * @param part: Partition number (0 .. parts-1).
+ * @param parts: Number of partitions.
+ *
+ * A copy of the pairs (memory, lsm) is split into equal slices.
+ * @return The cursor on Success. NULL on Error.
+ */
+EngineCursor *engine_scan(Engine *e, void *snap, unsigned long part, unsigned long parts) {
+  Slice *s = (Slice *) snap;
+  SliceCursor *c;
+
+  if (e->ops->scan)
+    return e->ops->scan(e->db, snap, part, parts);
+  if (!(c = slice_cursor(s->pairs, s->num * part / parts, s->num * (part + 1) / parts, e->key_size, e->value_size)))
+    return NULL;
+  return &c->base;
+}
+
+EngineCursor *engine_range(Engine *e, const char *lo, const char *hi, unsigned long prefix_len) {
+  if (!e->ops->range)
+    return NULL;
+  return e->ops->range(e->db, lo, hi, prefix_len);
+}
+
+int engine_next(EngineCursor *cur, char *key, char *value) {
+  return cur->next(cur, key, value);
+}
+
+void engine_cursor_close(EngineCursor *cur) {
+  if (cur)
+    cur->close(cur);
+}
+
+void engine_status(Engine *e, char *str) {
+  e->ops->status(e->db, str);
+}
+
+const char *engine_map(Engine *e) {
+  return e->ops->map ? e->ops->map(e->db) : NULL;
+}
+
+int engine_fd(Engine *e) {
+  return e->ops->fd ? e->ops->fd(e->db) : -1;
+}
+
+int engine_locate(Engine *e, const void *key, uint64_t *offset) {
+  return e->ops->locate ? e->ops->locate(e->db, key, offset) : -1;
+}
+
+void engine_read_lock(Engine *e) {
+  if (e->ops->read_lock)
+    e->ops->read_lock(e->db);
+}
+
+void engine_read_unlock(Engine *e) {
+  if (e->ops->read_unlock)
+    e->ops->read_unlock(e->db);
+}
+
+/**
+ * @name engine_compact - Compacts the engine's file on request (kissdb; lsm compacts its runs by itself, memory
+ * rewrites its snapshot whole).
+ * @param e: The engine.
+ * @param str: Receives how it went.
+ *
+ * @return 0 on Success. 1 if the engine doesn't compact on request. -1 on Error.
+ */
+int engine_compact(Engine *e, char *str) {
+  if (!e->ops->compact) {
+    sprintf(str, "%s compacts by itself", e->ops->name);
+    return 1;
+  }
+  return e->ops->compact(e->db, str);
+}
+
+void engine_close(Engine *e) {
+  if (!e)
+    return;
+  e->ops->close(e->db);
+  free(e);
+}
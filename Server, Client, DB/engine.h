@@ -0,0 +1,125 @@
+/* engine.h
+
+   Storage engines, behind one interface.
+
+   The server reaches its data only through an Engine: a table of
+   operations (EngineOps) and the engine's own state. Three are built in:
+
+     kissdb  The KISSDB file, read in place (mapped), with the ordered
+             index for RANGE/PREFIX. PUTs rewrite records in place;
+             DELETEs leave tombstones, which a compaction (in the
+             background, or on request) rewrites the file without.
+     memory  All pairs in memory (memdb.h), snapshotted to the file.
+     lsm     Log-structured (lsm.h): PUTs are appended to a log and
+             flushed as sorted runs; nothing is rewritten in place.
+
+   Every engine does GET, PUT, DELETE, batched GETs and point-in-time
+   snapshots, which SCAN/AGG read in partitions with cursors. RANGE/PREFIX
+   need key order (kissdb's index, lsm's runs). Only kissdb reads values
+   in place (engine_map()); the GETs of the others copy them.
+
+*/
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+// Definition of an engine's settings.
+typedef struct engineconfig {
+  unsigned long hash_table_size;       // kissdb (and memory's snapshots): buckets per hash table.
+  unsigned long key_size;
+  unsigned long value_size;
+  int ordered_index;                   // kissdb: keep the ordered key index (<path>.idx).
+  int snapshot_sec;                    // memory: seconds between snapshots (0: only on close).
+  int compact_sec;                     // kissdb: seconds between checks whether the file needs compacting (0: only on request).
+} EngineConfig;
+
+// Definition of a cursor over pairs: a partition of a snapshot, or a range.
+typedef struct enginecursor {
+  int (*next)(struct enginecursor *cur, char *key, char *value);   // 1 if filled, 0 at the end, negative on error.
+  void (*close)(struct enginecursor *cur);
+} EngineCursor;
+
+// Definition of an engine's operations. NULL ones aren't supported.
+typedef struct engineops {
+  const char *name;
+  void *(*open)(const char *path, const EngineConfig *cfg);
+  void (*sizes)(void *db, unsigned long *key_size, unsigned long *value_size);
+  int (*get)(void *db, const void *key, void *value);
+  int (*put)(void *db, const void *key, const void *value);
+  int (*del)(void *db, const void *key);
+  int (*get_batch)(void *db, const void *keys, void *values, int *results, unsigned long n);
+  void *(*snapshot)(void *db);
+  void (*release)(void *db, void *snap);
+  EngineCursor *(*scan)(void *db, void *snap, unsigned long part, unsigned long parts);
+  EngineCursor *(*range)(void *db, const char *lo, const char *hi, unsigned long prefix_len);
+  void (*status)(void *db, char *str);
+  int (*compact)(void *db, char *str);
+  void (*close)(void *db);
+  // Values read in place: the mapped file, its descriptor, and where a key's value is (under the read lock).
+  const char *(*map)(void *db);
+  int (*fd)(void *db);
+  int (*locate)(void *db, const void *key, uint64_t *offset);
+  void (*read_lock)(void *db);
+  void (*read_unlock)(void *db);
+} EngineOps;
+
+typedef struct engine Engine;
+
+// open engine 'name' (kissdb, memory or lsm) on 'path'. NULL on error (or an unknown name).
+Engine *engine_open(const char *name, const char *path, const EngineConfig *cfg);
+
+// its name.
+const char *engine_name(Engine *e);
+
+// its key and value sizes: an existing file keeps the ones it was created with, whatever 'cfg' said.
+void engine_sizes(Engine *e, unsigned long *key_size, unsigned long *value_size);
+
+// copy the value of 'key' to 'value'. 0 on success, 1 if not found, -1 on error.
+int engine_get(Engine *e, const void *key, void *value);
+
+// put 'key' = 'value'. 0 on success, -1 on error.
+int engine_put(Engine *e, const void *key, const void *value);
+
+// delete 'key'. 0 on success, 1 if not found, -1 on error.
+int engine_delete(Engine *e, const void *key);
+
+// get 'n' keys (key_size apart) into 'values' (value_size apart), each one's result in 'results'. the
+// number found, negative on error.
+int engine_get_batch(Engine *e, const void *keys, void *values, int *results, unsigned long n);
+
+// a point-in-time view for engine_scan(), kept until engine_release(). NULL on error.
+void *engine_snapshot(Engine *e);
+void engine_release(Engine *e, void *snap);
+
+// cursor over partition 'part' of 'parts' of a snapshot. NULL on error.
+EngineCursor *engine_scan(Engine *e, void *snap, unsigned long part, unsigned long parts);
+
+// cursor over the keys in [lo, hi] in key order, or (prefix_len > 0) the keys starting with the first prefix_len
+// bytes of 'lo'. NULL on error or if the engine keeps no key order.
+EngineCursor *engine_range(Engine *e, const char *lo, const char *hi, unsigned long prefix_len);
+
+// next pair of a cursor: 1 if filled, 0 at the end, negative on error.
+int engine_next(EngineCursor *cur, char *key, char *value);
+void engine_cursor_close(EngineCursor *cur);
+
+// one line about the engine's state.
+void engine_status(Engine *e, char *str);
+
+// values read in place: the mapped file (NULL if the engine can't), its descriptor, and under
+// engine_read_lock() the offset of a key's value (0 on success, 1 if not found).
+const char *engine_map(Engine *e);
+int engine_fd(Engine *e);
+int engine_locate(Engine *e, const void *key, uint64_t *offset);
+void engine_read_lock(Engine *e);
+void engine_read_unlock(Engine *e);
+
+// compact the engine's file now, while it keeps serving, and say how it went in 'str'. 0 on success, 1 if the
+// engine doesn't compact on request, -1 on error.
+int engine_compact(Engine *e, char *str);
+
+// close the engine (the memory engine writes its last snapshot).
+void engine_close(Engine *e);
+
+#endif
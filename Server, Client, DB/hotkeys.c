@@ -0,0 +1,250 @@
+/* hotkeys.c
+
+   Hot-key detection: per-thread Count-Min sketches and candidate sets,
+   merged once per window. See hotkeys.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "hotkeys.h"
+
+// Definition of a candidate key of a thread.
+typedef struct candidate {
+  uint64_t fp;                         // Hash of the key, compared first.
+  uint32_t est;                        // The thread's estimate when last seen.
+  HotKey stats;
+} Candidate;
+
+// Definition of a thread's counters, written by the thread and read by the merger under 'lock'.
+typedef struct hkthread {
+  pthread_mutex_t lock;
+  uint32_t cm[HK_DEPTH][HK_WIDTH];
+  Candidate cand[HK_CANDIDATES];
+  int num_cand;
+} __attribute__((aligned(64))) HKThread;
+
+struct hotkeys {
+  HKThread *threads;
+  int num_threads;
+  int window_sec;
+  unsigned long key_size;
+  uint64_t cm[HK_DEPTH][HK_WIDTH];     // Merger: the window's sum of the threads' sketches.
+  Candidate merged[HK_CANDIDATES * 8]; // Merger: union of the threads' candidates (as many as fit).
+  pthread_mutex_t lock;                // Guards 'top'.
+  HotKey top[HK_TOP];
+  int num_top;
+  pthread_t merger;
+};
+
+// FNV-1a over the key (up to its '\0').
+static uint64_t hk_hash(const char *key, unsigned long len) {
+  uint64_t h = 14695981039346656037ULL;
+  unsigned long i;
+
+  for (i = 0; i < len && key[i]; i++) {
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Column of row 'row' for hash 'fp' (double hashing: h1 + row * h2).
+static unsigned long hk_col(uint64_t fp, int row) {
+  return (unsigned long) (((fp >> 32) + (uint64_t) row * ((fp & 0xffffffffULL) | 1)) & (HK_WIDTH - 1));
+}
+
+/**
+ * @name hotkeys_record - Counts a request in the thread's sketch and candidates.
+ * @param h: The counters.
+ * @param thread: The calling thread's number.
+ * @param key: The key.
+ * @param put: 1 for a PUT, 0 for a GET.
+ * @param service_ns: The request's service time.
+ *
+ * @return
+ */
+void hotkeys_record(HotKeys *h, int thread, const char *key, int put, int64_t service_ns) {
+  HKThread *t;
+  Candidate *c = NULL;
+  uint64_t fp;
+  uint32_t est = UINT32_MAX;
+  int row, k, min = 0;
+
+  if (!h || thread < 0 || thread >= h->num_threads)
+    return;
+  t = &h->threads[thread];
+  fp = hk_hash(key, h->key_size);
+
+  pthread_mutex_lock(&t->lock);
+  for (row = 0; row < HK_DEPTH; row++) {
+    uint32_t *cell = &t->cm[row][hk_col(fp, row)];
+    if (*cell < UINT32_MAX)
+      (*cell)++;
+    if (*cell < est)
+      est = *cell;
+  }
+
+  // Already a candidate? Otherwise find the weakest one.
+  for (k = 0; k < t->num_cand; k++) {
+    if (t->cand[k].fp == fp && !strncmp(t->cand[k].stats.key, key, HK_KEY)) {
+      c = &t->cand[k];
+      break;
+    }
+    if (t->cand[k].est < t->cand[min].est)
+      min = k;
+  }
+  if (!c) {
+    if (t->num_cand < HK_CANDIDATES)
+      c = &t->cand[t->num_cand++];
+    else if (est > t->cand[min].est)
+      c = &t->cand[min];            // Evicts the weakest: its stats start over.
+    if (c) {
+      memset(c, 0, sizeof(Candidate));
+      c->fp = fp;
+      snprintf(c->stats.key, sizeof(c->stats.key), "%.*s",
+               (int) (h->key_size < HK_KEY ? h->key_size : HK_KEY), key);
+    }
+  }
+  if (c) {
+    c->est = est;
+    if (put)
+      c->stats.puts++;
+    else
+      c->stats.gets++;
+    c->stats.service_ns += service_ns;
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+static int hk_cmp(const void *a, const void *b) {
+  const HotKey *x = &((const Candidate *) a)->stats, *y = &((const Candidate *) b)->stats;
+
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+// Ends a window: sums the threads' sketches, ranks the union of their candidates and clears them.
+static void hk_merge(HotKeys *h) {
+  HKThread *t;
+  Candidate *c;
+  uint64_t est, v;
+  int k, j, row, n = 0;
+
+  memset(h->cm, 0, sizeof(h->cm));
+  for (k = 0; k < h->num_threads; k++) {
+    t = &h->threads[k];
+    pthread_mutex_lock(&t->lock);
+    for (row = 0; row < HK_DEPTH; row++) {
+      for (j = 0; j < HK_WIDTH; j++)
+        h->cm[row][j] += t->cm[row][j];
+    }
+    for (j = 0; j < t->num_cand; j++) {
+      c = &t->cand[j];
+      for (row = 0; row < n; row++) {  // The same key on another thread: add up its stats.
+        if (h->merged[row].fp == c->fp && !strcmp(h->merged[row].stats.key, c->stats.key))
+          break;
+      }
+      if (row < n) {
+        h->merged[row].stats.gets += c->stats.gets;
+        h->merged[row].stats.puts += c->stats.puts;
+        h->merged[row].stats.service_ns += c->stats.service_ns;
+      } else if (n < (int) (sizeof(h->merged) / sizeof(Candidate))) {
+        h->merged[n++] = *c;
+      }
+    }
+    memset(t->cm, 0, sizeof(t->cm));
+    t->num_cand = 0;
+    pthread_mutex_unlock(&t->lock);
+  }
+
+  // Estimates from the whole window's sketch.
+  for (k = 0; k < n; k++) {
+    est = UINT64_MAX;
+    for (row = 0; row < HK_DEPTH; row++) {
+      v = h->cm[row][hk_col(h->merged[k].fp, row)];
+      if (v < est)
+        est = v;
+    }
+    h->merged[k].stats.count = est;
+  }
+  qsort(h->merged, n, sizeof(Candidate), hk_cmp);
+
+  pthread_mutex_lock(&h->lock);
+  h->num_top = n < HK_TOP ? n : HK_TOP;
+  for (k = 0; k < h->num_top; k++)
+    h->top[k] = h->merged[k].stats;
+  pthread_mutex_unlock(&h->lock);
+}
+
+static void *hk_merger(void *arg) {
+  HotKeys *h = (HotKeys *) arg;
+
+  while (1) {
+    sleep(h->window_sec);
+    hk_merge(h);
+  }
+  return NULL;
+}
+
+/**
+ * @name hotkeys_open - Allocates the counters and starts the merger thread.
+ * @param threads: Number of threads that record.
+ * @param window_sec: Length of a window.
+ * @param key_size: Size of keys in bytes.
+ *
+ * @return The counters on Success. NULL on Error.
+ */
+HotKeys *hotkeys_open(int threads, int window_sec, unsigned long key_size) {
+  HotKeys *h;
+  int k;
+
+  if (threads < 1 || window_sec < 1)
+    return NULL;
+  if (!(h = (HotKeys *) calloc(1, sizeof(HotKeys))))
+    return NULL;
+  if (posix_memalign((void **) &h->threads, 64, threads * sizeof(HKThread))) {
+    free(h);
+    return NULL;
+  }
+  memset(h->threads, 0, threads * sizeof(HKThread));
+  for (k = 0; k < threads; k++)
+    pthread_mutex_init(&h->threads[k].lock, NULL);
+  h->num_threads = threads;
+  h->window_sec = window_sec;
+  h->key_size = key_size;
+  pthread_mutex_init(&h->lock, NULL);
+
+  if (pthread_create(&h->merger, NULL, hk_merger, h)) {
+    free(h->threads);
+    free(h);
+    return NULL;
+  }
+  pthread_detach(h->merger);
+  return h;
+}
+
+/**
+ * @name hotkeys_top - Copies the last window's top keys.
+ * @param h: The counters.
+ * @param top: Room for 'max' keys.
+ * @param max: At most this many.
+ * @param window_sec: Gets the window's length (may be NULL).
+ *
+ * @return The number of keys copied (0 until the first window ends).
+ */
+int hotkeys_top(HotKeys *h, HotKey *top, int max, int *window_sec) {
+  int n;
+
+  if (!h)
+    return 0;
+  pthread_mutex_lock(&h->lock);
+  n = h->num_top < max ? h->num_top : max;
+  memcpy(top, h->top, n * sizeof(HotKey));
+  pthread_mutex_unlock(&h->lock);
+  if (window_sec)
+    *window_sec = h->window_sec;
+  return n;
+}
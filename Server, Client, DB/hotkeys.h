@@ -0,0 +1,50 @@
+/* hotkeys.h
+
+   Hot-key detection with streaming sketches, in fixed memory.
+
+   Every worker thread counts the keys it serves in a Count-Min sketch of
+   its own (HK_DEPTH rows of HK_WIDTH counters) and keeps the HK_CANDIDATES
+   keys with the highest estimates as candidates, with their GET/PUT mix
+   and service time. Once per window a merger thread sums the threads'
+   sketches, re-estimates the union of their candidates against the sum,
+   keeps the top HK_TOP and starts a new window.
+
+   Counts are estimates: never below the true count, above it by at most
+   e/HK_WIDTH of the window's requests (with probability 1 - e^-HK_DEPTH).
+   A candidate's op mix and service time cover the part of the window
+   since it became a candidate.
+
+*/
+
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+#include <stdint.h>
+
+#define HK_DEPTH         4
+#define HK_WIDTH      4096  // Counters per row (a power of 2).
+#define HK_CANDIDATES   32  // Candidates per thread.
+#define HK_TOP          10  // Keys reported per window.
+#define HK_KEY          64  // Key bytes kept.
+
+typedef struct hotkeys HotKeys;
+
+// Definition of a reported key.
+typedef struct hotkey {
+  char key[HK_KEY + 1];
+  uint64_t count;          // Estimated requests in the window.
+  uint64_t gets, puts;     // Counted since it became a candidate.
+  int64_t service_ns;      // Total service time of those.
+} HotKey;
+
+// start counting keys of up to 'key_size' bytes for 'threads' threads (numbered 0 .. threads-1),
+// reporting every 'window_sec' seconds. NULL on error.
+HotKeys *hotkeys_open(int threads, int window_sec, unsigned long key_size);
+
+// thread 'thread' served 'key' (a GET, or a PUT if 'put') in 'service_ns'.
+void hotkeys_record(HotKeys *h, int thread, const char *key, int put, int64_t service_ns);
+
+// copy the last window's top keys (hottest first) to 'top'. The number of keys; 'window_sec' gets the window's length.
+int hotkeys_top(HotKeys *h, HotKey *top, int max, int *window_sec);
+
+#endif
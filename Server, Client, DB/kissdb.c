@@ -22,10 +22,72 @@
 #ifdef _WIN32
 #define fseeko _fseeki64
 #define ftello _ftelli64
+#else
+#include <unistd.h>
+#include <fcntl.h>
 #endif
 
 #define KISSDB_HEADER_SIZE ((sizeof(uint64_t) * 3) + 4)
 
+/* hash table slot of a deleted key: 0 ends a key's chain of tables, this
+ * one doesn't (the key may be in a later table), anything else is the
+ * offset of a record */
+#define KISSDB_TOMBSTONE ((uint64_t)1)
+
+/* hash table slots a compacted file may have per live key (or as many as
+ * the file had, if more): every table of a chain is as large as the
+ * first, so a table of a slot per key would need a chain of 7 for 10K
+ * keys and 9 for 1M, nearly all of it empty, held in memory */
+#define KISSDB_COMPACT_SLOTS 4
+
+#define KISSDB_INDEX_VERSION 1
+#define KISSDB_INDEX_HEADER_SIZE ((sizeof(uint64_t) * 3) + 4)
+#define KISSDB_INDEX_MAX_LEVEL 16
+
+/* Ordered key index: a skiplist with a single writer (the caller already
+ * serializes puts) and lock-free readers. New nodes are fully built before
+ * being linked in bottom-up with release stores, so a reader following
+ * next pointers with acquire loads always sees complete nodes. */
+typedef struct KISSDB_IndexNode {
+	uint64_t offset;
+	const uint8_t *key;
+	struct KISSDB_IndexNode *next[];
+} KISSDB_IndexNode;
+
+struct KISSDB_Index {
+	char *path;
+	unsigned long key_size;
+	unsigned long count;
+	uint32_t seed;
+	KISSDB_IndexNode *head;
+};
+
+/* Snapshot bookkeeping, allocated when the first snapshot is opened (or
+ * the first key is deleted). Each snapshot gets the next epoch; a record
+ * overwritten or deleted while epoch E was current dies at E and stays
+ * readable by every open snapshot with epoch <= E. Death epochs only
+ * grow, so the dead list is a FIFO and only its head has to be checked
+ * for reuse. While a compaction copies, the keys put or deleted are
+ * recorded in changed (tracking is -1 if one couldn't be). */
+typedef struct {
+	uint64_t offset;
+	uint64_t death;
+} KISSDB_DeadRecord;
+
+struct KISSDB_Mvcc {
+	uint64_t epoch;
+	KISSDB_Snapshot *oldest;
+	KISSDB_Snapshot *newest;
+	KISSDB_DeadRecord *dead;
+	unsigned long dead_head;
+	unsigned long dead_len;
+	unsigned long dead_cap;
+	uint8_t *changed;
+	unsigned long changed_len;
+	unsigned long changed_cap;
+	int tracking;
+};
+
 /* djb2 hash function */
 static uint64_t KISSDB_hash(const void *b,unsigned long len)
 {
@@ -36,6 +98,278 @@ static uint64_t KISSDB_hash(const void *b,unsigned long len)
 	return hash;
 }
 
+/* read len bytes at offset without touching the FILE position */
+static int KISSDB_pread(KISSDB *db,void *buf,uint64_t len,uint64_t offset)
+{
+#ifdef _WIN32
+	if (fseeko(db->f,offset,SEEK_SET))
+		return KISSDB_ERROR_IO;
+	return ((fread(buf,(size_t)len,1,db->f) == 1) ? 0 : KISSDB_ERROR_IO);
+#else
+	uint8_t *p = (uint8_t *)buf;
+	ssize_t n;
+	while (len) {
+		n = pread(fileno(db->f),p,(size_t)len,(off_t)offset);
+		if (n <= 0)
+			return KISSDB_ERROR_IO;
+		p += n;
+		offset += (uint64_t)n;
+		len -= (uint64_t)n;
+	}
+	return 0;
+#endif
+}
+
+/* natural order: runs of digits compare by numeric value, the rest bytewise */
+static int KISSDB_natural_cmp(const uint8_t *a,unsigned long alen,const uint8_t *b,unsigned long blen)
+{
+	unsigned long i = 0,j = 0,ni,nj;
+	int ea,eb,c;
+
+	for(;;) {
+		ea = ((i >= alen)||(!a[i]));
+		eb = ((j >= blen)||(!b[j]));
+		if ((ea)||(eb)) {
+			if (!((ea)&&(eb)))
+				return (ea ? -1 : 1);
+			break;
+		}
+		if ((a[i] >= '0')&&(a[i] <= '9')&&(b[j] >= '0')&&(b[j] <= '9')) {
+			while ((i + 1 < alen)&&(a[i] == '0')&&(a[i + 1] >= '0')&&(a[i + 1] <= '9')) ++i;
+			while ((j + 1 < blen)&&(b[j] == '0')&&(b[j + 1] >= '0')&&(b[j + 1] <= '9')) ++j;
+			for(ni=i;(ni<alen)&&(a[ni] >= '0')&&(a[ni] <= '9');++ni);
+			for(nj=j;(nj<blen)&&(b[nj] >= '0')&&(b[nj] <= '9');++nj);
+			if ((ni - i) != (nj - j))
+				return (((ni - i) < (nj - j)) ? -1 : 1);
+			if ((c = memcmp(a + i,b + j,ni - i)))
+				return c;
+			i = ni;
+			j = nj;
+		} else {
+			if (a[i] != b[j])
+				return ((a[i] < b[j]) ? -1 : 1);
+			++i;
+			++j;
+		}
+	}
+
+	/* naturally equal (e.g. leading zeros): fall back to bytes for a total order */
+	if ((c = memcmp(a,b,(alen < blen) ? alen : blen)))
+		return c;
+	return ((alen < blen) ? -1 : ((alen > blen) ? 1 : 0));
+}
+
+/* first node not less than key (len bytes); fills preds[] if given */
+static KISSDB_IndexNode *KISSDB_Index_seek(struct KISSDB_Index *idx,const void *key,unsigned long len,KISSDB_IndexNode **preds)
+{
+	KISSDB_IndexNode *x = idx->head,*n;
+	int l;
+
+	for(l=KISSDB_INDEX_MAX_LEVEL-1;l>=0;--l) {
+		while ((n = __atomic_load_n(&x->next[l],__ATOMIC_ACQUIRE))&&(KISSDB_natural_cmp(n->key,idx->key_size,(const uint8_t *)key,len) < 0))
+			x = n;
+		if (preds)
+			preds[l] = x;
+	}
+	return __atomic_load_n(&x->next[0],__ATOMIC_ACQUIRE);
+}
+
+/* add key at offset, or move it there if already present */
+static int KISSDB_Index_insert(struct KISSDB_Index *idx,const void *key,uint64_t offset)
+{
+	KISSDB_IndexNode *preds[KISSDB_INDEX_MAX_LEVEL];
+	KISSDB_IndexNode *n;
+	int l,level = 1;
+
+	n = KISSDB_Index_seek(idx,key,idx->key_size,preds);
+	if ((n)&&(!memcmp(n->key,key,idx->key_size))) {
+		if (!n->offset)
+			++idx->count; /* deleted before */
+		__atomic_store_n(&n->offset,offset,__ATOMIC_RELEASE);
+		return 0;
+	}
+
+	/* xorshift32, p = 1/4 per extra level */
+	for(;;) {
+		idx->seed ^= idx->seed << 13;
+		idx->seed ^= idx->seed >> 17;
+		idx->seed ^= idx->seed << 5;
+		if (((idx->seed & 3))||(level >= KISSDB_INDEX_MAX_LEVEL))
+			break;
+		++level;
+	}
+
+	n = malloc(sizeof(KISSDB_IndexNode) + (sizeof(KISSDB_IndexNode *) * level) + idx->key_size);
+	if (!n)
+		return KISSDB_ERROR_MALLOC;
+	n->offset = offset;
+	n->key = (const uint8_t *)(n->next + level);
+	memcpy((uint8_t *)(n->next + level),key,idx->key_size);
+
+	for(l=0;l<level;++l) {
+		n->next[l] = preds[l]->next[l];
+		__atomic_store_n(&preds[l]->next[l],n,__ATOMIC_RELEASE);
+	}
+	++idx->count;
+
+	return 0;
+}
+
+/* mark key deleted: its node stays linked (cursors may be on it), is
+ * skipped by cursors and saves, and is reused if the key is put again */
+static void KISSDB_Index_remove(struct KISSDB_Index *idx,const void *key)
+{
+	KISSDB_IndexNode *n = KISSDB_Index_seek(idx,key,idx->key_size,(KISSDB_IndexNode **)0);
+
+	if ((n)&&(!memcmp(n->key,key,idx->key_size))&&(n->offset)) {
+		__atomic_store_n(&n->offset,0,__ATOMIC_RELEASE);
+		--idx->count;
+	}
+}
+
+static void KISSDB_Index_clear(struct KISSDB_Index *idx)
+{
+	KISSDB_IndexNode *n = idx->head->next[0],*next;
+
+	while (n) {
+		next = n->next[0];
+		free(n);
+		n = next;
+	}
+	memset(idx->head->next,0,sizeof(KISSDB_IndexNode *) * KISSDB_INDEX_MAX_LEVEL);
+	idx->count = 0;
+}
+
+static void KISSDB_Index_free(struct KISSDB_Index *idx)
+{
+	KISSDB_Index_clear(idx);
+	free(idx->head);
+	free(idx->path);
+	free(idx);
+}
+
+/* position the file where a new record goes: a dead record no open
+ * snapshot can see any more, or the end of file */
+static int KISSDB_alloc_record(KISSDB *db,uint64_t *offset)
+{
+	struct KISSDB_Mvcc *m = db->mvcc;
+
+	if ((m)&&(m->dead_head < m->dead_len)&&((!m->oldest)||(m->oldest->epoch > m->dead[m->dead_head].death))) {
+		*offset = m->dead[m->dead_head++].offset;
+		if (fseeko(db->f,*offset,SEEK_SET))
+			return KISSDB_ERROR_IO;
+		return 0;
+	}
+
+	if (fseeko(db->f,0,SEEK_END))
+		return KISSDB_ERROR_IO;
+	*offset = ftello(db->f);
+	return 0;
+}
+
+/* make room for one more dead record (first, so running out of memory
+ * leaves the old record live) */
+static int KISSDB_dead_reserve(struct KISSDB_Mvcc *m)
+{
+	KISSDB_DeadRecord *dead_rea;
+
+	if (m->dead_len >= m->dead_cap) {
+		if (m->dead_head) {
+			memmove(m->dead,m->dead + m->dead_head,sizeof(KISSDB_DeadRecord) * (m->dead_len - m->dead_head));
+			m->dead_len -= m->dead_head;
+			m->dead_head = 0;
+		} else {
+			dead_rea = realloc(m->dead,sizeof(KISSDB_DeadRecord) * (m->dead_cap ? (m->dead_cap * 2) : 64));
+			if (!dead_rea)
+				return KISSDB_ERROR_MALLOC;
+			m->dead = dead_rea;
+			m->dead_cap = m->dead_cap ? (m->dead_cap * 2) : 64;
+		}
+	}
+	return 0;
+}
+
+/* record a key put or deleted while a compaction copies */
+static void KISSDB_track(KISSDB *db,const void *key)
+{
+	struct KISSDB_Mvcc *m = db->mvcc;
+	uint8_t *changed_rea;
+
+	if ((!m)||(m->tracking <= 0))
+		return;
+	if (m->changed_len >= m->changed_cap) {
+		changed_rea = realloc(m->changed,db->key_size * (m->changed_cap ? (m->changed_cap * 2) : 256));
+		if (!changed_rea) {
+			m->tracking = -1;
+			return;
+		}
+		m->changed = changed_rea;
+		m->changed_cap = m->changed_cap ? (m->changed_cap * 2) : 256;
+	}
+	memcpy(m->changed + (db->key_size * m->changed_len++),key,db->key_size);
+}
+
+/* write a new record and point the hash table slot at slot_offset to it */
+static int KISSDB_put_new(KISSDB *db,const void *key,const void *value,uint64_t slot_offset,uint64_t *slot)
+{
+	uint64_t endoffset;
+
+	if (KISSDB_alloc_record(db,&endoffset))
+		return KISSDB_ERROR_IO;
+
+	if (fwrite(key,db->key_size,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	if (fwrite(value,db->value_size,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+
+	if (fseeko(db->f,slot_offset,SEEK_SET))
+		return KISSDB_ERROR_IO;
+	if (fwrite(&endoffset,sizeof(uint64_t),1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	*slot = endoffset;
+
+	fflush(db->f);
+
+	if (db->index)
+		return KISSDB_Index_insert(db->index,key,endoffset);
+
+	return 0; /* success */
+}
+
+/* overwrite an existing key without touching the record snapshots may read */
+static int KISSDB_put_cow(KISSDB *db,const void *key,const void *value,uint64_t old_offset,uint64_t slot_offset,uint64_t *slot)
+{
+	struct KISSDB_Mvcc *m = db->mvcc;
+	uint64_t newoffset;
+
+	if (KISSDB_dead_reserve(m))
+		return KISSDB_ERROR_MALLOC;
+
+	if (KISSDB_alloc_record(db,&newoffset))
+		return KISSDB_ERROR_IO;
+	if (fwrite(key,db->key_size,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	if (fwrite(value,db->value_size,1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+
+	if (fseeko(db->f,slot_offset,SEEK_SET))
+		return KISSDB_ERROR_IO;
+	if (fwrite(&newoffset,sizeof(uint64_t),1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	*slot = newoffset;
+
+	fflush(db->f);
+
+	m->dead[m->dead_len].offset = old_offset;
+	m->dead[m->dead_len].death = m->epoch;
+	++m->dead_len;
+
+	if (db->index)
+		return KISSDB_Index_insert(db->index,key,newoffset);
+
+	return 0; /* success */
+}
+
 int KISSDB_open(
 	KISSDB *db,
 	const char *path,
@@ -49,6 +383,9 @@ int KISSDB_open(
 	uint64_t *httmp;
 	uint64_t *hash_tables_rea;
 
+	db->index = (struct KISSDB_Index *)0;
+	db->mvcc = (struct KISSDB_Mvcc *)0;
+
 #ifdef _WIN32
 	db->f = (FILE *)0;
 	fopen_s(&db->f,path,((mode == KISSDB_OPEN_MODE_RWREPLACE) ? "w+b" : (((mode == KISSDB_OPEN_MODE_RDWR)||(mode == KISSDB_OPEN_MODE_RWCREAT)) ? "r+b" : "rb")));
@@ -92,7 +429,7 @@ int KISSDB_open(
 	} else {
 		if (fseeko(db->f,0,SEEK_SET)) { fclose(db->f); return KISSDB_ERROR_IO; }
 		if (fread(tmp2,4,1,db->f) != 1) { fclose(db->f); return KISSDB_ERROR_IO; }
-		if ((tmp2[0] != 'K')||(tmp2[1] != 'd')||(tmp2[2] != 'B')||(tmp2[3] != KISSDB_VERSION)) {
+		if ((tmp2[0] != 'K')||(tmp2[1] != 'd')||(tmp2[2] != 'B')||((tmp2[3] != KISSDB_VERSION)&&(tmp2[3] != 2))) {
 			fclose(db->f);
 			return KISSDB_ERROR_CORRUPT_DBFILE;
 		}
@@ -114,6 +451,16 @@ int KISSDB_open(
 			return KISSDB_ERROR_CORRUPT_DBFILE;
 		}
 		value_size = (unsigned long)tmp;
+
+		/* a version 2 file has no tombstones yet: mark it before one is written */
+		if ((tmp2[3] != KISSDB_VERSION)&&(mode != KISSDB_OPEN_MODE_RDONLY)) {
+			tmp2[3] = KISSDB_VERSION;
+			if ((fseeko(db->f,0,SEEK_SET))||(fwrite(tmp2,4,1,db->f) != 1)||(fseeko(db->f,KISSDB_HEADER_SIZE,SEEK_SET))) {
+				fclose(db->f);
+				return KISSDB_ERROR_IO;
+			}
+			fflush(db->f);
+		}
 	}
 
 	db->hash_table_size = hash_table_size;
@@ -154,6 +501,17 @@ int KISSDB_open(
 
 void KISSDB_close(KISSDB *db)
 {
+	if (db->index) {
+		KISSDB_Index_save(db);
+		KISSDB_Index_free(db->index);
+	}
+	if (db->mvcc) {
+		if (db->mvcc->dead)
+			free(db->mvcc->dead);
+		if (db->mvcc->changed)
+			free(db->mvcc->changed);
+		free(db->mvcc);
+	}
 	if (db->hash_tables)
 		free(db->hash_tables);
 	if (db->f)
@@ -162,45 +520,139 @@ void KISSDB_close(KISSDB *db)
 }
 
 int KISSDB_get(KISSDB *db,const void *key,void *vbuf)
+{
+	uint64_t offset;
+	int rc = KISSDB_locate(db,key,&offset);
+
+	if (rc)
+		return rc;
+	return ((KISSDB_pread(db,vbuf,db->value_size,offset)) ? KISSDB_ERROR_IO : 0);
+}
+
+int KISSDB_locate(KISSDB *db,const void *key,uint64_t *value_offset)
 {
 	uint8_t tmp[4096];
-	const uint8_t *kptr;
-	unsigned long klen,i;
+	unsigned long i,k,n;
 	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
 	uint64_t offset;
 	uint64_t *cur_hash_table;
-	long n;
 
+	/* positional reads: concurrent gets don't share the FILE position */
 	cur_hash_table = db->hash_tables;
 	for(i=0;i<db->num_hash_tables;++i) {
 		offset = cur_hash_table[hash];
-		if (offset) {
-			if (fseeko(db->f,offset,SEEK_SET))
-				return KISSDB_ERROR_IO;
+		if (!offset)
+			return 1; /* not found */
 
-			kptr = (const uint8_t *)key;
-			klen = db->key_size;
-			while (klen) {
-				n = (long)fread(tmp,1,(klen > sizeof(tmp)) ? sizeof(tmp) : klen,db->f);
-				if (n > 0) {
-					if (memcmp(kptr,tmp,n))
-						goto get_no_match_next_hash_table;
-					kptr += n;
-					klen -= (unsigned long)n;
-				} else return 1; /* not found */
+		if (offset != KISSDB_TOMBSTONE) {
+			for(k=0;k<db->key_size;k+=n) {
+				n = ((db->key_size - k) > sizeof(tmp)) ? sizeof(tmp) : (db->key_size - k);
+				if (KISSDB_pread(db,tmp,n,offset + k))
+					return 1; /* not found (short file) */
+				if (memcmp(tmp,((const uint8_t *)key) + k,n))
+					break;
+			}
+			if (k >= db->key_size) {
+				*value_offset = offset + db->key_size;
+				return 0;
 			}
+		}
 
-			if (fread(vbuf,db->value_size,1,db->f) == 1)
-				return 0; /* success */
-			else return KISSDB_ERROR_IO;
-		} else return 1; /* not found */
-get_no_match_next_hash_table:
 		cur_hash_table += db->hash_table_size + 1;
 	}
 
 	return 1; /* not found */
 }
 
+/* a key of a batch get, and the record it is checked against next */
+typedef struct {
+	uint64_t offset;
+	uint64_t hash;
+	unsigned long key;
+	unsigned long table;
+} KISSDB_BatchKey;
+
+static int KISSDB_batch_cmp(const void *a,const void *b)
+{
+	const uint64_t x = ((const KISSDB_BatchKey *)a)->offset;
+	const uint64_t y = ((const KISSDB_BatchKey *)b)->offset;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+int KISSDB_get_batch(KISSDB *db,const void *keys,void *vbufs,int *results,unsigned long n)
+{
+	const uint64_t recsize = db->key_size + db->value_size;
+	KISSDB_BatchKey *bk;
+	uint8_t *buf,*rec;
+	unsigned long i,j,k,m,u,len;
+	int found = 0;
+
+	if (!n)
+		return 0;
+	bk = malloc(sizeof(KISSDB_BatchKey) * n);
+	buf = malloc(recsize * n);
+	if ((!bk)||(!buf)) {
+		free(bk);
+		free(buf);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	for(i=0;i<n;++i) {
+		results[i] = 1; /* not found, until its record says otherwise */
+		bk[i].hash = KISSDB_hash(((const uint8_t *)keys) + (db->key_size * i),db->key_size) % (uint64_t)db->hash_table_size;
+		bk[i].key = i;
+		bk[i].table = 0;
+	}
+
+	for(m=n;;) {
+		/* resolve the keys still pending against the in-memory hash tables */
+		for(i=0,k=m,m=0;i<k;++i) {
+			while ((bk[i].table < db->num_hash_tables)&&((bk[i].offset = db->hash_tables[((db->hash_table_size + 1) * bk[i].table) + bk[i].hash]) == KISSDB_TOMBSTONE))
+				++bk[i].table;
+			if ((bk[i].table < db->num_hash_tables)&&(bk[i].offset))
+				bk[m++] = bk[i];
+		}
+		if (!m)
+			break;
+		qsort(bk,m,sizeof(KISSDB_BatchKey),KISSDB_batch_cmp);
+
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+		posix_fadvise(fileno(db->f),(off_t)bk[0].offset,(off_t)(bk[m - 1].offset - bk[0].offset + recsize),POSIX_FADV_WILLNEED);
+#endif
+
+		/* one forward pass: one read per run of records back to back (keys sharing a record share the read) */
+		for(i=0,u=0;i<m;i=j,++u) {
+			for(j=i+1,len=1;j<m;++j) {
+				if (bk[j].offset == bk[j - 1].offset)
+					continue;
+				if (bk[j].offset != bk[j - 1].offset + recsize)
+					break;
+				++len;
+			}
+			if (KISSDB_pread(db,buf + (recsize * u),recsize * len,bk[i].offset)) {
+				free(bk);
+				free(buf);
+				return KISSDB_ERROR_IO;
+			}
+			for(k=i;k<j;++k) {
+				if ((k > i)&&(bk[k].offset != bk[k - 1].offset))
+					++u;
+				rec = buf + (recsize * u);
+				if (!memcmp(rec,((const uint8_t *)keys) + (db->key_size * bk[k].key),db->key_size)) {
+					memcpy(((uint8_t *)vbufs) + (db->value_size * bk[k].key),rec + db->key_size,db->value_size);
+					results[bk[k].key] = 0;
+					bk[k].table = db->num_hash_tables; /* done */
+					++found;
+				} else ++bk[k].table;
+			}
+		}
+	}
+
+	free(bk);
+	free(buf);
+	return found;
+}
+
 int KISSDB_put(KISSDB *db,const void *key,const void *value)
 {
 	uint8_t tmp[4096];
@@ -212,13 +664,23 @@ int KISSDB_put(KISSDB *db,const void *key,const void *value)
 	uint64_t endoffset;
 	uint64_t *cur_hash_table;
 	uint64_t *hash_tables_rea;
+	uint64_t *tomb_slot = (uint64_t *)0;
+	uint64_t tomb_slot_offset = 0;
 	long n;
 
+	KISSDB_track(db,key);
+
 	lasthtoffset = htoffset = KISSDB_HEADER_SIZE;
 	cur_hash_table = db->hash_tables;
 	for(i=0;i<db->num_hash_tables;++i) {
 		offset = cur_hash_table[hash];
-		if (offset) {
+		if (offset == KISSDB_TOMBSTONE) {
+			/* the key may still be further on; if not, it goes here */
+			if (!tomb_slot) {
+				tomb_slot = &cur_hash_table[hash];
+				tomb_slot_offset = htoffset + (sizeof(uint64_t) * hash);
+			}
+		} else if (offset) {
 			/* rewrite if already exists */
 			if (fseeko(db->f,offset,SEEK_SET))
 				return KISSDB_ERROR_IO;
@@ -235,6 +697,10 @@ int KISSDB_put(KISSDB *db,const void *key,const void *value)
 				}
 			}
 
+			/* snapshots may still read the old value: copy on write */
+			if ((db->mvcc)&&(db->mvcc->oldest))
+				return KISSDB_put_cow(db,key,value,offset,htoffset + (sizeof(uint64_t) * hash),&cur_hash_table[hash]);
+
 			/* C99 spec demands seek after fread(), required for Windows */
 			fseeko(db->f,0,SEEK_CUR);
  
@@ -243,25 +709,10 @@ int KISSDB_put(KISSDB *db,const void *key,const void *value)
 				return 0; /* success */
 			} else return KISSDB_ERROR_IO;
 		} else {
-			/* add if an empty hash table slot is discovered */
-			if (fseeko(db->f,0,SEEK_END))
-				return KISSDB_ERROR_IO;
-			endoffset = ftello(db->f);
-
-			if (fwrite(key,db->key_size,1,db->f) != 1)
-				return KISSDB_ERROR_IO;
-			if (fwrite(value,db->value_size,1,db->f) != 1)
-				return KISSDB_ERROR_IO;
-
-			if (fseeko(db->f,htoffset + (sizeof(uint64_t) * hash),SEEK_SET))
-				return KISSDB_ERROR_IO;
-			if (fwrite(&endoffset,sizeof(uint64_t),1,db->f) != 1)
-				return KISSDB_ERROR_IO;
-			cur_hash_table[hash] = endoffset;
-
-			fflush(db->f);
-
-			return 0; /* success */
+			/* add if an empty hash table slot is discovered (or a tombstone was passed) */
+			if (tomb_slot)
+				return KISSDB_put_new(db,key,value,tomb_slot_offset,tomb_slot);
+			return KISSDB_put_new(db,key,value,htoffset + (sizeof(uint64_t) * hash),&cur_hash_table[hash]);
 		}
 put_no_match_next_hash_table:
 		lasthtoffset = htoffset;
@@ -269,6 +720,9 @@ put_no_match_next_hash_table:
 		cur_hash_table += (db->hash_table_size + 1);
 	}
 
+	if (tomb_slot)
+		return KISSDB_put_new(db,key,value,tomb_slot_offset,tomb_slot);
+
 	/* if no existing slots, add a new page of hash table entries */
 	if (fseeko(db->f,0,SEEK_END))
 		return KISSDB_ERROR_IO;
@@ -303,9 +757,120 @@ put_no_match_next_hash_table:
 
 	fflush(db->f);
 
+	if (db->index)
+		return KISSDB_Index_insert(db->index,key,endoffset + db->hash_table_size_bytes);
+
+	return 0; /* success */
+}
+
+/* hash tables a compacted file with tables of size slots needs for keys
+ * of these (unreduced) hashes: its longest chain */
+static unsigned long KISSDB_compact_tables(const uint64_t *hashes,unsigned long n,unsigned long size,uint32_t *depth)
+{
+	unsigned long i,num_tables = 0;
+	uint64_t hash;
+
+	memset(depth,0,sizeof(uint32_t) * size);
+	for(i=0;i<n;++i) {
+		hash = hashes[i] % (uint64_t)size;
+		if (++depth[hash] > num_tables)
+			num_tables = depth[hash];
+	}
+	return num_tables;
+}
+
+int KISSDB_delete(KISSDB *db,const void *key)
+{
+	uint8_t tmp[4096];
+	unsigned long i,k,n;
+	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
+	uint64_t offset = 0;
+	uint64_t htoffset = KISSDB_HEADER_SIZE;
+	const uint64_t tombstone = KISSDB_TOMBSTONE;
+	uint64_t *cur_hash_table = db->hash_tables;
+	struct KISSDB_Mvcc *m;
+
+	KISSDB_track(db,key);
+
+	for(i=0;i<db->num_hash_tables;++i) {
+		offset = cur_hash_table[hash];
+		if (!offset)
+			return 1; /* not found */
+
+		if (offset != KISSDB_TOMBSTONE) {
+			for(k=0;k<db->key_size;k+=n) {
+				n = ((db->key_size - k) > sizeof(tmp)) ? sizeof(tmp) : (db->key_size - k);
+				if (KISSDB_pread(db,tmp,n,offset + k))
+					return KISSDB_ERROR_IO;
+				if (memcmp(tmp,((const uint8_t *)key) + k,n))
+					break;
+			}
+			if (k >= db->key_size)
+				break;
+		}
+
+		htoffset = cur_hash_table[db->hash_table_size];
+		cur_hash_table += db->hash_table_size + 1;
+	}
+	if (i >= db->num_hash_tables)
+		return 1; /* not found */
+
+	if (!db->mvcc) {
+		if (!(db->mvcc = calloc(1,sizeof(struct KISSDB_Mvcc))))
+			return KISSDB_ERROR_MALLOC;
+	}
+	m = db->mvcc;
+	if (KISSDB_dead_reserve(m))
+		return KISSDB_ERROR_MALLOC;
+
+	if (fseeko(db->f,htoffset + (sizeof(uint64_t) * hash),SEEK_SET))
+		return KISSDB_ERROR_IO;
+	if (fwrite(&tombstone,sizeof(uint64_t),1,db->f) != 1)
+		return KISSDB_ERROR_IO;
+	cur_hash_table[hash] = KISSDB_TOMBSTONE;
+
+	fflush(db->f);
+
+	/* snapshots that can see the record keep it until they close */
+	m->dead[m->dead_len].offset = offset;
+	m->dead[m->dead_len].death = m->epoch;
+	++m->dead_len;
+
+	if (db->index)
+		KISSDB_Index_remove(db->index,key);
+
 	return 0; /* success */
 }
 
+int KISSDB_stats(KISSDB *db,KISSDB_Stats *st)
+{
+	unsigned long i,j;
+	uint64_t offset;
+
+	memset(st,0,sizeof(KISSDB_Stats));
+	for(i=0;i<db->num_hash_tables;++i) {
+		for(j=0;j<db->hash_table_size;++j) {
+			offset = db->hash_tables[((db->hash_table_size + 1) * i) + j];
+			if (offset == KISSDB_TOMBSTONE)
+				++st->tombstones;
+			else if (offset)
+				++st->live;
+		}
+	}
+	st->num_hash_tables = db->num_hash_tables;
+
+	if (fseeko(db->f,0,SEEK_END))
+		return KISSDB_ERROR_IO;
+	st->file_size = (uint64_t)ftello(db->f);
+
+	i = KISSDB_COMPACT_SLOTS * (st->live + 1);
+	if (i < db->hash_table_size + 1)
+		i = db->hash_table_size + 1;
+	st->live_size = KISSDB_HEADER_SIZE + ((uint64_t)sizeof(uint64_t) * i) + ((uint64_t)(db->key_size + db->value_size) * st->live);
+
+	return 0;
+}
+
 void KISSDB_Iterator_init(KISSDB *db,KISSDB_Iterator *dbi)
 {
 	dbi->db = db;
@@ -318,7 +883,7 @@ int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf)
 	uint64_t offset;
 
 	if ((dbi->h_no < dbi->db->num_hash_tables)&&(dbi->h_idx < dbi->db->hash_table_size)) {
-		while (!(offset = dbi->db->hash_tables[((dbi->db->hash_table_size + 1) * dbi->h_no) + dbi->h_idx])) {
+		while ((offset = dbi->db->hash_tables[((dbi->db->hash_table_size + 1) * dbi->h_no) + dbi->h_idx]) <= KISSDB_TOMBSTONE) {
 			if (++dbi->h_idx >= dbi->db->hash_table_size) {
 				dbi->h_idx = 0;
 				if (++dbi->h_no >= dbi->db->num_hash_tables)
@@ -341,22 +906,728 @@ int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf)
 	return 0;
 }
 
-#ifdef KISSDB_TEST
-
-#include <inttypes.h>
+static int KISSDB_offset_cmp(const void *a,const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
 
-int main(int argc,char **argv)
+/* collect the next batch of record offsets into scan->ahead and hint it */
+static void KISSDB_Scan_fill_ahead(KISSDB_Scan *scan)
 {
-	uint64_t i,j;
-	uint64_t v[8];
-	KISSDB db;
-	KISSDB_Iterator dbi;
-	char got_all_values[10000];
-	int q;
+	const unsigned long slots = scan->db->hash_table_size;
+	const uint64_t *ht = (scan->hash_tables) ? scan->hash_tables : scan->db->hash_tables;
+	uint64_t offset;
 
-	printf("Opening new empty database test.db...\n");
+	scan->ahead_len = 0;
+	while ((scan->pos < scan->end)&&(scan->ahead_len < KISSDB_SCAN_BATCH)) {
+		offset = ht[((slots + 1) * (scan->pos / slots)) + (scan->pos % slots)];
+		if (offset > KISSDB_TOMBSTONE)
+			scan->ahead[scan->ahead_len++] = offset;
+		++scan->pos;
+	}
+	if (!scan->ahead_len)
+		return;
 
-	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,1024,8,sizeof(v))) {
+	qsort(scan->ahead,scan->ahead_len,sizeof(uint64_t),KISSDB_offset_cmp);
+
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(fileno(scan->db->f),(off_t)scan->ahead[0],(off_t)(scan->ahead[scan->ahead_len - 1] - scan->ahead[0] + scan->db->key_size + scan->db->value_size),POSIX_FADV_WILLNEED);
+#endif
+}
+
+static int KISSDB_Scan_setup(KISSDB *db,const uint64_t *hash_tables,unsigned long num_hash_tables,KISSDB_Scan *scan,unsigned long part,unsigned long num_parts)
+{
+	const unsigned long total = num_hash_tables * db->hash_table_size;
+
+	memset(scan,0,sizeof(KISSDB_Scan));
+	if ((!num_parts)||(part >= num_parts))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+
+	scan->db = db;
+	scan->hash_tables = hash_tables;
+	scan->pos = (unsigned long)(((uint64_t)total * part) / num_parts);
+	scan->end = (unsigned long)(((uint64_t)total * (part + 1)) / num_parts);
+
+	scan->cur = malloc(sizeof(uint64_t) * KISSDB_SCAN_BATCH);
+	scan->ahead = malloc(sizeof(uint64_t) * KISSDB_SCAN_BATCH);
+	scan->buf = malloc((db->key_size + db->value_size) * KISSDB_SCAN_BATCH);
+	if ((!scan->cur)||(!scan->ahead)||(!scan->buf)) {
+		KISSDB_Scan_close(scan);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	KISSDB_Scan_fill_ahead(scan);
+
+	return 0;
+}
+
+int KISSDB_Scan_init(KISSDB *db,KISSDB_Scan *scan,unsigned long part,unsigned long num_parts)
+{
+	return KISSDB_Scan_setup(db,(const uint64_t *)0,db->num_hash_tables,scan,part,num_parts);
+}
+
+int KISSDB_Scan_init_snapshot(KISSDB_Snapshot *snap,KISSDB_Scan *scan,unsigned long part,unsigned long num_parts)
+{
+	return KISSDB_Scan_setup(snap->db,snap->hash_tables,snap->num_hash_tables,scan,part,num_parts);
+}
+
+int KISSDB_Scan_next(KISSDB_Scan *scan,void *kbuf,void *vbuf)
+{
+	const uint64_t recsize = scan->db->key_size + scan->db->value_size;
+	uint64_t *tmp;
+	unsigned long i,j;
+	uint8_t *rec;
+
+	if (scan->cur_idx >= scan->cur_len) {
+		if (!scan->ahead_len)
+			return 0;
+
+		tmp = scan->cur;
+		scan->cur = scan->ahead;
+		scan->ahead = tmp;
+		scan->cur_len = scan->ahead_len;
+		scan->cur_idx = 0;
+
+		/* one read per run of records that lie back to back in the file */
+		for(i=0;i<scan->cur_len;i=j) {
+			for(j=i+1;(j<scan->cur_len)&&(scan->cur[j] == scan->cur[j - 1] + recsize);++j);
+			if (KISSDB_pread(scan->db,scan->buf + (recsize * i),recsize * (j - i),scan->cur[i]))
+				return KISSDB_ERROR_IO;
+		}
+
+		KISSDB_Scan_fill_ahead(scan);
+	}
+
+	rec = scan->buf + (recsize * scan->cur_idx++);
+	memcpy(kbuf,rec,scan->db->key_size);
+	memcpy(vbuf,rec + scan->db->key_size,scan->db->value_size);
+
+	return 1;
+}
+
+void KISSDB_Scan_close(KISSDB_Scan *scan)
+{
+	if (scan->cur)
+		free(scan->cur);
+	if (scan->ahead)
+		free(scan->ahead);
+	if (scan->buf)
+		free(scan->buf);
+	memset(scan,0,sizeof(KISSDB_Scan));
+}
+
+int KISSDB_Snapshot_open(KISSDB *db,KISSDB_Snapshot *snap)
+{
+	struct KISSDB_Mvcc *m;
+
+	memset(snap,0,sizeof(KISSDB_Snapshot));
+	if (!db->mvcc) {
+		if (!(db->mvcc = calloc(1,sizeof(struct KISSDB_Mvcc))))
+			return KISSDB_ERROR_MALLOC;
+	}
+	m = db->mvcc;
+
+	if (db->num_hash_tables) {
+		if (!(snap->hash_tables = malloc(db->hash_table_size_bytes * db->num_hash_tables)))
+			return KISSDB_ERROR_MALLOC;
+		memcpy(snap->hash_tables,db->hash_tables,db->hash_table_size_bytes * db->num_hash_tables);
+	}
+	snap->db = db;
+	snap->num_hash_tables = db->num_hash_tables;
+	snap->epoch = ++m->epoch;
+
+	snap->prev = m->newest;
+	if (m->newest)
+		m->newest->next = snap;
+	else m->oldest = snap;
+	m->newest = snap;
+
+	return 0;
+}
+
+void KISSDB_Snapshot_close(KISSDB_Snapshot *snap)
+{
+	struct KISSDB_Mvcc *m;
+
+	if (!snap->db)
+		return;
+	m = snap->db->mvcc;
+
+	if (snap->prev)
+		snap->prev->next = snap->next;
+	else m->oldest = snap->next;
+	if (snap->next)
+		snap->next->prev = snap->prev;
+	else m->newest = snap->prev;
+
+	if (snap->hash_tables)
+		free(snap->hash_tables);
+	memset(snap,0,sizeof(KISSDB_Snapshot));
+}
+
+int KISSDB_Snapshot_get(KISSDB_Snapshot *snap,const void *key,void *vbuf)
+{
+	uint8_t tmp[4096];
+	KISSDB *db = snap->db;
+	unsigned long i,k,n;
+	uint64_t hash = KISSDB_hash(key,db->key_size) % (uint64_t)db->hash_table_size;
+	uint64_t offset;
+	const uint64_t *cur_hash_table = snap->hash_tables;
+
+	for(i=0;i<snap->num_hash_tables;++i) {
+		offset = cur_hash_table[hash];
+		if (!offset)
+			return 1; /* not found */
+
+		if (offset != KISSDB_TOMBSTONE) {
+			for(k=0;k<db->key_size;k+=n) {
+				n = ((db->key_size - k) > sizeof(tmp)) ? sizeof(tmp) : (db->key_size - k);
+				if (KISSDB_pread(db,tmp,n,offset + k))
+					return KISSDB_ERROR_IO;
+				if (memcmp(tmp,((const uint8_t *)key) + k,n))
+					break;
+			}
+			if (k >= db->key_size)
+				return ((KISSDB_pread(db,vbuf,db->value_size,offset + db->key_size)) ? KISSDB_ERROR_IO : 0);
+		}
+
+		cur_hash_table += db->hash_table_size + 1;
+	}
+
+	return 1; /* not found */
+}
+
+static int KISSDB_Index_load(KISSDB *db,FILE *f,uint64_t db_size)
+{
+	uint8_t hdr[4];
+	uint64_t tmp[3];
+	uint64_t offset,i;
+	uint8_t *kbuf;
+	int rc = KISSDB_ERROR_CORRUPT_DBFILE;
+
+	if (fread(hdr,4,1,f) != 1)
+		return KISSDB_ERROR_IO;
+	if ((hdr[0] != 'K')||(hdr[1] != 'd')||(hdr[2] != 'B')||(hdr[3] != KISSDB_INDEX_VERSION))
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+	if (fread(tmp,sizeof(uint64_t),3,f) != 3)
+		return KISSDB_ERROR_IO;
+	/* a file saved before later puts is stale and must be rebuilt */
+	if ((tmp[0] != db->key_size)||(tmp[1] != db_size))
+		return KISSDB_ERROR_CORRUPT_DBFILE;
+
+	if (!(kbuf = malloc(db->key_size)))
+		return KISSDB_ERROR_MALLOC;
+	for(i=0;i<tmp[2];++i) {
+		if ((fread(kbuf,db->key_size,1,f) != 1)||(fread(&offset,sizeof(uint64_t),1,f) != 1))
+			break;
+		if (KISSDB_Index_insert(db->index,kbuf,offset)) {
+			rc = KISSDB_ERROR_MALLOC;
+			break;
+		}
+	}
+	free(kbuf);
+
+	return ((i == tmp[2]) ? 0 : rc);
+}
+
+static int KISSDB_Index_rebuild(KISSDB *db)
+{
+	uint64_t offset;
+	unsigned long i,j;
+	uint8_t *kbuf;
+	int rc = 0;
+
+	if (!(kbuf = malloc(db->key_size)))
+		return KISSDB_ERROR_MALLOC;
+	for(i=0;(i<db->num_hash_tables)&&(!rc);++i) {
+		for(j=0;(j<db->hash_table_size)&&(!rc);++j) {
+			if ((offset = db->hash_tables[((db->hash_table_size + 1) * i) + j]) > KISSDB_TOMBSTONE) {
+				if (!(rc = KISSDB_pread(db,kbuf,db->key_size,offset)))
+					rc = KISSDB_Index_insert(db->index,kbuf,offset);
+			}
+		}
+	}
+	free(kbuf);
+
+	return rc;
+}
+
+int KISSDB_Index_open(KISSDB *db,const char *path)
+{
+	struct KISSDB_Index *idx;
+	uint64_t db_size;
+	FILE *f;
+	int rc;
+
+	if (db->index)
+		return 0;
+	if (fseeko(db->f,0,SEEK_END))
+		return KISSDB_ERROR_IO;
+	db_size = (uint64_t)ftello(db->f);
+
+	if (!(idx = calloc(1,sizeof(struct KISSDB_Index))))
+		return KISSDB_ERROR_MALLOC;
+	idx->path = malloc(strlen(path) + 1);
+	idx->head = calloc(1,sizeof(KISSDB_IndexNode) + (sizeof(KISSDB_IndexNode *) * KISSDB_INDEX_MAX_LEVEL));
+	if ((!idx->path)||(!idx->head)) {
+		free(idx->path);
+		free(idx->head);
+		free(idx);
+		return KISSDB_ERROR_MALLOC;
+	}
+	strcpy(idx->path,path);
+	idx->key_size = db->key_size;
+	idx->seed = 2463534242U;
+	db->index = idx;
+
+	rc = -1;
+	if ((f = fopen(path,"rb"))) {
+		rc = KISSDB_Index_load(db,f,db_size);
+		fclose(f);
+	}
+	if (rc) {
+		KISSDB_Index_clear(idx);
+		if ((rc = KISSDB_Index_rebuild(db))) {
+			KISSDB_Index_free(idx);
+			db->index = (struct KISSDB_Index *)0;
+		}
+	}
+
+	return rc;
+}
+
+int KISSDB_Index_save(KISSDB *db)
+{
+	struct KISSDB_Index *idx = db->index;
+	KISSDB_IndexNode *n;
+	uint8_t hdr[4];
+	uint64_t tmp[3];
+	char *tmp_path;
+	FILE *f;
+	int rc = 0;
+
+	if (!idx)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	if (fseeko(db->f,0,SEEK_END))
+		return KISSDB_ERROR_IO;
+
+	hdr[0] = 'K'; hdr[1] = 'd'; hdr[2] = 'B'; hdr[3] = KISSDB_INDEX_VERSION;
+	tmp[0] = idx->key_size;
+	tmp[1] = (uint64_t)ftello(db->f);
+	tmp[2] = idx->count;
+
+	/* write next to the old file and rename, so a crash leaves one of them intact */
+	if (!(tmp_path = malloc(strlen(idx->path) + 5)))
+		return KISSDB_ERROR_MALLOC;
+	strcpy(tmp_path,idx->path);
+	strcat(tmp_path,".tmp");
+	if (!(f = fopen(tmp_path,"wb"))) {
+		free(tmp_path);
+		return KISSDB_ERROR_IO;
+	}
+	if ((fwrite(hdr,4,1,f) != 1)||(fwrite(tmp,sizeof(uint64_t),3,f) != 3))
+		rc = KISSDB_ERROR_IO;
+	for(n=idx->head->next[0];(n)&&(!rc);n=n->next[0]) {
+		if (!n->offset)
+			continue; /* deleted */
+		if ((fwrite(n->key,idx->key_size,1,f) != 1)||(fwrite(&n->offset,sizeof(uint64_t),1,f) != 1))
+			rc = KISSDB_ERROR_IO;
+	}
+	if (fclose(f))
+		rc = KISSDB_ERROR_IO;
+	if ((!rc)&&(rename(tmp_path,idx->path)))
+		rc = KISSDB_ERROR_IO;
+	if (rc)
+		remove(tmp_path);
+	free(tmp_path);
+
+	return rc;
+}
+
+int KISSDB_Range_init(KISSDB *db,KISSDB_Range *r,const void *lo,const void *hi)
+{
+	memset(r,0,sizeof(KISSDB_Range));
+	if (!db->index)
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	r->db = db;
+	r->hi = hi;
+	r->node = (lo) ? KISSDB_Index_seek(db->index,lo,db->key_size,(KISSDB_IndexNode **)0) : __atomic_load_n(&db->index->head->next[0],__ATOMIC_ACQUIRE);
+	return 0;
+}
+
+int KISSDB_Range_init_prefix(KISSDB *db,KISSDB_Range *r,const void *prefix,unsigned long prefix_len)
+{
+	const uint8_t *p = (const uint8_t *)prefix;
+
+	memset(r,0,sizeof(KISSDB_Range));
+	if ((!db->index)||(prefix_len > db->key_size))
+		return KISSDB_ERROR_INVALID_PARAMETERS;
+	r->db = db;
+	r->prefix = prefix;
+	r->prefix_len = prefix_len;
+
+	/* keys sharing the prefix up to its trailing digits are contiguous in
+	 * natural order (station.1 and station.10 are not, station. is) */
+	r->stem_len = prefix_len;
+	while ((r->stem_len)&&(p[r->stem_len - 1] >= '0')&&(p[r->stem_len - 1] <= '9'))
+		--r->stem_len;
+	r->node = KISSDB_Index_seek(db->index,prefix,r->stem_len,(KISSDB_IndexNode **)0);
+	return 0;
+}
+
+int KISSDB_Range_next(KISSDB_Range *r,void *kbuf,void *vbuf)
+{
+	const KISSDB_IndexNode *n;
+	KISSDB *db = r->db;
+	uint64_t offset;
+
+	while ((n = (const KISSDB_IndexNode *)r->node)) {
+		if ((r->hi)&&(KISSDB_natural_cmp(n->key,db->key_size,(const uint8_t *)r->hi,db->key_size) > 0))
+			break;
+		if ((r->prefix)&&(memcmp(n->key,r->prefix,r->stem_len)))
+			break;
+		r->node = __atomic_load_n(&n->next[0],__ATOMIC_ACQUIRE);
+		if ((r->prefix)&&(memcmp(n->key,r->prefix,r->prefix_len)))
+			continue;
+		if (!(offset = __atomic_load_n(&n->offset,__ATOMIC_ACQUIRE)))
+			continue; /* deleted */
+
+		memcpy(kbuf,n->key,db->key_size);
+		if (KISSDB_pread(db,vbuf,db->value_size,offset + db->key_size))
+			return KISSDB_ERROR_IO;
+		return 1;
+	}
+	r->node = (const void *)0;
+
+	return 0;
+}
+
+int KISSDB_Compact_begin(KISSDB *db,KISSDB_Compaction *c,const char *path)
+{
+	int rc;
+
+	memset(c,0,sizeof(KISSDB_Compaction));
+	if ((db->mvcc)&&(db->mvcc->tracking))
+		return KISSDB_ERROR_INVALID_PARAMETERS; /* one at a time */
+
+	c->path = malloc(strlen(path) + 1);
+	c->tmp_path = malloc(strlen(path) + 9);
+	if ((!c->path)||(!c->tmp_path)) {
+		KISSDB_Compact_abort(c);
+		return KISSDB_ERROR_MALLOC;
+	}
+	strcpy(c->path,path);
+	strcpy(c->tmp_path,path);
+	strcat(c->tmp_path,".compact");
+
+	if ((rc = KISSDB_Snapshot_open(db,&c->snap))) {
+		KISSDB_Compact_abort(c);
+		return rc;
+	}
+	c->db = db;
+	db->mvcc->tracking = 1;
+	db->mvcc->changed_len = 0;
+
+	return 0;
+}
+
+/* read the records at offsets[0 .. n-1] (sorted) into buf, one read per run back to back */
+static int KISSDB_Compact_read(KISSDB *db,const uint64_t *offsets,unsigned long n,uint8_t *buf)
+{
+	const uint64_t recsize = db->key_size + db->value_size;
+	unsigned long i,j;
+
+	for(i=0;i<n;i=j) {
+		for(j=i+1;(j<n)&&(offsets[j] == offsets[j - 1] + recsize);++j);
+		if (KISSDB_pread(db,buf + (recsize * i),recsize * (j - i),offsets[i]))
+			return KISSDB_ERROR_IO;
+	}
+	return 0;
+}
+
+int KISSDB_Compact_copy(KISSDB_Compaction *c)
+{
+	KISSDB *db = c->db;
+	const uint64_t recsize = db->key_size + db->value_size;
+	const uint64_t *ht = c->snap.hash_tables;
+	uint64_t *offsets,*place,*tables;
+	uint32_t *depth;
+	uint8_t *buf;
+	uint8_t magic[4];
+	uint64_t hdr[3];
+	uint64_t data_offset,max_slots;
+	unsigned long i,j,n,len,size,num_tables = 0;
+	FILE *f;
+	int rc = 0;
+
+	/* the snapshot's live records, in file order */
+	for(i=0,n=0;i<(c->snap.num_hash_tables * (db->hash_table_size + 1));++i) {
+		if (((i % (db->hash_table_size + 1)) != db->hash_table_size)&&(ht[i] > KISSDB_TOMBSTONE))
+			++n;
+	}
+	size = (n > db->hash_table_size) ? n : db->hash_table_size;
+	offsets = malloc(sizeof(uint64_t) * (n + 1));
+	place = malloc(sizeof(uint64_t) * (n + 1));
+	depth = calloc(size,sizeof(uint32_t));
+	buf = malloc(recsize * KISSDB_SCAN_BATCH);
+	c->moved = malloc(sizeof(uint64_t) * 2 * (n + 1));
+	if ((!offsets)||(!place)||(!depth)||(!buf)||(!c->moved)) {
+		free(offsets);
+		free(place);
+		free(depth);
+		free(buf);
+		return KISSDB_ERROR_MALLOC;
+	}
+	for(i=0,n=0;i<(c->snap.num_hash_tables * (db->hash_table_size + 1));++i) {
+		if (((i % (db->hash_table_size + 1)) != db->hash_table_size)&&(ht[i] > KISSDB_TOMBSTONE))
+			offsets[n++] = ht[i];
+	}
+	qsort(offsets,n,sizeof(uint64_t),KISSDB_offset_cmp);
+
+	/* the keys' hashes (in place[] until they're placed) */
+	for(i=0;(i<n)&&(!rc);i+=len) {
+		len = ((n - i) > KISSDB_SCAN_BATCH) ? KISSDB_SCAN_BATCH : (n - i);
+		if ((rc = KISSDB_Compact_read(db,offsets + i,len,buf)))
+			break;
+		for(j=0;j<len;++j)
+			place[i + j] = KISSDB_hash(buf + (recsize * j),db->key_size);
+	}
+
+	/* the largest tables, from a slot per key down to the old size, whose
+	 * chain fits in KISSDB_COMPACT_SLOTS slots per key (the old size
+	 * always fits the old chain's slots: its buckets only lose keys) */
+	max_slots = (uint64_t)KISSDB_COMPACT_SLOTS * (n + 1);
+	if (max_slots < (uint64_t)c->snap.num_hash_tables * (db->hash_table_size + 1))
+		max_slots = (uint64_t)c->snap.num_hash_tables * (db->hash_table_size + 1);
+	while (!rc) {
+		num_tables = KISSDB_compact_tables(place,n,size,depth);
+		if ((size == db->hash_table_size)||((uint64_t)num_tables * (size + 1) <= max_slots))
+			break;
+		size = ((size / 2) > db->hash_table_size) ? (size / 2) : db->hash_table_size;
+	}
+
+	/* where each goes: its slot in the first table that has it free */
+	if (!rc) {
+		memset(depth,0,sizeof(uint32_t) * size);
+		for(i=0;i<n;++i) {
+			j = (unsigned long)(place[i] % (uint64_t)size);
+			place[i] = ((uint64_t)depth[j]++ * (size + 1)) + j;
+		}
+	}
+	free(depth);
+
+	/* all tables first, then the records in the order they had */
+	tables = (uint64_t *)0;
+	if ((!rc)&&(num_tables)&&(!(tables = calloc((size_t)num_tables * (size + 1),sizeof(uint64_t)))))
+		rc = KISSDB_ERROR_MALLOC;
+	if (!rc) {
+		data_offset = KISSDB_HEADER_SIZE + ((uint64_t)sizeof(uint64_t) * (size + 1) * num_tables);
+		for(i=0;i<n;++i) {
+			tables[place[i]] = data_offset + (recsize * i);
+			c->moved[i * 2] = offsets[i];
+			c->moved[(i * 2) + 1] = data_offset + (recsize * i);
+		}
+		c->num_moved = n;
+		for(i=1;i<num_tables;++i)
+			tables[((size + 1) * (i - 1)) + size] = KISSDB_HEADER_SIZE + ((uint64_t)sizeof(uint64_t) * (size + 1) * i);
+	}
+
+	if ((!rc)&&(!(f = fopen(c->tmp_path,"wb"))))
+		rc = KISSDB_ERROR_IO;
+	if (!rc) {
+		magic[0] = 'K'; magic[1] = 'd'; magic[2] = 'B'; magic[3] = KISSDB_VERSION;
+		hdr[0] = size;
+		hdr[1] = db->key_size;
+		hdr[2] = db->value_size;
+		if ((fwrite(magic,4,1,f) != 1)||(fwrite(hdr,sizeof(uint64_t),3,f) != 3))
+			rc = KISSDB_ERROR_IO;
+		if ((!rc)&&(num_tables)&&(fwrite(tables,sizeof(uint64_t) * (size + 1),num_tables,f) != num_tables))
+			rc = KISSDB_ERROR_IO;
+		for(i=0;(i<n)&&(!rc);i+=len) {
+			len = ((n - i) > KISSDB_SCAN_BATCH) ? KISSDB_SCAN_BATCH : (n - i);
+			if (!(rc = KISSDB_Compact_read(db,offsets + i,len,buf))) {
+				if (fwrite(buf,recsize * len,1,f) != 1)
+					rc = KISSDB_ERROR_IO;
+			}
+		}
+		if (fflush(f))
+			rc = KISSDB_ERROR_IO;
+#ifndef _WIN32
+		if ((!rc)&&(fsync(fileno(f))))
+			rc = KISSDB_ERROR_IO;
+#endif
+		if (fclose(f))
+			rc = KISSDB_ERROR_IO;
+	}
+
+	free(tables);
+	free(offsets);
+	free(place);
+	free(buf);
+
+	return rc;
+}
+
+/* where the record at offset of the old file is in the new one (offset itself if it isn't) */
+static uint64_t KISSDB_Compact_moved(const KISSDB_Compaction *c,uint64_t offset)
+{
+	unsigned long lo = 0,hi = c->num_moved,mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->moved[mid * 2] < offset)
+			lo = mid + 1;
+		else hi = mid;
+	}
+	return (((lo < c->num_moved)&&(c->moved[lo * 2] == offset)) ? c->moved[(lo * 2) + 1] : offset);
+}
+
+int KISSDB_Compact_finish(KISSDB_Compaction *c)
+{
+	KISSDB *db = c->db;
+	struct KISSDB_Mvcc *m = db->mvcc;
+	KISSDB nd;
+	KISSDB_IndexNode *node;
+	const uint8_t *key;
+	uint8_t *vbuf;
+	uint64_t offset;
+	unsigned long i;
+	int rc;
+
+	/* its own snapshot is done with; the others still read the old file */
+	KISSDB_Snapshot_close(&c->snap);
+	if (m->oldest)
+		return 1;
+	if (m->tracking < 0) {
+		KISSDB_Compact_abort(c);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	if ((rc = KISSDB_open(&nd,c->tmp_path,KISSDB_OPEN_MODE_RDWR,0,0,0))) {
+		KISSDB_Compact_abort(c);
+		return rc;
+	}
+	if (!(vbuf = malloc(db->value_size))) {
+		KISSDB_close(&nd);
+		KISSDB_Compact_abort(c);
+		return KISSDB_ERROR_MALLOC;
+	}
+
+	/* the keys put or deleted since begin, as they are now */
+	for(i=0;(i<m->changed_len)&&(!rc);++i) {
+		key = m->changed + (db->key_size * i);
+		if (!(rc = KISSDB_get(db,key,vbuf)))
+			rc = KISSDB_put(&nd,key,vbuf);
+		else if ((rc == 1)&&((rc = KISSDB_delete(&nd,key)) == 1))
+			rc = 0;
+	}
+	free(vbuf);
+
+	/* durable before it replaces the old file */
+	if ((!rc)&&(fflush(nd.f)))
+		rc = KISSDB_ERROR_IO;
+#ifndef _WIN32
+	if ((!rc)&&(fsync(fileno(nd.f))))
+		rc = KISSDB_ERROR_IO;
+#endif
+	if ((!rc)&&(rename(c->tmp_path,c->path)))
+		rc = KISSDB_ERROR_IO;
+	if (rc) {
+		KISSDB_close(&nd);
+		KISSDB_Compact_abort(c);
+		return rc;
+	}
+
+	fclose(db->f);
+	if (db->hash_tables)
+		free(db->hash_tables);
+	db->f = nd.f;
+	db->hash_tables = nd.hash_tables;
+	db->num_hash_tables = nd.num_hash_tables;
+	db->hash_table_size = nd.hash_table_size;
+	db->hash_table_size_bytes = nd.hash_table_size_bytes;
+
+	/* the old file's dead records are gone; the ones catching up left in the new file are reusable now */
+	if (m->dead)
+		free(m->dead);
+	m->dead = (KISSDB_DeadRecord *)0;
+	m->dead_head = m->dead_len = m->dead_cap = 0;
+	if (nd.mvcc) {
+		m->dead = nd.mvcc->dead;
+		m->dead_head = nd.mvcc->dead_head;
+		m->dead_len = nd.mvcc->dead_len;
+		m->dead_cap = nd.mvcc->dead_cap;
+		for(i=m->dead_head;i<m->dead_len;++i)
+			m->dead[i].death = 0;
+		free(nd.mvcc);
+	}
+
+	/* the index follows: unchanged records moved with the file, changed keys are where they are now */
+	if (db->index) {
+		for(node=db->index->head->next[0];node;node=node->next[0]) {
+			if (node->offset)
+				__atomic_store_n(&node->offset,KISSDB_Compact_moved(c,node->offset),__ATOMIC_RELEASE);
+		}
+		for(i=0;i<m->changed_len;++i) {
+			key = m->changed + (db->key_size * i);
+			if (!KISSDB_locate(db,key,&offset))
+				KISSDB_Index_insert(db->index,key,offset - db->key_size);
+			else KISSDB_Index_remove(db->index,key);
+		}
+	}
+
+	m->tracking = 0;
+	m->changed_len = 0;
+	free(c->path);
+	free(c->tmp_path);
+	free(c->moved);
+	memset(c,0,sizeof(KISSDB_Compaction));
+
+	return 0;
+}
+
+void KISSDB_Compact_abort(KISSDB_Compaction *c)
+{
+	if (c->db) {
+		KISSDB_Snapshot_close(&c->snap);
+		c->db->mvcc->tracking = 0;
+		c->db->mvcc->changed_len = 0;
+	}
+	if (c->tmp_path) {
+		remove(c->tmp_path);
+		free(c->tmp_path);
+	}
+	free(c->path);
+	free(c->moved);
+	memset(c,0,sizeof(KISSDB_Compaction));
+}
+
+#ifdef KISSDB_TEST
+
+#include <inttypes.h>
+
+int main(int argc,char **argv)
+{
+	uint64_t i,j;
+	uint64_t v[8];
+	KISSDB db;
+	KISSDB_Iterator dbi;
+	KISSDB_Scan dbs;
+	KISSDB_Range dbr;
+	KISSDB_Snapshot snap;
+	KISSDB_Compaction comp;
+	KISSDB_Stats st;
+	char kb[16],lo[16],hi[16];
+	char got_all_values[10000];
+	uint64_t bkeys[1010],bvals[1010][8];
+	int bres[1010];
+	int q;
+
+	printf("Opening new empty database test.db...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,1024,8,sizeof(v))) {
 		printf("KISSDB_open failed\n");
 		return 1;
 	}
@@ -398,6 +1669,41 @@ int main(int argc,char **argv)
 		}
 	}
 
+	printf("Locating 10000 values in the file...\n");
+
+	for(i=0;i<10000;++i) {
+		if ((q = KISSDB_locate(&db,&i,&j))) {
+			printf("KISSDB_locate failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		if ((pread(fileno(db.f),v,sizeof(v),(off_t)j) != (ssize_t)sizeof(v))||(v[0] != i)||(v[7] != i)) {
+			printf("KISSDB_locate failed, bad offset (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	i = 10000;
+	if (KISSDB_locate(&db,&i,&j) != 1) {
+		printf("KISSDB_locate failed, found a missing key\n");
+		return 1;
+	}
+
+	printf("Getting 10000 values (and 10 missing ones) in batches...\n");
+
+	for(i=0;i<10000;i+=1000) {
+		for(j=0;j<1010;++j)
+			bkeys[j] = (j < 1000) ? (9999 - i - j) : (20000 + j); /* backwards, so the offsets need sorting */
+		if ((q = KISSDB_get_batch(&db,bkeys,bvals,bres,1010)) != 1000) {
+			printf("KISSDB_get_batch failed (%"PRIu64") (%d)\n",i,q);
+			return 1;
+		}
+		for(j=0;j<1010;++j) {
+			if ((bres[j] != (j >= 1000))||((j < 1000)&&((bvals[j][0] != bkeys[j])||(bvals[j][7] != bkeys[j])))) {
+				printf("KISSDB_get_batch failed, bad data (%"PRIu64")\n",bkeys[j]);
+				return 1;
+			}
+		}
+	}
+
 	printf("Closing and re-opening database in read-only mode...\n");
 
 	KISSDB_close(&db);
@@ -442,6 +1748,254 @@ int main(int argc,char **argv)
 		}
 	}
 
+	printf("Partitioned scan test...\n");
+
+	memset(got_all_values,0,sizeof(got_all_values));
+	for(j=0;j<3;++j) {
+		if (KISSDB_Scan_init(&db,&dbs,(unsigned long)j,3)) {
+			printf("KISSDB_Scan_init failed\n");
+			return 1;
+		}
+		while ((q = KISSDB_Scan_next(&dbs,&i,&v)) > 0) {
+			if ((i < 10000)&&(v[0] == i)&&(!got_all_values[i]))
+				got_all_values[i] = 1;
+			else {
+				printf("KISSDB_Scan_next failed, bad data (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+		KISSDB_Scan_close(&dbs);
+		if (q < 0) {
+			printf("KISSDB_Scan_next failed (%d)\n",q);
+			return 1;
+		}
+	}
+	for(i=0;i<10000;++i) {
+		if (!got_all_values[i]) {
+			printf("KISSDB_Scan failed, missing value index %"PRIu64"\n",i);
+			return 1;
+		}
+	}
+
+	KISSDB_close(&db);
+
+	printf("Ordered index test...\n");
+
+	if (KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RWREPLACE,64,16,sizeof(v))) {
+		printf("KISSDB_open failed\n");
+		return 1;
+	}
+	remove("test.db.idx");
+	if (KISSDB_Index_open(&db,"test.db.idx")) {
+		printf("KISSDB_Index_open failed\n");
+		return 1;
+	}
+	for(i=0;i<1000;++i) {
+		memset(kb,0,sizeof(kb));
+		sprintf(kb,"k.%"PRIu64,(i * 7919) % 1000);
+		v[0] = (i * 7919) % 1000;
+		if (KISSDB_put(&db,kb,v)) {
+			printf("KISSDB_put failed (%"PRIu64")\n",i);
+			return 1;
+		}
+	}
+	for(q=0;q<2;++q) {
+		memset(lo,0,sizeof(lo));
+		memset(hi,0,sizeof(hi));
+		strcpy(lo,"k.100");
+		strcpy(hi,"k.128");
+		KISSDB_Range_init(&db,&dbr,lo,hi);
+		for(j=100;KISSDB_Range_next(&dbr,kb,v) > 0;++j) {
+			if (v[0] != j) {
+				printf("KISSDB_Range_next failed, out of order (%"PRIu64")\n",v[0]);
+				return 1;
+			}
+		}
+		KISSDB_Range_init_prefix(&db,&dbr,"k.12",4);
+		for(i=0;KISSDB_Range_next(&dbr,kb,v) > 0;++i) {
+			if (strncmp(kb,"k.12",4)) {
+				printf("KISSDB_Range_next failed, bad prefix (%s)\n",kb);
+				return 1;
+			}
+		}
+		if ((j != 129)||(i != 11)) {
+			printf("KISSDB_Range failed, wrong count (%"PRIu64", %"PRIu64")\n",j,i);
+			return 1;
+		}
+
+		/* second round runs against the index saved by close */
+		KISSDB_close(&db);
+		if ((KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0))||(KISSDB_Index_open(&db,"test.db.idx"))) {
+			printf("KISSDB_open failed\n");
+			return 1;
+		}
+	}
+
+	printf("Snapshot test...\n");
+
+	if (KISSDB_Snapshot_open(&db,&snap)) {
+		printf("KISSDB_Snapshot_open failed\n");
+		return 1;
+	}
+	for(q=0;q<2;++q) {
+		for(i=0;i<1000;++i) {
+			memset(kb,0,sizeof(kb));
+			sprintf(kb,"k.%"PRIu64,i);
+			v[0] = i + 5000 + (q * 5000);
+			if (KISSDB_put(&db,kb,v)) {
+				printf("KISSDB_put failed (%"PRIu64")\n",i);
+				return 1;
+			}
+		}
+		if (q)
+			break;
+
+		KISSDB_Scan_init_snapshot(&snap,&dbs,0,1);
+		for(i=0;KISSDB_Scan_next(&dbs,kb,v) > 0;++i) {
+			if (v[0] >= 1000) {
+				printf("KISSDB_Scan_next failed, snapshot sees a later value (%"PRIu64")\n",v[0]);
+				return 1;
+			}
+		}
+		KISSDB_Scan_close(&dbs);
+		memset(kb,0,sizeof(kb));
+		strcpy(kb,"k.7");
+		if ((i != 1000)||(KISSDB_Snapshot_get(&snap,kb,v))||(v[0] != 7)||(KISSDB_get(&db,kb,v))||(v[0] != 5007)) {
+			printf("KISSDB_Snapshot failed\n");
+			return 1;
+		}
+
+		/* once the first snapshot is gone its records are reused by the
+		 * copies a second one forces, so the file must not grow */
+		KISSDB_Snapshot_close(&snap);
+		fseeko(db.f,0,SEEK_END);
+		j = (uint64_t)ftello(db.f);
+		KISSDB_Snapshot_open(&db,&snap);
+	}
+	KISSDB_Snapshot_close(&snap);
+	fseeko(db.f,0,SEEK_END);
+	if ((uint64_t)ftello(db.f) != j) {
+		printf("KISSDB_Snapshot failed, dead records not reused\n");
+		return 1;
+	}
+	KISSDB_Range_init(&db,&dbr,(const void *)0,(const void *)0);
+	while (KISSDB_Range_next(&dbr,kb,v) > 0) {
+		if (v[0] != (uint64_t)atoi(kb + 2) + 10000) {
+			printf("KISSDB_Range_next failed after copy on write (%s)\n",kb);
+			return 1;
+		}
+	}
+
+	printf("Delete test...\n");
+
+	for(i=0;i<1000;i+=2) {
+		memset(kb,0,sizeof(kb));
+		sprintf(kb,"k.%"PRIu64,i);
+		if ((KISSDB_delete(&db,kb))||(KISSDB_delete(&db,kb) != 1)||(KISSDB_get(&db,kb,v) != 1)) {
+			printf("KISSDB_delete failed (%s)\n",kb);
+			return 1;
+		}
+	}
+	KISSDB_Range_init(&db,&dbr,(const void *)0,(const void *)0);
+	for(i=0;KISSDB_Range_next(&dbr,kb,v) > 0;++i) {
+		if (!(atoi(kb + 2) & 1)) {
+			printf("KISSDB_Range_next failed, deleted key (%s)\n",kb);
+			return 1;
+		}
+	}
+	KISSDB_Iterator_init(&db,&dbi);
+	for(j=0;KISSDB_Iterator_next(&dbi,kb,v) > 0;++j);
+	if ((i != 500)||(j != 500)||(KISSDB_stats(&db,&st))||(st.live != 500)||(st.tombstones != 500)) {
+		printf("KISSDB_delete failed, wrong count (%"PRIu64", %"PRIu64")\n",i,j);
+		return 1;
+	}
+
+	/* puts of deleted keys reuse their slots and records */
+	fseeko(db.f,0,SEEK_END);
+	j = (uint64_t)ftello(db.f);
+	for(i=0;i<100;i+=2) {
+		memset(kb,0,sizeof(kb));
+		sprintf(kb,"k.%"PRIu64,i);
+		v[0] = i + 20000;
+		if ((KISSDB_put(&db,kb,v))||(KISSDB_get(&db,kb,v))||(v[0] != i + 20000)) {
+			printf("KISSDB_put failed after delete (%s)\n",kb);
+			return 1;
+		}
+	}
+	fseeko(db.f,0,SEEK_END);
+	if (((uint64_t)ftello(db.f) != j)||(KISSDB_stats(&db,&st))||(st.live != 550)||(st.tombstones != 450)) {
+		printf("KISSDB_put failed, deleted records or slots not reused\n");
+		return 1;
+	}
+
+	printf("Compaction test...\n");
+
+	if ((KISSDB_Compact_begin(&db,&comp,"test.db"))||(KISSDB_Compact_copy(&comp))) {
+		printf("KISSDB_Compact failed\n");
+		return 1;
+	}
+	/* changes while it copies: a put, a delete, a new key, and a snapshot that holds it up */
+	memset(kb,0,sizeof(kb));
+	strcpy(kb,"k.1");
+	v[0] = 30001;
+	q = KISSDB_put(&db,kb,v);
+	strcpy(kb,"k.3");
+	q |= (KISSDB_delete(&db,kb) != 0);
+	strcpy(kb,"k.5000");
+	v[0] = 35000;
+	q |= KISSDB_put(&db,kb,v);
+	q |= KISSDB_Snapshot_open(&db,&snap);
+	if ((q)||(KISSDB_Compact_finish(&comp) != 1)) {
+		printf("KISSDB_Compact_finish failed, replaced a file a snapshot reads\n");
+		return 1;
+	}
+	KISSDB_Snapshot_close(&snap);
+	if (KISSDB_Compact_finish(&comp)) {
+		printf("KISSDB_Compact_finish failed\n");
+		return 1;
+	}
+	/* the one tombstone left is k.3's, deleted while it copied */
+	fseeko(db.f,0,SEEK_END);
+	if (((uint64_t)ftello(db.f) >= j)||(KISSDB_stats(&db,&st))||(st.live != 550)||(st.tombstones != 1)) {
+		printf("KISSDB_Compact failed, file not compacted\n");
+		return 1;
+	}
+	for(q=0;q<2;++q) {
+		for(i=0;i<=5000;++i) {
+			memset(kb,0,sizeof(kb));
+			sprintf(kb,"k.%"PRIu64,i);
+			if (i == 1)
+				j = 30001;
+			else if (i == 5000)
+				j = 35000;
+			else if ((i == 3)||(i >= 1000)||((i & 1) == 0 && i >= 100))
+				j = 0; /* deleted */
+			else j = i + ((i & 1) ? 10000 : 20000);
+			if ((KISSDB_get(&db,kb,v) != (j == 0))||((j)&&(v[0] != j))) {
+				printf("KISSDB_Compact failed, bad data (%s)\n",kb);
+				return 1;
+			}
+		}
+		KISSDB_Range_init(&db,&dbr,(const void *)0,(const void *)0);
+		for(i=0;KISSDB_Range_next(&dbr,kb,v) > 0;++i) {
+			if ((KISSDB_get(&db,kb,bvals[0]))||(v[0] != bvals[0][0])) {
+				printf("KISSDB_Range_next failed after compaction (%s)\n",kb);
+				return 1;
+			}
+		}
+		if (i != 550) {
+			printf("KISSDB_Range failed after compaction, wrong count (%"PRIu64")\n",i);
+			return 1;
+		}
+
+		/* second round against the compacted file and its saved index */
+		KISSDB_close(&db);
+		if ((KISSDB_open(&db,"test.db",KISSDB_OPEN_MODE_RDWR,0,0,0))||(KISSDB_Index_open(&db,"test.db.idx"))) {
+			printf("KISSDB_open failed\n");
+			return 1;
+		}
+	}
+
 	KISSDB_close(&db);
 
 	printf("All tests OK!\n");
@@ -16,13 +16,19 @@ extern "C" {
 #endif
 
 /**
- * Version: 2
+ * Version: 3
  *
  * This is the file format identifier, and changes any time the file
  * format changes. The code version will be this dot something, and can
  * be seen in tags in the git repository.
+ *
+ * Version 3 adds deleted (tombstone) hash table slots. Version 2 files
+ * are read as is and marked version 3 when opened for writing.
  */
-#define KISSDB_VERSION 2
+#define KISSDB_VERSION 3
+
+struct KISSDB_Index;
+struct KISSDB_Mvcc;
 
 /**
  * KISSDB database state
@@ -38,6 +44,8 @@ typedef struct {
 	unsigned long num_hash_tables;
 	uint64_t *hash_tables;
 	FILE *f;
+	struct KISSDB_Index *index;
+	struct KISSDB_Mvcc *mvcc;
 } KISSDB;
 
 /**
@@ -118,10 +126,46 @@ extern void KISSDB_close(KISSDB *db);
  * @param db Database struct
  * @param key Key (key_size bytes)
  * @param vbuf Value buffer (value_size bytes capacity)
+ * Gets may run concurrently with each other, but not with a put.
+ *
  * @return -1 on I/O error, 0 on success, 1 on not found
  */
 extern int KISSDB_get(KISSDB *db,const void *key,void *vbuf);
 
+/**
+ * Find where an entry's value is stored in the database file
+ *
+ * The value is the value_size bytes at that offset, right after the
+ * key; a caller that maps or sendfile()s the file reads it from there.
+ * The offset stays valid until the next put (which may rewrite the
+ * value in place, or reuse the record of a dead version for another
+ * key), so read it under the same lock as a get.
+ *
+ * @param db Database struct
+ * @param key Key (key_size bytes)
+ * @param value_offset Receives the value's file offset
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_locate(KISSDB *db,const void *key,uint64_t *value_offset);
+
+/**
+ * Get many entries at once
+ *
+ * All keys are looked up in the in-memory hash tables first; the records
+ * they point to are then read in file offset order, in one forward pass,
+ * records that lie back to back in one read. A key whose record holds
+ * another key moves on to the next hash table and the pass is repeated
+ * for those, as a get would. Same concurrency rules as a get.
+ *
+ * @param db Database struct
+ * @param keys n keys, key_size bytes each, back to back
+ * @param vbufs Value buffers, value_size bytes each, back to back (n * value_size bytes capacity)
+ * @param results Receives per key 0 if found (its value is filled), 1 if not found
+ * @param n Number of keys
+ * @return Number of keys found, or negative on error (-1 I/O error, -2 out of memory)
+ */
+extern int KISSDB_get_batch(KISSDB *db,const void *keys,void *vbufs,int *results,unsigned long n);
+
 /**
  * Put an entry (overwriting it if it already exists)
  *
@@ -135,6 +179,46 @@ extern int KISSDB_get(KISSDB *db,const void *key,void *vbuf);
  */
 extern int KISSDB_put(KISSDB *db,const void *key,const void *value);
 
+/**
+ * Delete an entry
+ *
+ * The key's hash table slot becomes a tombstone: gets go on past it to
+ * the next hash table as if it held another key, and a later put of a
+ * key hashing to it reuses it. The record is dead from then on and is
+ * reused for a later put once no open snapshot can see it (as records
+ * overwritten under snapshots are). Tombstones and dead records are only
+ * removed from the file by a compaction (see KISSDB_Compact_begin()).
+ * Same concurrency rules as a put.
+ *
+ * @param db Database struct
+ * @param key Key (key_size bytes)
+ * @return -1 on I/O error, -2 out of memory, 0 on success, 1 on not found
+ */
+extern int KISSDB_delete(KISSDB *db,const void *key);
+
+/**
+ * Space use of a database
+ */
+typedef struct {
+	unsigned long live;
+	unsigned long tombstones;
+	unsigned long num_hash_tables;
+	uint64_t file_size;
+	uint64_t live_size;
+} KISSDB_Stats;
+
+/**
+ * Count live entries and tombstones, and the bytes they take
+ *
+ * live_size is about what a compacted file would take (its hash tables
+ * at most 4 slots per live key, see KISSDB_Compact_begin()). Same concurrency rules as a get.
+ *
+ * @param db Database struct
+ * @param st Receives the counts
+ * @return -1 on I/O error, 0 on success
+ */
+extern int KISSDB_stats(KISSDB *db,KISSDB_Stats *st);
+
 /**
  * Cursor used for iterating over all entries in database
  */
@@ -165,6 +249,291 @@ extern void KISSDB_Iterator_init(KISSDB *db,KISSDB_Iterator *dbi);
  */
 extern int KISSDB_Iterator_next(KISSDB_Iterator *dbi,void *kbuf,void *vbuf);
 
+/**
+ * Number of records read per scan batch
+ */
+#define KISSDB_SCAN_BATCH 256
+
+/**
+ * Cursor used for scanning one partition of the database
+ *
+ * A scan covers a contiguous range of hash table slots. Unlike the
+ * iterator it reads records with pread() and never moves the FILE
+ * position, so scans over disjoint partitions of the same database can
+ * run in parallel threads. Records are fetched in batches sorted by file
+ * offset; adjacent records are merged into one read and the next batch
+ * is hinted to the kernel for readahead while the current one is being
+ * consumed.
+ */
+typedef struct {
+	KISSDB *db;
+	const uint64_t *hash_tables;
+	unsigned long pos;
+	unsigned long end;
+	uint64_t *cur;
+	uint64_t *ahead;
+	unsigned long cur_len;
+	unsigned long cur_idx;
+	unsigned long ahead_len;
+	uint8_t *buf;
+} KISSDB_Scan;
+
+/**
+ * Initialize a scan over one partition of the database
+ *
+ * The slots of all hash tables are split into num_parts contiguous
+ * ranges of (nearly) equal size; part selects which one to cover.
+ * Each partition must be consumed by at most one thread at a time.
+ *
+ * @param db Database struct
+ * @param scan Scan to initialize
+ * @param part Partition number (0 .. num_parts-1)
+ * @param num_parts Total number of partitions (must be >0)
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Scan_init(KISSDB *db,KISSDB_Scan *scan,unsigned long part,unsigned long num_parts);
+
+/**
+ * Get the next entry of a scan
+ *
+ * Within a batch entries are returned in file offset order.
+ *
+ * @param scan Database scan
+ * @param kbuf Buffer to fill with next key (key_size bytes)
+ * @param vbuf Buffer to fill with next value (value_size bytes)
+ * @return 0 if there are no more entries, negative on error, positive if an kbuf/vbuf have been filled
+ */
+extern int KISSDB_Scan_next(KISSDB_Scan *scan,void *kbuf,void *vbuf);
+
+/**
+ * Release the buffers of a scan
+ *
+ * @param scan Database scan
+ */
+extern void KISSDB_Scan_close(KISSDB_Scan *scan);
+
+/**
+ * Point-in-time view of a database
+ *
+ * While at least one snapshot is open, KISSDB_put() stops overwriting
+ * values in place: it writes the new record elsewhere (copy-on-write)
+ * and leaves the old one for the snapshots that can still see it. Dead
+ * records are reused for later writes once no open snapshot references
+ * them. Records that are dead when the database is closed are not
+ * reclaimed (until a compaction).
+ */
+typedef struct KISSDB_Snapshot {
+	KISSDB *db;
+	uint64_t *hash_tables;
+	unsigned long num_hash_tables;
+	uint64_t epoch;
+	struct KISSDB_Snapshot *prev;
+	struct KISSDB_Snapshot *next;
+} KISSDB_Snapshot;
+
+/**
+ * Open a snapshot of the current state of the database
+ *
+ * Opening and closing snapshots must be serialized with puts, just as
+ * puts are among themselves. Reads through an open snapshot need no
+ * locking.
+ *
+ * @param db Database struct
+ * @param snap Snapshot to initialize
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Snapshot_open(KISSDB *db,KISSDB_Snapshot *snap);
+
+/**
+ * Close a snapshot, allowing the records only it could see to be reused
+ *
+ * @param snap Snapshot
+ */
+extern void KISSDB_Snapshot_close(KISSDB_Snapshot *snap);
+
+/**
+ * Get an entry as it was when the snapshot was opened
+ *
+ * @param snap Snapshot
+ * @param key Key (key_size bytes)
+ * @param vbuf Value buffer (value_size bytes capacity)
+ * @return -1 on I/O error, 0 on success, 1 on not found
+ */
+extern int KISSDB_Snapshot_get(KISSDB_Snapshot *snap,const void *key,void *vbuf);
+
+/**
+ * Initialize a scan over one partition of a snapshot
+ *
+ * Same as KISSDB_Scan_init(), but sees the database as it was when the
+ * snapshot was opened. A single partition (0 of 1) iterates the whole
+ * snapshot. The snapshot must stay open until the scan is closed.
+ *
+ * @param snap Snapshot
+ * @param scan Scan to initialize
+ * @param part Partition number (0 .. num_parts-1)
+ * @param num_parts Total number of partitions (must be >0)
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Scan_init_snapshot(KISSDB_Snapshot *snap,KISSDB_Scan *scan,unsigned long part,unsigned long num_parts);
+
+/**
+ * Compaction of a database file
+ *
+ * A compaction rewrites the live entries of a database to a new file
+ * (path + ".compact") with hash tables sized for them, so lookups stop
+ * walking long chains of overflow tables, and without tombstones or dead
+ * records; it then replaces the old file. Its tables are the largest
+ * (one slot per key at most, never smaller than the old ones) whose
+ * chain takes at most 4 slots per key, or the old file's slots if more:
+ * every table of a chain is as large as the first, and tables of a slot
+ * per key would need a chain of about 9 at 1M keys (9 slots, 72 bytes,
+ * per key in memory). At 1M keys that's a chain of about 24 tables of
+ * a slot per 8 keys: 3 slots per key, and a lookup steps past about 4
+ * other keys of its bucket. It runs in three steps so that
+ * only the first and the last need to be serialized with puts:
+ *
+ *  begin   opens a snapshot and starts recording the keys put or deleted
+ *  copy    writes the snapshot's entries to the new file (no locking,
+ *          puts and gets go on)
+ *  finish  applies the recorded keys to the new file and swaps it in
+ *          (under the put lock, with no gets running: the FILE, hash
+ *          tables and value offsets all change)
+ *
+ * One compaction at a time. The database file must be writable.
+ */
+typedef struct {
+	KISSDB *db;
+	KISSDB_Snapshot snap;
+	char *path;
+	char *tmp_path;
+	uint64_t *moved;
+	unsigned long num_moved;
+} KISSDB_Compaction;
+
+/**
+ * Start a compaction
+ *
+ * @param db Database struct
+ * @param c Compaction to initialize
+ * @param path Path of the database file
+ * @return 0 on success, nonzero on error (or if a compaction is running)
+ */
+extern int KISSDB_Compact_begin(KISSDB *db,KISSDB_Compaction *c,const char *path);
+
+/**
+ * Write the new file
+ *
+ * Needs no locking. On an error, abort the compaction.
+ *
+ * @param c Compaction
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Compact_copy(KISSDB_Compaction *c);
+
+/**
+ * Bring the new file up to date and replace the old one with it
+ *
+ * The new file can only replace the old one when no other snapshot is
+ * open (they read the old file): if one is, nothing changes and 1 is
+ * returned; call it again later. On an error the compaction is aborted
+ * and the database keeps its old file. The ordered index, if open, is
+ * moved to the new file's offsets.
+ *
+ * @param c Compaction
+ * @return 0 on success, 1 if other snapshots are open, negative on error
+ */
+extern int KISSDB_Compact_finish(KISSDB_Compaction *c);
+
+/**
+ * Give up a compaction, removing its new file
+ *
+ * Same concurrency rules as a put.
+ *
+ * @param c Compaction
+ */
+extern void KISSDB_Compact_abort(KISSDB_Compaction *c);
+
+/**
+ * Open the ordered key index of a database
+ *
+ * The index keeps all keys in natural order (runs of digits compare by
+ * numeric value, so station.9 < station.10) and is kept in sync by
+ * KISSDB_put() and KISSDB_delete() from then on. It is loaded from
+ * path if that file was saved against the current database file, and
+ * rebuilt from the hash tables otherwise. KISSDB_close() saves it back
+ * to path.
+ *
+ * Puts must be serialized by the caller as usual. A range cursor may be
+ * initialized, and kept open, concurrently with a put, but each
+ * KISSDB_Range_next() must be excluded from puts, deletes and
+ * KISSDB_Compact_finish() like a get (see KISSDB_Range_next()).
+ *
+ * @param db Open database struct
+ * @param path Path to index file (e.g. database path + ".idx")
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Index_open(KISSDB *db,const char *path);
+
+/**
+ * Write the ordered key index to its file
+ *
+ * @param db Database struct with an open index
+ * @return 0 on success, nonzero on error
+ */
+extern int KISSDB_Index_save(KISSDB *db);
+
+/**
+ * Cursor used for walking a key range of the ordered index
+ */
+typedef struct {
+	KISSDB *db;
+	const void *node;
+	const void *hi;
+	const void *prefix;
+	unsigned long prefix_len;
+	unsigned long stem_len;
+} KISSDB_Range;
+
+/**
+ * Initialize a cursor over all keys in [lo, hi]
+ *
+ * The bound buffers must stay valid while the cursor is in use.
+ *
+ * @param db Database struct with an open index
+ * @param r Cursor to initialize
+ * @param lo Lowest key (key_size bytes), or NULL for the first key
+ * @param hi Highest key (key_size bytes), or NULL for the last key
+ * @return 0 on success, nonzero if the database has no index
+ */
+extern int KISSDB_Range_init(KISSDB *db,KISSDB_Range *r,const void *lo,const void *hi);
+
+/**
+ * Initialize a cursor over all keys starting with prefix
+ *
+ * @param db Database struct with an open index
+ * @param r Cursor to initialize
+ * @param prefix Key prefix (must stay valid while the cursor is in use)
+ * @param prefix_len Length of prefix in bytes (at most key_size)
+ * @return 0 on success, nonzero if the database has no index
+ */
+extern int KISSDB_Range_init_prefix(KISSDB *db,KISSDB_Range *r,const void *prefix,unsigned long prefix_len);
+
+/**
+ * Get the next entry of a range, in key order
+ *
+ * Same concurrency rules as a get: a put may reuse the record of a
+ * deleted key, and KISSDB_Compact_finish() replaces the file and moves
+ * every record, so between loading a key's offset and reading its value
+ * the value could be another key's. Hold the caller's read lock (the one
+ * that excludes puts) across each call, not across the whole range.
+ *
+ * @param r Range cursor
+ * @param kbuf Buffer to fill with next key (key_size bytes)
+ * @param vbuf Buffer to fill with next value (value_size bytes)
+ * @return 0 if there are no more entries, negative on error, positive if an kbuf/vbuf have been filled
+ */
+extern int KISSDB_Range_next(KISSDB_Range *r,void *kbuf,void *vbuf);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,303 @@
+/* KISSDB microbenchmarks
+ *
+ * Times KISSDB_hash, KISSDB_get (hit and miss), KISSDB_get_batch,
+ * KISSDB_put (insert and overwrite), KISSDB_open and full-database iteration over a sweep of
+ * database sizes, key/value sizes and hash table sizes. Every measurement
+ * is repeated and written as one CSV row (median and best of the runs),
+ * so the output of two releases can be diffed.
+ *
+ * Built and run by "make bench". */
+
+/* Include the implementation itself: KISSDB_hash is static, and this way
+ * it's timed exactly as the library inlines it. */
+#include "kissdb.c"
+
+#include <stdio.h>
+#include <time.h>
+#include <getopt.h>
+
+#define BENCH_MAX_RUNS 32
+#define BENCH_HASH_KEYS 1024 /* keys formatted ahead of the hash loop */
+#define BENCH_BATCH 128 /* keys per KISSDB_get_batch call */
+
+/* One benchmark configuration */
+typedef struct {
+	uint64_t entries;
+	unsigned long key_size;
+	unsigned long value_size;
+	unsigned long hash_table_size;
+} BenchConfig;
+
+static const char *bench_path = "/tmp/kissdb_bench.db";
+static int bench_runs = 3;
+static FILE *bench_out;
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return ((uint64_t)t.tv_sec * 1000000000ULL) + (uint64_t)t.tv_nsec;
+}
+
+/* key number n as a zero padded decimal (distinct for n < 10^key_size) */
+static void bench_key(const BenchConfig *cfg,uint8_t *kbuf,uint64_t n)
+{
+	unsigned long i = cfg->key_size;
+	memset(kbuf,'0',cfg->key_size);
+	while ((i)&&(n)) {
+		kbuf[--i] = (uint8_t)('0' + (n % 10));
+		n /= 10;
+	}
+}
+
+static int bench_cmp(const void *a,const void *b)
+{
+	uint64_t x = *(const uint64_t *)a,y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Write a row: the ns per operation of every run, summarized */
+static void bench_report(const BenchConfig *cfg,const char *op,uint64_t *ns,uint64_t ops,int runs)
+{
+	double median,best;
+	qsort(ns,(size_t)runs,sizeof(uint64_t),bench_cmp);
+	median = (double)ns[runs / 2] / (double)ops;
+	best = (double)ns[0] / (double)ops;
+	fprintf(bench_out,"%s,%llu,%lu,%lu,%lu,%d,%llu,%.1f,%.1f,%.0f\n",
+		op,(unsigned long long)cfg->entries,cfg->key_size,cfg->value_size,cfg->hash_table_size,
+		runs,(unsigned long long)ops,median,best,1e9 / median);
+	fflush(bench_out);
+}
+
+/* Fill a fresh database with keys 0..entries-1, timing the inserts */
+static int bench_fill(const BenchConfig *cfg,KISSDB *db,uint8_t *kbuf,uint8_t *vbuf,uint64_t *ns)
+{
+	uint64_t i,t;
+	if (KISSDB_open(db,bench_path,KISSDB_OPEN_MODE_RWREPLACE,cfg->hash_table_size,cfg->key_size,cfg->value_size))
+		return -1;
+	memset(vbuf,'v',cfg->value_size);
+	t = bench_now_ns();
+	for(i=0;i<cfg->entries;++i) {
+		bench_key(cfg,kbuf,i);
+		if (KISSDB_put(db,kbuf,vbuf))
+			return -1;
+	}
+	*ns = bench_now_ns() - t;
+	return 0;
+}
+
+static int bench_config(const BenchConfig *cfg)
+{
+	uint64_t ns[8][BENCH_MAX_RUNS];
+	uint64_t i,t,n,hash_ops,sink = 0;
+	uint8_t *kbuf,*vbuf,*hkeys,*bkeys,*bvals;
+	int bres[BENCH_BATCH];
+	KISSDB db;
+	KISSDB_Iterator dbi;
+	int r,rc = 0;
+
+	kbuf = (uint8_t *)malloc(cfg->key_size);
+	vbuf = (uint8_t *)malloc(cfg->value_size);
+	hkeys = (uint8_t *)malloc(cfg->key_size * BENCH_HASH_KEYS);
+	bkeys = (uint8_t *)malloc(cfg->key_size * BENCH_BATCH);
+	bvals = (uint8_t *)malloc(cfg->value_size * BENCH_BATCH);
+	if ((!kbuf)||(!vbuf)||(!hkeys)||(!bkeys)||(!bvals)) {
+		free(kbuf);
+		free(vbuf);
+		free(hkeys);
+		free(bkeys);
+		free(bvals);
+		return -1;
+	}
+	for(i=0;i<BENCH_HASH_KEYS;++i)
+		bench_key(cfg,hkeys + (i * cfg->key_size),i);
+
+	/* the hash alone is too fast to time per key: a million hashes */
+	hash_ops = 1000000;
+
+	for(r=0;r<bench_runs;++r) {
+		/* hash */
+		t = bench_now_ns();
+		for(i=0;i<hash_ops;++i)
+			sink += KISSDB_hash(hkeys + ((i % BENCH_HASH_KEYS) * cfg->key_size),cfg->key_size);
+		ns[0][r] = bench_now_ns() - t;
+
+		/* put (insert) */
+		if (bench_fill(cfg,&db,kbuf,vbuf,&ns[1][r])) {
+			rc = -1;
+			break;
+		}
+
+		/* put (overwrite) */
+		memset(vbuf,'w',cfg->value_size);
+		t = bench_now_ns();
+		for(i=0;i<cfg->entries;++i) {
+			bench_key(cfg,kbuf,i);
+			if (KISSDB_put(&db,kbuf,vbuf))
+				rc = -1;
+		}
+		ns[2][r] = bench_now_ns() - t;
+
+		/* get (hit), in a scattered order */
+		t = bench_now_ns();
+		for(i=0;i<cfg->entries;++i) {
+			bench_key(cfg,kbuf,(i * 7919) % cfg->entries);
+			if (KISSDB_get(&db,kbuf,vbuf))
+				rc = -1;
+		}
+		ns[3][r] = bench_now_ns() - t;
+
+		/* get (miss) */
+		t = bench_now_ns();
+		for(i=0;i<cfg->entries;++i) {
+			bench_key(cfg,kbuf,cfg->entries + i);
+			if (KISSDB_get(&db,kbuf,vbuf) != 1)
+				rc = -1;
+		}
+		ns[4][r] = bench_now_ns() - t;
+
+		/* get (hit), the same scattered order BENCH_BATCH keys at a time */
+		t = bench_now_ns();
+		for(i=0;i<cfg->entries;i+=n) {
+			for(n=0;(n<BENCH_BATCH)&&(i + n < cfg->entries);++n)
+				bench_key(cfg,bkeys + (n * cfg->key_size),((i + n) * 7919) % cfg->entries);
+			if (KISSDB_get_batch(&db,bkeys,bvals,bres,n) != (int)n)
+				rc = -1;
+		}
+		ns[7][r] = bench_now_ns() - t;
+
+		/* iterator */
+		t = bench_now_ns();
+		KISSDB_Iterator_init(&db,&dbi);
+		for(n=0;KISSDB_Iterator_next(&dbi,kbuf,vbuf) > 0;++n)
+			sink += vbuf[0];
+		ns[5][r] = bench_now_ns() - t;
+		if (n != cfg->entries)
+			rc = -1;
+
+		/* open (reads the hash tables back) */
+		KISSDB_close(&db);
+		t = bench_now_ns();
+		if (KISSDB_open(&db,bench_path,KISSDB_OPEN_MODE_RDWR,cfg->hash_table_size,cfg->key_size,cfg->value_size)) {
+			rc = -1;
+			break;
+		}
+		ns[6][r] = bench_now_ns() - t;
+		KISSDB_close(&db);
+
+		if (rc)
+			break;
+	}
+
+	if (!rc) {
+		bench_report(cfg,"hash",ns[0],hash_ops,bench_runs);
+		bench_report(cfg,"put_insert",ns[1],cfg->entries,bench_runs);
+		bench_report(cfg,"put_overwrite",ns[2],cfg->entries,bench_runs);
+		bench_report(cfg,"get_hit",ns[3],cfg->entries,bench_runs);
+		bench_report(cfg,"get_miss",ns[4],cfg->entries,bench_runs);
+		bench_report(cfg,"get_batch",ns[7],cfg->entries,bench_runs);
+		bench_report(cfg,"iterate",ns[5],cfg->entries,bench_runs);
+		bench_report(cfg,"open",ns[6],1,bench_runs);
+	} else fprintf(stderr,"kissdb_bench: failed at %llu entries, key %lu, value %lu, hash table %lu\n",
+		(unsigned long long)cfg->entries,cfg->key_size,cfg->value_size,cfg->hash_table_size);
+
+	if (sink == 42) /* keep the hash loop from being optimized away */
+		fprintf(stderr," ");
+	free(kbuf);
+	free(vbuf);
+	free(hkeys);
+	free(bkeys);
+	free(bvals);
+	unlink(bench_path);
+	return rc;
+}
+
+static void bench_usage(void)
+{
+	fprintf(stderr,"Usage: kissdb_bench [-o out.csv] [-d db_file] [-r runs] [-q] [-f]\n\n");
+	fprintf(stderr,"-o <file>: Write the CSV here (default stdout).\n");
+	fprintf(stderr,"-d <file>: Scratch database (default %s).\n",bench_path);
+	fprintf(stderr,"-r <runs>: Runs per measurement (default %d, at most %d).\n",bench_runs,BENCH_MAX_RUNS);
+	fprintf(stderr,"-q:        Quick: the base configuration only.\n");
+	fprintf(stderr,"-f:        Full: every combination instead of one parameter at a time.\n");
+}
+
+int main(int argc,char **argv)
+{
+	static const uint64_t entries[] = { 1000,10000,100000 };
+	static const unsigned long key_sizes[] = { 8,32,128 };
+	static const unsigned long value_sizes[] = { 8,64,1024 };
+	static const unsigned long hash_sizes[] = { 256,1024,8192 };
+	const BenchConfig base = { 10000,32,64,1024 };
+	BenchConfig cfg;
+	int opt,quick = 0,full = 0,a,b,c,d,rc = 0;
+
+	bench_out = stdout;
+	while ((opt = getopt(argc,argv,"o:d:r:qfh")) != -1) {
+		switch(opt) {
+			case 'o':
+				if (!(bench_out = fopen(optarg,"w"))) {
+					fprintf(stderr,"kissdb_bench: cannot write %s\n",optarg);
+					return 1;
+				}
+				break;
+			case 'd': bench_path = optarg; break;
+			case 'r': bench_runs = atoi(optarg); break;
+			case 'q': quick = 1; break;
+			case 'f': full = 1; break;
+			default:
+				bench_usage();
+				return 1;
+		}
+	}
+	if ((bench_runs < 1)||(bench_runs > BENCH_MAX_RUNS)) {
+		bench_usage();
+		return 1;
+	}
+
+	fprintf(bench_out,"op,entries,key_size,value_size,hash_table_size,runs,ops_per_run,median_ns_per_op,best_ns_per_op,median_ops_per_sec\n");
+
+	if (quick) {
+		rc |= bench_config(&base);
+	} else if (full) {
+		for(a=0;a<3;++a) for(b=0;b<3;++b) for(c=0;c<3;++c) for(d=0;d<3;++d) {
+			cfg.entries = entries[a];
+			cfg.key_size = key_sizes[b];
+			cfg.value_size = value_sizes[c];
+			cfg.hash_table_size = hash_sizes[d];
+			rc |= bench_config(&cfg);
+		}
+	} else {
+		/* sweep one parameter at a time around the base configuration */
+		for(a=0;a<3;++a) {
+			cfg = base;
+			cfg.entries = entries[a];
+			rc |= bench_config(&cfg);
+		}
+		for(a=0;a<3;++a) {
+			if (key_sizes[a] == base.key_size)
+				continue;
+			cfg = base;
+			cfg.key_size = key_sizes[a];
+			rc |= bench_config(&cfg);
+		}
+		for(a=0;a<3;++a) {
+			if (value_sizes[a] == base.value_size)
+				continue;
+			cfg = base;
+			cfg.value_size = value_sizes[a];
+			rc |= bench_config(&cfg);
+		}
+		for(a=0;a<3;++a) {
+			if (hash_sizes[a] == base.hash_table_size)
+				continue;
+			cfg = base;
+			cfg.hash_table_size = hash_sizes[a];
+			rc |= bench_config(&cfg);
+		}
+	}
+
+	if (bench_out != stdout)
+		fclose(bench_out);
+	return (rc ? 1 : 0);
+}
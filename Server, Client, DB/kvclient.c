@@ -0,0 +1,1235 @@
+/* kvclient.c
+
+   Client library for the key-value server: a pool of persistent,
+   pipelined connections. See kvclient.h for the protocol.
+
+*/
+
+#include <stdint.h>
+#include <poll.h>
+#include <ifaddrs.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include "utils.h"
+#include "kvclient.h"
+#include "shmring.h"
+
+#define KV_HOST_LEN         1024
+#define KV_REQUEST_SIZE     1200  // Largest request (without the tag); the server reads up to 1160 bytes.
+#define KV_TAG_LEN            16
+#define KV_MSG_SIZE         (int) (sizeof(int) + KV_TAG_LEN + KV_REPLY_SIZE)
+
+// Transports, in the order they are tried (a remote server only gets KV_TCP).
+#define KV_SHM                 0
+#define KV_UNIX                1
+#define KV_TCP                 2
+
+// Definition of an in-flight request.
+typedef struct pending {
+  uint32_t id;
+  KVCallback cb;
+  void *arg;
+  struct pending *next;
+} Pending;
+
+// Definition of a virtual node: a point of the hash ring, owned by a shard.
+typedef struct kvpoint {
+  uint64_t hash;
+  int shard;
+} KVPoint;
+
+struct kvshards {
+  int num;
+  char (*host)[KV_HOST_LEN];
+  int *port;
+  KVPoint *ring;                       // KV_VNODES points per shard, by hash.
+  int num_points;
+};
+
+// Definition of a session.
+typedef struct kvconn {
+  KVClient *client;
+  int shard;                           // The server it's connected to.
+  int socket_fd;                       // -1 while down.
+  ShmChannel *shm;                     // Shared memory: requests go through it, the socket only tells a hangup.
+  pthread_cond_t room;                 // Shared memory: signaled when the ring has room again.
+  int room_waiters;
+  uint32_t next_id;
+  Pending *pending;                    // In send order: replies usually match the first one.
+  Pending **last;
+  pthread_mutex_t mutx;                // Guards all of the above and the writes to the socket.
+} KVConn;
+
+// Definition of a reader thread's argument: the session and the socket (or channel) it was started for.
+typedef struct reader {
+  KVConn *conn;
+  int socket_fd;
+  ShmChannel *shm;
+  char in[KV_MSG_SIZE];                // Shared memory: bytes taken from the ring, not framed yet.
+  int in_len;
+} Reader;
+
+struct kvclient {
+  KVShards *shards;                    // The servers, and which keys each one holds.
+  int *transport;                      // Per shard: the first transport to try, KV_SHM, KV_UNIX or KV_TCP.
+  int per_shard;                       // Sessions per shard.
+  int num_conns;
+  KVConn *conns;                       // Shard by shard.
+  unsigned int next_conn;              // Round robin (within a shard).
+  int readers;                         // Running reader threads.
+  pthread_mutex_t mutx;
+  pthread_cond_t readers_done;
+};
+
+struct kvfuture {
+  pthread_mutex_t mutx;
+  pthread_cond_t done_cond;
+  int done;
+  int status;
+  char reply[KV_REPLY_SIZE];
+};
+
+/**
+ * @name kv_write_msg - Writes a length-prefixed message with a single send.
+ * @param socket_fd: The socket descriptor.
+ * @param buf: The message.
+ * @param numbytes: The length of the message.
+ *
+ * Unlike write_str_to_socket(), never raises SIGPIPE in the application.
+ * @return 0 on Success. -1 on Error.
+ */
+static int kv_write_msg(int socket_fd, const char *buf, int numbytes) {
+  char msg[sizeof(int) + KV_TAG_LEN + KV_REQUEST_SIZE];
+  char *ptr = msg;
+  int nleft = sizeof(int) + numbytes, nwritten;
+
+  memcpy(msg, &numbytes, sizeof(int));
+  memcpy(msg + sizeof(int), buf, numbytes);
+  while (nleft > 0) {
+    if ((nwritten = send(socket_fd, ptr, nleft, MSG_NOSIGNAL)) <= 0) {
+      if (nwritten < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    nleft -= nwritten;
+    ptr += nwritten;
+  }
+  return 0;
+}
+
+/**
+ * @name kv_shm_write_msg - Writes a length-prefixed message to a shared-memory session. Called holding conn->mutx.
+ * @param conn: The session.
+ * @param buf: The message.
+ * @param numbytes: The length of the message.
+ *
+ * Waits (on conn->room) until the ring has room for the whole message: a writer that waited halfway
+ * would let another one's message into the middle of its own.
+ * @return 0 on Success. -1 on Error.
+ */
+static int kv_shm_write_msg(KVConn *conn, const char *buf, int numbytes) {
+  ShmChannel *shm = conn->shm;
+  char msg[sizeof(int) + KV_TAG_LEN + KV_REQUEST_SIZE];
+  int len = sizeof(int) + numbytes;
+
+  memcpy(msg, &numbytes, sizeof(int));
+  memcpy(msg + sizeof(int), buf, numbytes);
+  while (shm_writable(shm) < len) {
+    // Full: the reader signals when the server has taken some (or the session is down).
+    __atomic_add_fetch(&conn->room_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_wait(&conn->room, &conn->mutx);
+    __atomic_sub_fetch(&conn->room_waiters, 1, __ATOMIC_SEQ_CST);
+    if (conn->shm != shm)
+      return -1;
+  }
+  return shm_write(shm, msg, len) == len ? 0 : -1;
+}
+
+/**
+ * @name kv_is_local - Tells whether a host is this machine (a loopback address or one of its interfaces').
+ * @param host: Address or hostname.
+ *
+ * @return 1 if it is. 0 otherwise.
+ */
+static int kv_is_local(const char *host) {
+  struct addrinfo hints, *res, *ai;
+  struct ifaddrs *ifs, *ifa;
+  int local = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res))
+    return 0;
+  if (getifaddrs(&ifs))
+    ifs = NULL;
+  for (ai = res; ai && !local; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET)
+      local = (ntohl(((struct sockaddr_in *) ai->ai_addr)->sin_addr.s_addr) >> 24) == 127;
+    else if (ai->ai_family == AF_INET6)
+      local = IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr);
+    for (ifa = ifs; ifa && !local; ifa = ifa->ifa_next) {
+      if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != ai->ai_family)
+        continue;
+      if (ai->ai_family == AF_INET)
+        local = ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr == ((struct sockaddr_in *) ai->ai_addr)->sin_addr.s_addr;
+      else if (ai->ai_family == AF_INET6)
+        local = !memcmp(&((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr, &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr,
+                        sizeof(struct in6_addr));
+    }
+  }
+  if (ifs)
+    freeifaddrs(ifs);
+  freeaddrinfo(res);
+  return local;
+}
+
+/**
+ * @name kv_transport - The first transport to try for a server: KV_TRANSPORT if set (shm, unix or tcp), else the
+ *                      shared memory for a local server and TCP for a remote one.
+ * @param host: Server address or hostname.
+ *
+ * @return KV_SHM, KV_UNIX or KV_TCP.
+ */
+static int kv_transport(const char *host) {
+  const char *env = getenv("KV_TRANSPORT");
+  int transport = KV_SHM;
+
+  if (env && !strcmp(env, "tcp"))
+    return KV_TCP;
+  if (env && !strcmp(env, "unix"))
+    transport = KV_UNIX;
+  return kv_is_local(host) ? transport : KV_TCP;
+}
+
+/**
+ * @name kv_unix_connect - Connects to the Unix domain socket of the local server on 'port'.
+ * @param port: Server port.
+ *
+ * @return The socket on Success. -1 on Error.
+ */
+static int kv_unix_connect(int port) {
+  struct sockaddr_un addr;
+  int socket_fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), SHM_UNIX_PATH, port);
+  if ((socket_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    return -1;
+  if (connect(socket_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    close(socket_fd);
+    return -1;
+  }
+  return socket_fd;
+}
+
+/**
+ * @name kv_shm_connect - Opens a session over shared memory with the local server on 'port'.
+ * @param port: Server port.
+ * @param socket_fd: Gets the Unix domain socket, kept open: its hangup tells the server is gone.
+ *
+ * @return The channel on Success. NULL on Error.
+ */
+static ShmChannel *kv_shm_connect(int port, int *socket_fd) {
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char reply[sizeof(int) + 64];
+  int fds[3], len = -1;
+  ssize_t n;
+
+  if ((*socket_fd = kv_unix_connect(port)) == -1)
+    return NULL;
+  if (kv_write_msg(*socket_fd, "SHM", strlen("SHM")))
+    goto error;
+
+  // "SHM OK", with the memfd and both doorbells.
+  iov.iov_base = reply;
+  iov.iov_len = sizeof(reply) - 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  while ((n = recvmsg(*socket_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+    ;
+  if (n >= (ssize_t) sizeof(int))
+    memcpy(&len, reply, sizeof(int));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    goto error;                        // An older server: "FORMAT ERROR", no descriptors.
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  if (len < 0 || n != (ssize_t) sizeof(int) + len || strncmp(reply + sizeof(int), "SHM OK", strlen("SHM OK"))) {
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    goto error;
+  }
+  return shm_attach(fds);
+
+error:
+  close(*socket_fd);
+  *socket_fd = -1;
+  return NULL;
+}
+
+/**
+ * @name kv_socket_connect - Connects to the server on a socket.
+ * @param host: Server address or hostname.
+ * @param port: Server port.
+ * @param transport: KV_TCP, or the Unix domain socket first (falling back to TCP).
+ *
+ * @return The socket on Success. -1 on Error.
+ */
+static int kv_socket_connect(const char *host, int port, int transport) {
+  struct addrinfo hints, *res, *ai;
+  char service[16];
+  int socket_fd = -1, one = 1;
+
+  if (transport != KV_TCP && (socket_fd = kv_unix_connect(port)) != -1)
+    return socket_fd;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  sprintf(service, "%d", port);
+  if (getaddrinfo(host, service, &hints, &res))
+    return -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((socket_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+      continue;
+    if (!connect(socket_fd, ai->ai_addr, ai->ai_addrlen))
+      break;
+    close(socket_fd);
+    socket_fd = -1;
+  }
+  freeaddrinfo(res);
+  if (socket_fd == -1)
+    return -1;
+
+  // Small pipelined messages: don't hold them back waiting for ACKs.
+  setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return socket_fd;
+}
+
+/**
+ * @name kv_socket_session - Connects to the server and opens a session on a socket.
+ * @param host: Server address or hostname.
+ * @param port: Server port.
+ * @param transport: KV_TCP, or the Unix domain socket first (falling back to TCP).
+ *
+ * @return The socket on Success. -1 on Error.
+ */
+static int kv_socket_session(const char *host, int port, int transport) {
+  char reply[KV_REPLY_SIZE];
+  int socket_fd;
+
+  if ((socket_fd = kv_socket_connect(host, port, transport)) == -1)
+    return -1;
+  if (kv_write_msg(socket_fd, "SESSION", strlen("SESSION")) ||
+      read_msg_from_socket(socket_fd, reply, sizeof(reply)) <= 0 ||
+      strncmp(reply, "SESSION OK", strlen("SESSION OK"))) {
+    close(socket_fd);
+    return -1;
+  }
+  return socket_fd;
+}
+
+/**
+ * @name kv_session_connect - Connects to the server and opens a session: on its Unix domain socket if the server is
+ *                            local (unless KV_TRANSPORT=tcp), else (or if that fails) over TCP.
+ * @param host: Server address or hostname.
+ * @param port: Server port.
+ *
+ * @return The socket on Success. -1 on Error.
+ */
+int kv_session_connect(const char *host, int port) {
+  return kv_socket_session(host, port, kv_transport(host));
+}
+
+/**
+ * @name kv_shm_read_msg - Reads a length-prefixed message from a shared-memory session (its reader thread).
+ * @param r: The reader.
+ * @param buf: Receives the message, '\0'-terminated.
+ * @param bufsize: Size of 'buf'.
+ *
+ * Sleeps on the doorbell while the ring is empty, and wakes the writers waiting for room on the way.
+ * @return The length of the message on Success. -1 on Error, or once the server (or kv_close()) hung up.
+ */
+static int kv_shm_read_msg(Reader *r, char *buf, int bufsize) {
+  KVConn *conn = r->conn;
+  struct pollfd fds[2];
+  int len, n, waiters;
+
+  while (1) {
+    if (r->in_len >= (int) sizeof(int)) {
+      memcpy(&len, r->in, sizeof(int));
+      if (len < 0 || len >= bufsize || (int) sizeof(int) + len > (int) sizeof(r->in))
+        return -1;
+      if (r->in_len >= (int) sizeof(int) + len) {
+        memcpy(buf, r->in + sizeof(int), len);
+        buf[len] = '\0';
+        r->in_len -= sizeof(int) + len;
+        memmove(r->in, r->in + sizeof(int) + len, r->in_len);
+        return len;
+      }
+    }
+
+    // Writers wait for room while the ring is full: tell them when there is some.
+    if ((waiters = __atomic_load_n(&conn->room_waiters, __ATOMIC_SEQ_CST)) && shm_writable(r->shm)) {
+      pthread_mutex_lock(&conn->mutx);
+      pthread_cond_broadcast(&conn->room);
+      pthread_mutex_unlock(&conn->mutx);
+    }
+
+    if ((n = shm_read(r->shm, r->in + r->in_len, sizeof(r->in) - r->in_len)) < 0)
+      return -1;
+    if (n) {
+      r->in_len += n;
+      continue;
+    }
+
+    // Nothing to read: sleep, unless something came in meanwhile.
+    shm_sleep(r->shm, SHM_WAIT_DATA | (waiters ? SHM_WAIT_ROOM : 0));
+    if (shm_readable(r->shm) || (waiters && shm_writable(r->shm)))
+      continue;
+    fds[0].fd = shm_bell(r->shm);
+    fds[0].events = POLLIN;
+    fds[1].fd = r->socket_fd;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0 && errno != EINTR)
+      return -1;
+    if (fds[1].revents)
+      return -1;                       // Hung up.
+    if (fds[0].revents)
+      shm_clear(r->shm);
+  }
+}
+
+/**
+ * @name kv_reader - Reader thread of a session: hands each reply to its request.
+ * @param arg: The Reader, freed here.
+ *
+ * When the connection fails, the session is marked down and its in-flight requests fail.
+ * @return
+ */
+static void *kv_reader(void *arg) {
+  Reader *r = (Reader *) arg;
+  KVConn *conn = r->conn;
+  KVClient *c = conn->client;
+  char msg[KV_TAG_LEN + KV_REPLY_SIZE], *reply;
+  Pending *p, **pp, *failed = NULL;
+  unsigned long id;
+  size_t len;
+
+  while ((r->shm ? kv_shm_read_msg(r, msg, sizeof(msg)) : read_msg_from_socket(r->socket_fd, msg, sizeof(msg))) > 0) {
+    id = strtoul(msg, &reply, 10);
+    if (*reply != '|')
+      break;                           // Not a session reply: the stream is out of sync.
+    reply++;
+    len = strlen(reply);
+    if (len && reply[len - 1] == '\n')
+      reply[len - 1] = '\0';
+
+    pthread_mutex_lock(&conn->mutx);
+    for (pp = &conn->pending; *pp && (*pp)->id != (uint32_t) id; pp = &(*pp)->next)
+      ;
+    if ((p = *pp)) {
+      if (!(*pp = p->next))
+        conn->last = pp;
+    }
+    pthread_mutex_unlock(&conn->mutx);
+
+    if (p) {
+      p->cb(p->arg, 0, reply);
+      free(p);
+    }
+  }
+
+  // Down: fail what's in flight (unless the session was already reopened on another socket).
+  pthread_mutex_lock(&conn->mutx);
+  if (conn->socket_fd == r->socket_fd) {
+    conn->socket_fd = -1;
+    conn->shm = NULL;
+    failed = conn->pending;
+    conn->pending = NULL;
+    conn->last = &conn->pending;
+  }
+  pthread_cond_broadcast(&conn->room);  // Writers waiting for room give up.
+  pthread_mutex_unlock(&conn->mutx);
+  close(r->socket_fd);
+  shm_close(r->shm);
+  free(r);
+
+  while ((p = failed)) {
+    failed = p->next;
+    p->cb(p->arg, -1, NULL);
+    free(p);
+  }
+
+  pthread_mutex_lock(&c->mutx);
+  if (--c->readers == 0)
+    pthread_cond_broadcast(&c->readers_done);
+  pthread_mutex_unlock(&c->mutx);
+  return NULL;
+}
+
+/**
+ * @name kv_up - Makes sure a session is connected. Called holding conn->mutx.
+ * @param conn: The session.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+static int kv_up(KVConn *conn) {
+  KVClient *c = conn->client;
+  ShmChannel *shm = NULL;
+  pthread_t tid;
+  Reader *r;
+  int socket_fd = -1;
+
+  if (conn->socket_fd != -1)
+    return 0;
+  if (c->transport[conn->shard] == KV_SHM)
+    shm = kv_shm_connect(c->shards->port[conn->shard], &socket_fd);
+  if (!shm && (socket_fd = kv_socket_session(c->shards->host[conn->shard], c->shards->port[conn->shard],
+                                             c->transport[conn->shard])) == -1)
+    return -1;
+  if (!(r = (Reader *) calloc(1, sizeof(Reader)))) {
+    close(socket_fd);
+    shm_close(shm);
+    return -1;
+  }
+  r->conn = conn;
+  r->socket_fd = socket_fd;
+  r->shm = shm;
+
+  pthread_mutex_lock(&c->mutx);
+  c->readers++;
+  pthread_mutex_unlock(&c->mutx);
+  if (pthread_create(&tid, NULL, kv_reader, r)) {
+    pthread_mutex_lock(&c->mutx);
+    c->readers--;
+    pthread_mutex_unlock(&c->mutx);
+    close(socket_fd);
+    shm_close(shm);
+    free(r);
+    return -1;
+  }
+  pthread_detach(tid);
+  conn->socket_fd = socket_fd;
+  conn->shm = shm;
+  return 0;
+}
+
+// FNV-1a, then mixed (splitmix64's finalizer): similar keys and shard names land far apart on the ring.
+static uint64_t kv_hash(const char *s, int len) {
+  uint64_t h = 14695981039346656037ULL;
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+static int kv_point_cmp(const void *a, const void *b) {
+  const KVPoint *x = (const KVPoint *) a, *y = (const KVPoint *) b;
+
+  if (x->hash != y->hash)
+    return (x->hash > y->hash) - (x->hash < y->hash);
+  return x->shard - y->shard;
+}
+
+/**
+ * @name kv_shards_new - Parses a list of servers and places each one on the hash ring.
+ * @param endpoints: "host[:port],host[:port],..." (an IPv6 address goes without a port).
+ * @param port: The port of the hosts given without one.
+ *
+ * A shard's points are named after its host:port, so every client with the same list routes keys the same way,
+ * and adding or removing a server only moves the keys of its own points.
+ * @return The shards on Success. NULL on Error (or an empty list).
+ */
+KVShards *kv_shards_new(const char *endpoints, int port) {
+  KVShards *s;
+  const char *p = endpoints, *end, *colon;
+  char name[KV_HOST_LEN + 32];
+  int num = 1, k, v, len;
+
+  for (end = endpoints; *end; end++)
+    num += (*end == ',');
+  if (!(s = (KVShards *) calloc(1, sizeof(KVShards))))
+    return NULL;
+  s->host = calloc(num, sizeof(*s->host));
+  s->port = (int *) calloc(num, sizeof(int));
+  s->ring = (KVPoint *) calloc((size_t) num * KV_VNODES, sizeof(KVPoint));
+  if (!s->host || !s->port || !s->ring)
+    goto error;
+
+  for (k = 0; k < num; k++, p = end + 1) {
+    end = p + strcspn(p, ",");
+    len = end - p;
+    colon = memchr(p, ':', len);
+    if (colon && !memchr(colon + 1, ':', end - colon - 1)) {
+      s->port[k] = atoi(colon + 1);    // host:port
+      len = colon - p;
+    } else {
+      s->port[k] = port;               // host, or an IPv6 address
+    }
+    if (!len || len >= KV_HOST_LEN || s->port[k] <= 0)
+      goto error;
+    memcpy(s->host[k], p, len);
+    for (v = 0; v < KV_VNODES; v++) {
+      len = snprintf(name, sizeof(name), "%s:%d#%d", s->host[k], s->port[k], v);
+      s->ring[s->num_points].hash = kv_hash(name, len);
+      s->ring[s->num_points++].shard = k;
+    }
+  }
+  s->num = num;
+  qsort(s->ring, s->num_points, sizeof(KVPoint), kv_point_cmp);
+  return s;
+
+error:
+  kv_shards_free(s);
+  return NULL;
+}
+
+/**
+ * @name kv_shards_find - Finds the shard that holds a key: the owner of the first point at or after its hash.
+ * @param s: The shards.
+ * @param key: The key.
+ *
+ * @return The shard (0 .. kv_shards_count() - 1).
+ */
+int kv_shards_find(const KVShards *s, const char *key) {
+  uint64_t h = kv_hash(key, strlen(key));
+  int lo = 0, hi = s->num_points, mid;
+
+  if (s->num == 1)
+    return 0;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (s->ring[mid].hash < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return s->ring[lo == s->num_points ? 0 : lo].shard;
+}
+
+/**
+ * @name kv_shards_count - Number of shards.
+ * @param s: The shards.
+ *
+ * @return
+ */
+int kv_shards_count(const KVShards *s) {
+  return s->num;
+}
+
+/**
+ * @name kv_shards_endpoint - A shard's server.
+ * @param s: The shards.
+ * @param shard: The shard.
+ * @param port: Gets its port.
+ *
+ * @return Its host.
+ */
+const char *kv_shards_endpoint(const KVShards *s, int shard, int *port) {
+  *port = s->port[shard];
+  return s->host[shard];
+}
+
+/**
+ * @name kv_shards_free - Frees the shards.
+ * @param s: The shards.
+ *
+ * @return
+ */
+void kv_shards_free(KVShards *s) {
+  free(s->host);
+  free(s->port);
+  free(s->ring);
+  free(s);
+}
+
+/**
+ * @name kv_shards_route - The shard a request goes to: its key's.
+ * @param s: The shards.
+ * @param request: The request, e.g. "GET:key" (or "@table:GET:key": a key goes to the same shard in every table).
+ *
+ * @return The shard. -1 for a request without a key (STATUS, AGG, SCAN...), or on many (MGET, a WATCH of a prefix).
+ */
+int kv_shards_route(const KVShards *s, const char *request) {
+  static const char *keyed[] = { "GET:", "PUT:", "DELETE:", "INCR:", "DECR:", "CAS:", "APPEND:", "TSAGG:", "WATCH:",
+                                 "UNWATCH:", NULL };
+  char key[KV_REQUEST_SIZE];
+  const char *p;
+  int k, len;
+
+  if (request[0] == '@' && (p = strchr(request, ':')))
+    request = p + 1;                   // Skip the table.
+  for (k = 0; keyed[k] && strncmp(request, keyed[k], strlen(keyed[k])); k++)
+    ;
+  if (!keyed[k])
+    return -1;
+  p = request + strlen(keyed[k]);
+  len = strcspn(p, ":");
+  if (len && p[len - 1] == '*' && strstr(keyed[k], "WATCH"))
+    return -1;                         // A prefix: on every shard.
+  snprintf(key, sizeof(key), "%.*s", len, p);
+  return kv_shards_find(s, key);
+}
+
+/**
+ * @name kv_open - Opens a client with a pool of sessions to host:port.
+ * @param host: Server address or hostname.
+ * @param port: Server port.
+ * @param connections: Number of sessions (at least 1).
+ *
+ * @return The client on Success. NULL on Error.
+ */
+KVClient *kv_open(const char *host, int port, int connections) {
+  char endpoint[KV_HOST_LEN + 16];
+
+  // One shard: a ':' in the host is an IPv6 address's, not a port.
+  snprintf(endpoint, sizeof(endpoint), strchr(host, ':') ? "%s" : "%s:%d", host, port);
+  return kv_open_shards(endpoint, port, connections);
+}
+
+/**
+ * @name kv_open_shards - Opens a client with a pool of sessions to each of a list of servers, which the keys are
+ *                        spread over by consistent hashing.
+ * @param endpoints: "host[:port],host[:port],..."
+ * @param port: The port of the hosts given without one.
+ * @param connections: Number of sessions per server (at least 1).
+ *
+ * @return The client on Success. NULL on Error.
+ */
+KVClient *kv_open_shards(const char *endpoints, int port, int connections) {
+  KVClient *c;
+  int k;
+
+  if (connections < 1)
+    connections = 1;
+  if (!(c = (KVClient *) calloc(1, sizeof(KVClient))))
+    return NULL;
+  if (!(c->shards = kv_shards_new(endpoints, port))) {
+    free(c);
+    return NULL;
+  }
+  c->per_shard = connections;
+  c->num_conns = connections * c->shards->num;
+  c->conns = (KVConn *) calloc(c->num_conns, sizeof(KVConn));
+  c->transport = (int *) calloc(c->shards->num, sizeof(int));
+  if (!c->conns || !c->transport) {
+    free(c->conns);
+    free(c->transport);
+    kv_shards_free(c->shards);
+    free(c);
+    return NULL;
+  }
+  for (k = 0; k < c->shards->num; k++)
+    c->transport[k] = kv_transport(c->shards->host[k]);
+  pthread_mutex_init(&c->mutx, NULL);
+  pthread_cond_init(&c->readers_done, NULL);
+
+  for (k = 0; k < c->num_conns; k++) {
+    c->conns[k].client = c;
+    c->conns[k].shard = k / connections;
+    c->conns[k].socket_fd = -1;
+    c->conns[k].last = &c->conns[k].pending;
+    pthread_mutex_init(&c->conns[k].mutx, NULL);
+    pthread_cond_init(&c->conns[k].room, NULL);
+  }
+
+  // Connect them all now, so a bad address fails here rather than on the first request.
+  for (k = 0; k < c->num_conns; k++) {
+    pthread_mutex_lock(&c->conns[k].mutx);
+    if (kv_up(&c->conns[k])) {
+      pthread_mutex_unlock(&c->conns[k].mutx);
+      kv_close(c);
+      return NULL;
+    }
+    pthread_mutex_unlock(&c->conns[k].mutx);
+  }
+  return c;
+}
+
+/**
+ * @name kv_close - Closes the sessions and frees the client.
+ * @param c: The client.
+ *
+ * @return
+ */
+void kv_close(KVClient *c) {
+  int k;
+
+  // Wake the readers up; they fail the requests in flight and exit.
+  for (k = 0; k < c->num_conns; k++) {
+    pthread_mutex_lock(&c->conns[k].mutx);
+    if (c->conns[k].socket_fd != -1)
+      shutdown(c->conns[k].socket_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&c->conns[k].mutx);
+  }
+  pthread_mutex_lock(&c->mutx);
+  while (c->readers)
+    pthread_cond_wait(&c->readers_done, &c->mutx);
+  pthread_mutex_unlock(&c->mutx);
+
+  for (k = 0; k < c->num_conns; k++) {
+    pthread_mutex_destroy(&c->conns[k].mutx);
+    pthread_cond_destroy(&c->conns[k].room);
+  }
+  pthread_mutex_destroy(&c->mutx);
+  pthread_cond_destroy(&c->readers_done);
+  free(c->conns);
+  free(c->transport);
+  kv_shards_free(c->shards);
+  free(c);
+}
+
+/**
+ * @name kv_shards - The servers a client spreads its keys over.
+ * @param c: The client.
+ *
+ * @return The shards (freed by kv_close()).
+ */
+const KVShards *kv_shards(KVClient *c) {
+  return c->shards;
+}
+
+/**
+ * @name kv_send - Sends a request on the next session of its key's shard; its callback gets the reply.
+ * @param c: The client.
+ * @param request: The request, e.g. "GET:key".
+ * @param cb: Called once with the reply (or the failure).
+ * @param arg: Passed to 'cb'.
+ *
+ * @return 0 on Success. -1 on Error ('cb' is not called).
+ */
+int kv_send(KVClient *c, const char *request, KVCallback cb, void *arg) {
+  KVConn *conn;
+  Pending *p, **pp;
+  ShmChannel *shm;
+  char msg[KV_TAG_LEN + KV_REQUEST_SIZE];
+  int len, shard, fd, rc = 0;
+
+  if (strlen(request) >= KV_REQUEST_SIZE)
+    return -1;
+  if (!(p = (Pending *) malloc(sizeof(Pending))))
+    return -1;
+  p->cb = cb;
+  p->arg = arg;
+  p->next = NULL;
+
+  shard = (c->shards->num == 1) ? 0 : kv_shards_route(c->shards, request);
+  conn = &c->conns[(shard < 0 ? 0 : shard) * c->per_shard +
+                   __atomic_fetch_add(&c->next_conn, 1, __ATOMIC_RELAXED) % c->per_shard];
+  pthread_mutex_lock(&conn->mutx);
+  if (kv_up(conn)) {
+    pthread_mutex_unlock(&conn->mutx);
+    free(p);
+    return -1;
+  }
+
+  // Register first: the reply may arrive before send() returns.
+  p->id = conn->next_id++;
+  *conn->last = p;
+  conn->last = &p->next;
+
+  len = sprintf(msg, "%u|%s", p->id, request);
+  shm = conn->shm;
+  fd = conn->socket_fd;
+  if (shm ? kv_shm_write_msg(conn, msg, len) : kv_write_msg(fd, msg, len)) {
+    // Take the request back; the reader fails any others when it sees the broken socket.
+    for (pp = &conn->pending; *pp && *pp != p; pp = &(*pp)->next)
+      ;
+    if (*pp) {
+      if (!(*pp = p->next))
+        conn->last = pp;
+      free(p);
+      rc = -1;
+    }
+    // Unless the session went down while kv_shm_write_msg() waited: the socket may be a new session's by now.
+    if (conn->shm == shm && conn->socket_fd == fd)
+      shutdown(fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&conn->mutx);
+  return rc;
+}
+
+static void kv_complete(void *arg, int status, const char *reply) {
+  KVFuture *f = (KVFuture *) arg;
+
+  pthread_mutex_lock(&f->mutx);
+  f->status = status;
+  if (reply)
+    strncpy(f->reply, reply, KV_REPLY_SIZE - 1);
+  f->done = 1;
+  pthread_cond_signal(&f->done_cond);
+  pthread_mutex_unlock(&f->mutx);
+}
+
+/**
+ * @name kv_submit - Sends a request; its reply is collected with kv_wait().
+ * @param c: The client.
+ * @param request: The request, e.g. "GET:key".
+ *
+ * @return The future on Success. NULL on Error.
+ */
+KVFuture *kv_submit(KVClient *c, const char *request) {
+  KVFuture *f;
+
+  if (!(f = (KVFuture *) calloc(1, sizeof(KVFuture))))
+    return NULL;
+  pthread_mutex_init(&f->mutx, NULL);
+  pthread_cond_init(&f->done_cond, NULL);
+  if (kv_send(c, request, kv_complete, f)) {
+    pthread_mutex_destroy(&f->mutx);
+    pthread_cond_destroy(&f->done_cond);
+    free(f);
+    return NULL;
+  }
+  return f;
+}
+
+/**
+ * @name kv_wait - Waits for the reply of a request sent with kv_submit().
+ * @param f: The future, freed here.
+ * @param reply: Receives the reply (may be NULL).
+ * @param len: Size of 'reply'.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int kv_wait(KVFuture *f, char *reply, int len) {
+  int status;
+
+  pthread_mutex_lock(&f->mutx);
+  while (!f->done)
+    pthread_cond_wait(&f->done_cond, &f->mutx);
+  pthread_mutex_unlock(&f->mutx);
+
+  status = f->status;
+  if (!status && reply && len > 0) {
+    strncpy(reply, f->reply, len - 1);
+    reply[len - 1] = '\0';
+  }
+  pthread_mutex_destroy(&f->mutx);
+  pthread_cond_destroy(&f->done_cond);
+  free(f);
+  return status;
+}
+
+/**
+ * @name kv_request - Sends a request and waits for its reply.
+ * @param c: The client.
+ * @param request: The request, e.g. "AGG:SUM".
+ * @param reply: Receives the reply.
+ * @param len: Size of 'reply'.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int kv_request(KVClient *c, const char *request, char *reply, int len) {
+  KVFuture *f;
+
+  if (!(f = kv_submit(c, request)))
+    return -1;
+  return kv_wait(f, reply, len);
+}
+
+/**
+ * @name kv_batch - Pipelines requests over the pool and waits for all the replies; sent to several shards, they are
+ *                   served by the servers in parallel.
+ * @param c: The client.
+ * @param requests: The requests.
+ * @param replies: replies[i] receives the reply of requests[i] ("" if it failed).
+ * @param n: Number of requests.
+ * @param len: Size of each reply buffer.
+ *
+ * @return Number of replies received.
+ */
+int kv_batch(KVClient *c, const char **requests, char **replies, int n, int len) {
+  KVFuture **f;
+  int k, ok = 0;
+
+  if (!(f = (KVFuture **) malloc(n * sizeof(KVFuture *))))
+    return 0;
+  for (k = 0; k < n; k++)
+    f[k] = kv_submit(c, requests[k]);
+  for (k = 0; k < n; k++) {
+    replies[k][0] = '\0';
+    if (f[k] && !kv_wait(f[k], replies[k], len))
+      ok++;
+  }
+  free(f);
+  return ok;
+}
+
+/**
+ * @name kv_get_async - Sends a GET; kv_wait() returns "GET OK: value" or "GET ERROR".
+ * @param c: The client.
+ * @param key: The key.
+ *
+ * @return The future on Success. NULL on Error.
+ */
+KVFuture *kv_get_async(KVClient *c, const char *key) {
+  char request[KV_REQUEST_SIZE];
+
+  if (snprintf(request, sizeof(request), "GET:%s", key) >= (int) sizeof(request))
+    return NULL;
+  return kv_submit(c, request);
+}
+
+/**
+ * @name kv_put_async - Sends a PUT; kv_wait() returns "PUT OK" or "PUT ERROR...".
+ * @param c: The client.
+ * @param key: The key.
+ * @param value: The value.
+ *
+ * @return The future on Success. NULL on Error.
+ */
+KVFuture *kv_put_async(KVClient *c, const char *key, const char *value) {
+  char request[KV_REQUEST_SIZE];
+
+  if (snprintf(request, sizeof(request), "PUT:%s:%s", key, value) >= (int) sizeof(request))
+    return NULL;
+  return kv_submit(c, request);
+}
+
+/**
+ * @name kv_get - Gets the value of a key.
+ * @param c: The client.
+ * @param key: The key.
+ * @param value: Receives the value.
+ * @param len: Size of 'value'.
+ *
+ * @return 0 on Success. 1 if the key doesn't exist. -1 on Error.
+ */
+int kv_get(KVClient *c, const char *key, char *value, int len) {
+  char reply[KV_REPLY_SIZE];
+  KVFuture *f;
+
+  if (!(f = kv_get_async(c, key)) || kv_wait(f, reply, sizeof(reply)))
+    return -1;
+  if (strncmp(reply, "GET OK: ", strlen("GET OK: ")))
+    return 1;
+  strncpy(value, reply + strlen("GET OK: "), len - 1);
+  value[len - 1] = '\0';
+  return 0;
+}
+
+/**
+ * @name kv_put - Puts a key/value pair.
+ * @param c: The client.
+ * @param key: The key.
+ * @param value: The value.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int kv_put(KVClient *c, const char *key, const char *value) {
+  char reply[KV_REPLY_SIZE];
+  KVFuture *f;
+
+  if (!(f = kv_put_async(c, key, value)) || kv_wait(f, reply, sizeof(reply)))
+    return -1;
+  return strncmp(reply, "PUT OK", strlen("PUT OK")) ? -1 : 0;
+}
+
+/**
+ * @name kv_delete - Deletes a key.
+ * @param c: The client.
+ * @param key: The key.
+ *
+ * @return 0 on Success. 1 if the key doesn't exist. -1 on Error.
+ */
+int kv_delete(KVClient *c, const char *key) {
+  char request[KV_REQUEST_SIZE], reply[KV_REPLY_SIZE];
+
+  if (snprintf(request, sizeof(request), "DELETE:%s", key) >= (int) sizeof(request) ||
+      kv_request(c, request, reply, sizeof(reply)))
+    return -1;
+  if (!strncmp(reply, "DELETE OK", strlen("DELETE OK")))
+    return 0;
+  return strncmp(reply, "DELETE ERROR: not found", strlen("DELETE ERROR: not found")) ? -1 : 1;
+}
+
+// Definition of a change received while waiting for a WATCH/UNWATCH reply.
+typedef struct kvchange {
+  struct kvchange *next;
+  char msg[];
+} KVChange;
+
+struct kvwatch {
+  int socket_fd;
+  KVChange *queued, **last;            // Told before kv_watch_next() asked.
+};
+
+/**
+ * @name kv_watch_open - Connects a watch connection to the server (the Unix domain socket for a local server).
+ * @param host: Server address or hostname.
+ * @param port: Server port.
+ *
+ * @return The watch connection on Success. NULL on Error.
+ */
+KVWatch *kv_watch_open(const char *host, int port) {
+  KVWatch *w;
+
+  if (!(w = (KVWatch *) calloc(1, sizeof(KVWatch))))
+    return NULL;
+  if ((w->socket_fd = kv_socket_connect(host, port, kv_transport(host))) == -1) {
+    free(w);
+    return NULL;
+  }
+  w->last = &w->queued;
+  return w;
+}
+
+/**
+ * @name kv_watch_call - Sends a WATCH or UNWATCH and waits for its reply, keeping the changes told meanwhile.
+ * @param w: The watch connection.
+ * @param request: The request.
+ * @param op: "WATCH" or "UNWATCH".
+ *
+ * @return 0 on "<op> OK". 1 on "<op> ERROR: not watched". -1 on Error.
+ */
+static int kv_watch_call(KVWatch *w, const char *request, const char *op) {
+  KVChange *change;
+  char msg[KV_MSG_SIZE], ok[16], error[16];
+  int len;
+
+  sprintf(ok, "%s OK", op);
+  sprintf(error, "%s ERROR", op);
+  if (kv_write_msg(w->socket_fd, request, strlen(request)))
+    return -1;
+  while ((len = read_msg_from_socket(w->socket_fd, msg, sizeof(msg))) > 0) {
+    if (!strncmp(msg, ok, strlen(ok)))
+      return 0;
+    if (!strncmp(msg, error, strlen(error)))
+      return strstr(msg, "not watched") ? 1 : -1;
+    if (!(change = (KVChange *) malloc(sizeof(KVChange) + len + 1)))
+      return -1;
+    memcpy(change->msg, msg, len + 1);
+    change->next = NULL;
+    *w->last = change;
+    w->last = &change->next;
+  }
+  return -1;
+}
+
+/**
+ * @name kv_watch - Watches a key, or the keys with a prefix.
+ * @param w: The watch connection.
+ * @param pattern: A key, or a prefix followed by '*'.
+ * @param window_ms: Coalesce the connection's changes over this many msecs (0: each one; -1: keep the last window).
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int kv_watch(KVWatch *w, const char *pattern, int window_ms) {
+  char request[KV_REQUEST_SIZE];
+  int len;
+
+  if (window_ms >= 0)
+    len = snprintf(request, sizeof(request), "WATCH:%s:%d", pattern, window_ms);
+  else
+    len = snprintf(request, sizeof(request), "WATCH:%s", pattern);
+  if (len >= (int) sizeof(request))
+    return -1;
+  return kv_watch_call(w, request, "WATCH") ? -1 : 0;
+}
+
+/**
+ * @name kv_unwatch - Stops watching a key or a prefix.
+ * @param w: The watch connection.
+ * @param pattern: As given to kv_watch().
+ *
+ * @return 0 on Success. 1 if it wasn't watched. -1 on Error.
+ */
+int kv_unwatch(KVWatch *w, const char *pattern) {
+  char request[KV_REQUEST_SIZE];
+
+  if (snprintf(request, sizeof(request), "UNWATCH:%s", pattern) >= (int) sizeof(request))
+    return -1;
+  return kv_watch_call(w, request, "UNWATCH");
+}
+
+/**
+ * @name kv_watch_next - Waits for the next change of the watched keys.
+ * @param w: The watch connection.
+ * @param key: Gets the key (up to 'key_len' bytes, '\0'-terminated).
+ * @param key_len: Size of 'key'.
+ * @param value: Gets its value (likewise), or "" if it was deleted.
+ * @param value_len: Size of 'value'.
+ * @param timeout_ms: Msecs to wait at most (-1: until a change comes).
+ *
+ * @return KV_WATCH_PUT, KV_WATCH_DELETE, KV_WATCH_OVERFLOW (changes were dropped: re-read the watched keys) or
+ *         KV_WATCH_TIMEOUT. -1 on Error (or if the server hung up).
+ */
+int kv_watch_next(KVWatch *w, char *key, int key_len, char *value, int value_len, int timeout_ms) {
+  struct pollfd pfd;
+  KVChange *change;
+  char buf[KV_MSG_SIZE], *msg, *sep;
+  int rc;
+
+  while (1) {
+    if ((change = w->queued)) {
+      if (!(w->queued = change->next))
+        w->last = &w->queued;
+      msg = buf;
+      snprintf(buf, sizeof(buf), "%s", change->msg);
+      free(change);
+    } else {
+      pfd.fd = w->socket_fd;
+      pfd.events = POLLIN;
+      while ((rc = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR)
+        ;
+      if (rc < 0)
+        return -1;
+      if (!rc)
+        return KV_WATCH_TIMEOUT;
+      if (read_msg_from_socket(w->socket_fd, buf, sizeof(buf)) <= 0)
+        return -1;
+      msg = buf;
+    }
+    msg[strcspn(msg, "\n")] = '\0';
+    if (!strncmp(msg, "WATCH OVERFLOW", strlen("WATCH OVERFLOW")))
+      return KV_WATCH_OVERFLOW;
+    if (!strncmp(msg, "DELETED ", strlen("DELETED "))) {
+      snprintf(key, key_len, "%s", msg + strlen("DELETED "));
+      snprintf(value, value_len, "%s", "");
+      return KV_WATCH_DELETE;
+    }
+    if (!strncmp(msg, "CHANGED ", strlen("CHANGED ")) && (sep = strstr(msg, ": "))) {
+      *sep = '\0';                       // Keys have no ':'.
+      snprintf(key, key_len, "%s", msg + strlen("CHANGED "));
+      snprintf(value, value_len, "%s", sep + 2);
+      return KV_WATCH_PUT;
+    }
+  }
+}
+
+/**
+ * @name kv_watch_close - Closes a watch connection; the server drops its subscriptions.
+ * @param w: The watch connection.
+ *
+ * @return
+ */
+void kv_watch_close(KVWatch *w) {
+  KVChange *change;
+
+  close(w->socket_fd);
+  while ((change = w->queued)) {
+    w->queued = change->next;
+    free(change);
+  }
+  free(w);
+}
@@ -0,0 +1,140 @@
+/* kvclient.h
+
+   Client library for the key-value server.
+
+   A client keeps a pool of persistent connections ("sessions") to one
+   server, or to each of several (shards). Every request is tagged with an id ("<id>|GET:key") and the
+   server answers with the same tag ("<id>|GET OK: value"), so many
+   requests can be in flight on one connection: they are written back to
+   back and the replies are matched to them as they arrive. Requests are
+   spread over the pool round robin.
+
+   Three ways to issue a request:
+     - sync:     kv_get(), kv_put(), kv_delete(), kv_request(), kv_batch().
+     - future:   kv_submit() / kv_get_async() / kv_put_async(), then kv_wait().
+     - callback: kv_send(); the callback runs on the connection's reader
+                 thread, so it should be quick and must not kv_wait().
+
+   With shards (kv_open_shards()), keys are spread over the servers by
+   consistent hashing: each server is KV_VNODES points on a hash ring,
+   and a key belongs to the first point after its hash, so adding or
+   removing a server moves only the keys next to its points. A request
+   goes to its key's shard (one without a key, e.g. STATUS or AGG, to the
+   first), and kv_batch() fans its requests out to all of them at once.
+
+   Only single-reply operations (GET, PUT, AGG, TSAGG, STATUS) can be sent
+   on a session; SCAN, RANGE, PREFIX and MGET need a connection of their own.
+   A broken connection fails its in-flight requests and is reopened by the
+   next request that picks it.
+
+   Instead of polling keys with GETs, a watch connection (kv_watch_open(),
+   a connection of its own, not a session) is told of every PUT/DELETE of
+   the keys, or key prefixes, it watches: kv_watch_next() returns them
+   one at a time. Use it from one thread at a time.
+
+   For a server on this host (a loopback address or one of the host's
+   own), sessions skip the TCP stack: each one asks the server's Unix
+   domain socket for a shared-memory channel (shmring.h) and falls back to
+   a session on that socket, then to TCP. KV_TRANSPORT=shm|unix|tcp in the
+   environment caps the choice (e.g. to compare them).
+
+*/
+
+#ifndef KVCLIENT_H
+#define KVCLIENT_H
+
+#define KV_REPLY_SIZE 2048  // Largest reply (without the tag), including '\0'.
+#define KV_VNODES      160  // Points per shard on the hash ring (more: a more even spread of the keys).
+
+// What kv_watch_next() returns.
+#define KV_WATCH_PUT       0
+#define KV_WATCH_DELETE    1
+#define KV_WATCH_OVERFLOW  2  // Changes were dropped (a slow reader): re-read the watched keys.
+#define KV_WATCH_TIMEOUT   3
+
+typedef struct kvclient KVClient;
+typedef struct kvfuture KVFuture;
+typedef struct kvwatch KVWatch;
+typedef struct kvshards KVShards;
+
+// Called once per request: status 0 and the reply, or -1 and NULL if the connection failed.
+typedef void (*KVCallback)(void *arg, int status, const char *reply);
+
+// connect 'connections' sessions to host:port. NULL on error.
+KVClient *kv_open(const char *host, int port, int connections);
+
+// connect 'connections' sessions to each server of "host[:port],host[:port],..." ('port' for those without one),
+// routing each key to one of them by consistent hashing. NULL on error.
+KVClient *kv_open_shards(const char *endpoints, int port, int connections);
+
+// the servers of 'c' (owned by 'c').
+const KVShards *kv_shards(KVClient *c);
+
+// close the sessions; in-flight requests fail. Don't use 'c' afterwards.
+void kv_close(KVClient *c);
+
+// send 'request' (e.g. "GET:key"); 'cb' gets the reply. 0 on success, -1 if it couldn't be sent (cb isn't called).
+int kv_send(KVClient *c, const char *request, KVCallback cb, void *arg);
+
+// send 'request'; the reply is collected with kv_wait(). NULL on error.
+KVFuture *kv_submit(KVClient *c, const char *request);
+
+// wait for the reply of 'f' and copy it to 'reply' (up to 'len' bytes). Frees 'f'. 0 on success, -1 on error.
+int kv_wait(KVFuture *f, char *reply, int len);
+
+// send 'request' and wait for its reply. 0 on success, -1 on error.
+int kv_request(KVClient *c, const char *request, char *reply, int len);
+
+// pipeline 'n' requests and wait for all of them; replies[i] holds 'len' bytes. Returns the number of replies received.
+int kv_batch(KVClient *c, const char **requests, char **replies, int n, int len);
+
+// get the value of 'key'. 0 on success, 1 if the key doesn't exist, -1 on error.
+int kv_get(KVClient *c, const char *key, char *value, int len);
+
+// put 'key' = 'value'. 0 on success, -1 on error.
+int kv_put(KVClient *c, const char *key, const char *value);
+
+// delete 'key'. 0 on success, 1 if the key doesn't exist, -1 on error.
+int kv_delete(KVClient *c, const char *key);
+
+// kv_get() / kv_put() as futures: kv_wait() returns the raw reply ("GET OK: value", "PUT OK", ...).
+KVFuture *kv_get_async(KVClient *c, const char *key);
+KVFuture *kv_put_async(KVClient *c, const char *key, const char *value);
+
+// connect a watch connection to host:port. NULL on error.
+KVWatch *kv_watch_open(const char *host, int port);
+
+// watch 'pattern': a key, or a prefix followed by '*' ("*": all keys). Changes are coalesced over 'window_ms'
+// msecs (0: each one is told; -1: keep the connection's window). 0 on success, -1 on error.
+int kv_watch(KVWatch *w, const char *pattern, int window_ms);
+
+// stop watching 'pattern'. 0 on success, 1 if it wasn't watched, -1 on error.
+int kv_unwatch(KVWatch *w, const char *pattern);
+
+// wait up to 'timeout_ms' (-1: no limit) for the next change: its key, and its value ("" if deleted).
+// KV_WATCH_PUT, KV_WATCH_DELETE, KV_WATCH_OVERFLOW or KV_WATCH_TIMEOUT; -1 on error.
+int kv_watch_next(KVWatch *w, char *key, int key_len, char *value, int value_len, int timeout_ms);
+
+// close the watch connection.
+void kv_watch_close(KVWatch *w);
+
+// hash ring of "host[:port],host[:port],..." ('port' for those without one). NULL on error.
+KVShards *kv_shards_new(const char *endpoints, int port);
+
+// number of servers, the shard that holds 'key', and a shard's host and port.
+int kv_shards_count(const KVShards *s);
+int kv_shards_find(const KVShards *s, const char *key);
+const char *kv_shards_endpoint(const KVShards *s, int shard, int *port);
+
+// the shard of the key of 'request' (e.g. "GET:key", or "@table:GET:key": the same in every table); -1 if it has none (STATUS, AGG, SCAN...) or many (MGET, a
+// WATCH of a prefix), for the caller to send it to every shard.
+int kv_shards_route(const KVShards *s, const char *request);
+
+// free a hash ring from kv_shards_new().
+void kv_shards_free(KVShards *s);
+
+// low level: connect a session socket to host:port (blocking; the Unix domain socket for a local server,
+// else TCP_NODELAY), for callers that do their own I/O with the "<id>|request" framing. The socket on success, -1 on error.
+int kv_session_connect(const char *host, int port);
+
+#endif
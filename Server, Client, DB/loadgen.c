@@ -0,0 +1,839 @@
+/* loadgen.c
+
+   Open-loop load generator for the key-value server. See loadgen.h.
+
+*/
+
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include "utils.h"
+#include "kvclient.h"
+#include "loadgen.h"
+
+#define LOAD_KEY_LEN          32
+#define LOAD_PRELOAD_WINDOW  512  // PUTs in flight while preloading the keyspace.
+#define LOAD_DRAIN_SEC        10  // Wait this long for the last replies.
+#define SAT_MSG_SIZE        1300  // Largest framed request or reply of the saturation driver.
+#define SAT_RBUF_SIZE      65536  // Per connection receive buffer.
+#define SAT_EVENTS            64
+
+// Definition of a run's shared state, updated by the client's reader threads.
+typedef struct loadstate {
+  Histogram hist;
+  uint64_t completed;
+  uint64_t errors;
+} LoadState;
+
+static LoadState state;
+
+/**
+ * @name loadgen_now_ns - Reads the monotonic clock.
+ *
+ * @return Time in ns.
+ */
+int64_t loadgen_now_ns() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/**
+ * @name loadgen_defaults - Sets the default load.
+ * @param cfg: The load.
+ *
+ * @return
+ */
+void loadgen_defaults(LoadConfig *cfg) {
+  memset(cfg, 0, sizeof(LoadConfig));
+  cfg->rate = 1000;
+  cfg->seconds = 10;
+  cfg->connections = 4;
+  cfg->keys = 10000;
+  cfg->dist = LOAD_UNIFORM;
+  cfg->zipf_theta = 0.99;
+  cfg->hot_keys = 0.1;
+  cfg->hot_ops = 0.9;
+  cfg->read_pct = 90;
+  cfg->value_size = 16;
+  cfg->threads = 2;
+  cfg->depth = 16;
+}
+
+/**
+ * @name loadgen_parse_dist - Parses a key distribution.
+ * @param cfg: The load.
+ * @param spec: "uniform", "zipf[:theta]" or "hotspot[:hot_keys[:hot_ops]]".
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int loadgen_parse_dist(LoadConfig *cfg, const char *spec) {
+  if (!strcmp(spec, "uniform")) {
+    cfg->dist = LOAD_UNIFORM;
+  } else if (!strncmp(spec, "zipf", 4)) {
+    cfg->dist = LOAD_ZIPF;
+    if (spec[4] == ':')
+      cfg->zipf_theta = atof(spec + 5);
+    else if (spec[4])
+      return -1;
+    if (cfg->zipf_theta <= 0 || cfg->zipf_theta >= 1)
+      return -1;
+  } else if (!strncmp(spec, "hotspot", 7)) {
+    cfg->dist = LOAD_HOTSPOT;
+    if (spec[7] == ':' && sscanf(spec + 8, "%lf:%lf", &cfg->hot_keys, &cfg->hot_ops) < 1)
+      return -1;
+    else if (spec[7] && spec[7] != ':')
+      return -1;
+    if (cfg->hot_keys <= 0 || cfg->hot_keys > 1 || cfg->hot_ops < 0 || cfg->hot_ops > 1)
+      return -1;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// xorshift64*: fast, and good enough to pick keys.
+static uint64_t keygen_rand(KeyGen *g) {
+  g->rng ^= g->rng >> 12;
+  g->rng ^= g->rng << 25;
+  g->rng ^= g->rng >> 27;
+  return g->rng * 2685821657736338717ULL;
+}
+
+// Uniform in [0, 1), from the top 53 bits.
+double keygen_uniform(KeyGen *g) {
+  return (keygen_rand(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @name keygen_init - Prepares a key generator.
+ * @param g: The generator.
+ * @param cfg: The load (keyspace and distribution).
+ * @param seed: Random seed.
+ *
+ * Zipfian keys use the rejection-free method of Gray et al. ("Quickly generating billion-record
+ * synthetic databases"); its zeta(n) costs O(keys) here, once.
+ * @return
+ */
+void keygen_init(KeyGen *g, const LoadConfig *cfg, uint64_t seed) {
+  unsigned long i;
+  double zeta2;
+
+  memset(g, 0, sizeof(KeyGen));
+  g->dist = cfg->dist;
+  g->keys = cfg->keys ? cfg->keys : 1;
+  g->rng = seed ? seed : 88172645463325252ULL;
+
+  if (g->dist == LOAD_ZIPF) {
+    g->theta = cfg->zipf_theta;
+    for (i = 1; i <= g->keys; i++)
+      g->zetan += 1.0 / pow((double) i, g->theta);
+    zeta2 = 1.0 + 1.0 / pow(2.0, g->theta);
+    g->alpha = 1.0 / (1.0 - g->theta);
+    g->eta = (1.0 - pow(2.0 / g->keys, 1.0 - g->theta)) / (1.0 - zeta2 / g->zetan);
+    g->half_pow_theta = pow(0.5, g->theta);
+  } else if (g->dist == LOAD_HOTSPOT) {
+    g->hot = (unsigned long) (cfg->hot_keys * g->keys);
+    if (!g->hot)
+      g->hot = 1;
+    g->hot_ops = cfg->hot_ops;
+  }
+}
+
+/**
+ * @name keygen_next - Draws the next key.
+ * @param g: The generator.
+ *
+ * Zipfian and hotspot keys are hottest at key 0.
+ * @return A key number in [0, keys).
+ */
+unsigned long keygen_next(KeyGen *g) {
+  double u, uz;
+  unsigned long k;
+
+  switch (g->dist) {
+    case LOAD_ZIPF:
+      u = keygen_uniform(g);
+      uz = u * g->zetan;
+      if (uz < 1.0)
+        return 0;
+      if (uz < 1.0 + g->half_pow_theta)
+        return 1;
+      k = (unsigned long) (g->keys * pow(g->eta * u - g->eta + 1.0, g->alpha));
+      return k < g->keys ? k : g->keys - 1;
+    case LOAD_HOTSPOT:
+      if (g->hot >= g->keys || keygen_uniform(g) < g->hot_ops)
+        return keygen_rand(g) % g->hot;
+      return g->hot + keygen_rand(g) % (g->keys - g->hot);
+    default:
+      return keygen_rand(g) % g->keys;
+  }
+}
+
+static int hist_index(uint64_t v) {
+  int shift;
+
+  if (v < HIST_LINEAR)
+    return (int) v;
+  shift = 63 - __builtin_clzll(v) - 6;        // v >> shift is in [HIST_HALF, HIST_LINEAR).
+  if (shift > 48)
+    return HIST_BUCKETS - 1;
+  return HIST_LINEAR + (shift - 1) * HIST_HALF + (int) (v >> shift) - HIST_HALF;
+}
+
+static uint64_t hist_upper(int idx) {
+  int shift;
+
+  if (idx < HIST_LINEAR)
+    return idx;
+  shift = (idx - HIST_LINEAR) / HIST_HALF + 1;
+  return ((uint64_t) ((idx - HIST_LINEAR) % HIST_HALF + HIST_HALF + 1) << shift) - 1;
+}
+
+/**
+ * @name hist_record - Records a value.
+ * @param h: The histogram.
+ * @param ns: The value (ns).
+ *
+ * @return
+ */
+void hist_record(Histogram *h, uint64_t ns) {
+  uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&h->counts[hist_index(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * @name hist_percentile - Finds a percentile.
+ * @param h: The histogram.
+ * @param p: The fraction (e.g. 0.99).
+ *
+ * @return The upper bound of the bucket holding the percentile (ns), at most the largest value.
+ */
+uint64_t hist_percentile(const Histogram *h, double p) {
+  uint64_t target, seen = 0;
+  int k;
+
+  if (!h->total)
+    return 0;
+  target = (uint64_t) ceil(p * h->total);
+  if (!target)
+    target = 1;
+  for (k = 0; k < HIST_BUCKETS; k++) {
+    seen += h->counts[k];
+    if (seen >= target)
+      return hist_upper(k) < h->max ? hist_upper(k) : h->max;
+  }
+  return h->max;
+}
+
+// Reply of a timed request: 'arg' carries its intended send time.
+static void loadgen_reply(void *arg, int status, const char *reply) {
+  int64_t intended = (int64_t) (intptr_t) arg;
+
+  hist_record(&state.hist, loadgen_now_ns() - intended);
+  if (status || strstr(reply, "ERROR"))
+    __atomic_fetch_add(&state.errors, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&state.completed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @name loadgen_preload - PUTs every key of the keyspace once, so GETs find them.
+ * @param c: The client.
+ * @param cfg: The load.
+ * @param value: The value to PUT.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+static int loadgen_preload(KVClient *c, const LoadConfig *cfg, const char *value) {
+  KVFuture *window[LOAD_PRELOAD_WINDOW];
+  char key[LOAD_KEY_LEN];
+  unsigned long k;
+  int rc = 0;
+
+  fprintf(stdout, "Preloading %lu keys...\n", cfg->keys);
+  fflush(stdout);
+  memset(window, 0, sizeof(window));
+  for (k = 0; k < cfg->keys + LOAD_PRELOAD_WINDOW; k++) {
+    // Wait for the PUT sent a window ago, then reuse its slot.
+    if (window[k % LOAD_PRELOAD_WINDOW] && kv_wait(window[k % LOAD_PRELOAD_WINDOW], NULL, 0))
+      rc = -1;
+    window[k % LOAD_PRELOAD_WINDOW] = NULL;
+    if (k < cfg->keys) {
+      sprintf(key, "key.%lu", k);
+      if (!(window[k % LOAD_PRELOAD_WINDOW] = kv_put_async(c, key, value)))
+        rc = -1;
+    }
+  }
+  return rc;
+}
+
+// Appends the results of an "open" or "saturate" run as a CSV row (with a header if the file is new).
+static void loadgen_csv(const LoadConfig *cfg, const char *mode, double elapsed, uint64_t sent) {
+  const char *dist[] = { "uniform", "zipf", "hotspot" };
+  const Histogram *h = &state.hist;
+  struct stat st;
+  FILE *f;
+
+  if (!(f = fopen(cfg->csv, "a"))) {
+    fprintf(stderr, "Error: Cannot open %s.\n", cfg->csv);
+    return;
+  }
+  if (!fstat(fileno(f), &st) && !st.st_size)
+    fprintf(f, "mode,target_rate,seconds,connections,depth,keys,dist,read_pct,value_size,sent,completed,errors,throughput,p50_us,p90_us,p99_us,p999_us,max_us\n");
+  fprintf(f, "%s,%.0f,%d,%d,%d,%lu,%s,%d,%d,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+          mode, strcmp(mode, "open") ? 0 : cfg->rate, cfg->seconds, cfg->connections, strcmp(mode, "open") ? cfg->depth : 0,
+          cfg->keys, dist[cfg->dist], cfg->read_pct, cfg->value_size,
+          (unsigned long long) sent, (unsigned long long) state.completed, (unsigned long long) state.errors,
+          state.completed / elapsed,
+          hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.90) / 1e3, hist_percentile(h, 0.99) / 1e3,
+          hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+  fclose(f);
+}
+
+/**
+ * @name loadgen_run - Runs a load and prints throughput and latency percentiles.
+ * @param cfg: The load.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int loadgen_run(const LoadConfig *cfg) {
+  const char *dist[] = { "uniform", "zipf", "hotspot" };
+  char request[LOAD_KEY_LEN + LOAD_MAX_VALUE_SIZE + 8], value[LOAD_MAX_VALUE_SIZE + 1];
+  struct timespec until;
+  KVClient *c;
+  KeyGen g;
+  int64_t start, end, next, now;
+  uint64_t sent = 0;
+  double elapsed;
+  unsigned long key;
+  const Histogram *h = &state.hist;
+
+  if (cfg->rate <= 0 || cfg->seconds <= 0 || !cfg->keys ||
+      cfg->value_size < 1 || cfg->value_size > LOAD_MAX_VALUE_SIZE) {
+    fprintf(stderr, "Error: Bad load parameters.\n");
+    return -1;
+  }
+  memset(value, 'v', cfg->value_size);
+  value[cfg->value_size] = '\0';
+  memset(&state, 0, sizeof(state));
+
+  // kv_send() routes each key to its server.
+  if (!(c = kv_open_shards(cfg->host, cfg->port, cfg->connections))) {
+    fprintf(stderr, "Error: Cannot connect to %s.\n", cfg->host);
+    return -1;
+  }
+  if (cfg->read_pct > 0 && loadgen_preload(c, cfg, value))
+    fprintf(stderr, "Warning: Some preload PUTs failed.\n");
+  keygen_init(&g, cfg, cfg->seed ? cfg->seed : (uint64_t) loadgen_now_ns());
+
+  fprintf(stdout, "Load: %.0f req/s for %d s, %d connections, %lu keys (%s), %d%% reads, %d-byte values\n",
+          cfg->rate, cfg->seconds, cfg->connections, cfg->keys, dist[cfg->dist], cfg->read_pct, cfg->value_size);
+  if (kv_shards_count(kv_shards(c)) > 1)
+    fprintf(stdout, "Servers: %d (keys spread by consistent hashing, %d connections each)\n",
+            kv_shards_count(kv_shards(c)), cfg->connections);
+  fflush(stdout);
+
+  // Open loop: request N is due at its scheduled time, however many are still in flight.
+  start = next = loadgen_now_ns();
+  end = start + (int64_t) cfg->seconds * 1000000000;
+  while (next < end) {
+    if ((now = loadgen_now_ns()) < next) {
+      until.tv_sec = next / 1000000000;
+      until.tv_nsec = next % 1000000000;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+    }
+
+    key = keygen_next(&g);
+    if ((int) (keygen_uniform(&g) * 100) < cfg->read_pct)
+      sprintf(request, "GET:key.%lu", key);
+    else
+      sprintf(request, "PUT:key.%lu:%s", key, value);
+    if (kv_send(c, request, loadgen_reply, (void *) (intptr_t) next)) {
+      __atomic_fetch_add(&state.errors, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&state.completed, 1, __ATOMIC_RELAXED);
+    }
+    sent++;
+
+    // Poisson arrivals.
+    next += (int64_t) (-log(1.0 - keygen_uniform(&g)) / cfg->rate * 1e9);
+  }
+
+  // Drain.
+  while (__atomic_load_n(&state.completed, __ATOMIC_RELAXED) < sent &&
+         loadgen_now_ns() - end < (int64_t) LOAD_DRAIN_SEC * 1000000000)
+    usleep(1000);
+  elapsed = (loadgen_now_ns() - start) / 1e9;
+  kv_close(c);
+
+  fprintf(stdout, "Sent: %llu  Completed: %llu  Errors: %llu  Throughput: %.1f req/s\n",
+          (unsigned long long) sent, (unsigned long long) state.completed,
+          (unsigned long long) state.errors, state.completed / elapsed);
+  fprintf(stdout, "Latency (us, from intended send time): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+          hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.90) / 1e3, hist_percentile(h, 0.99) / 1e3,
+          hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+  if (cfg->csv)
+    loadgen_csv(cfg, "open", elapsed, sent);
+  return 0;
+}
+
+// Definition of a request's timestamps (saturation driver).
+typedef struct stamp {
+  int conn;
+  uint32_t id;
+  char op;                             // 'G'et or 'P'ut.
+  int64_t sent;
+  int64_t received;
+} Stamp;
+
+// Definition of a saturation connection: requests in flight to one server, replies in order.
+typedef struct satconn {
+  int fd;
+  int num;                             // Connection number, for the timestamps.
+  int shard;                           // Server it's connected to.
+  uint32_t next_id;
+  int inflight;
+  int oldest;                          // Ring of the requests in flight ('cap' slots).
+  int cap;
+  uint32_t *ids;
+  int64_t *sent;
+  char *ops;
+  char *wbuf;                          // Framed requests not yet written.
+  int wlen, woff, wcap;
+  char *rbuf;                          // Bytes of replies not yet parsed.
+  int rlen;
+  uint32_t events;                     // Current epoll mask.
+} SatConn;
+
+// Definition of a saturation thread: drives its connections with one epoll set.
+typedef struct satthread {
+  const LoadConfig *cfg;
+  const char *value;
+  const KVShards *shards;
+  int num_shards;
+  SatConn *conns;                      // Connection k is to server k % num_shards.
+  int num_conns;
+  int ep;                              // Its epoll set (-1 until the first requests are queued).
+  KeyGen g;
+  int64_t end;
+  uint64_t sent, completed, errors;
+  Stamp *stamps;
+  size_t num_stamps, cap_stamps;
+} SatThread;
+
+// Sets the epoll mask of 'c' to what it waits for.
+static void sat_arm(SatThread *t, SatConn *c) {
+  struct epoll_event ev;
+  uint32_t want = EPOLLIN | ((c->woff < c->wlen) ? EPOLLOUT : 0);
+
+  if (want != c->events) {
+    c->events = ev.events = want;
+    ev.data.ptr = c;
+    epoll_ctl(t->ep, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+}
+
+static int sat_flush(SatConn *c);
+
+// Queues the next request and stamps its send time: on 'c' if its key is on c's server, else (or if 'c' is NULL)
+// on the thread's connection to the key's server with the fewest requests in flight.
+static void sat_issue(SatThread *t, SatConn *c) {
+  const LoadConfig *cfg = t->cfg;
+  unsigned long key = keygen_next(&t->g);
+  char op = ((int) (keygen_uniform(&t->g) * 100) < cfg->read_pct) ? 'G' : 'P';
+  char name[LOAD_KEY_LEN], *msg, *wbuf;
+  SatConn *to = c;
+  int shard = 0, slot, len, k;
+
+  if (t->num_shards > 1) {
+    sprintf(name, "key.%lu", key);
+    shard = kv_shards_find(t->shards, name);
+  }
+  if (!to || to->fd == -1 || to->shard != shard) {
+    to = NULL;
+    for (k = shard; k < t->num_conns; k += t->num_shards)
+      if (t->conns[k].fd != -1 && (!to || t->conns[k].inflight < to->inflight))
+        to = &t->conns[k];
+  }
+  if (to && to->woff) {
+    memmove(to->wbuf, to->wbuf + to->woff, to->wlen - to->woff);
+    to->wlen -= to->woff;
+    to->woff = 0;
+  }
+  if (to && to->wlen + SAT_MSG_SIZE > to->wcap) {
+    if ((wbuf = (char *) realloc(to->wbuf, 2 * to->wcap))) {
+      to->wbuf = wbuf;
+      to->wcap *= 2;
+    } else
+      to = NULL;
+  }
+  if (!to || to->inflight == to->cap) {
+    // Its server's connections all failed.
+    t->sent++;
+    t->completed++;
+    t->errors++;
+    return;
+  }
+
+  slot = (to->oldest + to->inflight) % to->cap;
+  msg = to->wbuf + to->wlen + sizeof(int);
+  to->ops[slot] = op;
+  if (op == 'G')
+    len = sprintf(msg, "%u|GET:key.%lu", to->next_id, key);
+  else
+    len = sprintf(msg, "%u|PUT:key.%lu:%s", to->next_id, key, t->value);
+  memcpy(to->wbuf + to->wlen, &len, sizeof(int));
+  to->wlen += sizeof(int) + len;
+
+  to->ids[slot] = to->next_id++;
+  to->sent[slot] = loadgen_now_ns();
+  to->inflight++;
+  t->sent++;
+
+  // 'c' is written by the caller; another connection now.
+  if (to != c && t->ep != -1) {
+    sat_flush(to);
+    sat_arm(t, to);
+  }
+}
+
+// Writes what the socket takes. -1 if the connection failed.
+static int sat_flush(SatConn *c) {
+  ssize_t n;
+
+  while (c->woff < c->wlen) {
+    if ((n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    c->woff += n;
+  }
+  return 0;
+}
+
+// Reads and matches replies, issuing a new request for each one while the run lasts. -1 if the connection failed.
+static int sat_receive(SatThread *t, SatConn *c) {
+  char reply[SAT_MSG_SIZE];
+  int64_t now;
+  ssize_t n;
+  int len, pos = 0;
+  Stamp *stamps;
+
+  while (1) {
+    if ((n = recv(c->fd, c->rbuf + c->rlen, SAT_RBUF_SIZE - c->rlen, 0)) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+    c->rlen += n;
+
+    for (; c->rlen - pos >= (int) sizeof(int); pos += sizeof(int) + len) {
+      memcpy(&len, c->rbuf + pos, sizeof(int));
+      if (len < 0 || len >= SAT_MSG_SIZE || !c->inflight)
+        return -1;
+      if (c->rlen - pos - (int) sizeof(int) < len)
+        break;
+      memcpy(reply, c->rbuf + pos + sizeof(int), len);
+      reply[len] = '\0';
+      if (strtoul(reply, NULL, 10) != c->ids[c->oldest])
+        return -1;                     // A session's replies come back in order.
+
+      now = loadgen_now_ns();
+      hist_record(&state.hist, now - c->sent[c->oldest]);
+      if (strstr(reply, "ERROR"))
+        t->errors++;
+      t->completed++;
+      if (t->cfg->timestamps) {
+        if (t->num_stamps == t->cap_stamps) {
+          t->cap_stamps = t->cap_stamps ? 2 * t->cap_stamps : 65536;
+          if (!(stamps = (Stamp *) realloc(t->stamps, t->cap_stamps * sizeof(Stamp))))
+            return -1;
+          t->stamps = stamps;
+        }
+        t->stamps[t->num_stamps].conn = c->num;
+        t->stamps[t->num_stamps].id = c->ids[c->oldest];
+        t->stamps[t->num_stamps].op = c->ops[c->oldest];
+        t->stamps[t->num_stamps].sent = c->sent[c->oldest];
+        t->stamps[t->num_stamps].received = now;
+        t->num_stamps++;
+      }
+      c->oldest = (c->oldest + 1) % c->cap;
+      c->inflight--;
+
+      // Closed loop: keep 'depth' requests in flight per connection until the end of the run.
+      if (now < t->end)
+        sat_issue(t, c);
+    }
+    memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+    c->rlen -= pos;
+    pos = 0;
+  }
+  return 0;
+}
+
+// Thread of the saturation driver.
+static void *sat_thread(void *arg) {
+  SatThread *t = (SatThread *) arg;
+  struct epoll_event ev, events[SAT_EVENTS];
+  SatConn *c;
+  int ep, n, k, active = 0;
+
+  if ((ep = epoll_create1(0)) == -1)
+    return NULL;
+  t->ep = -1;
+  for (k = 0; k < t->num_conns; k++) {
+    if (t->conns[k].fd != -1) {
+      fcntl(t->conns[k].fd, F_SETFL, fcntl(t->conns[k].fd, F_GETFL) | O_NONBLOCK);
+      active++;
+    }
+  }
+  // 'depth' requests per connection, each on its key's server.
+  for (k = 0; active && k < t->num_conns * t->cfg->depth; k++)
+    sat_issue(t, NULL);
+  for (k = 0; k < t->num_conns; k++) {
+    c = &t->conns[k];
+    if (c->fd == -1)
+      continue;
+    c->events = EPOLLIN | EPOLLOUT;
+    ev.events = c->events;
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+  }
+  t->ep = ep;
+
+  while (active) {
+    if (loadgen_now_ns() - t->end > (int64_t) LOAD_DRAIN_SEC * 1000000000)
+      break;
+    if ((n = epoll_wait(ep, events, SAT_EVENTS, 100)) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (k = 0; k < n; k++) {
+      c = (SatConn *) events[k].data.ptr;
+      if (c->fd == -1)
+        continue;
+      if (((events[k].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && sat_receive(t, c)) || sat_flush(c)) {
+        // Failed: what's in flight is lost.
+        t->errors += c->inflight;
+        t->completed += c->inflight;
+        c->inflight = 0;
+        epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+        active--;
+        continue;
+      }
+      sat_arm(t, c);
+    }
+
+    // Past the end of the run (a connection may idle before it, its keys drawn for other servers): close the
+    // connections that are done.
+    if (loadgen_now_ns() >= t->end) {
+      for (k = 0; k < t->num_conns; k++) {
+        c = &t->conns[k];
+        if (c->fd != -1 && !c->inflight) {
+          epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+          close(c->fd);
+          c->fd = -1;
+          active--;
+        }
+      }
+    }
+  }
+
+  // Drain timeout: the rest is lost.
+  for (k = 0; k < t->num_conns; k++) {
+    c = &t->conns[k];
+    if (c->fd != -1) {
+      t->errors += c->inflight;
+      t->completed += c->inflight;
+      close(c->fd);
+      c->fd = -1;
+    }
+  }
+  close(ep);
+  return NULL;
+}
+
+// Writes every request's timestamps (ns since the start of the run) as CSV.
+static void sat_timestamps(const LoadConfig *cfg, SatThread *threads, int64_t start) {
+  FILE *f;
+  size_t i;
+  int t;
+
+  if (!(f = fopen(cfg->timestamps, "w"))) {
+    fprintf(stderr, "Error: Cannot open %s.\n", cfg->timestamps);
+    return;
+  }
+  fprintf(f, "thread,conn,id,op,send_ns,recv_ns,latency_ns\n");
+  for (t = 0; t < cfg->threads; t++) {
+    for (i = 0; i < threads[t].num_stamps; i++) {
+      fprintf(f, "%d,%d,%u,%s,%lld,%lld,%lld\n", t, threads[t].stamps[i].conn, threads[t].stamps[i].id,
+              (threads[t].stamps[i].op == 'G') ? "GET" : "PUT",
+              (long long) (threads[t].stamps[i].sent - start), (long long) (threads[t].stamps[i].received - start),
+              (long long) (threads[t].stamps[i].received - threads[t].stamps[i].sent));
+    }
+  }
+  fclose(f);
+}
+
+/**
+ * @name loadgen_saturate - Drives the server as hard as it goes and prints throughput and latency percentiles.
+ * @param cfg: The load ('rate' is ignored).
+ *
+ * 'threads' threads share 'connections' sessions (per server, if 'host' lists several); each thread
+ * waits on its own with one epoll set and keeps 'depth' requests in flight on each of them (closed
+ * loop), so a single process reaches thousands of outstanding requests. With several servers a
+ * thread sends each key on its least busy session to the key's server. Latency is from send to
+ * reply of each request.
+ * @return 0 on Success. -1 on Error.
+ */
+int loadgen_saturate(const LoadConfig *cfg) {
+  const char *dist[] = { "uniform", "zipf", "hotspot" };
+  char value[LOAD_MAX_VALUE_SIZE + 1];
+  const Histogram *h = &state.hist;
+  SatThread *threads;
+  SatConn *conns;
+  pthread_t *tids;
+  KVClient *kv;
+  KVShards *shards;
+  const char *host;
+  int64_t start;
+  uint64_t sent = 0;
+  double elapsed;
+  int k, t, num_shards, num_conns, port, rc = 0;
+
+  if (cfg->seconds <= 0 || !cfg->keys || cfg->threads < 1 || cfg->connections < cfg->threads ||
+      cfg->depth < 1 || cfg->value_size < 1 || cfg->value_size > LOAD_MAX_VALUE_SIZE) {
+    fprintf(stderr, "Error: Bad load parameters (need connections >= threads >= 1, depth >= 1).\n");
+    return -1;
+  }
+  memset(value, 'v', cfg->value_size);
+  value[cfg->value_size] = '\0';
+  memset(&state, 0, sizeof(state));
+
+  if (!(shards = kv_shards_new(cfg->host, cfg->port))) {
+    fprintf(stderr, "Error: Bad server list %s.\n", cfg->host);
+    return -1;
+  }
+  num_shards = kv_shards_count(shards);
+  num_conns = cfg->connections * num_shards;
+
+  if (cfg->read_pct > 0) {
+    if (!(kv = kv_open_shards(cfg->host, cfg->port, cfg->connections))) {
+      fprintf(stderr, "Error: Cannot connect to %s.\n", cfg->host);
+      kv_shards_free(shards);
+      return -1;
+    }
+    if (loadgen_preload(kv, cfg, value))
+      fprintf(stderr, "Warning: Some preload PUTs failed.\n");
+    kv_close(kv);
+  }
+
+  threads = (SatThread *) calloc(cfg->threads, sizeof(SatThread));
+  conns = (SatConn *) calloc(num_conns, sizeof(SatConn));
+  tids = (pthread_t *) calloc(cfg->threads, sizeof(pthread_t));
+  if (!threads || !conns || !tids) {
+    free(threads);
+    free(conns);
+    free(tids);
+    kv_shards_free(shards);
+    return -1;
+  }
+  for (k = 0; k < num_conns; k++)
+    conns[k].fd = -1;
+  for (t = 0; t < cfg->threads; t++) {
+    // Connections are dealt out in contiguous runs of whole rounds of the servers, so a thread reaches each one.
+    threads[t].cfg = cfg;
+    threads[t].value = value;
+    threads[t].shards = shards;
+    threads[t].num_shards = num_shards;
+    threads[t].conns = conns + (long) t * cfg->connections / cfg->threads * num_shards;
+    threads[t].num_conns = (int) ((long) (t + 1) * cfg->connections / cfg->threads -
+                                  (long) t * cfg->connections / cfg->threads) * num_shards;
+    // Any of its connections may end up holding all of the thread's requests in flight.
+    for (k = 0; k < threads[t].num_conns; k++)
+      threads[t].conns[k].cap = cfg->depth * threads[t].num_conns;
+  }
+  for (k = 0; k < num_conns; k++) {
+    conns[k].num = k;
+    conns[k].shard = k % num_shards;
+    conns[k].wcap = cfg->depth * SAT_MSG_SIZE;
+    conns[k].ids = (uint32_t *) malloc(conns[k].cap * sizeof(uint32_t));
+    conns[k].sent = (int64_t *) malloc(conns[k].cap * sizeof(int64_t));
+    conns[k].ops = (char *) malloc(conns[k].cap);
+    conns[k].wbuf = (char *) malloc(conns[k].wcap);
+    conns[k].rbuf = (char *) malloc(SAT_RBUF_SIZE);
+    host = kv_shards_endpoint(shards, conns[k].shard, &port);
+    if (!conns[k].ids || !conns[k].sent || !conns[k].ops || !conns[k].wbuf || !conns[k].rbuf ||
+        (conns[k].fd = kv_session_connect(host, port)) == -1) {
+      fprintf(stderr, "Error: Cannot open session %d to %s:%d.\n", k, host, port);
+      conns[k].fd = -1;
+      rc = -1;
+      break;
+    }
+  }
+
+  if (!rc) {
+    fprintf(stdout, "Saturation: %d s, %d threads, %d connections x %d in flight, %lu keys (%s), %d%% reads, %d-byte values\n",
+            cfg->seconds, cfg->threads, cfg->connections, cfg->depth, cfg->keys, dist[cfg->dist], cfg->read_pct, cfg->value_size);
+    if (num_shards > 1)
+      fprintf(stdout, "Servers: %d (keys spread by consistent hashing, %d connections each)\n", num_shards, cfg->connections);
+    fflush(stdout);
+
+    start = loadgen_now_ns();
+    for (k = 0; k < cfg->threads; k++) {
+      threads[k].end = start + (int64_t) cfg->seconds * 1000000000;
+      keygen_init(&threads[k].g, cfg, (cfg->seed ? cfg->seed : (uint64_t) start) + k * 7919);
+    }
+    for (k = 0; k < cfg->threads; k++)
+      pthread_create(&tids[k], NULL, sat_thread, &threads[k]);
+    for (k = 0; k < cfg->threads; k++) {
+      pthread_join(tids[k], NULL);
+      sent += threads[k].sent;
+      state.completed += threads[k].completed;
+      state.errors += threads[k].errors;
+    }
+    elapsed = (loadgen_now_ns() - start) / 1e9;
+
+    fprintf(stdout, "Sent: %llu  Completed: %llu  Errors: %llu  Throughput: %.1f req/s\n",
+            (unsigned long long) sent, (unsigned long long) state.completed,
+            (unsigned long long) state.errors, state.completed / elapsed);
+    fprintf(stdout, "Latency (us, send to reply): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.90) / 1e3, hist_percentile(h, 0.99) / 1e3,
+            hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    if (cfg->csv)
+      loadgen_csv(cfg, "saturate", elapsed, sent);
+    if (cfg->timestamps)
+      sat_timestamps(cfg, threads, start);
+  }
+
+  for (k = 0; k < num_conns; k++) {
+    if (conns[k].fd != -1)
+      close(conns[k].fd);
+    free(conns[k].ids);
+    free(conns[k].sent);
+    free(conns[k].ops);
+    free(conns[k].wbuf);
+    free(conns[k].rbuf);
+  }
+  for (k = 0; k < cfg->threads; k++)
+    free(threads[k].stamps);
+  free(threads);
+  free(conns);
+  free(tids);
+  kv_shards_free(shards);
+  return rc;
+}
@@ -0,0 +1,108 @@
+/* loadgen.h
+
+   Open-loop load generator for the key-value server.
+
+   Requests are issued at a target rate (Poisson arrivals) through the
+   client library, whether or not earlier ones have completed. Latency is
+   measured from each request's intended send time, not from when it was
+   actually sent, so a stalled server shows up in the percentiles instead
+   of silently lowering the offered load (coordinated omission).
+
+   Keys are drawn from a keyspace of 'keys' keys ("key.<n>") with a
+   uniform, Zipfian or hotspot distribution.
+
+   The saturation driver is closed loop instead: a few threads, each
+   with an epoll set, keep 'depth' requests in flight on every session
+   they drive, to find the highest throughput the server sustains.
+
+   Either one drives several servers as a single store if 'host' lists
+   them: each key goes to the server the client library's hash ring
+   (kv_shards_new()) maps it to.
+
+*/
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdint.h>
+
+#define LOAD_UNIFORM 0
+#define LOAD_ZIPF    1
+#define LOAD_HOTSPOT 2
+
+#define LOAD_MAX_VALUE_SIZE 1000  // The server keeps values of up to 1023 bytes.
+
+// Definition of a load run.
+typedef struct loadconfig {
+  const char *host;          // Server, or servers "host[:port],..." (keys spread by consistent hashing).
+  int port;                  // Port of the servers listed without one.
+  double rate;               // Target requests per second.
+  int seconds;               // Duration of the run.
+  int connections;           // Sessions in the client's pool (per server).
+  unsigned long keys;        // Keyspace size.
+  int dist;                  // LOAD_UNIFORM, LOAD_ZIPF or LOAD_HOTSPOT.
+  double zipf_theta;         // Zipfian skew (0 < theta < 1).
+  double hot_keys;           // Hotspot: fraction of keys that are hot ...
+  double hot_ops;            // ... and fraction of requests that go to them.
+  int read_pct;              // Percentage of GETs; the rest are PUTs.
+  int value_size;            // PUT value size in bytes.
+  const char *csv;           // Append a result row to this file (NULL: none).
+  int threads;               // Saturation: driver threads.
+  int depth;                 // Saturation: requests in flight per connection.
+  const char *timestamps;    // Saturation: write each request's send/receive times to this CSV (NULL: none).
+  uint64_t seed;             // Key (and arrival) sequence seed; 0 seeds from the clock.
+} LoadConfig;
+
+// Definition of a key generator.
+typedef struct keygen {
+  int dist;
+  unsigned long keys;
+  uint64_t rng;
+  double theta, zetan, alpha, eta, half_pow_theta;   // Zipfian.
+  unsigned long hot;                                 // Hotspot: keys [0, hot) are hot.
+  double hot_ops;
+} KeyGen;
+
+#define HIST_LINEAR   128  // Exact buckets for values below this ...
+#define HIST_HALF      64  // ... then this many buckets per power of two (< 1.6% error).
+#define HIST_BUCKETS  (HIST_LINEAR + 48 * HIST_HALF)
+
+// Definition of a latency histogram (log-linear buckets, in ns). Safe to record from many threads.
+typedef struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+} Histogram;
+
+// set the defaults: 1000 req/s for 10 s, 4 connections, 10000 uniform keys, 90% reads, 16-byte values;
+// saturation: 2 threads, 16 requests in flight per connection.
+void loadgen_defaults(LoadConfig *cfg);
+
+// parse "uniform", "zipf[:theta]" or "hotspot[:hot_keys[:hot_ops]]" into 'cfg'. 0 on success.
+int loadgen_parse_dist(LoadConfig *cfg, const char *spec);
+
+// run the load described by 'cfg' and print the results. 0 on success.
+int loadgen_run(const LoadConfig *cfg);
+
+// run the saturation driver described by 'cfg' and print the results. 0 on success.
+int loadgen_saturate(const LoadConfig *cfg);
+
+// key generator for 'cfg', seeded with 'seed'.
+void keygen_init(KeyGen *g, const LoadConfig *cfg, uint64_t seed);
+
+// next key number, in [0, keys).
+unsigned long keygen_next(KeyGen *g);
+
+// uniform random number in [0, 1).
+double keygen_uniform(KeyGen *g);
+
+// record a value (ns).
+void hist_record(Histogram *h, uint64_t ns);
+
+// value (ns) below which 'p' (0..1) of the recorded values fall.
+uint64_t hist_percentile(const Histogram *h, double p);
+
+// monotonic clock (ns).
+int64_t loadgen_now_ns();
+
+#endif
@@ -0,0 +1,1449 @@
+/* lsm.c
+
+   Log-structured storage engine: a logged memtable, sorted immutable runs
+   with Bloom filters, and background flushes and compactions. See lsm.h.
+
+   Compile with LSM_TEST to build as a test program.
+
+*/
+
+#define _GNU_SOURCE                 // qsort_r().
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lsm.h"
+
+#define LSM_MAGIC       0x6b766c72u   // "kvlr"
+#define LSM_VERSION     2
+#define LSM_BUCKETS     (2 * LSM_MEMTABLE)   // Memtable buckets (a power of 2).
+#define LSM_READ_PAIRS  256            // Pairs read at once when a run is merged.
+
+// Records (memtables, logs and runs) are the key, the value, then a byte: LSM_TOMBSTONE if the key was deleted.
+#define LSM_TOMBSTONE   1
+
+// Definition of a run file's header. The sorted records follow, then the Bloom filter, then the sparse index.
+typedef struct lsmheader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t count;                      // Pairs.
+  uint64_t key_size;
+  uint64_t value_size;
+  uint64_t bloom_words;                // 64-bit words of the Bloom filter.
+  uint64_t index_count;                // Keys of the sparse index.
+} LSMHeader;
+
+// Definition of a memtable pair, chained in its bucket.
+typedef struct lsmentry {
+  struct lsmentry *next;
+  uint64_t hash;
+  char data[];                         // The record: the key, the value, the tombstone byte.
+} LSMEntry;
+
+// Definition of a memtable: a hash table, and the log of its PUTs.
+typedef struct memtable {
+  LSMEntry **buckets;
+  unsigned long count;
+  unsigned long wal;                   // Number of its log (<path>.wal.<wal>).
+  FILE *log;                           // NULL once it's frozen.
+} MemTable;
+
+// Definition of a run, as kept open.
+typedef struct lsmrun {
+  uint64_t id;                         // <path>.run.<id>
+  int refs;                            // The engine's, and one per range cursor reading it.
+  int fd;
+  uint64_t count;
+  uint64_t *bloom;
+  uint64_t bloom_bits;
+  char *index;                         // Keys number 0, LSM_INDEX_EVERY, 2 * LSM_INDEX_EVERY, ...
+  uint64_t index_count;
+} LSMRun;
+
+// Definition of a sorted input of a merge: a memtable's pairs, or a run read in order.
+typedef struct lsmsource {
+  const char *rec;                     // Its current pair (NULL when it's done).
+  LSMEntry **items;                    // Memtable: its pairs, sorted.
+  unsigned long num, next;
+  LSMRun *run;                         // Run: 'buf' holds pairs [done - buf_len, done).
+  char *buf;
+  uint64_t buf_len, buf_pos, done;
+} LSMSource;
+
+// Definition of a run being written by a merge.
+typedef struct lsmwriter {
+  struct lsm *l;
+  FILE *f;
+  LSMRun *run;
+  uint64_t max;                        // At most this many pairs (sizes the filter and the index).
+  int drop;                            // Leave tombstones out (a merge of the oldest runs: nothing older to hide).
+} LSMWriter;
+
+// Definition of a range cursor: a merge of the memtables' pairs in the range (copied) and of the runs (held).
+struct lsmrange {
+  struct lsm *l;
+  LSMSource *srcs;                     // Newest first.
+  int n, done;
+  LSMRun **runs;
+  int num_runs;
+  char *copies[2];                     // The memtables' pairs in the range, as LSMEntry's 'items' point to.
+  LSMEntry **items[2];
+  char *lo, *hi, *rec;
+  unsigned long prefix_len;
+};
+
+struct lsm {
+  char *path;
+  unsigned long key_size;
+  unsigned long value_size;
+  unsigned long rec;                   // key_size + value_size + 1.
+  pthread_rwlock_t lock;               // Guards 'mem', 'imm' and 'runs'; GETs hold it while they read the runs.
+  pthread_mutex_t write_mutx;          // Serializes PUTs: the log, then the memtable.
+  pthread_mutex_t maint_mutx;          // Guards the manifest and 'stop'; 'imm' and 'runs' change holding both.
+  pthread_cond_t flushed;              // 'imm' was flushed.
+  pthread_cond_t work;                 // A memtable to flush, or runs to compact.
+  MemTable *mem, *imm;                 // The memtable taking the PUTs, and the frozen one being flushed.
+  LSMRun **runs;                       // Oldest first.
+  int num_runs, cap_runs;
+  uint64_t next_run;
+  unsigned long flushed_wal;           // The last log whose pairs are all in runs.
+  unsigned long flushes, compactions;
+  int stop;
+  int threads;
+  pthread_t flusher, compactor;
+};
+
+// FNV-1a over the whole key: the memtable's buckets and the Bloom filters' bits.
+static uint64_t lsm_hash(const void *key, unsigned long len) {
+  const unsigned char *p = (const unsigned char *) key;
+  uint64_t h = 14695981039346656037ULL;
+  unsigned long i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Bit 'k' of the Bloom filter for 'hash' (double hashing).
+static uint64_t lsm_bloom_bit(uint64_t hash, int k, uint64_t bits) {
+  return (hash + (uint64_t) k * ((hash >> 32) | 1)) % bits;
+}
+
+static int lsm_cmp_entries(const void *a, const void *b, void *key_size) {
+  return memcmp((*(LSMEntry * const *) a)->data, (*(LSMEntry * const *) b)->data, *(unsigned long *) key_size);
+}
+
+static void lsm_file(LSM *l, char *buf, const char *kind, uint64_t n) {
+  sprintf(buf, "%s.%s.%llu", l->path, kind, (unsigned long long) n);
+}
+
+// Times out a wait on 'cond' after 'sec' seconds.
+static void lsm_wait(pthread_cond_t *cond, pthread_mutex_t *mutx, int sec) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += sec;
+  pthread_cond_timedwait(cond, mutx, &until);
+}
+
+/* Memtables */
+
+// A new memtable, logging to <path>.wal.<wal> (truncated) if 'logged'.
+static MemTable *mt_new(LSM *l, unsigned long wal, int logged) {
+  char name[strlen(l->path) + 32];
+  MemTable *mt;
+
+  if (!(mt = (MemTable *) calloc(1, sizeof(MemTable))))
+    return NULL;
+  mt->wal = wal;
+  lsm_file(l, name, "wal", wal);
+  if (!(mt->buckets = (LSMEntry **) calloc(LSM_BUCKETS, sizeof(LSMEntry *))) || (logged && !(mt->log = fopen(name, "wb")))) {
+    free(mt->buckets);
+    free(mt);
+    return NULL;
+  }
+  return mt;
+}
+
+static LSMEntry *mt_find(LSM *l, MemTable *mt, const void *key, uint64_t hash) {
+  LSMEntry *e;
+
+  for (e = mt->buckets[hash & (LSM_BUCKETS - 1)]; e; e = e->next) {
+    if (e->hash == hash && !memcmp(e->data, key, l->key_size))
+      return e;
+  }
+  return NULL;
+}
+
+static int mt_put(LSM *l, MemTable *mt, const char *rec, uint64_t hash) {
+  LSMEntry *e;
+
+  if (!(e = mt_find(l, mt, rec, hash))) {
+    if (!(e = (LSMEntry *) malloc(sizeof(LSMEntry) + l->rec)))
+      return -1;
+    e->hash = hash;
+    e->next = mt->buckets[hash & (LSM_BUCKETS - 1)];
+    mt->buckets[hash & (LSM_BUCKETS - 1)] = e;
+    mt->count++;
+  }
+  memcpy(e->data, rec, l->rec);
+  return 0;
+}
+
+// Its pairs, sorted by key (a new array). NULL on Error, or if it's empty.
+static LSMEntry **mt_sorted(LSM *l, MemTable *mt) {
+  LSMEntry **items, *e;
+  unsigned long k, n = 0;
+
+  if (!mt->count || !(items = (LSMEntry **) malloc(mt->count * sizeof(LSMEntry *))))
+    return NULL;
+  for (k = 0; k < LSM_BUCKETS; k++) {
+    for (e = mt->buckets[k]; e; e = e->next)
+      items[n++] = e;
+  }
+  qsort_r(items, n, sizeof(LSMEntry *), lsm_cmp_entries, &l->key_size);
+  return items;
+}
+
+static void mt_free(MemTable *mt) {
+  LSMEntry *e, *next;
+  unsigned long k;
+
+  if (!mt)
+    return;
+  for (k = 0; k < LSM_BUCKETS; k++) {
+    for (e = mt->buckets[k]; e; e = next) {
+      next = e->next;
+      free(e);
+    }
+  }
+  if (mt->log)
+    fclose(mt->log);
+  free(mt->buckets);
+  free(mt);
+}
+
+/* Runs */
+
+static void run_free(LSMRun *run) {
+  if (!run)
+    return;
+  if (run->fd != -1)
+    close(run->fd);
+  free(run->bloom);
+  free(run->index);
+  free(run);
+}
+
+// Drops a reference to a run, freeing it with the last one.
+static void run_unref(LSMRun *run) {
+  if (run && !__sync_sub_and_fetch(&run->refs, 1))
+    run_free(run);
+}
+
+// Opens run 'id': reads its header, Bloom filter and sparse index. NULL on Error.
+static LSMRun *run_open(LSM *l, uint64_t id) {
+  char name[strlen(l->path) + 32];
+  LSMHeader h;
+  LSMRun *run;
+  off_t off;
+
+  if (!(run = (LSMRun *) calloc(1, sizeof(LSMRun))))
+    return NULL;
+  run->id = id;
+  run->refs = 1;
+  lsm_file(l, name, "run", id);
+  if ((run->fd = open(name, O_RDONLY)) == -1 || pread(run->fd, &h, sizeof(h), 0) != sizeof(h) ||
+      h.magic != LSM_MAGIC || h.version != LSM_VERSION || h.key_size != l->key_size || h.value_size != l->value_size ||
+      !h.bloom_words) {
+    fprintf(stderr, "(Error) lsm: Cannot read run '%s'.\n", name);
+    run_free(run);
+    return NULL;
+  }
+  run->count = h.count;
+  run->bloom_bits = h.bloom_words * 64;
+  run->index_count = h.index_count;
+  off = sizeof(LSMHeader) + h.count * l->rec;
+  if (!(run->bloom = (uint64_t *) malloc(h.bloom_words * 8)) ||
+      !(run->index = (char *) malloc(h.index_count * l->key_size + 1)) ||
+      pread(run->fd, run->bloom, h.bloom_words * 8, off) != (ssize_t) (h.bloom_words * 8) ||
+      pread(run->fd, run->index, h.index_count * l->key_size, off + h.bloom_words * 8) !=
+      (ssize_t) (h.index_count * l->key_size)) {
+    fprintf(stderr, "(Error) lsm: Cannot read the filter and index of run '%s'.\n", name);
+    run_free(run);
+    return NULL;
+  }
+  return run;
+}
+
+// Looks 'key' up in a run. 0 if found (its value copied), 1 if not, 2 if deleted there, -1 on Error.
+static int run_get(LSM *l, LSMRun *run, const void *key, uint64_t hash, void *value) {
+  char block[LSM_INDEX_EVERY * l->rec];
+  uint64_t lo = 0, hi = run->index_count, mid, first, n, k;
+  int k_hash, c;
+
+  for (k_hash = 0; k_hash < LSM_BLOOM_HASHES; k_hash++) {
+    mid = lsm_bloom_bit(hash, k_hash, run->bloom_bits);
+    if (!(run->bloom[mid / 64] & (1ULL << (mid % 64))))
+      return 1;                     // Surely not in this run.
+  }
+
+  // The last index key <= key starts the only block that may hold it.
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (memcmp(run->index + mid * l->key_size, key, l->key_size) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!lo)
+    return 1;
+  first = (lo - 1) * LSM_INDEX_EVERY;
+  n = run->count - first < LSM_INDEX_EVERY ? run->count - first : LSM_INDEX_EVERY;
+  if (pread(run->fd, block, n * l->rec, sizeof(LSMHeader) + first * l->rec) != (ssize_t) (n * l->rec))
+    return -1;
+  for (k = 0; k < n; k++) {
+    if (!(c = memcmp(block + k * l->rec, key, l->key_size))) {
+      if (block[k * l->rec + l->rec - 1] == LSM_TOMBSTONE)
+        return 2;
+      memcpy(value, block + k * l->rec + l->key_size, l->value_size);
+      return 0;
+    }
+    if (c > 0)
+      break;
+  }
+  return 1;
+}
+
+/* Merges */
+
+// Moves a source to its next pair. 0 on Success. -1 on Error.
+static int src_next(LSM *l, LSMSource *s) {
+  uint64_t n;
+
+  if (s->items) {
+    s->rec = s->next < s->num ? s->items[s->next++]->data : NULL;
+    return 0;
+  }
+  if (s->buf_pos >= s->buf_len) {
+    s->rec = NULL;
+    if (s->done >= s->run->count)
+      return 0;
+    n = s->run->count - s->done < LSM_READ_PAIRS ? s->run->count - s->done : LSM_READ_PAIRS;
+    if (pread(s->run->fd, s->buf, n * l->rec, sizeof(LSMHeader) + s->done * l->rec) != (ssize_t) (n * l->rec))
+      return -1;
+    s->done += n;
+    s->buf_len = n;
+    s->buf_pos = 0;
+  }
+  s->rec = s->buf + l->rec * s->buf_pos++;
+  return 0;
+}
+
+// Starts a source on a memtable's sorted pairs, or on a run. 0 on Success. -1 on Error.
+static int src_init(LSM *l, LSMSource *s, LSMEntry **items, unsigned long num, LSMRun *run) {
+  memset(s, 0, sizeof(LSMSource));
+  s->items = items;
+  s->num = num;
+  s->run = run;
+  if (run && !(s->buf = (char *) malloc(LSM_READ_PAIRS * l->rec)))
+    return -1;
+  return src_next(l, s);
+}
+
+// Starts a source on a run at its first pair >= 'key', found with the sparse index. 0 on Success. -1 on Error.
+static int src_seek(LSM *l, LSMSource *s, LSMRun *run, const char *key) {
+  uint64_t lo = 0, hi = run->index_count, mid;
+
+  // The last index key < key starts the first block that may hold a pair >= key.
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (memcmp(run->index + mid * l->key_size, key, l->key_size) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  memset(s, 0, sizeof(LSMSource));
+  s->run = run;
+  s->done = lo ? (lo - 1) * LSM_INDEX_EVERY : 0;
+  if (!(s->buf = (char *) malloc(LSM_READ_PAIRS * l->rec)))
+    return -1;
+  do {
+    if (src_next(l, s))
+      return -1;
+  } while (s->rec && memcmp(s->rec, key, l->key_size) < 0);
+  return 0;
+}
+
+// Copies the next pair of a merge of sorted sources (newest first) to 'rec': of a key in several, only the newest.
+// 1 if copied, 0 at the end, -1 on Error.
+static int merge_next(LSM *l, LSMSource *srcs, int n, char *rec) {
+  int k, best;
+
+  for (k = 0, best = -1; k < n; k++) {
+    if (srcs[k].rec && (best < 0 || memcmp(srcs[k].rec, srcs[best].rec, l->key_size) < 0))
+      best = k;
+  }
+  if (best < 0)
+    return 0;
+  memcpy(rec, srcs[best].rec, l->rec);
+  for (k = 0; k < n; k++) {         // Each source holds a key once.
+    if (srcs[k].rec && !memcmp(srcs[k].rec, rec, l->key_size) && src_next(l, &srcs[k]))
+      return -1;
+  }
+  return 1;
+}
+
+// Merges sorted sources, newest first, into 'emit' in key order: of a key in several, only the newest pair.
+static int lsm_merge(LSM *l, LSMSource *srcs, int n, int (*emit)(void *arg, const char *rec), void *arg) {
+  char rec[l->rec];
+  int rc;
+
+  while ((rc = merge_next(l, srcs, n, rec)) > 0) {
+    if (emit(arg, rec))
+      return -1;
+  }
+  return rc;
+}
+
+static void src_free(LSMSource *srcs, int n) {
+  int k;
+
+  for (k = 0; k < n; k++)
+    free(srcs[k].buf);
+}
+
+// Adds a pair to the run being written: the file, the Bloom filter and every LSM_INDEX_EVERY-th key to the index.
+static int run_emit(void *arg, const char *rec) {
+  LSMWriter *w = (LSMWriter *) arg;
+  LSMRun *run = w->run;
+  uint64_t hash = lsm_hash(rec, w->l->key_size), bit;
+  int k;
+
+  if (w->drop && rec[w->l->rec - 1] == LSM_TOMBSTONE)
+    return 0;
+  if (run->count >= w->max || fwrite(rec, w->l->rec, 1, w->f) != 1)
+    return -1;
+  for (k = 0; k < LSM_BLOOM_HASHES; k++) {
+    bit = lsm_bloom_bit(hash, k, run->bloom_bits);
+    run->bloom[bit / 64] |= 1ULL << (bit % 64);
+  }
+  if (run->count % LSM_INDEX_EVERY == 0)
+    memcpy(run->index + w->l->key_size * run->index_count++, rec, w->l->key_size);
+  run->count++;
+  return 0;
+}
+
+// Writes run 'id' with the merged records of 'srcs' (newest first, at most 'max' of them) and opens it. NULL on Error.
+static LSMRun *run_write(LSM *l, uint64_t id, LSMSource *srcs, int n, uint64_t max, int drop) {
+  char name[strlen(l->path) + 32];
+  LSMWriter w;
+  LSMHeader h;
+  LSMRun *run;
+  int rc;
+
+  if (!(run = (LSMRun *) calloc(1, sizeof(LSMRun))))
+    return NULL;
+  run->id = id;
+  run->refs = 1;
+  run->fd = -1;
+  run->bloom_bits = ((max * LSM_BLOOM_BITS + 63) / 64) * 64;
+  if (!run->bloom_bits)
+    run->bloom_bits = 64;
+  lsm_file(l, name, "run", id);
+  if (!(run->bloom = (uint64_t *) calloc(run->bloom_bits / 64, 8)) ||
+      !(run->index = (char *) malloc((max / LSM_INDEX_EVERY + 1) * l->key_size)) ||
+      !(w.f = fopen(name, "wb"))) {
+    run_free(run);
+    return NULL;
+  }
+  w.l = l;
+  w.run = run;
+  w.max = max;
+  w.drop = drop;
+
+  // The header once the counts are known; the pairs, then the filter and the index.
+  memset(&h, 0, sizeof(h));
+  rc = fseek(w.f, sizeof(LSMHeader), SEEK_SET) || lsm_merge(l, srcs, n, run_emit, &w);
+  h.magic = LSM_MAGIC;
+  h.version = LSM_VERSION;
+  h.count = run->count;
+  h.key_size = l->key_size;
+  h.value_size = l->value_size;
+  h.bloom_words = run->bloom_bits / 64;
+  h.index_count = run->index_count;
+  if (rc || fwrite(run->bloom, 8, h.bloom_words, w.f) != h.bloom_words ||
+      (h.index_count && fwrite(run->index, l->key_size, h.index_count, w.f) != h.index_count) ||
+      fseek(w.f, 0, SEEK_SET) || fwrite(&h, sizeof(h), 1, w.f) != 1 || fflush(w.f) || fsync(fileno(w.f))) {
+    fclose(w.f);
+    unlink(name);
+    run_free(run);
+    return NULL;
+  }
+  fclose(w.f);
+  if ((run->fd = open(name, O_RDONLY)) == -1) {
+    run_free(run);
+    return NULL;
+  }
+  return run;
+}
+
+/* The manifest */
+
+// Writes the manifest: the live runs, oldest first, and the last log that's in them. Called holding 'maint_mutx'.
+static int lsm_save_manifest(LSM *l) {
+  char name[strlen(l->path) + 16], tmp[strlen(l->path) + 16];
+  FILE *f;
+  int k, rc;
+
+  sprintf(name, "%s.lsm", l->path);
+  sprintf(tmp, "%s.lsm.tmp", l->path);
+  if (!(f = fopen(tmp, "w")))
+    return -1;
+  fprintf(f, "kvlsm %d\nsizes %lu %lu\nnext_run %llu\nwal %lu\n", LSM_VERSION, l->key_size, l->value_size,
+          (unsigned long long) l->next_run, l->flushed_wal);
+  for (k = 0; k < l->num_runs; k++)
+    fprintf(f, "run %llu\n", (unsigned long long) l->runs[k]->id);
+  rc = fflush(f) || fsync(fileno(f));
+  if (fclose(f) || rc || rename(tmp, name)) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// Adds a run as the newest. Called holding 'maint_mutx' and the write lock.
+static int lsm_add_run(LSM *l, LSMRun *run) {
+  LSMRun **runs;
+
+  if (l->num_runs == l->cap_runs) {
+    if (!(runs = (LSMRun **) realloc(l->runs, (l->cap_runs ? 2 * l->cap_runs : 8) * sizeof(LSMRun *))))
+      return -1;
+    l->runs = runs;
+    l->cap_runs = l->cap_runs ? 2 * l->cap_runs : 8;
+  }
+  l->runs[l->num_runs++] = run;
+  return 0;
+}
+
+// Writes a frozen memtable out as the newest run and drops its log. 0 on Success. -1 on Error.
+static int lsm_flush(LSM *l, MemTable *mt) {
+  char name[strlen(l->path) + 32];
+  LSMSource src;
+  LSMEntry **items;
+  LSMRun *run = NULL;
+  uint64_t id;
+  int rc = -1;
+
+  if (!(items = mt_sorted(l, mt)) && mt->count)
+    return -1;
+  pthread_mutex_lock(&l->maint_mutx);
+  id = l->next_run++;
+  pthread_mutex_unlock(&l->maint_mutx);
+  if (mt->count && (src_init(l, &src, items, mt->count, NULL) || !(run = run_write(l, id, &src, 1, mt->count, 0)))) {
+    free(items);
+    return -1;
+  }
+  free(items);
+
+  pthread_mutex_lock(&l->maint_mutx);
+  pthread_rwlock_wrlock(&l->lock);
+  if (!run || !lsm_add_run(l, run)) {
+    l->flushed_wal = mt->wal;
+    if (l->imm == mt)
+      l->imm = NULL;
+    rc = 0;
+  }
+  pthread_rwlock_unlock(&l->lock);
+  if (!rc) {
+    if (lsm_save_manifest(l))
+      fprintf(stderr, "(Error) lsm_flush: Cannot write the manifest of '%s'.\n", l->path);
+    if (run)
+      l->flushes++;
+    pthread_cond_broadcast(&l->flushed);
+    pthread_cond_broadcast(&l->work);
+  }
+  pthread_mutex_unlock(&l->maint_mutx);
+  if (rc) {
+    run_free(run);
+    return -1;
+  }
+  lsm_file(l, name, "wal", mt->wal);
+  unlink(name);
+  mt_free(mt);
+  return 0;
+}
+
+// The newest runs of similar size: going back from the newest, each older run while it holds at most LSM_SIZE_RATIO
+// times the pairs of the newer ones picked. Returns how many, if at least LSM_MAX_RUNS (else 0), and sets '*first' to
+// the oldest one's index. Called holding 'maint_mutx'.
+static int lsm_pick(LSM *l, int *first) {
+  uint64_t newer = 0;
+  int k;
+
+  for (k = l->num_runs - 1; k >= 0 && (k == l->num_runs - 1 || l->runs[k]->count <= LSM_SIZE_RATIO * newer); k--)
+    newer += l->runs[k]->count;
+  *first = k + 1;
+  return (l->num_runs - *first >= LSM_MAX_RUNS) ? l->num_runs - *first : 0;
+}
+
+// Merges the 'n' runs from index 'first' (lsm_pick()) into one, which takes their place. The deleted keys are left out
+// if they include the oldest run. 0 on Success. -1 on Error.
+static int lsm_compact(LSM *l, int first, int n) {
+  char name[strlen(l->path) + 32];
+  LSMSource *srcs;
+  LSMRun *run, **old;
+  uint64_t id, max = 0;
+  int k, rc = 0;
+
+  // Only this thread removes runs: these stay where they are, and unchanged, until the swap.
+  pthread_rwlock_rdlock(&l->lock);
+  old = (LSMRun **) malloc(n * sizeof(LSMRun *));
+  srcs = (LSMSource *) calloc(n, sizeof(LSMSource));
+  for (k = 0; old && k < n; k++) {
+    old[k] = l->runs[first + k];
+    max += old[k]->count;
+  }
+  pthread_rwlock_unlock(&l->lock);
+  if (!old || !srcs) {
+    free(old);
+    free(srcs);
+    return -1;
+  }
+  for (k = 0; k < n && !rc; k++)
+    rc = src_init(l, &srcs[k], NULL, 0, old[n - 1 - k]);   // Newest first.
+  pthread_mutex_lock(&l->maint_mutx);
+  id = l->next_run++;
+  pthread_mutex_unlock(&l->maint_mutx);
+  run = rc ? NULL : run_write(l, id, srcs, n, max, !first);
+  src_free(srcs, n);
+  free(srcs);
+  if (!run) {
+    free(old);
+    return -1;
+  }
+
+  // Swap it in for them; GETs still reading them hold the lock, so they're closed after.
+  pthread_mutex_lock(&l->maint_mutx);
+  pthread_rwlock_wrlock(&l->lock);
+  l->runs[first] = run;
+  memmove(l->runs + first + 1, l->runs + first + n, (l->num_runs - first - n) * sizeof(LSMRun *));
+  l->num_runs -= n - 1;
+  l->compactions++;
+  pthread_rwlock_unlock(&l->lock);
+  if (lsm_save_manifest(l))
+    fprintf(stderr, "(Error) lsm_compact: Cannot write the manifest of '%s'.\n", l->path);
+  pthread_mutex_unlock(&l->maint_mutx);
+
+  fprintf(stderr, "(Info) lsm_compact: Merged %d runs into one of %llu pairs (%d older runs left alone).\n", n,
+          (unsigned long long) run->count, first);
+  for (k = 0; k < n; k++) {         // Range cursors still reading one hold it (and its open file).
+    lsm_file(l, name, "run", old[k]->id);
+    unlink(name);
+    run_unref(old[k]);
+  }
+  free(old);
+  return 0;
+}
+
+static void *lsm_flusher(void *arg) {
+  LSM *l = (LSM *) arg;
+  MemTable *mt;
+
+  pthread_mutex_lock(&l->maint_mutx);
+  while (!l->stop) {
+    if (!(mt = l->imm)) {
+      pthread_cond_wait(&l->work, &l->maint_mutx);
+      continue;
+    }
+    pthread_mutex_unlock(&l->maint_mutx);
+    if (lsm_flush(l, mt)) {
+      fprintf(stderr, "(Error) lsm_flusher: Cannot flush a memtable of '%s'; retrying.\n", l->path);
+      pthread_mutex_lock(&l->maint_mutx);
+      lsm_wait(&l->work, &l->maint_mutx, 1);
+      continue;
+    }
+    pthread_mutex_lock(&l->maint_mutx);
+  }
+  pthread_mutex_unlock(&l->maint_mutx);
+  return NULL;
+}
+
+static void *lsm_compactor(void *arg) {
+  LSM *l = (LSM *) arg;
+  int first, n;
+
+  pthread_mutex_lock(&l->maint_mutx);
+  while (!l->stop) {
+    if (!(n = lsm_pick(l, &first))) {
+      pthread_cond_wait(&l->work, &l->maint_mutx);
+      continue;
+    }
+    pthread_mutex_unlock(&l->maint_mutx);
+    if (lsm_compact(l, first, n)) {
+      fprintf(stderr, "(Error) lsm_compactor: Cannot compact the runs of '%s'; retrying.\n", l->path);
+      pthread_mutex_lock(&l->maint_mutx);
+      lsm_wait(&l->work, &l->maint_mutx, 1);
+      continue;
+    }
+    pthread_mutex_lock(&l->maint_mutx);
+  }
+  pthread_mutex_unlock(&l->maint_mutx);
+  return NULL;
+}
+
+/**
+ * @name lsm_get - Copies the value of a key: from the memtables, else from the newest run that has it (or its tombstone).
+ * @param l: The engine.
+ * @param key: The key (key_size bytes).
+ * @param value: Receives the value (value_size bytes).
+ *
+ * @return 0 on Success. 1 if the key isn't there. -1 on Error.
+ */
+int lsm_get(LSM *l, const void *key, void *value) {
+  uint64_t hash = lsm_hash(key, l->key_size);
+  LSMEntry *e;
+  int k, rc = 1;
+
+  pthread_rwlock_rdlock(&l->lock);
+  if ((e = mt_find(l, l->mem, key, hash)) || (l->imm && (e = mt_find(l, l->imm, key, hash)))) {
+    if (e->data[l->rec - 1] == LSM_TOMBSTONE) {
+      rc = 2;
+    } else {
+      memcpy(value, e->data + l->key_size, l->value_size);
+      rc = 0;
+    }
+  }
+  for (k = l->num_runs - 1; k >= 0 && rc == 1; k--)
+    rc = run_get(l, l->runs[k], key, hash, value);
+  pthread_rwlock_unlock(&l->lock);
+  return rc == 2 ? 1 : rc;
+}
+
+// Logs a record and puts it in the memtable: 'key' = 'value', or (NULL) its tombstone if the key is there.
+static int lsm_write(LSM *l, const void *key, const void *value) {
+  uint64_t hash = lsm_hash(key, l->key_size);
+  char rec[l->rec], old[l->value_size];
+  MemTable *mt;
+  int rc;
+
+  memcpy(rec, key, l->key_size);
+  if (value)
+    memcpy(rec + l->key_size, value, l->value_size);
+  else
+    memset(rec + l->key_size, 0, l->value_size);
+  rec[l->rec - 1] = value ? 0 : LSM_TOMBSTONE;
+
+  pthread_mutex_lock(&l->write_mutx);
+  if (!value && (rc = lsm_get(l, key, old))) {   // Nothing to delete (PUTs wait: no race).
+    pthread_mutex_unlock(&l->write_mutx);
+    return rc;
+  }
+  if (l->mem->count >= LSM_MEMTABLE) {
+    pthread_mutex_lock(&l->maint_mutx);
+    while (l->imm && l->threads && !l->stop)
+      pthread_cond_wait(&l->flushed, &l->maint_mutx);
+    if (l->imm || !(mt = mt_new(l, l->mem->wal + 1, 1))) {
+      pthread_mutex_unlock(&l->maint_mutx);
+      pthread_mutex_unlock(&l->write_mutx);
+      return -1;
+    }
+    pthread_rwlock_wrlock(&l->lock);
+    l->imm = l->mem;
+    l->mem = mt;
+    pthread_rwlock_unlock(&l->lock);
+    fclose(l->imm->log);
+    l->imm->log = NULL;
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->maint_mutx);
+  }
+
+  // The log first (GETs go on meanwhile), then the memtable.
+  if (fwrite(rec, l->rec, 1, l->mem->log) != 1 || fflush(l->mem->log)) {
+    pthread_mutex_unlock(&l->write_mutx);
+    return -1;
+  }
+  pthread_rwlock_wrlock(&l->lock);
+  rc = mt_put(l, l->mem, rec, hash);
+  pthread_rwlock_unlock(&l->lock);
+  pthread_mutex_unlock(&l->write_mutx);
+  return rc;
+}
+
+/**
+ * @name lsm_put - Logs a pair and puts it in the memtable, freezing the memtable first if it's full.
+ * @param l: The engine.
+ * @param key: The key (key_size bytes).
+ * @param value: The value (value_size bytes).
+ *
+ * A full memtable waits for the flush of the one frozen before it: the flusher sets the pace.
+ * @return 0 on Success. -1 on Error.
+ */
+int lsm_put(LSM *l, const void *key, const void *value) {
+  return lsm_write(l, key, value);
+}
+
+/**
+ * @name lsm_delete - Logs a tombstone for a key and puts it in the memtable, like a PUT.
+ * @param l: The engine.
+ * @param key: The key (key_size bytes).
+ *
+ * The tombstone hides the key's older pairs, in the runs, until a compaction that reaches the oldest run drops both.
+ * @return 0 on Success. 1 if the key isn't there. -1 on Error.
+ */
+int lsm_delete(LSM *l, const void *key) {
+  return lsm_write(l, key, NULL);
+}
+
+// Collects the pairs of a merge into a growing array, without the tombstones.
+typedef struct lsmcopy {
+  char *pairs;
+  unsigned long num, cap, rec;         // 'rec': key_size + value_size (the records' tombstone byte is left out).
+} LSMCopy;
+
+static int copy_emit(void *arg, const char *rec) {
+  LSMCopy *c = (LSMCopy *) arg;
+  char *pairs;
+
+  if (rec[c->rec] == LSM_TOMBSTONE)
+    return 0;
+  if (c->num == c->cap) {
+    if (!(pairs = (char *) realloc(c->pairs, (c->cap ? 2 * c->cap : 1024) * c->rec)))
+      return -1;
+    c->pairs = pairs;
+    c->cap = c->cap ? 2 * c->cap : 1024;
+  }
+  memcpy(c->pairs + c->num++ * c->rec, rec, c->rec);
+  return 0;
+}
+
+/**
+ * @name lsm_copy - Copies all pairs in key order, as they are at one point in time.
+ * @param l: The engine.
+ * @param pairs: Gets a new array of records, each the key then the value (NULL if there are none).
+ * @param num: Gets the number of records.
+ *
+ * Holds the read lock throughout: PUTs wait for the copy, GETs don't.
+ * @return 0 on Success. -1 on Error.
+ */
+int lsm_copy(LSM *l, char **pairs, unsigned long *num) {
+  LSMSource *srcs;
+  LSMEntry **items[2] = { NULL, NULL };
+  MemTable *mts[2];
+  LSMCopy c;
+  int k, n = 0, rc = 0;
+
+  memset(&c, 0, sizeof(c));
+  c.rec = l->key_size + l->value_size;
+  pthread_rwlock_rdlock(&l->lock);
+  mts[0] = l->mem;
+  mts[1] = l->imm;
+  if (!(srcs = (LSMSource *) calloc(l->num_runs + 2, sizeof(LSMSource)))) {
+    pthread_rwlock_unlock(&l->lock);
+    return -1;
+  }
+  for (k = 0; k < 2 && !rc; k++) {
+    if (!mts[k] || !mts[k]->count)
+      continue;
+    if (!(items[k] = mt_sorted(l, mts[k])) || src_init(l, &srcs[n++], items[k], mts[k]->count, NULL))
+      rc = -1;
+  }
+  for (k = l->num_runs - 1; k >= 0 && !rc; k--)
+    rc = src_init(l, &srcs[n++], NULL, 0, l->runs[k]);
+  if (!rc)
+    rc = lsm_merge(l, srcs, n, copy_emit, &c);
+  pthread_rwlock_unlock(&l->lock);
+
+  src_free(srcs, n);
+  free(srcs);
+  free(items[0]);
+  free(items[1]);
+  if (rc) {
+    free(c.pairs);
+    return -1;
+  }
+  *pairs = c.pairs;
+  *num = c.num;
+  return 0;
+}
+
+// Whether a key is past the end of a range.
+static int range_past(LSMRange *r, const char *key) {
+  return r->prefix_len ? memcmp(key, r->lo, r->prefix_len) > 0 : memcmp(key, r->hi, r->l->key_size) > 0;
+}
+
+// Copies the pairs of a memtable in the range, sorted, as merge source 'k'. Called holding the read lock. 0 on Success.
+// -1 on Error.
+static int range_memtable(LSMRange *r, MemTable *mt, int k) {
+  LSM *l = r->l;
+  const unsigned long size = (sizeof(LSMEntry) + l->rec + 7) & ~7UL;
+  unsigned long b, num = 0;
+  LSMEntry *e, *copy;
+
+  for (b = 0; b < LSM_BUCKETS; b++) {
+    for (e = mt->buckets[b]; e; e = e->next)
+      num += (memcmp(e->data, r->lo, l->key_size) >= 0 && !range_past(r, e->data));
+  }
+  if (!num)
+    return 0;
+  if (!(r->copies[k] = (char *) malloc(num * size)) || !(r->items[k] = (LSMEntry **) malloc(num * sizeof(LSMEntry *))))
+    return -1;
+  for (b = 0, num = 0; b < LSM_BUCKETS; b++) {
+    for (e = mt->buckets[b]; e; e = e->next) {
+      if (memcmp(e->data, r->lo, l->key_size) >= 0 && !range_past(r, e->data)) {
+        copy = (LSMEntry *) (r->copies[k] + num * size);
+        memcpy(copy->data, e->data, l->rec);
+        r->items[k][num++] = copy;
+      }
+    }
+  }
+  qsort_r(r->items[k], num, sizeof(LSMEntry *), lsm_cmp_entries, &l->key_size);
+  return src_init(l, &r->srcs[r->n++], r->items[k], num, NULL);
+}
+
+/**
+ * @name lsm_range - Opens a cursor over the pairs in a key range, in key order, as they are now.
+ * @param l: The engine.
+ * @param lo: The first key (key_size bytes).
+ * @param hi: The last key (key_size bytes).
+ * @param prefix_len: Nonzero: the keys that start with the first 'prefix_len' bytes of 'lo' instead ('hi' unused).
+ *
+ * Holds the read lock only to copy the memtables' pairs in the range and to take a reference to each run, which
+ * compactions then leave open until the cursor is closed. Each run is read from the block its sparse index gives
+ * for 'lo', and the merge stops at the first key past the range.
+ * @return The cursor on Success. NULL on Error.
+ */
+LSMRange *lsm_range(LSM *l, const void *lo, const void *hi, unsigned long prefix_len) {
+  LSMRange *r;
+  MemTable *mts[2];
+  int k, rc = 0;
+
+  if (!(r = (LSMRange *) calloc(1, sizeof(LSMRange))))
+    return NULL;
+  r->l = l;
+  r->prefix_len = prefix_len;
+  if (!(r->lo = (char *) malloc(3 * l->key_size + l->rec))) {
+    free(r);
+    return NULL;
+  }
+  r->hi = r->lo + l->key_size;
+  r->rec = r->hi + l->key_size;
+  memcpy(r->lo, lo, l->key_size);
+  memcpy(r->hi, prefix_len ? lo : hi, l->key_size);
+
+  pthread_rwlock_rdlock(&l->lock);
+  mts[0] = l->mem;
+  mts[1] = l->imm;
+  if (!(r->srcs = (LSMSource *) calloc(l->num_runs + 2, sizeof(LSMSource))) ||
+      (l->num_runs && !(r->runs = (LSMRun **) malloc(l->num_runs * sizeof(LSMRun *))))) {
+    pthread_rwlock_unlock(&l->lock);
+    lsm_range_close(r);
+    return NULL;
+  }
+  for (k = 0; k < 2 && !rc; k++) {
+    if (mts[k])
+      rc = range_memtable(r, mts[k], k);
+  }
+  for (k = l->num_runs - 1; k >= 0; k--) {
+    __sync_fetch_and_add(&l->runs[k]->refs, 1);
+    r->runs[r->num_runs++] = l->runs[k];
+  }
+  pthread_rwlock_unlock(&l->lock);
+
+  // The runs' reads go on without the lock.
+  for (k = 0; k < r->num_runs && !rc; k++)
+    rc = src_seek(l, &r->srcs[r->n++], r->runs[k], r->lo);
+  if (rc) {
+    lsm_range_close(r);
+    return NULL;
+  }
+  return r;
+}
+
+/**
+ * @name lsm_range_next - Copies the next pair of a range to 'key' and 'value'.
+ * @param r: The cursor.
+ * @param key: Receives the key (key_size bytes).
+ * @param value: Receives the value (value_size bytes).
+ *
+ * @return 1 if copied. 0 at the end of the range. -1 on Error.
+ */
+int lsm_range_next(LSMRange *r, void *key, void *value) {
+  LSM *l = r->l;
+  int rc;
+
+  if (r->done)
+    return 0;
+  while ((rc = merge_next(l, r->srcs, r->n, r->rec)) > 0) {
+    if (range_past(r, r->rec)) {
+      r->done = 1;
+      return 0;
+    }
+    if (r->rec[l->rec - 1] != LSM_TOMBSTONE) {
+      memcpy(key, r->rec, l->key_size);
+      memcpy(value, r->rec + l->key_size, l->value_size);
+      return 1;
+    }
+  }
+  return rc;
+}
+
+/**
+ * @name lsm_range_close - Closes a range cursor, dropping its references to the runs.
+ * @param r: The cursor.
+ *
+ * @return
+ */
+void lsm_range_close(LSMRange *r) {
+  int k;
+
+  if (!r)
+    return;
+  if (r->srcs)
+    src_free(r->srcs, r->n);
+  for (k = 0; k < r->num_runs; k++)
+    run_unref(r->runs[k]);
+  free(r->runs);
+  free(r->srcs);
+  free(r->copies[0]);
+  free(r->copies[1]);
+  free(r->items[0]);
+  free(r->items[1]);
+  free(r->lo);
+  free(r);
+}
+
+void lsm_sizes(LSM *l, unsigned long *key_size, unsigned long *value_size) {
+  *key_size = l->key_size;
+  *value_size = l->value_size;
+}
+
+/**
+ * @name lsm_stats - Describes the engine's runs and background work.
+ * @param l: The engine.
+ * @param runs: Gets the number of runs.
+ * @param pairs: Gets the pairs in them (a key in several runs counts once per run).
+ * @param flushes: Gets the memtables flushed so far.
+ * @param compactions: Gets the compactions so far.
+ *
+ * @return
+ */
+void lsm_stats(LSM *l, int *runs, unsigned long *pairs, unsigned long *flushes, unsigned long *compactions) {
+  int k;
+
+  pthread_mutex_lock(&l->maint_mutx);
+  *runs = l->num_runs;
+  *pairs = 0;
+  for (k = 0; k < l->num_runs; k++)
+    *pairs += l->runs[k]->count;
+  *flushes = l->flushes;
+  *compactions = l->compactions;
+  pthread_mutex_unlock(&l->maint_mutx);
+}
+
+// Frees the memtables and the runs.
+static void lsm_free(LSM *l) {
+  int k;
+
+  mt_free(l->mem);
+  mt_free(l->imm);
+  for (k = 0; k < l->num_runs; k++)
+    run_free(l->runs[k]);
+  free(l->runs);
+  free(l->path);
+  free(l);
+}
+
+// Reads the manifest, if there's one, and opens its runs. Its sizes win over the ones given. 0 on Success. -1 on Error.
+static int lsm_load(LSM *l) {
+  char name[strlen(l->path) + 16], line[64];
+  unsigned long long n, m;
+  LSMRun *run;
+  FILE *f;
+  int version;
+
+  sprintf(name, "%s.lsm", l->path);
+  if (!(f = fopen(name, "r")))
+    return errno == ENOENT ? 0 : -1;
+  if (!fgets(line, sizeof(line), f) || sscanf(line, "kvlsm %d", &version) != 1 || version != LSM_VERSION) {
+    fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {   // "sizes" comes before the runs.
+    if (sscanf(line, "sizes %llu %llu", &n, &m) == 2 && n && m) {
+      l->key_size = n;
+      l->value_size = m;
+      l->rec = n + m + 1;
+    } else if (sscanf(line, "next_run %llu", &n) == 1) {
+      l->next_run = n;
+    } else if (sscanf(line, "wal %llu", &n) == 1) {
+      l->flushed_wal = n;
+    } else if (sscanf(line, "run %llu", &n) == 1) {
+      if (!(run = run_open(l, n)) || lsm_add_run(l, run)) {
+        run_free(run);
+        fclose(f);
+        return -1;
+      }
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+/**
+ * @name lsm_open - Opens the engine: its runs, then the logs of the PUTs not in them yet (flushed to a run at once).
+ * @param path: Names its files: <path>.lsm (the manifest), <path>.run.<id> and <path>.wal.<n>.
+ * @param key_size: Size of keys in bytes (an existing engine keeps the ones in its manifest: lsm_sizes()).
+ * @param value_size: Size of values in bytes (likewise).
+ *
+ * @return The engine on Success. NULL on Error.
+ */
+LSM *lsm_open(const char *path, unsigned long key_size, unsigned long value_size) {
+  char name[strlen(path) + 32], *rec = NULL;
+  unsigned long first, last, wal, replayed = 0;
+  MemTable *mt;
+  FILE *f;
+  LSM *l;
+
+  if (!(l = (LSM *) calloc(1, sizeof(LSM))))
+    return NULL;
+  l->key_size = key_size;
+  l->value_size = value_size;
+  l->rec = key_size + value_size + 1;
+  l->next_run = 1;
+  pthread_rwlock_init(&l->lock, NULL);
+  pthread_mutex_init(&l->write_mutx, NULL);
+  pthread_mutex_init(&l->maint_mutx, NULL);
+  pthread_cond_init(&l->flushed, NULL);
+  pthread_cond_init(&l->work, NULL);
+  if (!(l->path = strdup(path)) || lsm_load(l)) {
+    fprintf(stderr, "(Error) lsm_open: Cannot read the manifest '%s.lsm'.\n", path);
+    lsm_free(l);
+    return NULL;
+  }
+
+  // Replay the logs after the last one in the runs, into one memtable, and flush it.
+  if (!(l->mem = mt_new(l, 0, 0)) || !(rec = (char *) malloc(l->rec))) {
+    free(rec);
+    lsm_free(l);
+    return NULL;
+  }
+  for (first = wal = l->flushed_wal + 1; ; wal++) {
+    lsm_file(l, name, "wal", wal);
+    if (!(f = fopen(name, "rb")))
+      break;
+    while (fread(rec, l->rec, 1, f) == 1) {   // A pair cut short by a crash is dropped.
+      if (mt_put(l, l->mem, rec, lsm_hash(rec, key_size))) {
+        fclose(f);
+        free(rec);
+        lsm_free(l);
+        return NULL;
+      }
+      replayed++;
+    }
+    fclose(f);
+  }
+  free(rec);
+  mt = l->mem;
+  l->mem = NULL;
+  mt->wal = wal - 1;
+  if (!replayed) {
+    mt_free(mt);
+  } else if (lsm_flush(l, mt)) {
+    fprintf(stderr, "(Error) lsm_open: Cannot flush the replayed logs of '%s'.\n", path);
+    mt_free(mt);
+    lsm_free(l);
+    return NULL;
+  } else {
+    fprintf(stderr, "(Info) lsm_open: Replayed %lu logged PUTs of '%s'.\n", replayed, path);
+  }
+  for (last = wal - 1, wal = first; wal <= last; wal++) {
+    lsm_file(l, name, "wal", wal);
+    unlink(name);
+  }
+  if (lsm_save_manifest(l) || !(l->mem = mt_new(l, l->flushed_wal + 1, 1))) {   // A new one records its sizes.
+    lsm_free(l);
+    return NULL;
+  }
+
+  if (pthread_create(&l->flusher, NULL, lsm_flusher, l)) {
+    lsm_free(l);
+    return NULL;
+  }
+  if (pthread_create(&l->compactor, NULL, lsm_compactor, l)) {
+    pthread_mutex_lock(&l->maint_mutx);
+    l->stop = 1;
+    pthread_cond_broadcast(&l->work);
+    pthread_mutex_unlock(&l->maint_mutx);
+    pthread_join(l->flusher, NULL);
+    lsm_free(l);
+    return NULL;
+  }
+  l->threads = 1;
+  pthread_mutex_lock(&l->maint_mutx);
+  pthread_cond_broadcast(&l->work);  // Maybe too many runs already.
+  pthread_mutex_unlock(&l->maint_mutx);
+  return l;
+}
+
+/**
+ * @name lsm_close - Stops the flusher and the compactor and frees the engine.
+ * @param l: The engine.
+ *
+ * The memtables aren't flushed: their logs are replayed by the next lsm_open().
+ * @return
+ */
+void lsm_close(LSM *l) {
+  if (!l)
+    return;
+  pthread_mutex_lock(&l->maint_mutx);
+  l->stop = 1;
+  pthread_cond_broadcast(&l->work);
+  pthread_cond_broadcast(&l->flushed);
+  pthread_mutex_unlock(&l->maint_mutx);
+  if (l->threads) {
+    pthread_join(l->flusher, NULL);
+    pthread_join(l->compactor, NULL);
+  }
+  if (l->mem->log)
+    fflush(l->mem->log);
+  lsm_free(l);
+}
+
+#ifdef LSM_TEST
+
+#include <glob.h>
+
+#define TEST_PATH  "lsmtest.db"
+#define TEST_KEYS  (10 * LSM_MEMTABLE)   // Enough flushes for a compaction.
+#define TEST_SIZE  16                    // Key and value size.
+
+// The value key 'i' should have after the test's PUTs and DELETEs (NULL: deleted).
+static const char *test_value(unsigned long i, char *value) {
+  memset(value, 0, TEST_SIZE);
+  if (i % 3 == 0)
+    return NULL;
+  sprintf(value, "%c%lu", (i % 2) ? 'v' : 'w', i);
+  return value;
+}
+
+static void test_key(unsigned long i, char *key) {
+  memset(key, 0, TEST_SIZE);
+  sprintf(key, "k%08lu", i);            // Byte order is numeric order.
+}
+
+// Checks that a range cursor returns the live keys 'first' to 'last' in order. 0 if all is well.
+static int test_range(LSMRange *r, unsigned long first, unsigned long last) {
+  char key[TEST_SIZE], value[TEST_SIZE], got_key[TEST_SIZE], got[TEST_SIZE];
+  unsigned long i;
+  int rc;
+
+  if (!r) {
+    printf("lsm_range failed\n");
+    return 1;
+  }
+  for (i = first; i <= last; i++) {
+    if (!test_value(i, value))
+      continue;
+    test_key(i, key);
+    if ((rc = lsm_range_next(r, got_key, got)) != 1 || memcmp(got_key, key, TEST_SIZE) || memcmp(got, value, TEST_SIZE)) {
+      printf("lsm_range_next failed (%lu) (%d)\n", i, rc);
+      lsm_range_close(r);
+      return 1;
+    }
+  }
+  if ((rc = lsm_range_next(r, got_key, got))) {
+    printf("lsm_range_next failed, past the end (%d)\n", rc);
+    lsm_range_close(r);
+    return 1;
+  }
+  lsm_range_close(r);
+  return 0;
+}
+
+// Checks every key with lsm_get(), then all of them with lsm_copy(), then a range and a prefix. 0 if all is well.
+static int test_check(LSM *l, const char *when) {
+  char key[TEST_SIZE], value[TEST_SIZE], got[TEST_SIZE], *pairs;
+  unsigned long i, num, live = 0;
+  const char *want;
+  int rc;
+
+  printf("Checking %d keys %s...\n", TEST_KEYS, when);
+  for (i = 0; i < TEST_KEYS; i++) {
+    test_key(i, key);
+    want = test_value(i, value);
+    rc = lsm_get(l, key, got);
+    if (want ? (rc || memcmp(got, want, TEST_SIZE)) : rc != 1) {
+      printf("lsm_get failed (%lu) (%d)\n", i, rc);
+      return 1;
+    }
+    live += want != NULL;
+  }
+  if (lsm_copy(l, &pairs, &num)) {
+    printf("lsm_copy failed\n");
+    return 1;
+  }
+  if (num != live) {
+    printf("lsm_copy failed, %lu pairs instead of %lu\n", num, live);
+    free(pairs);
+    return 1;
+  }
+  for (i = 0; i < num; i++) {
+    if ((i && memcmp(pairs + (i - 1) * 2 * TEST_SIZE, pairs + i * 2 * TEST_SIZE, TEST_SIZE) >= 0) ||
+        !test_value(strtoul(pairs + i * 2 * TEST_SIZE + 1, NULL, 10), value) ||
+        memcmp(pairs + i * 2 * TEST_SIZE + TEST_SIZE, value, TEST_SIZE)) {
+      printf("lsm_copy failed, out of order or bad pair (%lu)\n", i);
+      free(pairs);
+      return 1;
+    }
+  }
+  free(pairs);
+
+  test_key(1000, key);
+  test_key(3000, value);
+  if (test_range(lsm_range(l, key, value, 0), 1000, 3000))
+    return 1;
+  test_key(1200, key);                  // "k000012": keys 1200 to 1299.
+  return test_range(lsm_range(l, key, NULL, 7), 1200, 1299);
+}
+
+// Waits (10 s at most) for the background flushes and compactions to catch up.
+static int test_settle(LSM *l, unsigned long compactions) {
+  unsigned long pairs, flushes, done;
+  int runs, first, pending, k;
+
+  for (k = 0; k < 1000; k++) {
+    lsm_stats(l, &runs, &pairs, &flushes, &done);
+    pthread_mutex_lock(&l->maint_mutx);
+    pending = lsm_pick(l, &first) || l->imm;
+    pthread_mutex_unlock(&l->maint_mutx);
+    if (!pending && done >= compactions) {
+      printf("%d runs of %lu pairs, after %lu flushes and %lu compactions\n", runs, pairs, flushes, done);
+      return 0;
+    }
+    usleep(10000);
+  }
+  printf("lsm_compact failed, %d runs after %lu compactions\n", runs, done);
+  return 1;
+}
+
+// Checks which runs lsm_pick() merges, given their sizes (oldest first). 0 if it picks 'want' of them, from 'want_first'.
+static int test_pick(const uint64_t *counts, int num, int want, int want_first) {
+  LSMRun runs[num], *ptrs[num];
+  LSM l;
+  int k, n, first;
+
+  memset(&l, 0, sizeof(l));
+  memset(runs, 0, sizeof(runs));
+  for (k = 0; k < num; k++) {
+    runs[k].count = counts[k];
+    ptrs[k] = &runs[k];
+  }
+  l.runs = ptrs;
+  l.num_runs = num;
+  if ((n = lsm_pick(&l, &first)) != want || (n && first != want_first)) {
+    printf("lsm_pick failed, %d runs from %d instead of %d from %d (of %d)\n", n, first, want, want_first, num);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char key[TEST_SIZE], value[TEST_SIZE];
+  unsigned long i;
+  glob_t files;
+  LSM *l;
+  int rc;
+
+  (void) argc;
+  (void) argv;
+  printf("Picking runs to compact...\n");
+  if (test_pick((uint64_t []) { 1 << 20, 4096, 4096, 4096, 4096 }, 5, 4, 1) ||
+      test_pick((uint64_t []) { 16384, 4096, 4096, 4096, 4096 }, 5, 5, 0) ||
+      test_pick((uint64_t []) { 1 << 20, 4096, 4096, 4096 }, 4, 0, 0) ||
+      test_pick((uint64_t []) { 1 << 20, 65536, 16384, 4096, 4096, 4096, 4096 }, 7, 6, 1))
+    return 1;
+
+  if (!glob(TEST_PATH ".*", 0, NULL, &files)) {
+    for (i = 0; i < files.gl_pathc; i++)
+      unlink(files.gl_pathv[i]);
+    globfree(&files);
+  }
+
+  printf("Opening new empty engine " TEST_PATH "...\n");
+  if (!(l = lsm_open(TEST_PATH, TEST_SIZE, TEST_SIZE))) {
+    printf("lsm_open failed\n");
+    return 1;
+  }
+
+  printf("Putting %d values, overwriting the even ones, deleting every third...\n", TEST_KEYS);
+  for (i = 0; i < TEST_KEYS; i++) {
+    test_key(i, key);
+    memset(value, 0, TEST_SIZE);
+    sprintf(value, "v%lu", i);
+    if (lsm_put(l, key, value)) {
+      printf("lsm_put failed (%lu)\n", i);
+      return 1;
+    }
+  }
+  for (i = 0; i < TEST_KEYS; i += 2) {
+    test_key(i, key);
+    memset(value, 0, TEST_SIZE);
+    sprintf(value, "w%lu", i);
+    if (lsm_put(l, key, value)) {
+      printf("lsm_put (overwrite) failed (%lu)\n", i);
+      return 1;
+    }
+  }
+  for (i = 0; i < TEST_KEYS; i += 3) {
+    test_key(i, key);
+    if ((rc = lsm_delete(l, key))) {
+      printf("lsm_delete failed (%lu) (%d)\n", i, rc);
+      return 1;
+    }
+    if ((rc = lsm_delete(l, key)) != 1) {
+      printf("lsm_delete failed, deleted a key twice (%lu) (%d)\n", i, rc);
+      return 1;
+    }
+  }
+  if (test_check(l, "alongside the flushes and compactions") || test_settle(l, 1) ||
+      test_check(l, "after compaction"))
+    return 1;
+
+  printf("Closing and reopening (replaying the logs)...\n");
+  lsm_close(l);
+  if (!(l = lsm_open(TEST_PATH, TEST_SIZE, TEST_SIZE))) {
+    printf("lsm_open (reopen) failed\n");
+    return 1;
+  }
+  if (test_check(l, "after reopening"))
+    return 1;
+
+  printf("Deleting and putting back one key, then reopening...\n");
+  test_key(1, key);
+  test_value(1, value);
+  if (lsm_delete(l, key) || lsm_get(l, key, value) != 1 || lsm_put(l, key, test_value(1, value))) {
+    printf("lsm_delete/lsm_put failed\n");
+    return 1;
+  }
+  lsm_close(l);
+  if (!(l = lsm_open(TEST_PATH, TEST_SIZE, TEST_SIZE))) {
+    printf("lsm_open (reopen) failed\n");
+    return 1;
+  }
+  if (test_check(l, "after the second reopening"))
+    return 1;
+  lsm_close(l);
+
+  printf("All tests OK!\n");
+  return 0;
+}
+
+#endif
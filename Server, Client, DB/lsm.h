@@ -0,0 +1,82 @@
+/* lsm.h
+
+   Log-structured storage engine.
+
+   A PUT is appended to a write-ahead log and put in the memtable (a hash
+   table in memory); nothing is written in place. When the memtable holds
+   LSM_MEMTABLE pairs it's frozen, a new one (and a new log) takes the
+   writes, and a flusher thread writes the frozen one out as a run: a file
+   of its pairs sorted by key, followed by a Bloom filter of its keys and
+   a sparse index (every LSM_INDEX_EVERY-th key). Runs never change. A GET
+   looks in the memtables, then in the runs from newest to oldest; a run
+   is only read if its Bloom filter may hold the key, and then with one
+   read of the LSM_INDEX_EVERY pairs the index points to. A range starts
+   each run at the block the index gives for its first key, and merges
+   them with the memtables' pairs in the range until its last key.
+
+   Once LSM_MAX_RUNS of the newest runs are of similar size (going back
+   from the newest, each older one holds at most LSM_SIZE_RATIO times
+   the pairs of the newer ones), a compactor thread merges them into one
+   (the newest value of a key wins) and swaps it in while GETs and PUTs
+   go on. Older, larger runs are left alone until enough newer pairs
+   pile up, so a pair is rewritten about log(pairs / LSM_MEMTABLE) times
+   rather than at every compaction. A delete is written like a PUT, as a
+   tombstone that hides the key's older pairs; a merge that reaches the
+   oldest run drops both. The manifest
+   (<path>.lsm) names the live runs (<path>.run.<id>) and the last log
+   that's in them; the logs after it (<path>.wal.<n>) are replayed when
+   the engine is opened.
+
+*/
+
+#ifndef LSM_H
+#define LSM_H
+
+#define LSM_MEMTABLE      4096  // Pairs per memtable.
+#define LSM_MAX_RUNS         4  // Runs of similar size before they're compacted into one.
+#define LSM_SIZE_RATIO       2  // A run is similar to the newer ones if it holds at most this times their pairs.
+#define LSM_BLOOM_BITS      10  // Bloom filter bits per key (~1% false positives with 7 hashes).
+#define LSM_BLOOM_HASHES     7
+#define LSM_INDEX_EVERY     16  // Pairs per sparse index entry (read at once by a GET).
+
+typedef struct lsm LSM;
+typedef struct lsmrange LSMRange;
+
+// open (or create) the engine whose manifest is <path>.lsm, replaying its logs. An existing one keeps the key and
+// value sizes in its manifest. NULL on error.
+LSM *lsm_open(const char *path, unsigned long key_size, unsigned long value_size);
+
+// copy the value of 'key' (key_size bytes) to 'value' (value_size bytes). 0 on success, 1 if not found, -1 on error.
+int lsm_get(LSM *l, const void *key, void *value);
+
+// put 'key' = 'value' (key_size and value_size bytes). 0 on success, -1 on error.
+int lsm_put(LSM *l, const void *key, const void *value);
+
+// delete 'key': a tombstone, dropped with the key's older pairs by a compaction that reaches the oldest run. 0 on
+// success, 1 if not found, -1 on error.
+int lsm_delete(LSM *l, const void *key);
+
+// copy all pairs, as one consistent cut and in key order, to a new array of '*num' key_size + value_size
+// records (free() it). 0 on success, -1 on error.
+int lsm_copy(LSM *l, char **pairs, unsigned long *num);
+
+// open a cursor over the pairs from 'lo' to 'hi' (key_size bytes each), or with the first 'prefix_len' bytes of 'lo'
+// if that's nonzero, in key order and as they are now. NULL on error.
+LSMRange *lsm_range(LSM *l, const void *lo, const void *hi, unsigned long prefix_len);
+
+// copy the next pair of a range to 'key' and 'value'. 1 on success, 0 at the end, -1 on error.
+int lsm_range_next(LSMRange *r, void *key, void *value);
+
+// close a range cursor.
+void lsm_range_close(LSMRange *r);
+
+// key and value sizes (an existing engine's own).
+void lsm_sizes(LSM *l, unsigned long *key_size, unsigned long *value_size);
+
+// runs, pairs in them, flushes and compactions so far.
+void lsm_stats(LSM *l, int *runs, unsigned long *pairs, unsigned long *flushes, unsigned long *compactions);
+
+// stop the background threads and free the engine (the last memtable stays in its log).
+void lsm_close(LSM *l);
+
+#endif
@@ -0,0 +1,412 @@
+/* memdb.c
+
+   In-memory storage engine: a lock-striped hash table, snapshotted to a
+   KISSDB file by a thread of its own. See memdb.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "kissdb.h"
+#include "memdb.h"
+
+// Definition of a pair, chained in its bucket.
+typedef struct mementry {
+  struct mementry *next;
+  uint64_t hash;
+  char data[];                         // The key (key_size bytes), then the value (value_size bytes).
+} MemEntry;
+
+// Definition of a stripe: a chained hash table of its own, behind its own lock.
+typedef struct memstripe {
+  pthread_rwlock_t lock;
+  MemEntry **buckets;
+  unsigned long num_buckets;
+  unsigned long count;
+} __attribute__((aligned(64))) MemStripe;
+
+struct memdb {
+  MemStripe stripes[MEMDB_STRIPES];
+  unsigned long hash_table_size;
+  unsigned long key_size;
+  unsigned long value_size;
+  char *path;
+  uint64_t version;                    // PUTs and deletes so far (updated atomically).
+  uint64_t saved;                      // 'version' as of the last snapshot.
+  int snapshot_sec;
+  int stop;
+  pthread_mutex_t lock;                // One snapshot at a time; guards 'saved' and 'stop'.
+  pthread_cond_t wake;                 // The snapshot thread's sleep, cut short by memdb_close().
+  pthread_t saver;
+  int has_saver;
+};
+
+// FNV-1a over the whole key. The top bits pick the stripe, the low ones the bucket.
+static uint64_t memdb_hash(const void *key, unsigned long len) {
+  const unsigned char *p = (const unsigned char *) key;
+  uint64_t h = 14695981039346656037ULL;
+  unsigned long i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static MemStripe *memdb_stripe(MemDB *m, uint64_t hash) {
+  return &m->stripes[hash >> 58 & (MEMDB_STRIPES - 1)];
+}
+
+// The pair of 'key' in stripe 's' (locked by the caller). NULL if there's none.
+static MemEntry *memdb_find(MemDB *m, MemStripe *s, const void *key, uint64_t hash) {
+  MemEntry *e;
+
+  for (e = s->buckets[hash & (s->num_buckets - 1)]; e; e = e->next) {
+    if (e->hash == hash && !memcmp(e->data, key, m->key_size))
+      return e;
+  }
+  return NULL;
+}
+
+// Doubles the buckets of stripe 's' (write-locked by the caller). Keeps the old ones if there's no memory.
+static void memdb_grow(MemStripe *s) {
+  MemEntry **buckets, *e, *next;
+  unsigned long n = s->num_buckets * 2, k;
+
+  if (!(buckets = (MemEntry **) calloc(n, sizeof(MemEntry *))))
+    return;
+  for (k = 0; k < s->num_buckets; k++) {
+    for (e = s->buckets[k]; e; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  }
+  free(s->buckets);
+  s->buckets = buckets;
+  s->num_buckets = n;
+}
+
+/**
+ * @name memdb_get - Copies the value of a key.
+ * @param m: The engine.
+ * @param key: The key (key_size bytes).
+ * @param value: Receives the value (value_size bytes).
+ *
+ * @return 0 on Success. 1 if the key isn't there.
+ */
+int memdb_get(MemDB *m, const void *key, void *value) {
+  uint64_t hash = memdb_hash(key, m->key_size);
+  MemStripe *s = memdb_stripe(m, hash);
+  MemEntry *e;
+
+  pthread_rwlock_rdlock(&s->lock);
+  if ((e = memdb_find(m, s, key, hash)))
+    memcpy(value, e->data + m->key_size, m->value_size);
+  pthread_rwlock_unlock(&s->lock);
+  return e ? 0 : 1;
+}
+
+/**
+ * @name memdb_put - Puts a pair, overwriting the key's value if it's there.
+ * @param m: The engine.
+ * @param key: The key (key_size bytes).
+ * @param value: The value (value_size bytes).
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int memdb_put(MemDB *m, const void *key, const void *value) {
+  uint64_t hash = memdb_hash(key, m->key_size);
+  MemStripe *s = memdb_stripe(m, hash);
+  MemEntry *e;
+
+  pthread_rwlock_wrlock(&s->lock);
+  if (!(e = memdb_find(m, s, key, hash))) {
+    if (!(e = (MemEntry *) malloc(sizeof(MemEntry) + m->key_size + m->value_size))) {
+      pthread_rwlock_unlock(&s->lock);
+      return -1;
+    }
+    e->hash = hash;
+    memcpy(e->data, key, m->key_size);
+    e->next = s->buckets[hash & (s->num_buckets - 1)];
+    s->buckets[hash & (s->num_buckets - 1)] = e;
+    if (++s->count > 2 * s->num_buckets)
+      memdb_grow(s);
+  }
+  memcpy(e->data + m->key_size, value, m->value_size);
+  __sync_fetch_and_add(&m->version, 1);
+  pthread_rwlock_unlock(&s->lock);
+  return 0;
+}
+
+/**
+ * @name memdb_delete - Removes a pair.
+ * @param m: The engine.
+ * @param key: The key (key_size bytes).
+ *
+ * @return 0 on Success. 1 if the key isn't there.
+ */
+int memdb_delete(MemDB *m, const void *key) {
+  uint64_t hash = memdb_hash(key, m->key_size);
+  MemStripe *s = memdb_stripe(m, hash);
+  MemEntry **link, *e;
+  int rc = 1;
+
+  pthread_rwlock_wrlock(&s->lock);
+  for (link = &s->buckets[hash & (s->num_buckets - 1)]; (e = *link); link = &e->next) {
+    if (e->hash == hash && !memcmp(e->data, key, m->key_size))
+      break;
+  }
+  if (e) {
+    *link = e->next;
+    s->count--;
+    __sync_fetch_and_add(&m->version, 1);
+    rc = 0;
+  }
+  pthread_rwlock_unlock(&s->lock);
+  free(e);
+  return rc;
+}
+
+// memdb_copy(), also returning the 'version' the copy has.
+static int memdb_cut(MemDB *m, char **pairs, unsigned long *num, uint64_t *version) {
+  const unsigned long rec = m->key_size + m->value_size;
+  MemEntry *e;
+  unsigned long n = 0, k;
+  int i;
+  char *p = NULL;
+
+  // All stripes held at once: no PUT lands in the middle of the copy.
+  for (i = 0; i < MEMDB_STRIPES; i++) {
+    pthread_rwlock_rdlock(&m->stripes[i].lock);
+    n += m->stripes[i].count;
+  }
+  if (n && !(p = (char *) malloc(n * rec))) {
+    n = (unsigned long) -1;
+  } else {
+    *pairs = p;
+    for (i = 0; i < MEMDB_STRIPES; i++) {
+      for (k = 0; k < m->stripes[i].num_buckets; k++) {
+        for (e = m->stripes[i].buckets[k]; e; e = e->next) {
+          memcpy(p, e->data, rec);
+          p += rec;
+        }
+      }
+    }
+    *num = n;
+    if (version)
+      *version = __atomic_load_n(&m->version, __ATOMIC_RELAXED);
+  }
+  for (i = MEMDB_STRIPES - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&m->stripes[i].lock);
+  return n == (unsigned long) -1 ? -1 : 0;
+}
+
+/**
+ * @name memdb_copy - Copies all pairs, as they are at one point in time.
+ * @param m: The engine.
+ * @param pairs: Gets a new array of records, each the key then the value (NULL if there are none).
+ * @param num: Gets the number of records.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int memdb_copy(MemDB *m, char **pairs, unsigned long *num) {
+  return memdb_cut(m, pairs, num, NULL);
+}
+
+// Writes a snapshot if anything changed since the last one. Called holding 'lock'.
+static int memdb_save(MemDB *m) {
+  const unsigned long rec = m->key_size + m->value_size;
+  char tmp[strlen(m->path) + 8], *pairs = NULL;
+  unsigned long num = 0, k;
+  uint64_t version;
+  struct timespec t0, t1;
+  KISSDB snap;
+  int rc = 0;
+
+  if (__atomic_load_n(&m->version, __ATOMIC_RELAXED) == m->saved)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (memdb_cut(m, &pairs, &num, &version)) {
+    fprintf(stderr, "(Error) memdb_save: Cannot copy the table.\n");
+    return -1;
+  }
+
+  // A new file beside the old one, which it replaces only once it's complete (and on disk).
+  sprintf(tmp, "%s.snap", m->path);
+  if (KISSDB_open(&snap, tmp, KISSDB_OPEN_MODE_RWREPLACE, m->hash_table_size, m->key_size, m->value_size)) {
+    fprintf(stderr, "(Error) memdb_save: Cannot create '%s'.\n", tmp);
+    free(pairs);
+    return -1;
+  }
+  for (k = 0; k < num && !rc; k++)
+    rc = KISSDB_put(&snap, pairs + k * rec, pairs + k * rec + m->key_size);
+  if (!rc && (fflush(snap.f) || fsync(fileno(snap.f))))
+    rc = -1;
+  KISSDB_close(&snap);
+  free(pairs);
+  if (rc || rename(tmp, m->path)) {
+    fprintf(stderr, "(Error) memdb_save: Cannot write the snapshot to '%s'.\n", m->path);
+    unlink(tmp);
+    return -1;
+  }
+  m->saved = version;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fprintf(stderr, "(Info) memdb_save: Snapshot of %lu pairs written to '%s' in %.1f ms.\n", num, m->path,
+          (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+  return 0;
+}
+
+/**
+ * @name memdb_snapshot - Writes a snapshot now, if anything changed since the last one.
+ * @param m: The engine.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int memdb_snapshot(MemDB *m) {
+  int rc;
+
+  pthread_mutex_lock(&m->lock);
+  rc = memdb_save(m);
+  pthread_mutex_unlock(&m->lock);
+  return rc;
+}
+
+static void *memdb_saver(void *arg) {
+  MemDB *m = (MemDB *) arg;
+  struct timespec until;
+
+  pthread_mutex_lock(&m->lock);
+  while (!m->stop) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += m->snapshot_sec;
+    while (!m->stop && pthread_cond_timedwait(&m->wake, &m->lock, &until) != ETIMEDOUT)
+      ;
+    if (!m->stop)
+      memdb_save(m);
+  }
+  pthread_mutex_unlock(&m->lock);
+  return NULL;
+}
+
+// Frees the pairs and the buckets.
+static void memdb_free(MemDB *m) {
+  MemEntry *e, *next;
+  unsigned long k;
+  int i;
+
+  for (i = 0; i < MEMDB_STRIPES; i++) {
+    for (k = 0; m->stripes[i].buckets && k < m->stripes[i].num_buckets; k++) {
+      for (e = m->stripes[i].buckets[k]; e; e = next) {
+        next = e->next;
+        free(e);
+      }
+    }
+    free(m->stripes[i].buckets);
+    pthread_rwlock_destroy(&m->stripes[i].lock);
+  }
+  free(m->path);
+  free(m);
+}
+
+/**
+ * @name memdb_open - Loads a KISSDB file into memory and starts the snapshot thread.
+ * @param path: The file, written back by the snapshots (it needn't exist yet).
+ * @param hash_table_size: Hash table size of the snapshots.
+ * @param key_size: Size of keys in bytes (an existing file keeps its own: memdb_sizes()).
+ * @param value_size: Size of values in bytes (likewise).
+ * @param snapshot_sec: Seconds between snapshots (0: only on memdb_close()).
+ *
+ * @return The engine on Success. NULL on Error.
+ */
+MemDB *memdb_open(const char *path, unsigned long hash_table_size, unsigned long key_size, unsigned long value_size,
+                  int snapshot_sec) {
+  KISSDB file;
+  KISSDB_Iterator it;
+  MemDB *m;
+  char *key, *value;
+  int i, rc = 0;
+
+  if (snapshot_sec < 0 || !(m = (MemDB *) calloc(1, sizeof(MemDB))))
+    return NULL;
+  m->hash_table_size = hash_table_size;
+  m->key_size = key_size;
+  m->value_size = value_size;
+  m->snapshot_sec = snapshot_sec;
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_cond_init(&m->wake, NULL);
+  for (i = 0; i < MEMDB_STRIPES; i++) {
+    pthread_rwlock_init(&m->stripes[i].lock, NULL);
+    m->stripes[i].num_buckets = MEMDB_BUCKETS;
+    if (!(m->stripes[i].buckets = (MemEntry **) calloc(MEMDB_BUCKETS, sizeof(MemEntry *))))
+      rc = -1;
+  }
+  if (rc || !(m->path = strdup(path))) {
+    memdb_free(m);
+    return NULL;
+  }
+
+  // The last snapshot (or a file the KISSDB engine wrote).
+  if (!access(path, F_OK)) {
+    if (KISSDB_open(&file, path, KISSDB_OPEN_MODE_RDONLY, hash_table_size, key_size, value_size)) {
+      fprintf(stderr, "(Error) memdb_open: Cannot read '%s'.\n", path);
+      memdb_free(m);
+      return NULL;
+    }
+    m->key_size = file.key_size;    // The file's sizes win, as with the KISSDB engine.
+    m->value_size = file.value_size;
+    if (!(key = (char *) malloc(m->key_size + m->value_size))) {
+      rc = -1;
+    } else {
+      value = key + m->key_size;
+      KISSDB_Iterator_init(&file, &it);
+      while (!rc && (rc = KISSDB_Iterator_next(&it, key, value)) > 0)
+        rc = memdb_put(m, key, value);
+      free(key);
+    }
+    KISSDB_close(&file);
+    if (rc) {
+      memdb_free(m);
+      return NULL;
+    }
+  }
+  m->saved = m->version;            // The file has all of it already.
+
+  if (snapshot_sec && !pthread_create(&m->saver, NULL, memdb_saver, m))
+    m->has_saver = 1;
+  else if (snapshot_sec)
+    fprintf(stderr, "(Warning) memdb_open: No snapshot thread; snapshots are only written on close.\n");
+  return m;
+}
+
+void memdb_sizes(MemDB *m, unsigned long *key_size, unsigned long *value_size) {
+  *key_size = m->key_size;
+  *value_size = m->value_size;
+}
+
+/**
+ * @name memdb_close - Stops the snapshot thread, writes a last snapshot and frees the table.
+ * @param m: The engine.
+ *
+ * @return
+ */
+void memdb_close(MemDB *m) {
+  if (!m)
+    return;
+  pthread_mutex_lock(&m->lock);
+  m->stop = 1;
+  pthread_cond_signal(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+  if (m->has_saver)
+    pthread_join(m->saver, NULL);
+  memdb_snapshot(m);
+  memdb_free(m);
+}
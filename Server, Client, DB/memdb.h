@@ -0,0 +1,56 @@
+/* memdb.h
+
+   In-memory storage engine, persisted by periodic snapshots.
+
+   Pairs live in a hash table split into MEMDB_STRIPES stripes, each a
+   chained table of its own behind its own read-write lock (and grown on
+   its own), so GETs never wait for each other and a PUT only holds back
+   the requests that hash to its stripe. Keys and values are fixed size,
+   as in KISSDB.
+
+   Nothing is written per PUT. Every 'snapshot_sec' seconds, if anything
+   changed, a thread copies the whole table under all the stripes' read
+   locks (a consistent cut: PUTs wait for the copy, GETs don't) and
+   writes it as a KISSDB file next to 'path', which then replaces 'path'.
+   The file is loaded back when the engine is opened, so a restart loses
+   at most the PUTs of the last interval (none after memdb_close()).
+
+*/
+
+#ifndef MEMDB_H
+#define MEMDB_H
+
+#define MEMDB_STRIPES      64  // Stripes of the table (a power of 2).
+#define MEMDB_BUCKETS      64  // Initial buckets per stripe (a power of 2); doubled past 2 pairs per bucket.
+
+typedef struct memdb MemDB;
+
+// load the KISSDB file 'path' (if any, with its own key and value sizes) into memory and snapshot it back there
+// every 'snapshot_sec' seconds (0: only on memdb_close()); 'hash_table_size' sizes the snapshots' hash tables.
+// NULL on error.
+MemDB *memdb_open(const char *path, unsigned long hash_table_size, unsigned long key_size, unsigned long value_size,
+                  int snapshot_sec);
+
+// copy the value of 'key' (key_size bytes) to 'value' (value_size bytes). 0 on success, 1 if not found.
+int memdb_get(MemDB *m, const void *key, void *value);
+
+// put 'key' = 'value' (key_size and value_size bytes). 0 on success, -1 on error.
+int memdb_put(MemDB *m, const void *key, const void *value);
+
+// remove 'key'. 0 on success, 1 if not found.
+int memdb_delete(MemDB *m, const void *key);
+
+// copy all pairs, as one consistent cut, to a new array of '*num' key_size + value_size records (free() it).
+// 0 on success, -1 on error.
+int memdb_copy(MemDB *m, char **pairs, unsigned long *num);
+
+// write a snapshot now (if anything changed since the last one). 0 on success, -1 on error.
+int memdb_snapshot(MemDB *m);
+
+// key and value sizes (an existing file's).
+void memdb_sizes(MemDB *m, unsigned long *key_size, unsigned long *value_size);
+
+// stop the snapshot thread, write a last snapshot and free the table.
+void memdb_close(MemDB *m);
+
+#endif
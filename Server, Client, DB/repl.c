@@ -0,0 +1,699 @@
+/* repl.c
+
+   Asynchronous primary -> follower replication. See repl.h for the
+   protocol.
+
+*/
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include "utils.h"
+#include "repl.h"
+
+#define REPL_BATCH               64  // Log entries sent per wakeup of a sender (or copied at a time when trimming).
+#define REPL_HEARTBEAT_SEC        1  // Idle senders send a heartbeat this often.
+#define REPL_RETRY_SEC            1  // Follower reconnect delay.
+#define REPL_HOST_LEN          1024
+#define REPL_DELETED           0xFF  // First value byte of a logged DELETE (the value is all of them).
+#define REPL_LOG_KEEP         16384  // Entries the trimmer keeps for reconnecting followers (it trims at twice that).
+#define REPL_MAGIC       "KVRLOG01"  // Header: the magic, then the position of the first entry (8 bytes each).
+#define REPL_HEADER              16
+
+struct repllog {
+  FILE *f;
+  char *path;
+  unsigned long key_size;
+  unsigned long value_size;
+  unsigned long entry_size;            // Entry: key, value. Position N is at data_off + (N - file_base) * entry_size.
+  char *deleted;                       // The value of a DELETE entry.
+  off_t data_off;                      // REPL_HEADER (0 in a log written before the header existed).
+  uint64_t file_base;                  // First position in 'f'.
+  uint64_t base;                       // First position served: below it, followers get a copy of the tables.
+  uint64_t head;
+  int followers;
+  struct sender *senders;
+  ReplSnapshot snapshot;
+  pthread_mutex_t mutx;
+  pthread_cond_t appended;             // Wakes up the senders.
+  pthread_cond_t full;                 // Wakes up the trimmer.
+  pthread_rwlock_t swap;               // Read: an append or a sender reading 'f'. Write: the trimmer replacing it.
+};
+
+// Definition of a sender: one per connected follower.
+typedef struct sender {
+  ReplLog *log;
+  int socket_fd;
+  int copy;                            // 1: send a copy of the tables first.
+  uint64_t next;                       // Next position to send (under the log's 'mutx').
+  struct sender *link;
+} Sender;
+
+// Follower side (a server follows at most one primary).
+static struct follower {
+  char host[REPL_HOST_LEN];
+  int port;
+  int pos_fd;                          // Holds the applied position (8 bytes).
+  unsigned long key_size;
+  unsigned long value_size;
+  ReplApply apply;
+  ReplReset reset;
+  pthread_mutex_t mutx;
+  uint64_t applied;
+  uint64_t head;
+  uint64_t copy_pos;                   // Position a copy of the tables in progress resumes from.
+  int copying;
+  int64_t last_ms;
+  int connected;
+} follower = { .mutx = PTHREAD_MUTEX_INITIALIZER };
+
+static int64_t repl_now_ms() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void *repl_trimmer(void *arg);
+
+/*
+ * @name repl_log_free - Frees a log that couldn't be opened.
+ *
+ * @return NULL
+ */
+static ReplLog *repl_log_free(ReplLog *log) {
+  if (log->f)
+    fclose(log->f);
+  pthread_rwlock_destroy(&log->swap);
+  pthread_cond_destroy(&log->full);
+  pthread_cond_destroy(&log->appended);
+  pthread_mutex_destroy(&log->mutx);
+  free(log->path);
+  free(log->deleted);
+  free(log);
+  return NULL;
+}
+
+/**
+ * @name repl_log_open - Opens (or creates) the replication log, and starts its trimmer.
+ * @param path: The log file.
+ * @param key_size: Size of keys in bytes.
+ * @param value_size: Size of values in bytes.
+ * @param snapshot: Copies the tables to a follower the log can't bring up to date.
+ *
+ * @return The log on Success. NULL on Error.
+ */
+ReplLog *repl_log_open(const char *path, unsigned long key_size, unsigned long value_size, ReplSnapshot snapshot) {
+  char magic[8];
+  pthread_t tid;
+  ReplLog *log;
+  off_t size;
+
+  if (!(log = (ReplLog *) calloc(1, sizeof(ReplLog))))
+    return NULL;
+  log->key_size = key_size;
+  log->value_size = value_size;
+  log->entry_size = key_size + value_size;
+  log->snapshot = snapshot;
+  pthread_mutex_init(&log->mutx, NULL);
+  pthread_cond_init(&log->appended, NULL);
+  pthread_cond_init(&log->full, NULL);
+  pthread_rwlock_init(&log->swap, NULL);
+  if (!(log->deleted = (char *) malloc(value_size)) || !(log->path = strdup(path)))
+    return repl_log_free(log);
+  memset(log->deleted, REPL_DELETED, value_size);
+
+  if (!(log->f = fopen(path, "r+b")) && !(log->f = fopen(path, "w+b")))
+    return repl_log_free(log);
+  if (fseeko(log->f, 0, SEEK_END) || (size = ftello(log->f)) < 0)
+    return repl_log_free(log);
+
+  // New (or torn before its first entry): write the header.
+  if (size < REPL_HEADER) {
+    size = REPL_HEADER;
+    if (ftruncate(fileno(log->f), 0) || fseeko(log->f, 0, SEEK_SET) ||
+        fwrite(REPL_MAGIC, 8, 1, log->f) != 1 || fwrite(&log->file_base, 8, 1, log->f) != 1 || fflush(log->f))
+      return repl_log_free(log);
+  }
+  if (pread(fileno(log->f), magic, 8, 0) != 8)
+    return repl_log_free(log);
+  if (!memcmp(magic, REPL_MAGIC, 8)) {
+    log->data_off = REPL_HEADER;
+    if (pread(fileno(log->f), &log->file_base, 8, 8) != 8)
+      return repl_log_free(log);
+  }
+  log->base = log->file_base;
+
+  // Drop a torn entry left by a crash.
+  log->head = log->file_base + (size - log->data_off) / log->entry_size;
+  size = log->data_off + (log->head - log->file_base) * log->entry_size;
+  if (ftruncate(fileno(log->f), size) || fseeko(log->f, size, SEEK_SET))
+    return repl_log_free(log);
+
+  if (pthread_create(&tid, NULL, repl_trimmer, log))
+    return repl_log_free(log);
+  pthread_detach(tid);
+  return log;
+}
+
+/**
+ * @name repl_log_append - Appends a committed PUT (or DELETE) to the log and wakes up the senders.
+ * @param log: The replication log.
+ * @param key: The key (key_size bytes).
+ * @param value: The value (value_size bytes). NULL for a DELETE.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int repl_log_append(ReplLog *log, const char *key, const char *value) {
+  int rc = 0;
+
+  if (!value)
+    value = log->deleted;
+  pthread_rwlock_rdlock(&log->swap);
+  if (fwrite(key, log->key_size, 1, log->f) != 1 ||
+      fwrite(value, log->value_size, 1, log->f) != 1 ||
+      fflush(log->f))
+    rc = -1;
+  pthread_rwlock_unlock(&log->swap);
+  if (rc)
+    return -1;
+
+  pthread_mutex_lock(&log->mutx);
+  log->head++;
+  pthread_cond_broadcast(&log->appended);
+  if (log->head - log->base > 2 * REPL_LOG_KEEP)
+    pthread_cond_signal(&log->full);
+  pthread_mutex_unlock(&log->mutx);
+  return 0;
+}
+
+/**
+ * @name repl_log_head - Returns the number of entries in the log.
+ * @param log: The replication log.
+ *
+ * @return
+ */
+uint64_t repl_log_head(ReplLog *log) {
+  uint64_t head;
+
+  pthread_mutex_lock(&log->mutx);
+  head = log->head;
+  pthread_mutex_unlock(&log->mutx);
+  return head;
+}
+
+/**
+ * @name repl_log_base - Returns the first position still in the log (older ones were trimmed).
+ * @param log: The replication log.
+ *
+ * @return
+ */
+uint64_t repl_log_base(ReplLog *log) {
+  uint64_t base;
+
+  pthread_mutex_lock(&log->mutx);
+  base = log->base;
+  pthread_mutex_unlock(&log->mutx);
+  return base;
+}
+
+/**
+ * @name repl_log_followers - Returns the number of followers being streamed to.
+ * @param log: The replication log.
+ *
+ * @return
+ */
+int repl_log_followers(ReplLog *log) {
+  int followers;
+
+  pthread_mutex_lock(&log->mutx);
+  followers = log->followers;
+  pthread_mutex_unlock(&log->mutx);
+  return followers;
+}
+
+/*
+ * @name repl_log_read - Reads the entries [from, to) of the log into 'buf' (at most REPL_BATCH). Called holding 'swap'.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+static int repl_log_read(ReplLog *log, char *buf, uint64_t from, uint64_t to) {
+  const size_t len = (to - from) * log->entry_size;
+
+  return (pread(fileno(log->f), buf, len, log->data_off + (from - log->file_base) * log->entry_size) == (ssize_t) len) ? 0 : -1;
+}
+
+/*
+ * @name repl_log_copy - Appends the entries [from, to) of the log to 'f'. Called holding 'swap', or by the trimmer.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+static int repl_log_copy(ReplLog *log, FILE *f, char *buf, uint64_t from, uint64_t to) {
+  uint64_t n;
+
+  for (; from < to; from += n) {
+    n = (to - from < REPL_BATCH) ? to - from : REPL_BATCH;
+    if (repl_log_read(log, buf, from, from + n) || fwrite(buf, log->entry_size, n, f) != n)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * @name repl_log_trim - Drops the entries below 'cut': copies the rest to a new file that replaces the log.
+ * @param log: The replication log.
+ * @param cut: The first position kept ('base' is already there, so no new sender needs an older one).
+ * @param buf: Buffer for REPL_BATCH entries.
+ *
+ * Appends only wait while the entries logged during the copy are copied too.
+ * @return 0 on Success. -1 on Error.
+ */
+static int repl_log_trim(ReplLog *log, uint64_t cut, char *buf) {
+  char tmp[strlen(log->path) + 8];
+  uint64_t end;
+  FILE *f;
+
+  sprintf(tmp, "%s.tmp", log->path);
+  if (!(f = fopen(tmp, "w+b")))
+    return -1;
+  end = repl_log_head(log);
+  if (fwrite(REPL_MAGIC, 8, 1, f) != 1 || fwrite(&cut, 8, 1, f) != 1 || repl_log_copy(log, f, buf, cut, end))
+    goto error;
+
+  pthread_rwlock_wrlock(&log->swap);
+  if (repl_log_copy(log, f, buf, end, repl_log_head(log)) || fflush(f) || fsync(fileno(f)) || rename(tmp, log->path)) {
+    pthread_rwlock_unlock(&log->swap);
+    goto error;
+  }
+  fclose(log->f);
+  log->f = f;
+  log->data_off = REPL_HEADER;
+  log->file_base = cut;
+  pthread_rwlock_unlock(&log->swap);
+  return 0;
+
+error:
+  fclose(f);
+  unlink(tmp);
+  return -1;
+}
+
+/*
+ * @name repl_trimmer - Trimmer thread: keeps the log at most 2 * REPL_LOG_KEEP entries past what the followers still need.
+ * @param arg: The log.
+ *
+ * The entries a connected follower has yet to be sent are kept. A follower that reconnects from a trimmed position
+ * gets a copy of the tables instead.
+ * @return
+ */
+static void *repl_trimmer(void *arg) {
+  ReplLog *log = (ReplLog *) arg;
+  char *buf;
+  uint64_t cut;
+  Sender *s;
+
+  if (!(buf = (char *) malloc(REPL_BATCH * log->entry_size)))
+    return NULL;
+  while (1) {
+    pthread_mutex_lock(&log->mutx);
+    while (log->head - log->base <= 2 * REPL_LOG_KEEP)
+      pthread_cond_wait(&log->full, &log->mutx);
+    cut = log->head - REPL_LOG_KEEP;
+    for (s = log->senders; s; s = s->link)
+      if (s->next < cut)
+        cut = s->next;
+    if (cut > log->base)
+      log->base = cut;
+    pthread_mutex_unlock(&log->mutx);
+
+    if (cut <= log->file_base) {
+      sleep(REPL_RETRY_SEC);        // A follower far behind holds the log.
+      continue;
+    }
+    if (repl_log_trim(log, cut, buf)) {
+      fprintf(stderr, "(Error) repl_trimmer: Cannot trim the log below %llu.\n", (unsigned long long) cut);
+      sleep(REPL_RETRY_SEC);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * @name repl_emit - Sends one pair of the copy of the tables to a follower ('S:<key>:<value>').
+ * @param arg: The Sender.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+static int repl_emit(void *arg, const char *key, const char *value) {
+  Sender *s = (Sender *) arg;
+  ReplLog *log = s->log;
+  char msg[log->entry_size + 64];
+  int len;
+
+  len = snprintf(msg, sizeof(msg), "S:%.*s:%.*s", (int) log->key_size, key, (int) log->value_size, value);
+  return (write_msg_to_socket(s->socket_fd, msg, len) < 0) ? -1 : 0;
+}
+
+/*
+ * @name repl_sender - Streams the log to one follower until it goes away, after a copy of the tables if it needs one.
+ * @param arg: The Sender.
+ *
+ * @return
+ */
+static void *repl_sender(void *arg) {
+  Sender *s = (Sender *) arg;
+  ReplLog *log = s->log;
+  const int msg_size = log->entry_size + 64;
+  struct timespec deadline;
+  uint64_t head, pos;
+  char *batch, *entry, *msg;
+  Sender **prev;
+  int n, len;
+
+  batch = (char *) malloc(REPL_BATCH * log->entry_size);
+  msg = (char *) malloc(msg_size);
+  pos = s->next;
+
+  // The copy: every table as it is at or after 'pos', which the log then brings up to date.
+  if (batch && msg && s->copy) {
+    fprintf(stderr, "(Info) repl_sender: Copying the tables to a follower, resuming the log at %llu.\n", (unsigned long long) pos);
+    len = snprintf(msg, msg_size, "B:%llu", (unsigned long long) pos);
+    if (write_msg_to_socket(s->socket_fd, msg, len) < 0 || log->snapshot(repl_emit, s))
+      goto done;
+    len = snprintf(msg, msg_size, "E:%llu", (unsigned long long) pos);
+    if (write_msg_to_socket(s->socket_fd, msg, len) < 0)
+      goto done;
+  }
+
+  while (batch && msg) {
+    pthread_mutex_lock(&log->mutx);
+    s->next = pos;
+    if (pos >= log->head) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += REPL_HEARTBEAT_SEC;
+      pthread_cond_timedwait(&log->appended, &log->mutx, &deadline);
+    }
+    head = log->head;
+    pthread_mutex_unlock(&log->mutx);
+
+    n = (head - pos < REPL_BATCH) ? head - pos : REPL_BATCH;
+    pthread_rwlock_rdlock(&log->swap);
+    len = repl_log_read(log, batch, pos, pos + n);
+    pthread_rwlock_unlock(&log->swap);
+    if (len)
+      goto done;
+
+    for (entry = batch; n > 0; n--, pos++, entry += log->entry_size) {
+      if ((unsigned char) entry[log->key_size] == REPL_DELETED)
+        len = snprintf(msg, msg_size, "D:%llu:%.*s", (unsigned long long) pos, (int) log->key_size, entry);
+      else
+        len = snprintf(msg, msg_size, "R:%llu:%.*s:%.*s", (unsigned long long) pos,
+                       (int) log->key_size, entry, (int) log->value_size, entry + log->key_size);
+      if (write_msg_to_socket(s->socket_fd, msg, len) < 0)
+        goto done;
+    }
+
+    // Heartbeat after every batch, and when idle.
+    len = snprintf(msg, msg_size, "H:%llu", (unsigned long long) head);
+    if (write_msg_to_socket(s->socket_fd, msg, len) < 0)
+      goto done;
+  }
+
+done:
+  fprintf(stderr, "(Info) repl_sender: Follower left at position %llu.\n", (unsigned long long) pos);
+  pthread_mutex_lock(&log->mutx);
+  log->followers--;
+  for (prev = &log->senders; *prev != s; prev = &(*prev)->link)
+    ;
+  *prev = s->link;
+  pthread_mutex_unlock(&log->mutx);
+  close(s->socket_fd);
+  free(batch);
+  free(msg);
+  free(s);
+  return NULL;
+}
+
+/**
+ * @name repl_serve_follower - Starts streaming the log to a follower.
+ * @param log: The replication log.
+ * @param socket_fd: The follower's socket, owned by the sender from now on.
+ * @param from: The first position the follower needs.
+ *
+ * A new follower (position 0), or one the trimmer left behind, first gets a copy of the tables and then the
+ * log from the head it had when the copy started.
+ * @return 0 on Success. -1 on Error (the caller still owns the socket).
+ */
+int repl_serve_follower(ReplLog *log, int socket_fd, uint64_t from) {
+  Sender *s, **prev;
+  pthread_t tid;
+
+  if (!(s = (Sender *) malloc(sizeof(Sender))))
+    return -1;
+  s->log = log;
+  s->socket_fd = socket_fd;
+
+  pthread_mutex_lock(&log->mutx);
+  if (from > log->head) {                  // Follower is ahead of this log: it belongs to another primary.
+    pthread_mutex_unlock(&log->mutx);
+    free(s);
+    return -1;
+  }
+  s->copy = (!from || from < log->base);
+  s->next = s->copy ? log->head : from;    // Registered now, so the trimmer keeps it.
+  s->link = log->senders;
+  log->senders = s;
+  log->followers++;
+  pthread_mutex_unlock(&log->mutx);
+
+  if (pthread_create(&tid, NULL, repl_sender, s)) {
+    pthread_mutex_lock(&log->mutx);
+    log->followers--;
+    for (prev = &log->senders; *prev != s; prev = &(*prev)->link)
+      ;
+    *prev = s->link;
+    pthread_mutex_unlock(&log->mutx);
+    free(s);
+    return -1;
+  }
+  pthread_detach(tid);
+  return 0;
+}
+
+/*
+ * @name repl_connect - Connects to the primary.
+ *
+ * @return The socket on Success. -1 on Error.
+ */
+static int repl_connect() {
+  struct addrinfo hints, *res, *ai;
+  char port[16];
+  int socket_fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  sprintf(port, "%d", follower.port);
+  if (getaddrinfo(follower.host, port, &hints, &res))
+    return -1;
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((socket_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+      continue;
+    if (!connect(socket_fd, ai->ai_addr, ai->ai_addrlen))
+      break;
+    close(socket_fd);
+    socket_fd = -1;
+  }
+  freeaddrinfo(res);
+  return socket_fd;
+}
+
+/*
+ * @name repl_apply - Applies one 'R:<position>:<key>:<value>' (or 'D:<position>:<key>') message.
+ *
+ * @return 0 on Success. -1 if the stream must be restarted.
+ */
+static int repl_apply(char *msg, char *key, char *value) {
+  const int deleted = (msg[0] == 'D');
+  unsigned long long pos;
+  char *p, *sep;
+
+  pos = strtoull(msg + 2, &p, 10);
+  if (*p != ':')
+    return -1;
+  if (!(sep = strchr(p + 1, ':')) && !(deleted && (sep = p + 1 + strlen(p + 1))))
+    return -1;
+  if (follower.copying || pos != follower.applied)   // Out of order: resume from what was applied.
+    return -1;
+
+  memset(key, 0, follower.key_size);
+  memset(value, 0, follower.value_size);
+  memcpy(key, p + 1, (sep - p - 1 < (long) follower.key_size) ? sep - p - 1 : follower.key_size);
+  if (!deleted)
+    strncpy(value, sep + 1, follower.value_size);
+  if (follower.apply(key, deleted ? NULL : value))
+    return -1;
+
+  pthread_mutex_lock(&follower.mutx);
+  follower.applied++;
+  if (follower.head < follower.applied)
+    follower.head = follower.applied;
+  pthread_mutex_unlock(&follower.mutx);
+
+  // Resume point after a restart. Re-applying one PUT after a crash is harmless.
+  if (pwrite(follower.pos_fd, &follower.applied, sizeof(uint64_t), 0) != sizeof(uint64_t))
+    return -1;
+  return 0;
+}
+
+/*
+ * @name repl_copy - Applies one message of a copy of the primary's tables: 'B:<position>', 'S:<key>:<value>' or 'E:<position>'.
+ *
+ * The tables are emptied at 'B'. The position only moves at 'E', so a copy cut short starts over after the reconnect.
+ * @return 0 on Success. -1 if the stream must be restarted.
+ */
+static int repl_copy(char *msg, char *key, char *value) {
+  char *sep;
+
+  if (msg[0] == 'B') {
+    follower.copy_pos = strtoull(msg + 2, NULL, 10);
+    follower.copying = 1;
+    fprintf(stderr, "(Info) repl_copy: Copying the primary's tables.\n");
+    return follower.reset() ? -1 : 0;
+  }
+  if (!follower.copying)
+    return -1;
+  if (msg[0] == 'E') {
+    if (strtoull(msg + 2, NULL, 10) != follower.copy_pos)
+      return -1;
+    follower.copying = 0;
+    pthread_mutex_lock(&follower.mutx);
+    follower.applied = follower.copy_pos;
+    if (follower.head < follower.applied)
+      follower.head = follower.applied;
+    pthread_mutex_unlock(&follower.mutx);
+    fprintf(stderr, "(Info) repl_copy: Copied the primary's tables, following from position %llu.\n",
+            (unsigned long long) follower.applied);
+    return (pwrite(follower.pos_fd, &follower.applied, sizeof(uint64_t), 0) != sizeof(uint64_t)) ? -1 : 0;
+  }
+
+  if (!(sep = strchr(msg + 2, ':')))
+    return -1;
+  memset(key, 0, follower.key_size);
+  memset(value, 0, follower.value_size);
+  memcpy(key, msg + 2, (sep - msg - 2 < (long) follower.key_size) ? sep - msg - 2 : follower.key_size);
+  strncpy(value, sep + 1, follower.value_size);
+  return follower.apply(key, value) ? -1 : 0;
+}
+
+/*
+ * @name repl_follower - Follower thread: (re)connects to the primary and applies its log in order.
+ *
+ * @return
+ */
+static void *repl_follower(void *arg) {
+  const int msg_size = follower.key_size + follower.value_size + 64;
+  char *msg, *key, *value;
+  int socket_fd, n;
+
+  msg = (char *) malloc(msg_size);
+  key = (char *) malloc(follower.key_size);
+  value = (char *) malloc(follower.value_size);
+  if (!msg || !key || !value)
+    return NULL;
+
+  while (1) {
+    if ((socket_fd = repl_connect()) == -1) {
+      sleep(REPL_RETRY_SEC);
+      continue;
+    }
+
+    n = snprintf(msg, msg_size, "REPLICATE:%llu", (unsigned long long) follower.applied);
+    if (write_msg_to_socket(socket_fd, msg, n) > 0) {
+      pthread_mutex_lock(&follower.mutx);
+      follower.connected = 1;
+      pthread_mutex_unlock(&follower.mutx);
+      fprintf(stderr, "(Info) repl_follower: Following %s:%d from position %llu.\n",
+              follower.host, follower.port, (unsigned long long) follower.applied);
+
+      while ((n = read_msg_from_socket(socket_fd, msg, msg_size)) > 0) {
+        pthread_mutex_lock(&follower.mutx);
+        follower.last_ms = repl_now_ms();
+        pthread_mutex_unlock(&follower.mutx);
+
+        if (msg[0] == 'H' && msg[1] == ':') {
+          pthread_mutex_lock(&follower.mutx);
+          follower.head = strtoull(msg + 2, NULL, 10);
+          pthread_mutex_unlock(&follower.mutx);
+        } else if (msg[1] != ':' || ((msg[0] == 'R' || msg[0] == 'D') ? repl_apply(msg, key, value) :
+                   (msg[0] == 'B' || msg[0] == 'S' || msg[0] == 'E') ? repl_copy(msg, key, value) : -1)) {
+          fprintf(stderr, "(Error) repl_follower: Unexpected message from the primary: %.64s\n", msg);
+          break;
+        }
+      }
+
+      follower.copying = 0;
+      pthread_mutex_lock(&follower.mutx);
+      follower.connected = 0;
+      pthread_mutex_unlock(&follower.mutx);
+      fprintf(stderr, "(Info) repl_follower: Lost the primary at position %llu, reconnecting.\n",
+              (unsigned long long) follower.applied);
+    }
+    close(socket_fd);
+    sleep(REPL_RETRY_SEC);
+  }
+  return NULL;
+}
+
+/**
+ * @name repl_follow - Starts following a primary.
+ * @param host: The primary's address or hostname.
+ * @param port: The primary's port.
+ * @param pos_path: File holding the applied position, to resume after a restart.
+ * @param key_size: Size of keys in bytes.
+ * @param value_size: Size of values in bytes.
+ * @param apply: Applies a replicated PUT.
+ * @param reset: Empties the tables before a copy of the primary's.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int repl_follow(const char *host, int port, const char *pos_path, unsigned long key_size, unsigned long value_size,
+                ReplApply apply, ReplReset reset) {
+  pthread_t tid;
+
+  strncpy(follower.host, host, sizeof(follower.host) - 1);
+  follower.port = port;
+  follower.key_size = key_size;
+  follower.value_size = value_size;
+  follower.apply = apply;
+  follower.reset = reset;
+  follower.last_ms = -1;
+
+  if ((follower.pos_fd = open(pos_path, O_RDWR | O_CREAT, 0644)) == -1)
+    return -1;
+  if (pread(follower.pos_fd, &follower.applied, sizeof(uint64_t), 0) != sizeof(uint64_t))
+    follower.applied = 0;
+  follower.head = follower.applied;
+
+  if (pthread_create(&tid, NULL, repl_follower, NULL))
+    return -1;
+  pthread_detach(tid);
+  return 0;
+}
+
+/**
+ * @name repl_follower_status - Reports how far behind the primary this follower is.
+ * @param applied: Position applied.
+ * @param head: The primary's log head, as last reported.
+ * @param silent_ms: Milliseconds since the primary was last heard (-1: never).
+ * @param connected: 1 while connected to the primary.
+ *
+ * @return
+ */
+void repl_follower_status(uint64_t *applied, uint64_t *head, int64_t *silent_ms, int *connected) {
+  pthread_mutex_lock(&follower.mutx);
+  *applied = follower.applied;
+  *head = follower.head;
+  *silent_ms = (follower.last_ms < 0) ? -1 : repl_now_ms() - follower.last_ms;
+  *connected = follower.connected;
+  pthread_mutex_unlock(&follower.mutx);
+}
@@ -0,0 +1,81 @@
+/* repl.h
+
+   Asynchronous primary -> follower replication.
+
+   The primary appends every committed PUT and DELETE to a replication
+   log, in commit order. A follower connects with "REPLICATE:<position>"
+   and a sender thread on the primary streams the log from that position
+   on:
+
+     R:<position>:<key>:<value>    one logged PUT
+     D:<position>:<key>            one logged DELETE
+     H:<head>                      heartbeat with the primary's log head
+
+   The follower applies the entries in order and stores the position it
+   reached, so after a restart it resumes from there instead of copying
+   the whole database.
+
+   A new follower (position 0), or one asking for entries the log no
+   longer holds, first gets a copy of every table, taken after the log
+   reached <position>, and then the log from there:
+
+     B:<position>                  a copy starts
+     S:<key>:<value>               one pair of it
+     E:<position>                  the copy is complete
+
+   The follower empties its tables when a copy starts, so the keys the
+   primary deleted while it was away go too.
+
+   The log keeps the entries the connected followers haven't been sent,
+   plus the last REPL_LOG_KEEP (repl.c) for those that reconnect; a trimmer
+   thread drops older ones.
+
+*/
+
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdint.h>
+
+typedef struct repllog ReplLog;
+
+// Applies one replicated PUT (a DELETE if 'value' is NULL) on a follower. 0 on success.
+typedef int (*ReplApply)(const char *key, const char *value);
+
+// Empties the follower's tables before a copy of the primary's. 0 on success.
+typedef int (*ReplReset)(void);
+
+// Sends one pair of a copy to a follower ('arg' as given to the ReplSnapshot). 0 on success.
+typedef int (*ReplEmit)(void *arg, const char *key, const char *value);
+
+// Copies every table with 'emit', each from a snapshot taken when called (primary). 0 on success.
+typedef int (*ReplSnapshot)(ReplEmit emit, void *arg);
+
+// open (or create) the replication log at 'path'. 'snapshot' copies the tables to a follower the log can't
+// bring up to date. NULL on error.
+ReplLog *repl_log_open(const char *path, unsigned long key_size, unsigned long value_size, ReplSnapshot snapshot);
+
+// append a committed PUT (a DELETE if 'value' is NULL). Callers serialize appends in commit order. 0 on success.
+int repl_log_append(ReplLog *log, const char *key, const char *value);
+
+// number of entries in the log (the position the next append gets).
+uint64_t repl_log_head(ReplLog *log);
+
+// first position still in the log (the trimmer dropped older ones).
+uint64_t repl_log_base(ReplLog *log);
+
+// number of followers being streamed to.
+int repl_log_followers(ReplLog *log);
+
+// stream the log from 'from' to the follower on 'socket_fd' in a detached thread that owns the socket. 0 on success.
+int repl_serve_follower(ReplLog *log, int socket_fd, uint64_t from);
+
+// follow the primary at host:port, applying its PUTs with 'apply' (and emptying the tables with 'reset' before a copy)
+// and keeping the position in 'pos_path'. 0 on success.
+int repl_follow(const char *host, int port, const char *pos_path, unsigned long key_size, unsigned long value_size,
+                ReplApply apply, ReplReset reset);
+
+// follower state: position applied, primary's head as last reported, ms since the primary was last heard, connected.
+void repl_follower_status(uint64_t *applied, uint64_t *head, int64_t *silent_ms, int *connected);
+
+#endif
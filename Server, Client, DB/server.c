@@ -1,9 +1,30 @@
+#define _GNU_SOURCE                 // pthread_attr_setaffinity_np(), cpu_set_t.
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
+#include <glob.h>
 #include "utils.h"
-#include "kissdb.h"
+#include "tseries.h"
+#include "agg.h"
+#include "repl.h"
+#include "trace.h"
+#include "hotkeys.h"
+#include "shmring.h"
+#include "engine.h"
+#include "tables.h"
+#include "watch.h"
 
 #define MY_PORT                 6767
 #define BUF_SIZE                1160
@@ -11,9 +32,23 @@
 #define HASH_SIZE               1024
 #define VALUE_SIZE              1024
 #define MAX_PENDING_CONNECTIONS   10
+#define PATH_LEN                1024
+#define CACHE_LINE                64  // Shared hot variables get a line of their own, so writers on different cores don't bounce it.
 
-#define QUEUE_SIZE                 10  // QUEUE_SIZE>=2
-#define THREAD_NUM                 10  // THREAD_NUM>=1
+#define QUEUE_SIZE                 10  // Default FIFO size (-Q), QUEUE_SIZE>=2
+#define THREAD_NUM                 10  // Default number of workers (-w), THREAD_NUM>=1
+#define IO_THREADS                  2  // Default number of I/O threads (-i), IO_THREADS>=1
+#define IO_EVENTS                  64  // Events per epoll_wait().
+#define IO_OUT_MAX     (64 * BUF_SIZE)  // Reply bytes a client may leave unread before its next requests wait.
+#define SCAN_THREADS                4  // Threads per SCAN/AGG request, one partition each.
+#define AGG_BATCH                1024  // Values parsed per aggregation batch.
+#define ORDERED_INDEX               1  // kissdb engine: keep an ordered key index (mydb.db.idx) for RANGE/PREFIX.
+#define TIME_SERIES                 1  // PUTs of integer values also append a timestamped sample (mydb.db.ts) for TSAGG.
+#define HOT_KEYS                    1  // Sketch the keys of GETs/PUTs and report the hottest (HOTKEYS, Control+Z).
+#define HOT_KEY_WINDOW             10  // Seconds per hot-key window.
+#define ZERO_COPY_GET             256  // GET values this long (or more) go from the DB file to the socket with sendfile(); 0: never.
+#define COMPACT_SEC                60  // kissdb engine: seconds between checks whether mydb.db needs compacting; 0: only on COMPACT.
+#define MEM_SNAPSHOT_SEC           10  // memory engine: default seconds between snapshots to mydb.db (-m).
 
 #define EMPTY                      1   // FIFO Queue's states
 #define FULL                       2
@@ -23,231 +58,2286 @@
 // Definition of the operation type.
 typedef enum operation {
   PUT,
-  GET
+  GET,
+  SCAN,
+  RANGE,
+  PREFIX,
+  TSAGG,
+  AGG,
+  REPLICATE,
+  STATUS,
+  SESSION,
+  TRACE,
+  HOTKEYS,
+  QUEUES,
+  INCR,
+  DECR,
+  CAS,
+  APPEND,
+  SHM,
+  MGET,
+  DELETE,
+  COMPACT,
+  WATCH,
+  UNWATCH
 } Operation; 
 
+// Names of the operations, as in the requests.
+const char *op_names[] = {
+  "PUT", "GET", "SCAN", "RANGE", "PREFIX", "TSAGG", "AGG", "REPLICATE", "STATUS", "SESSION", "TRACE", "HOTKEYS", "QUEUES",
+  "INCR", "DECR", "CAS", "APPEND", "SHM", "MGET", "DELETE", "COMPACT", "WATCH", "UNWATCH"
+};
+
 // Definition of the request.
 typedef struct request {
   Operation operation;
+  char table_name[TABLE_NAME_LEN];   // "@table:request": a named table's ("" the default table's).
   char key[KEY_SIZE];  
   char value[VALUE_SIZE];
+  uint64_t value_offset;     // GET of a large value: where it is in the DB file, sent from there by the I/O thread (0: in 'value').
+  Table *table;              // Held while it's served (and, for 'value_offset', until its reply is out).
 } Request;
 
-// Definition of FIFO's elements
-typedef struct inqueue
-{ 
-  int accptFd;                 // File Descriptor
-  struct timeval accptTime;    // Time (sec,usecs)
-} InQueue;
+// Definition of a SCAN/AGG partition, handled by its own thread.
+typedef struct scanjob {
+  Engine *engine;                  // The table's.
+  void *snap;                      // Point-in-time view shared by all partitions (engine_snapshot()).
+  int socket_fd;                   // SCAN: Client socket, shared by all partitions.
+  pthread_mutex_t *socket_mutx;    // SCAN: Serializes the partitions' writes to the socket.
+  const char *prefix;              // AGG: Only keys starting with 'prefix'.
+  size_t prefix_len;
+  AggResult agg;                   // AGG: This partition's aggregate.
+  unsigned long part;              // Partition number (0 .. SCAN_THREADS-1).
+  unsigned long entries;           // Entries sent by this partition.
+  int error;
+} ScanJob;
+
+// Definition of a worker's statistics. Each worker writes only its own, on its own cache line.
+typedef struct workerstats {
+  double total_waiting_time;
+  double total_service_time;
+  int completed_requests;
+} __attribute__((aligned(CACHE_LINE))) WorkerStats;
+
+// Definition of a client connection, served by one I/O thread (non-blocking).
+typedef struct conn {
+  int fd;
+  int local;                   // Accepted on the Unix domain socket.
+  ShmChannel *shm;             // After "SHM": requests and replies go through shared memory, 'fd' only tells a hangup.
+  int session;                 // After "SESSION": tagged requests ("<id>|request"), kept open.
+  int busy;                    // One of its requests is being served (one at a time, so replies keep the requests' order).
+  int closed;                  // Hung up while busy: freed when the reply comes back.
+  int64_t accptTime;           // When the current request started to arrive (monotonic, nsecs).
+  char in[sizeof(int) + BUF_SIZE];   // Received bytes not framed yet: <int length><request>...
+  int in_len;
+  char *out;                   // Reply bytes the socket didn't take yet.
+  int out_len, out_off, out_cap;
+  uint32_t events;             // Registered with epoll.
+  struct iothread *io;
+  int dead;                    // Closed: freed once the I/O thread is done with its batch of events.
+  struct conn *next_dead;
+  Watcher *watch;              // After "WATCH": kept open, told of the changes of the keys it watches.
+  int watch_queued;            // On its I/O thread's 'watching' list.
+  struct conn *next_watch;
+} Conn;
+
+// Definition of a request, passed from stage to stage.
+typedef struct job {
+  Conn *conn;
+  Request *request;
+  char tag[12];                // A session request's tag ("" if it isn't a session).
+  char response_str[BUF_SIZE];
+  TraceSpan span;
+  struct job *next;            // In its I/O thread's reply queue.
+} Job;
+
+// Definition of an I/O thread: reads and frames its connections' requests, writes their replies.
+typedef struct iothread {
+  pthread_t tid;
+  int epfd;
+  int wake_fd;                 // eventfd, written when replies are queued.
+  pthread_mutex_t reply_mutx;
+  Job *replies, *replies_tail; // Reply queue, filled by the DB workers.
+  int num_replies,             // Its length, and the longest it has been.
+      max_replies;
+  int num_conns;               // Connections served (updated atomically).
+  Conn *watching;              // Connections with changes to take, filled by the notifier (under 'reply_mutx').
+  Conn *dead;                  // Closed in this batch of events, which may still name them.
+} __attribute__((aligned(CACHE_LINE))) IOThread;
+
+// Definition of FIFO's elements
+typedef struct inqueue
+{ 
+  Job *job;                    // Parsed request
+  int64_t accptTime;           // Monotonic time (nsecs)
+} InQueue;
+
+int thread_num = THREAD_NUM,   // Workers, FIFO size and I/O threads, set with -w, -Q and -i.
+    queue_size = QUEUE_SIZE,
+    io_num = IO_THREADS;
+
+pthread_t *id;                 // All threads
+
+IOThread *io_threads;          // Network stage: frames requests and writes replies.
+int num_streams = 0;           // SCAN/RANGE/PREFIX/MGET/REPLICATE connections, each on a thread of its own.
+
+int queue_max = 0;             // The DB FIFO's longest length, and how often it was full.
+unsigned long queue_full = 0;
+
+int state = EMPTY;             // FIFO Queue's state. (defined as EMPTY, FULL or LOADED)
+int stopping = 0;              // Control+Z: the workers take no more requests from the FIFO.
+int busy = 0;                  // Workers running a request.
+int head __attribute__((aligned(CACHE_LINE))) = 0,   // FIFO Queue's head & tail, a cache line each.
+    tail __attribute__((aligned(CACHE_LINE))) = 0;
+
+WorkerStats **stats;                // Per worker, allocated by the worker itself once it runs on its cpu.
+
+int cpus[CPU_SETSIZE];              // -c: cpus[0] runs the acceptor, the rest the workers (round robin).
+int num_cpus = 0;
+
+pthread_mutex_t fifo_mutx __attribute__((aligned(CACHE_LINE))) = PTHREAD_MUTEX_INITIALIZER,
+                log_mutx __attribute__((aligned(CACHE_LINE))) = PTHREAD_MUTEX_INITIALIZER;   // Commits' shared logs.
+
+pthread_cond_t emptyFifo = PTHREAD_COND_INITIALIZER,
+               fullFifo = PTHREAD_COND_INITIALIZER,
+               drained = PTHREAD_COND_INITIALIZER;   // The last busy worker is done, once stopping.
+
+int reader_count,                   // Count readers(GET), writers(PUT)
+    writer_count = 0;
+
+// Definition of the database: its tables, the default one (the database file) and the named ones, on
+// a storage engine (-e) which locks them as it needs. Each table has its own writer lock.
+Tables *tables = NULL;
+char engine_type[16] = "kissdb";
+int mem_snapshot_sec = MEM_SNAPSHOT_SEC;  // -m: the memory engine's seconds between snapshots.
+int max_tables = TABLES_OPEN;       // -n: named tables open at once, at most.
+
+// Time series of the integer values PUT per key.
+TSeries *ts = NULL;
+
+// Per-worker key sketches, merged every HOT_KEY_WINDOW seconds.
+HotKeys *hot = NULL;
+
+// Change subscriptions (WATCH): told of every commit.
+WatchHub *watch_hub = NULL;
+
+char unix_path[PATH_LEN] = "";      // Unix domain socket for local clients (default: SHM_UNIX_PATH for the port).
+char db_file[PATH_LEN] = "mydb.db";  // Database file; the index, time series and replication files are named after it.
+int port = MY_PORT;
+
+char trace_file[PATH_LEN + 16] = "";  // -t: sampled requests' spans are exported here (Chrome trace JSON).
+
+ReplLog *rlog = NULL;               // Primary: log of committed PUTs, streamed to followers.
+int follower = 0;                   // Follower: read-only, applies the primary's PUTs.
+
+InQueue *aithseis;                  // FIFO Queue's array: requests waiting for a DB worker.
+
+struct pollfd listeners[2];         // The TCP socket, then the Unix domain socket.
+int num_listeners = 1;
+
+/**
+ * @name parse_request - Parses a received message and generates a new request.
+ * @param buffer: A pointer to the received message.
+ *
+ * @return Initialized request on Success. NULL on Error.
+ */
+Request *parse_request(char *buffer) {
+  char *token = NULL, *save = NULL;    // strtok_r(): the workers parse concurrently.
+  Request *req = NULL;
+  
+  // Check arguments.
+  if (!buffer)
+    return NULL;
+  
+  // Prepare the request.
+  req = (Request *) malloc(sizeof(Request));
+  req->table_name[0] = '\0';
+  memset(req->key, 0, KEY_SIZE);
+  memset(req->value, 0, VALUE_SIZE);
+  req->value_offset = 0;
+  req->table = NULL;
+
+  // Extract the table ("@table:", none for the default table) and the operation type.
+  token = strtok_r(buffer, ":", &save);    
+  if (token && token[0] == '@') {
+    if (!tables_name_ok(token + 1)) {
+      free(req);
+      return NULL;
+    }
+    strcpy(req->table_name, token + 1);
+    token = strtok_r(NULL, ":", &save);
+  }
+  if (!token) {
+    free(req);
+    return NULL;
+  } else if (!strcmp(token, "PUT")) {
+    req->operation = PUT;
+  } else if (!strcmp(token, "GET")) {
+    req->operation = GET;
+  } else if (!strcmp(token, "DELETE")) {
+    req->operation = DELETE;
+  } else if (!strcmp(token, "COMPACT")) {
+    req->operation = COMPACT;         // Compact the DB file now (the kissdb engine), while serving.
+    return req;
+  } else if (!strcmp(token, "WATCH")) {
+    req->operation = WATCH;           // WATCH:key or WATCH:prefix*[:window_ms], the window is kept in 'value'.
+  } else if (!strcmp(token, "UNWATCH")) {
+    req->operation = UNWATCH;
+  } else if (!strcmp(token, "SCAN")) {
+    req->operation = SCAN;            // No key, streams the whole database.
+    return req;
+  } else if (!strcmp(token, "RANGE")) {
+    req->operation = RANGE;           // RANGE:lo:hi, hi is kept in 'value'.
+  } else if (!strcmp(token, "PREFIX")) {
+    req->operation = PREFIX;
+  } else if (!strcmp(token, "AGG")) {
+    req->operation = AGG;             // AGG:function[:prefix], the prefix is kept in 'value'.
+  } else if (!strcmp(token, "REPLICATE")) {
+    req->operation = REPLICATE;       // REPLICATE:position, sent by a follower.
+  } else if (!strcmp(token, "STATUS")) {
+    req->operation = STATUS;
+    return req;
+  } else if (!strcmp(token, "SESSION")) {
+    req->operation = SESSION;         // Keep the connection open for tagged requests.
+    return req;
+  } else if (!strcmp(token, "SHM")) {
+    req->operation = SHM;             // A local session over shared memory instead of the socket.
+    return req;
+  } else if (!strcmp(token, "TRACE")) {
+    req->operation = TRACE;           // Export the tracing spans.
+    return req;
+  } else if (!strcmp(token, "HOTKEYS")) {
+    req->operation = HOTKEYS;         // The last window's hottest keys.
+    return req;
+  } else if (!strcmp(token, "QUEUES")) {
+    req->operation = QUEUES;          // Lengths of the stages' queues.
+    return req;
+  } else if (!strcmp(token, "INCR")) {
+    req->operation = INCR;            // INCR:key[:delta], the delta (default 1) is kept in 'value'.
+  } else if (!strcmp(token, "DECR")) {
+    req->operation = DECR;
+  } else if (!strcmp(token, "CAS")) {
+    req->operation = CAS;             // CAS:key:expected:new, "expected:new" is kept in 'value'.
+  } else if (!strcmp(token, "APPEND")) {
+    req->operation = APPEND;          // APPEND:key:suffix
+  } else if (!strcmp(token, "MGET")) {
+    req->operation = MGET;            // MGET:key1,key2,..., the list is kept in 'value' (its first key in 'key').
+    token = strtok_r(NULL, "", &save);
+    if (!token || !*token) {
+      free(req);
+      return NULL;
+    }
+    strncpy(req->value, token, VALUE_SIZE - 1);
+    strncpy(req->key, token, strcspn(token, ",") < KEY_SIZE ? strcspn(token, ",") : KEY_SIZE);
+    if (req->key[0] == '@') {
+      free(req);
+      return NULL;
+    }
+    return req;
+  } else if (!strcmp(token, "TSAGG")) {
+    req->operation = TSAGG;           // TSAGG:key[:from_ms[:to_ms]], the window is kept in 'value'.
+  } else {
+    free(req);
+    return NULL;
+  }
+  
+  // Extract the key. It can't start with '@', which marks a named table's keys in the logs (see qualify_key()).
+  token = strtok_r(NULL, ":", &save);
+  if (token && token[0] != '@') {
+    strncpy(req->key, token, KEY_SIZE);
+  } else {
+    free(req);
+    return NULL;
+  }
+  
+  // Extract the value.
+  token = strtok_r(NULL, (req->operation == TSAGG || req->operation == CAS) ? "" : ":", &save);
+  if (token) {
+    strncpy(req->value, token, VALUE_SIZE);
+  } else if (req->operation == PUT || req->operation == RANGE || req->operation == CAS || req->operation == APPEND) {
+    free(req);
+    return NULL;
+  }
+  return req;
+}
+
+/**
+ * @name free_request - Frees a request, letting go of its table.
+ * @param request: The request (NULL: none).
+ *
+ * @return
+ */
+void free_request(Request *request) {
+  if (!request)
+    return;
+  tables_release(tables, request->table);
+  free(request);
+}
+
+/**
+ * @name qualify_key - Names a key in the logs, the time series, the hot keys and to the watchers: the key itself in
+ *                     the default table, "@table/key" in a named table.
+ * @param table_name: The table ("" for the default one).
+ * @param key: The key, or a WATCH pattern (KEY_SIZE bytes).
+ * @param qkey: Buffer of KEY_SIZE bytes for the name.
+ *
+ * @return 0 on Success. -1 if the name doesn't fit.
+ */
+int qualify_key(const char *table_name, const char *key, char *qkey) {
+  if (!table_name[0]) {
+    memcpy(qkey, key, KEY_SIZE);
+    return 0;
+  }
+  memset(qkey, 0, KEY_SIZE);
+  return (snprintf(qkey, KEY_SIZE, "@%s/%.*s", table_name, KEY_SIZE, key) < KEY_SIZE) ? 0 : -1;
+}
+
+/**
+ * @name open_table - Holds the table of a request that reads or writes one, opening it if it isn't open.
+ * @param request: The request.
+ * @param response_str: Buffer for the reply if it can't be served.
+ *
+ * A named table's keys (and PUT values) must fit its sizes, and its keys' names (qualify_key()) KEY_SIZE.
+ * @return 0 on Success. -1 on Error.
+ */
+int open_table(Request *request, char *response_str) {
+  const char *op = (request->operation == PREFIX) ? "RANGE" : op_names[request->operation];
+  Table *t;
+  char qkey[KEY_SIZE];
+
+  if (!(t = request->table = tables_acquire(tables, request->table_name))) {
+    sprintf(response_str, "%s ERROR: cannot open table %s\n", op, request->table_name);
+    return -1;
+  }
+  if (t->name[0] && (strnlen(request->key, KEY_SIZE) >= t->key_size || qualify_key(t->name, request->key, qkey) ||
+                     (request->operation == PUT && strnlen(request->value, VALUE_SIZE) >= t->value_size))) {
+    sprintf(response_str, "%s ERROR: too long for table %s\n", op, t->name);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @name parse_cpus - Parses a cpu list such as "0,2,4-7" into 'cpus'.
+ * @param list: The cpu list.
+ *
+ * @return Number of cpus on Success. -1 on Error (or a cpu this process may not run on).
+ */
+int parse_cpus(const char *list) {
+  cpu_set_t allowed;
+  char *end;
+  long first, last;
+
+  num_cpus = 0;
+  while (*list) {
+    first = last = strtol(list, &end, 10);
+    if (end == list)
+      return -1;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list)
+        return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return -1;
+    for (; first <= last && num_cpus < CPU_SETSIZE; first++)
+      cpus[num_cpus++] = first;
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return -1;
+    list = end;
+  }
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed))
+    return -1;
+  for (first = 0; first < num_cpus; first++) {
+    if (!CPU_ISSET(cpus[first], &allowed))
+      return -1;
+  }
+  return num_cpus;
+}
+
+/**
+ * @name pin_attr - Restricts the threads created with 'attr' to cpus[first .. first+count-1].
+ * @param attr: Initialized thread attributes.
+ * @param first: Index of the first cpu in 'cpus'.
+ * @param count: Number of cpus.
+ *
+ * The thread starts on its cpu, so its stack is first touched (allocated) on that cpu's NUMA node.
+ * Does nothing without -c.
+ * @return
+ */
+void pin_attr(pthread_attr_t *attr, int first, int count) {
+  cpu_set_t set;
+  int k;
+
+  if (!num_cpus)
+    return;
+  CPU_ZERO(&set);
+  for (k = first; k < first + count; k++)
+    CPU_SET(cpus[k], &set);
+  pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/*
+ * @name flush_pairs - Sends the 'key:value' lines collected in a chunk as one message.
+ * @param socket_fd: The accept descriptor.
+ * @param socket_mutx: Serializes writers sharing the socket (NULL if there's only one).
+ * @param chunk: The collected lines.
+ * @param len: The chunk's length, reset to 0.
+ *
+ * @return
+ */
+void flush_pairs(int socket_fd, pthread_mutex_t *socket_mutx, char *chunk, int *len) {
+  if (!*len)
+    return;
+  if (socket_mutx)
+    pthread_mutex_lock(socket_mutx);
+  write_str_to_socket(socket_fd, chunk, *len);
+  if (socket_mutx)
+    pthread_mutex_unlock(socket_mutx);
+  *len = 0;
+}
+
+/*
+ * @name send_pair - Appends a 'key:value' line to a chunk of up to BUF_SIZE bytes, sending the chunk first if the line doesn't fit.
+ * @param socket_fd: The accept descriptor.
+ * @param socket_mutx: Serializes writers sharing the socket (NULL if there's only one).
+ * @param chunk: The collected lines.
+ * @param len: The chunk's length.
+ * @param key: The key (KEY_SIZE bytes).
+ * @param value: The value (VALUE_SIZE bytes).
+ *
+ * @return
+ */
+void send_pair(int socket_fd, pthread_mutex_t *socket_mutx, char *chunk, int *len, const char *key, const char *value) {
+  if (*len + KEY_SIZE + VALUE_SIZE + 3 > BUF_SIZE)
+    flush_pairs(socket_fd, socket_mutx, chunk, len);
+  *len += snprintf(chunk + *len, BUF_SIZE - *len, "%.*s:%.*s\n", KEY_SIZE, key, VALUE_SIZE, value);
+}
+
+/*
+ * @name scan_partition - Streams one partition of the database to the client.
+ * @param arg: The partition's ScanJob.
+ *
+ * @return
+ */
+void *scan_partition(void *arg) {
+  ScanJob *job = (ScanJob *) arg;
+  EngineCursor *cur;
+  char key[KEY_SIZE], value[VALUE_SIZE], chunk[BUF_SIZE];
+  int rc, len = 0;
+
+  if (!(cur = engine_scan(job->engine, job->snap, job->part, SCAN_THREADS))) {
+    job->error = 1;
+    return NULL;
+  }
+
+  while ((rc = engine_next(cur, key, value)) > 0) {
+    send_pair(job->socket_fd, job->socket_mutx, chunk, &len, key, value);
+    job->entries++;
+  }
+  flush_pairs(job->socket_fd, job->socket_mutx, chunk, &len);
+  if (rc < 0)
+    job->error = 1;
+
+  engine_cursor_close(cur);
+  return NULL;
+}
+
+/*
+ * @name aggregate_partition - Aggregates the integer values of one partition of the database.
+ * @param arg: The partition's ScanJob.
+ *
+ * Values are parsed into a packed array and reduced AGG_BATCH at a time. Non-integer values are skipped.
+ * @return
+ */
+void *aggregate_partition(void *arg) {
+  ScanJob *job = (ScanJob *) arg;
+  EngineCursor *cur;
+  char key[KEY_SIZE], value[VALUE_SIZE + 1], *end;
+  int32_t packed[AGG_BATCH];
+  size_t n = 0;
+  long v;
+  int rc;
+
+  agg_init(&job->agg);
+  if (!(cur = engine_scan(job->engine, job->snap, job->part, SCAN_THREADS))) {
+    job->error = 1;
+    return NULL;
+  }
+
+  value[VALUE_SIZE] = '\0';
+  while ((rc = engine_next(cur, key, value)) > 0) {
+    if (job->prefix_len && strncmp(key, job->prefix, job->prefix_len))
+      continue;
+    v = strtol(value, &end, 10);
+    if (end == value || *end || v > INT32_MAX || v < INT32_MIN)
+      continue;
+    packed[n++] = (int32_t) v;
+    if (n == AGG_BATCH) {
+      agg_reduce_i32(&job->agg, packed, n, 0);
+      n = 0;
+    }
+  }
+  agg_reduce_i32(&job->agg, packed, n, 0);
+  if (rc < 0)
+    job->error = 1;
+
+  engine_cursor_close(cur);
+  return NULL;
+}
+
+/*
+ * @name run_partitions - Runs 'partition' on SCAN_THREADS partitions of a snapshot in parallel.
+ * @param e: The table's engine.
+ * @param partition: The thread function (scan_partition or aggregate_partition).
+ * @param jobs: SCAN_THREADS jobs, with the request's fields set. 'engine', 'snap' and 'part' are set here.
+ *
+ * The partitions read a snapshot, so they see the database exactly as it was when the request
+ * started while PUTs keep going (kissdb: copy-on-write until the snapshot is closed; memory and
+ * lsm: a copy of their pairs, split between the partitions).
+ * @return 0 on Success. 1 on Error.
+ */
+int run_partitions(Engine *e, void *(*partition)(void *), ScanJob *jobs) {
+  pthread_t tid[SCAN_THREADS];
+  pthread_attr_t attr;
+  void *snap;
+  int k, error = 0;
+
+  if (!(snap = engine_snapshot(e)))
+    return 1;
+
+  // Partitions may run on any of the workers' cpus.
+  pthread_attr_init(&attr);
+  pin_attr(&attr, num_cpus > 1, num_cpus > 1 ? num_cpus - 1 : num_cpus);
+  for (k = 0; k < SCAN_THREADS; k++) {
+    jobs[k].engine = e;
+    jobs[k].snap = snap;
+    jobs[k].part = k;
+    jobs[k].entries = 0;
+    jobs[k].error = 0;
+    if (pthread_create(&tid[k], &attr, partition, &jobs[k])) {
+      partition(&jobs[k]);          // No thread available, run this partition here.
+      tid[k] = 0;
+    }
+  }
+  pthread_attr_destroy(&attr);
+  for (k = 0; k < SCAN_THREADS; k++) {
+    if (tid[k])
+      pthread_join(tid[k], NULL);
+    error |= jobs[k].error;
+  }
+
+  engine_release(e, snap);
+  return error;
+}
+
+/*
+ * @name scan_database - Streams all key/value pairs of a table to the client, scanning SCAN_THREADS partitions in parallel.
+ * @param request: The SCAN request.
+ * @param socket_fd: The accept descriptor.
+ * @param response_str: Buffer for the final status line.
+ *
+ * @return
+ */
+void scan_database(Request *request, int socket_fd, char *response_str) {
+  ScanJob jobs[SCAN_THREADS];
+  pthread_mutex_t socket_mutx = PTHREAD_MUTEX_INITIALIZER;
+  unsigned long entries = 0;
+  int k, error;
+
+  memset(jobs, 0, sizeof(jobs));
+  for (k = 0; k < SCAN_THREADS; k++) {
+    jobs[k].socket_fd = socket_fd;
+    jobs[k].socket_mutx = &socket_mutx;
+  }
+  error = run_partitions(request->table->engine, scan_partition, jobs);
+  for (k = 0; k < SCAN_THREADS; k++)
+    entries += jobs[k].entries;
+  pthread_mutex_destroy(&socket_mutx);
+
+  if (error)
+    sprintf(response_str, "SCAN ERROR\n");
+  else
+    sprintf(response_str, "SCAN OK: %lu entries\n", entries);
+}
+
+/*
+ * @name aggregate_database - Computes SUM/MIN/MAX/AVG/COUNT over the integer values of all keys (with an optional key prefix).
+ * @param request: The AGG request (key = function, value = prefix).
+ * @param response_str: Buffer for the response.
+ *
+ * @return
+ */
+void aggregate_database(Request *request, char *response_str) {
+  ScanJob jobs[SCAN_THREADS];
+  AggResult res;
+  int k;
+
+  if (strcmp(request->key, "SUM") && strcmp(request->key, "MIN") && strcmp(request->key, "MAX") &&
+      strcmp(request->key, "AVG") && strcmp(request->key, "COUNT")) {
+    sprintf(response_str, "AGG ERROR: unknown function\n");
+    return;
+  }
+
+  memset(jobs, 0, sizeof(jobs));
+  for (k = 0; k < SCAN_THREADS; k++) {
+    jobs[k].prefix = request->value;
+    jobs[k].prefix_len = strnlen(request->value, KEY_SIZE);
+  }
+  if (run_partitions(request->table->engine, aggregate_partition, jobs)) {
+    sprintf(response_str, "AGG ERROR\n");
+    return;
+  }
+
+  // Only the merged partials cross the network.
+  agg_init(&res);
+  for (k = 0; k < SCAN_THREADS; k++)
+    agg_merge(&res, &jobs[k].agg);
+
+  if (!strcmp(request->key, "COUNT"))
+    sprintf(response_str, "AGG OK: COUNT=%lld\n", (long long) res.count);
+  else if (!res.count)
+    sprintf(response_str, "AGG OK: %s=none (count=0)\n", request->key);
+  else if (!strcmp(request->key, "SUM"))
+    sprintf(response_str, "AGG OK: SUM=%lld (count=%lld)\n", (long long) res.sum, (long long) res.count);
+  else if (!strcmp(request->key, "MIN"))
+    sprintf(response_str, "AGG OK: MIN=%lld (count=%lld)\n", (long long) res.min, (long long) res.count);
+  else if (!strcmp(request->key, "MAX"))
+    sprintf(response_str, "AGG OK: MAX=%lld (count=%lld)\n", (long long) res.max, (long long) res.count);
+  else
+    sprintf(response_str, "AGG OK: AVG=%.2f (count=%lld)\n", (double) res.sum / res.count, (long long) res.count);
+}
+
+/*
+ * @name range_database - Streams the key/value pairs of a RANGE or PREFIX request in key order.
+ * @param request: The parsed request (RANGE: key=lo, value=hi. PREFIX: key=prefix).
+ * @param socket_fd: The accept descriptor.
+ * @param response_str: Buffer for the final status line.
+ *
+ * @return
+ */
+void range_database(Request *request, int socket_fd, char *response_str) {
+  EngineCursor *cur;
+  char hi[KEY_SIZE], key[KEY_SIZE], value[VALUE_SIZE], chunk[BUF_SIZE];
+  const char *name = (request->operation == RANGE) ? "RANGE" : "PREFIX";
+  unsigned long entries = 0;
+  int rc, len = 0;
+
+  snprintf(hi, KEY_SIZE, "%.*s", KEY_SIZE - 1, request->value);
+  if (!(cur = engine_range(request->table->engine, request->key, hi,
+                           request->operation == RANGE ? 0 : strnlen(request->key, KEY_SIZE)))) {
+    sprintf(response_str, "%s ERROR\n", name);   // The engine keeps no key order (or no index).
+    return;
+  }
+
+  while ((rc = engine_next(cur, key, value)) > 0) {
+    send_pair(socket_fd, NULL, chunk, &len, key, value);
+    entries++;
+  }
+  flush_pairs(socket_fd, NULL, chunk, &len);
+  engine_cursor_close(cur);
+
+  if (rc < 0)
+    sprintf(response_str, "%s ERROR\n", name);
+  else
+    sprintf(response_str, "%s OK: %lu entries\n", name, entries);
+}
+
+/*
+ * @name mget_database - Streams the key/value pairs of an MGET request, reading all its keys in one batch.
+ * @param request: The parsed request (value = the keys, comma separated).
+ * @param socket_fd: The accept descriptor.
+ * @param response_str: Buffer for the final status line.
+ *
+ * The kissdb engine reads the keys' records in file order, not with a seek per key. Keys not found are left out.
+ * @return
+ */
+void mget_database(Request *request, int socket_fd, char *response_str) {
+  Table *t = request->table;
+  char *keys, *values, *token, *save = NULL, chunk[BUF_SIZE];
+  int *results, n = 0, max = VALUE_SIZE / 2 + 1, k, found, len = 0;   // At most one key per 2 bytes of the list.
+
+  keys = (char *) calloc(max, t->key_size);   // The table's sizes apart.
+  values = (char *) malloc(max * t->value_size);
+  results = (int *) malloc(max * sizeof(int));
+  if (!keys || !values || !results) {
+    sprintf(response_str, "MGET ERROR\n");
+    goto out;
+  }
+  for (token = strtok_r(request->value, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+    if (t->name[0] && strlen(token) >= t->key_size) {
+      sprintf(response_str, "MGET ERROR: too long for table %s\n", t->name);
+      goto out;
+    }
+    strncpy(keys + t->key_size * n++, token, t->key_size);
+  }
+
+  found = engine_get_batch(t->engine, keys, values, results, n);
+
+  for (k = 0; found > 0 && k < n; k++) {
+    if (!results[k])
+      send_pair(socket_fd, NULL, chunk, &len, keys + t->key_size * k, values + t->value_size * k);
+  }
+  flush_pairs(socket_fd, NULL, chunk, &len);
+
+  if (found < 0)
+    sprintf(response_str, "MGET ERROR\n");
+  else
+    sprintf(response_str, "MGET OK: %d of %d keys found\n", found, n);
+out:
+  free(keys);
+  free(values);
+  free(results);
+}
+
+/*
+ * @name now_ms - Wall-clock time in milliseconds, used to timestamp samples.
+ * @return
+ */
+int64_t now_ms() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+ * @name append_sample - Appends the value of a PUT to its key's time series, if it is an integer.
+ * @param key: The key.
+ * @param str: The value.
+ *
+ * @return
+ */
+void append_sample(const char *key, const char *str) {
+  char *end;
+  long value;
+
+  value = strtol(str, &end, 10);
+  if (end == str || *end || value > INT32_MAX || value < INT32_MIN)
+    return;                         // Not a reading, only kept as the latest value.
+  if (tseries_append(ts, key, now_ms(), (int32_t) value))
+    fprintf(stderr, "(Error) append_sample: Cannot append to '%s'.\n", key);
+}
+
+/*
+ * @name apply_put - Commits a PUT: the table, then the time series, the replication log and the watchers. Called holding the table's 'put_mutx'.
+ * @param t: The table.
+ * @param key: The key (KEY_SIZE bytes).
+ * @param value: The value (VALUE_SIZE bytes).
+ *
+ * The logs are shared by all tables, under 'log_mutx' (taken after the table's write), and name the key with qualify_key().
+ * @return 0 on Success. -1 on Error.
+ */
+int apply_put(Table *t, const char *key, const char *value) {
+  char qkey[KEY_SIZE];
+  int rc = 0;
+
+  if (engine_put(t->engine, key, value))
+    return -1;
+  qualify_key(t->name, key, qkey);
+  pthread_mutex_lock(&log_mutx);
+  if (ts)
+    append_sample(qkey, value);
+  if (rlog && repl_log_append(rlog, qkey, value)) {
+    fprintf(stderr, "(Error) apply_put: Cannot log '%.*s' for the followers.\n", KEY_SIZE, qkey);
+    rc = -1;
+  } else {
+    watch_publish(watch_hub, qkey, value);
+  }
+  pthread_mutex_unlock(&log_mutx);
+  return rc;
+}
+
+/*
+ * @name apply_delete - Commits a DELETE: the table, then the replication log and the watchers. Called holding the table's 'put_mutx'.
+ * @param t: The table.
+ * @param key: The key (KEY_SIZE bytes).
+ *
+ * The key's time series keeps its samples.
+ * @return 0 on Success. 1 if the key wasn't found. -1 on Error.
+ */
+int apply_delete(Table *t, const char *key) {
+  char qkey[KEY_SIZE];
+  int rc;
+
+  if ((rc = engine_delete(t->engine, key)))
+    return rc;
+  qualify_key(t->name, key, qkey);
+  pthread_mutex_lock(&log_mutx);
+  if (rlog && repl_log_append(rlog, qkey, NULL)) {
+    fprintf(stderr, "(Error) apply_delete: Cannot log '%.*s' for the followers.\n", KEY_SIZE, qkey);
+    rc = -1;
+  } else {
+    watch_publish(watch_hub, qkey, NULL);
+  }
+  pthread_mutex_unlock(&log_mutx);
+  return rc;
+}
+
+/*
+ * @name replicate_put - Applies a PUT (or, with a NULL value, a DELETE) streamed by the primary (follower only).
+ * @param key: The key (KEY_SIZE bytes), "@table/key" for a named table's.
+ * @param value: The value (VALUE_SIZE bytes), or NULL.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int replicate_put(const char *key, const char *value) {
+  char name[TABLE_NAME_LEN] = "", table_key[KEY_SIZE];
+  const char *sep;
+  Table *t;
+  int rc;
+
+  memcpy(table_key, key, KEY_SIZE);
+  if (key[0] == '@' && (sep = (const char *) memchr(key, '/', strnlen(key, KEY_SIZE))) &&
+      sep - key - 1 < TABLE_NAME_LEN) {
+    memcpy(name, key + 1, sep - key - 1);
+    name[sep - key - 1] = '\0';
+    memset(table_key, 0, KEY_SIZE);
+    memcpy(table_key, sep + 1, KEY_SIZE - (sep + 1 - key));
+  }
+  if (!(t = tables_acquire(tables, name)))
+    return -1;
+  pthread_mutex_lock(&t->put_mutx);
+  rc = value ? apply_put(t, table_key, value) : (apply_delete(t, table_key) < 0 ? -1 : 0);
+  pthread_mutex_unlock(&t->put_mutx);
+  tables_release(tables, t);
+  return rc;
+}
+
+/*
+ * @name copy_table - Sends every pair of one table to a new follower (primary), or to drop_pair() (follower).
+ * @param name: The table ("" for the default one).
+ * @param emit: Sends a pair, named with qualify_key().
+ * @param arg: For 'emit'.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int copy_table(const char *name, ReplEmit emit, void *arg) {
+  char key[KEY_SIZE], value[VALUE_SIZE], qkey[KEY_SIZE];
+  EngineCursor *cur = NULL;
+  void *snap;
+  Table *t;
+  int rc = -1;
+
+  if (!(t = tables_acquire(tables, name)))
+    return -1;
+  if ((snap = engine_snapshot(t->engine)) && (cur = engine_scan(t->engine, snap, 0, 1))) {
+    do {
+      memset(key, 0, KEY_SIZE);     // A named table's pairs may be shorter.
+      memset(value, 0, VALUE_SIZE);
+      if ((rc = engine_next(cur, key, value)) > 0 && (qualify_key(name, key, qkey) || emit(arg, qkey, value)))
+        rc = -1;
+    } while (rc > 0);
+  }
+  engine_cursor_close(cur);
+  if (snap)
+    engine_release(t->engine, snap);
+  tables_release(tables, t);
+  return rc;
+}
+
+/*
+ * @name replication_snapshot - Copies every table to a new follower (primary): the default table, then the
+ *                              named tables found next to the database file.
+ * @param emit: Sends a pair.
+ * @param arg: For 'emit'.
+ *
+ * The replication log's head was taken first, so each table's snapshot holds every entry before it.
+ * @return 0 on Success. -1 on Error.
+ */
+int replication_snapshot(ReplEmit emit, void *arg) {
+  char pattern[PATH_LEN + 16];
+  const char *name;
+  glob_t files;
+  size_t k;
+  int rc;
+
+  if ((rc = copy_table("", emit, arg)))
+    return rc;
+  sprintf(pattern, "%s.table.*", db_file);
+  if (glob(pattern, 0, NULL, &files))
+    return 0;                       // No named tables.
+  for (k = 0; !rc && k < files.gl_pathc; k++) {
+    name = files.gl_pathv[k] + strlen(pattern) - 1;
+    if (tables_name_ok(name))       // Not their index or log files.
+      rc = copy_table(name, emit, arg);
+  }
+  globfree(&files);
+  return rc;
+}
+
+/*
+ * @name drop_pair - Deletes one pair of a follower's table (for replication_reset()).
+ * @param arg: Unused.
+ * @param key: The key, named with qualify_key().
+ * @param value: Unused.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int drop_pair(void *arg, const char *key, const char *value) {
+  return replicate_put(key, NULL);
+}
+
+/*
+ * @name replication_reset - Empties every table of a follower before it gets a copy of the primary's.
+ *
+ * The pairs are read from snapshots, so deleting them meanwhile is safe.
+ * @return 0 on Success. -1 on Error.
+ */
+int replication_reset() {
+  return replication_snapshot(drop_pair, NULL);
+}
+
+/*
+ * @name update_value - Runs a read-modify-write (INCR, DECR, CAS, APPEND) atomically: the read,
+ *                      the new value and its single write all happen holding its table's 'put_mutx' once.
+ * @param request: The request.
+ * @param response_str: Buffer for the reply.
+ *
+ * @return
+ */
+void update_value(Request *request, char *response_str) {
+  Table *t = request->table;
+  const char *op = op_names[request->operation];
+  char old[VALUE_SIZE], new[VALUE_SIZE], *sep = NULL, *end;
+  long long delta = 1, number;
+  int rc;
+
+  if (follower) {
+    sprintf(response_str, "%s ERROR: read-only follower\n", op);
+    return;
+  }
+
+  // Check the arguments before taking the lock.
+  if (request->operation == INCR || request->operation == DECR) {
+    if (request->value[0]) {
+      errno = 0;
+      delta = strtoll(request->value, &end, 10);
+      if (*end || errno || delta == LLONG_MIN) {
+        sprintf(response_str, "%s ERROR: bad delta\n", op);
+        return;
+      }
+    }
+    if (request->operation == DECR)
+      delta = -delta;
+  } else if (request->operation == CAS) {
+    if (!(sep = strchr(request->value, ':'))) {
+      sprintf(response_str, "FORMAT ERROR\n");
+      return;
+    }
+    *sep = '\0';                    // 'value' is now the expected value, 'sep + 1' the new one.
+    if (strlen(sep + 1) >= t->value_size) {
+      sprintf(response_str, "%s ERROR: too long for table %s\n", op, t->name);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&t->put_mutx);
+  rc = engine_get(t->engine, request->key, old);
+  if (rc < 0) {
+    sprintf(response_str, "%s ERROR\n", op);
+    goto unlock;
+  }
+  if (rc)
+    old[0] = '\0';                  // A missing key counts as "" (0 for INCR/DECR).
+
+  memset(new, 0, VALUE_SIZE);
+  switch (request->operation) {
+    case INCR:
+    case DECR:
+      errno = 0;
+      number = old[0] ? strtoll(old, &end, 10) : 0;
+      if (old[0] && (*end || errno)) {
+        sprintf(response_str, "%s ERROR: not an integer\n", op);
+        goto unlock;
+      }
+      if ((delta > 0 && number > LLONG_MAX - delta) || (delta < 0 && number < LLONG_MIN - delta)) {
+        sprintf(response_str, "%s ERROR: overflow\n", op);
+        goto unlock;
+      }
+      if (snprintf(new, t->value_size, "%lld", number + delta) >= (int) t->value_size) {
+        sprintf(response_str, "%s ERROR: too long for table %s\n", op, t->name);
+        goto unlock;
+      }
+      break;
+    case CAS:
+      if (strcmp(old, request->value)) {
+        if (rc)
+          sprintf(response_str, "CAS FAILED\n");
+        else
+          sprintf(response_str, "CAS FAILED: %s\n", old);
+        goto unlock;
+      }
+      strcpy(new, sep + 1);
+      break;
+    case APPEND:
+      if (strlen(old) + strlen(request->value) >= t->value_size) {
+        sprintf(response_str, "APPEND ERROR: value too long\n");
+        goto unlock;
+      }
+      strcpy(new, old);
+      strcat(new, request->value);
+      break;
+    default:
+      break;
+  }
+
+  if (apply_put(t, request->key, new))
+    sprintf(response_str, "%s ERROR\n", op);
+  else if (request->operation == CAS)
+    sprintf(response_str, "CAS OK\n");
+  else
+    sprintf(response_str, "%s OK: %s\n", op, new);
+unlock:
+  pthread_mutex_unlock(&t->put_mutx);
+}
+
+/*
+ * @name replication_status - Describes this server's replication role and lag.
+ * @param response_str: Buffer for the description.
+ *
+ * @return
+ */
+void replication_status(char *response_str) {
+  uint64_t applied, head;
+  int64_t silent_ms;
+  int connected;
+
+  if (follower) {
+    repl_follower_status(&applied, &head, &silent_ms, &connected);
+    sprintf(response_str, "role=follower connected=%d applied=%llu primary_head=%llu lag=%llu last_heard_ms=%lld",
+            connected, (unsigned long long) applied, (unsigned long long) head,
+            (unsigned long long) (head - applied), (long long) silent_ms);
+  } else if (rlog) {
+    sprintf(response_str, "role=primary log_head=%llu log_base=%llu followers=%d",
+            (unsigned long long) repl_log_head(rlog), (unsigned long long) repl_log_base(rlog), repl_log_followers(rlog));
+  } else {
+    sprintf(response_str, "role=standalone");
+  }
+}
+
+/*
+ * @name aggregate_series - Aggregates a key's samples over a time window.
+ * @param request: The TSAGG request (key, value = "[from_ms[:to_ms]]").
+ * @param response_str: Buffer for the response.
+ *
+ * @return
+ */
+void aggregate_series(Request *request, char *response_str) {
+  long long from = 0, to = INT64_MAX;
+  char qkey[KEY_SIZE];
+  AggResult res;
+
+  sscanf(request->value, "%lld:%lld", &from, &to);
+  if (!ts || qualify_key(request->table_name, request->key, qkey) || tseries_aggregate(ts, qkey, from, to, &res))
+    sprintf(response_str, "TSAGG ERROR\n");
+  else if (!res.count)
+    sprintf(response_str, "TSAGG OK: count=0\n");
+  else
+    sprintf(response_str, "TSAGG OK: count=%lld min=%lld max=%lld avg=%.2f\n",
+            (long long) res.count, (long long) res.min, (long long) res.max, (double) res.sum / res.count);
+}
+
+/*
+ * @name hot_keys_status - Describes the last window's hottest keys: estimated requests, GET/PUT mix and average service time.
+ * @param response_str: Buffer of BUF_SIZE bytes for the description.
+ *
+ * @return
+ */
+void hot_keys_status(char *response_str) {
+  HotKey top[HK_TOP];
+  char entry[HK_KEY + 96];
+  int k, n, len, entry_len, window;
+  uint64_t ops;
+
+  if (!hot) {
+    sprintf(response_str, "off");
+    return;
+  }
+  n = hotkeys_top(hot, top, HK_TOP, &window);
+  len = sprintf(response_str, "window=%ds keys=%d", window, n);
+  for (k = 0; k < n; k++) {
+    ops = top[k].gets + top[k].puts;
+    entry_len = snprintf(entry, sizeof(entry), " %s=%llu(get=%llu,put=%llu,avg_us=%.1f)",
+                         top[k].key, (unsigned long long) top[k].count, (unsigned long long) top[k].gets,
+                         (unsigned long long) top[k].puts, ops ? top[k].service_ns / 1000.0 / ops : 0.0);
+    if (len + entry_len >= BUF_SIZE - 8)   // Room for the caller's "\n": whole keys only.
+      break;
+    strcpy(response_str + len, entry);
+    len += entry_len;
+  }
+}
+
+/*
+ * @name queues_status - Describes the stages' queues: the DB FIFO, the streams, the change notifier's, the named tables
+ *                        open, the I/O threads' connections and reply queues.
+ * @param response_str: Buffer of BUF_SIZE bytes for the description.
+ *
+ * @return
+ */
+void queues_status(char *response_str) {
+  unsigned long dropped, opened, closed;
+  int k, len, queued, watch_max, watchers, open, open_max;
+
+  pthread_mutex_lock(&fifo_mutx);
+  queued = (state == FULL) ? queue_size : (tail - head + queue_size) % queue_size;
+  len = sprintf(response_str, "db_queue=%d/%d db_queue_max=%d db_queue_full=%lu streams=%d",
+                queued, queue_size, queue_max, queue_full, num_streams);
+  pthread_mutex_unlock(&fifo_mutx);
+  if (watch_hub) {
+    watch_stats(watch_hub, &queued, &watch_max, &watchers, &dropped);
+    len += sprintf(response_str + len, " watch_queue=%d/%d watch_queue_max=%d watchers=%d watch_dropped=%lu",
+                   queued, WATCH_QUEUE, watch_max, watchers, dropped);
+  }
+  if (tables) {
+    tables_stats(tables, &open, &open_max, &opened, &closed);
+    len += sprintf(response_str + len, " tables=%d/%d tables_max=%d tables_opened=%lu tables_closed=%lu",
+                   open, max_tables, open_max, opened, closed);
+  }
+  for (k = 0; k < io_num && len < BUF_SIZE - 80; k++) {
+    pthread_mutex_lock(&io_threads[k].reply_mutx);
+    len += sprintf(response_str + len, " io%d=conns:%d,replies:%d,replies_max:%d", k,
+                   io_threads[k].num_conns, io_threads[k].num_replies, io_threads[k].max_replies);
+    pthread_mutex_unlock(&io_threads[k].reply_mutx);
+  }
+}
+
+/**
+ * @name enqueue - Adds a parsed request to the FIFO Queue of the DB workers, waiting while it's full.
+ * @param job: The request.
+ *
+ * Called by the I/O threads. A full FIFO holds the calling I/O thread back: the database sets the pace.
+ * @return
+ */
+void enqueue(Job *job) {
+  int queued;
+
+  pthread_mutex_lock(&fifo_mutx);
+  if (state==FULL)
+    queue_full++;
+  while(state==FULL){               // FIFO is full.
+    fprintf(stdout, "(FIFO is Full) waiting for empty slot in FIFO...\n");
+
+    // Note: Wait mexri na erthei Signal apo ta threads oti yparxei eleytheros xwros sth FIFO.
+    pthread_cond_wait(&fullFifo, &fifo_mutx);
+  }
+
+  // Apothkeysh stoixeiwn ths kathe Aithshs sthn FIFO. (struct: Job, Time)
+  aithseis[tail].job = job;
+  aithseis[tail].accptTime = trace_now_ns();
+
+  tail++;                           // Proxwrw to 'tail' mia thesh mprosta gia thn epomenh(available) apothhkeysh ths Aithshs.
+  if(tail>=queue_size){
+    tail=0;                         // Reset tail back at start of FIFO.
+  }
+  state = (tail==head) ? FULL : LOADED;
+  queued = (state == FULL) ? queue_size : (tail - head + queue_size) % queue_size;
+  if (queued > queue_max)
+    queue_max = queued;
+
+  // Signal threads to continue. (Not Empty Fifo now)
+  pthread_cond_signal(&emptyFifo);
+  pthread_mutex_unlock(&fifo_mutx);
+}
+
+/**
+ * @name conn_close - Closes a connection and frees it. I/O thread only.
+ * @param c: The connection.
+ *
+ * @return
+ */
+void conn_close(Conn *c) {
+  Conn **prev;
+
+  if (c->watch) {
+    watch_close(c->watch);          // After it, the notifier doesn't queue the connection again.
+    c->watch = NULL;
+    if (c->watch_queued) {
+      pthread_mutex_lock(&c->io->reply_mutx);
+      for (prev = &c->io->watching; *prev != c; prev = &(*prev)->next_watch)
+        ;
+      *prev = c->next_watch;
+      c->watch_queued = 0;
+      pthread_mutex_unlock(&c->io->reply_mutx);
+    }
+  }
+  epoll_ctl(c->io->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  if (c->shm) {
+    epoll_ctl(c->io->epfd, EPOLL_CTL_DEL, shm_bell(c->shm), NULL);
+    shm_close(c->shm);
+    c->shm = NULL;
+  }
+  __sync_fetch_and_sub(&c->io->num_conns, 1);
+  free(c->out);
+  c->out = NULL;
+  c->dead = 1;
+  c->next_dead = c->io->dead;
+  c->io->dead = c;
+}
+
+/**
+ * @name conn_events - Polls a connection for what it waits on: a request (unless busy), room for its pending reply.
+ * @param c: The connection.
+ *
+ * @return
+ */
+void conn_events(Conn *c) {
+  struct epoll_event ev;
+  uint32_t want = (c->busy || c->closed || c->out_len - c->out_off > IO_OUT_MAX ? 0 : EPOLLIN) |
+                  (c->out_off < c->out_len ? EPOLLOUT : 0);
+
+  if (c->shm) {
+    // Its doorbell is always polled: have the client ring it for what we wait on, or ring it now if that's here already.
+    if (c->closed)
+      return;
+    shm_sleep(c->shm, ((want & EPOLLIN) ? SHM_WAIT_DATA : 0) | ((want & EPOLLOUT) ? SHM_WAIT_ROOM : 0));
+    if (((want & EPOLLIN) && shm_readable(c->shm)) || ((want & EPOLLOUT) && shm_writable(c->shm)))
+      shm_wake(c->shm);
+    return;
+  }
+  if (want == c->events)
+    return;
+  ev.events = want;
+  ev.data.ptr = c;
+  epoll_ctl(c->io->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+  c->events = want;
+}
+
+/**
+ * @name conn_flush - Writes as much of a connection's pending reply as the socket (or the shared-memory ring) takes.
+ * @param c: The connection.
+ *
+ * @return 0 on Success (written, or waiting for room). -1 on Error.
+ */
+int conn_flush(Conn *c) {
+  int n;
+
+  if (c->shm && c->out_off < c->out_len) {
+    if ((n = shm_write(c->shm, c->out + c->out_off, c->out_len - c->out_off)) < 0)
+      return -1;
+    c->out_off += n;
+    if (c->out_off < c->out_len)
+      return 0;
+  }
+  while (c->out_off < c->out_len) {
+    if ((n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+  return 0;
+}
+
+/**
+ * @name conn_reserve - Makes room at the end of a connection's pending reply bytes.
+ * @param c: The connection.
+ * @param len: Bytes to add.
+ *
+ * @return Where they go on Success. NULL on Error.
+ */
+char *conn_reserve(Conn *c, int len) {
+  char *out;
+
+  if (c->out_len + len > c->out_cap) {
+    if (!(out = (char *) realloc(c->out, c->out_len + len)))
+      return NULL;
+    c->out = out;
+    c->out_cap = c->out_len + len;
+  }
+  return c->out + c->out_len;
+}
+
+/**
+ * @name conn_send - Queues a reply message (tagged for a session) and writes what the socket takes.
+ * @param c: The connection.
+ * @param tag: The request's tag ("" if it isn't a session).
+ * @param response_str: The reply.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int conn_send(Conn *c, const char *tag, const char *response_str) {
+  int len = (tag[0] ? strlen(tag) + 1 : 0) + strlen(response_str);
+  char *out;
+
+  if (!(out = conn_reserve(c, sizeof(int) + len + 1)))
+    return -1;
+  memcpy(out, &len, sizeof(int));
+  if (tag[0])
+    sprintf(out + sizeof(int), "%s|%s", tag, response_str);
+  else
+    memcpy(out + sizeof(int), response_str, len);
+  c->out_len += sizeof(int) + len;
+  return conn_flush(c);
+}
+
+/**
+ * @name conn_send_value - Sends a GET reply whose value is left in the DB file: the header from here, the value with sendfile().
+ * @param c: The connection.
+ * @param job: The GET, with request->value_offset.
+ *
+ * Runs under the DB read lock, so no PUT rewrites the value meanwhile. The key is looked up again: since the worker's
+ * lookup, a PUT or DELETE may have moved it and given its old record to another key, or a compaction moved the whole
+ * file (and, if it couldn't map the new one, left the value to be copied). The value is copied (from the mapped
+ * file) after all on shared memory, behind replies still pending, and for what the socket doesn't take at once.
+ * @return 0 on Success. -1 on Error.
+ */
+int conn_send_value(Conn *c, Job *job) {
+  Request *request = job->request;
+  Engine *engine = request->table->engine;
+  uint64_t offset;
+  const char *map;
+  char head[sizeof(int) + 32], *out;
+  const char *part[3];
+  int part_len[3], len, sent = 0, n, k;
+  off_t pos;
+
+  engine_read_lock(engine);
+  if (!(map = engine_map(engine)) || engine_locate(engine, request->key, &offset)) {
+    engine_read_unlock(engine);
+    if (map || engine_get(engine, request->key, request->value))
+      return conn_send(c, job->tag, "GET ERROR\n");
+    snprintf(job->response_str, BUF_SIZE, "GET OK: %.*s\n", (int) request->table->value_size - 1, request->value);
+    return conn_send(c, job->tag, job->response_str);
+  }
+
+  // <length><tag|>GET OK: , the value, "\n".
+  part[0] = head;
+  part[1] = map + offset;
+  part[2] = "\n";
+  part_len[1] = strnlen(part[1], request->table->value_size - 1);
+  part_len[2] = 1;
+  part_len[0] = sprintf(head + sizeof(int), "%s%sGET OK: ", job->tag, job->tag[0] ? "|" : "");
+  len = part_len[0] + part_len[1] + part_len[2];
+  memcpy(head, &len, sizeof(int));
+  part_len[0] += sizeof(int);
+
+  if (!c->shm && c->out_off == c->out_len &&
+      (n = send(c->fd, head, part_len[0], MSG_NOSIGNAL | MSG_MORE)) > 0 && (sent = n) == part_len[0]) {
+    pos = offset;
+    while (sent < part_len[0] + part_len[1] &&
+           (n = sendfile(c->fd, engine_fd(engine), &pos, part_len[0] + part_len[1] - sent)) > 0)
+      sent += n;
+  }
+
+  // The rest goes through the buffer.
+  if (!(out = conn_reserve(c, sizeof(int) + len - sent))) {
+    engine_read_unlock(engine);
+    return -1;
+  }
+  for (k = 0; k < 3; k++) {
+    n = sent < part_len[k] ? part_len[k] - sent : 0;
+    memcpy(out, part[k] + part_len[k] - n, n);
+    out += n;
+    c->out_len += n;
+    sent = sent > part_len[k] ? sent - part_len[k] : 0;
+  }
+  engine_read_unlock(engine);
+  return conn_flush(c);
+}
+
+/**
+ * @name conn_reply - Sends a request's reply, then closes the connection or (a session) makes it ready for its next request.
+ * @param c: The connection.
+ * @param job: The served request, freed here.
+ *
+ * @return 0 on Success. -1 if the connection was closed (and freed).
+ */
+int conn_reply(Conn *c, Job *job) {
+  int rc = (job->request && job->request->value_offset) ? conn_send_value(c, job) : conn_send(c, job->tag, job->response_str);
+
+  trace_mark(&job->span, TRACE_WRITTEN);
+  free_request(job->request);
+  c->busy = 0;
+  if (rc < 0 || (!c->session && !c->watch)) {
+    if (rc == 0 && c->out_off < c->out_len) {
+      c->closed = 1;                // Closed once the reply is out (io_thread).
+      conn_events(c);
+      rc = 0;
+    } else {
+      conn_close(c);
+      rc = -1;
+    }
+  }
+  trace_mark(&job->span, TRACE_CLOSED);
+  trace_end(&job->span);
+  free(job);
+  return rc;
+}
+
+/**
+ * @name stream_request - Serves a SCAN, RANGE, PREFIX, MGET or REPLICATE request, which writes to the socket as it goes.
+ * @param arg: The Job; the thread owns its connection (blocking again).
+ *
+ * Runs on a thread of its own, so a slow reader holds neither an I/O thread nor a DB worker.
+ * @return
+ */
+void *stream_request(void *arg) {
+  Job *job = (Job *) arg;
+  Request *request = job->request;
+  int socket_fd = job->conn->fd, detached = 0;
+
+  trace_mark(&job->span, TRACE_DEQUEUED);
+  if (request->operation == REPLICATE) {
+    // From a follower: its sender thread owns the socket from now on.
+    if (rlog && !repl_serve_follower(rlog, socket_fd, strtoull(request->key, NULL, 10)))
+      detached = 1;
+    else
+      sprintf(job->response_str, "REPLICATE ERROR\n");
+  } else if (!open_table(request, job->response_str)) {
+    switch (request->operation) {
+      case SCAN:                    // Readers, one per partition.
+        scan_database(request, socket_fd, job->response_str);
+        break;
+      case RANGE:                   // Readers, in key order.
+      case PREFIX:
+        range_database(request, socket_fd, job->response_str);
+        break;
+      default:                      // MGET: readers, in file order.
+        mget_database(request, socket_fd, job->response_str);
+    }
+  }
+  trace_mark(&job->span, TRACE_EXECUTED);
+  if (!detached) {
+    write_msg_to_socket(socket_fd, job->response_str, strlen(job->response_str));
+    trace_mark(&job->span, TRACE_WRITTEN);
+    close(socket_fd);
+    trace_mark(&job->span, TRACE_CLOSED);
+  }
+  fprintf(stdout, "response: %s\n", job->response_str);
+  trace_end(&job->span);
+
+  __sync_fetch_and_sub(&num_streams, 1);
+  free(job->conn->out);
+  free(job->conn);
+  free_request(request);
+  free(job);
+  return NULL;
+}
+
+/**
+ * @name conn_shm - Moves a local session to shared memory: the reply to "SHM" carries the channel's descriptors.
+ * @param c: The connection (on the Unix domain socket, and not a session yet).
+ * @param job: The SHM request, freed here.
+ *
+ * @return 0 on Success. -1 if the connection was closed (and freed).
+ */
+int conn_shm(Conn *c, Job *job) {
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  struct epoll_event ev;
+  char reply[sizeof(int) + 16];
+  int fds[3], len;
+
+  if (c->session || c->watch || !c->local || c->out_off < c->out_len) {
+    sprintf(job->response_str, "SHM ERROR: only on a new connection to the Unix domain socket\n");
+    return conn_reply(c, job);
+  }
+  if (!(c->shm = shm_create())) {
+    sprintf(job->response_str, "SHM ERROR\n");
+    return conn_reply(c, job);
+  }
+
+  // "SHM OK", with the memfd and both doorbells.
+  len = sprintf(reply + sizeof(int), "SHM OK\n");
+  memcpy(reply, &len, sizeof(int));
+  iov.iov_base = reply;
+  iov.iov_len = sizeof(int) + len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  shm_fds(c->shm, fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  trace_mark(&job->span, TRACE_EXECUTED);
+  if (sendmsg(c->fd, &msg, MSG_NOSIGNAL) != (ssize_t) iov.iov_len) {
+    conn_close(c);                  // A fresh socket takes a few bytes: the client is gone.
+    len = -1;
+  } else {
+    // From now on the socket is only polled for a hangup (tagged, see io_thread), the doorbell for the rest.
+    c->session = 1;
+    c->busy = 0;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uintptr_t) c | 1;
+    epoll_ctl(c->io->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(c->io->epfd, EPOLL_CTL_ADD, shm_bell(c->shm), &ev);
+    c->events = EPOLLIN;
+    len = 0;
+  }
+  trace_mark(&job->span, TRACE_WRITTEN);
+  trace_end(&job->span);
+  free_request(job->request);
+  free(job);
+  return len;
+}
+
+/**
+ * @name watch_ready - Queues a watching connection for its I/O thread, which takes its changes. Called by the notifier.
+ * @param arg: The connection.
+ *
+ * @return
+ */
+void watch_ready(void *arg) {
+  Conn *c = (Conn *) arg;
+  IOThread *io = c->io;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&io->reply_mutx);
+  if (c->watch_queued) {
+    pthread_mutex_unlock(&io->reply_mutx);
+    return;                         // Still queued: its changes were taken early (EPOLLOUT), the new ones go along.
+  }
+  c->watch_queued = 1;
+  c->next_watch = io->watching;
+  io->watching = c;
+  pthread_mutex_unlock(&io->reply_mutx);
 
-pthread_t id[THREAD_NUM];      // All threads
+  if (write(io->wake_fd, &one, sizeof(one)) < 0)
+    fprintf(stderr, "(Error) watch_ready: Cannot wake the I/O thread.\n");
+}
 
-int state;                     // FIFO Queue's state. (defined as EMPTY, FULL or LOADED)
-int head, tail =0;             // FIFO Queue's head & tail.
+/**
+ * @name conn_subscribe - Serves a WATCH or UNWATCH: a key or prefix the connection is told of the changes of, or no more.
+ * @param c: The connection.
+ * @param job: The request; gets the reply.
+ *
+ * The first WATCH makes the connection a watching one: not closed after its reply.
+ * @return
+ */
+void conn_subscribe(Conn *c, Job *job) {
+  Request *request = job->request;
+  char pattern[KEY_SIZE], *end;
+  long window = -1;
+  int rc;
 
-double total_waiting_time,            
-       total_service_time = 0.0;
-int completed_requests = 0;
+  if (c->session) {
+    sprintf(job->response_str, "%s ERROR: not available in a session\n", op_names[request->operation]);
+    return;
+  }
+  if (qualify_key(request->table_name, request->key, pattern)) {   // A named table's keys: "@table/key".
+    sprintf(job->response_str, "%s ERROR: too long\n", op_names[request->operation]);
+    return;
+  }
+  if (request->operation == UNWATCH) {
+    rc = c->watch ? watch_remove(c->watch, pattern) : 1;
+    sprintf(job->response_str, rc ? "UNWATCH ERROR: not watched\n" : "UNWATCH OK\n");
+    return;
+  }
+  if (request->value[0]) {
+    window = strtol(request->value, &end, 10);
+    if (*end || window < 0 || window > WATCH_WINDOW_MAX) {
+      sprintf(job->response_str, "WATCH ERROR: bad window (0 to %d msecs)\n", WATCH_WINDOW_MAX);
+      return;
+    }
+  }
+  if (!c->watch && !(c->watch = watch_new(watch_hub, watch_ready, c))) {
+    sprintf(job->response_str, "WATCH ERROR\n");
+    return;
+  }
+  if (window >= 0)
+    watch_window(c->watch, window);
+  sprintf(job->response_str, watch_add(c->watch, pattern) < 0 ? "WATCH ERROR\n" : "WATCH OK\n");
+}
 
-pthread_mutex_t fifo_mutx = PTHREAD_MUTEX_INITIALIZER,
-                times_mutx = PTHREAD_MUTEX_INITIALIZER,
-                put_critical = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * @name conn_request - Takes a framed request: replies right away, hands it to a stream thread or queues it for the DB workers.
+ * @param c: The connection.
+ * @param request_str: The request ("<id>|request" on a session).
+ *
+ * @return 0 on Success. -1 if the connection was closed or handed to a stream thread.
+ */
+int conn_request(Conn *c, char *request_str) {
+  pthread_t tid;
+  pthread_attr_t attr;
+  Job *job;
+  char *body = request_str, *sep;
+  int one = 1, flags;
 
-pthread_cond_t emptyFifo = PTHREAD_COND_INITIALIZER,
-               fullFifo = PTHREAD_COND_INITIALIZER;
+  if (!(job = (Job *) calloc(1, sizeof(Job)))) {
+    conn_close(c);
+    return -1;
+  }
+  job->conn = c;
+  trace_begin(&job->span, c->accptTime);
+  trace_mark(&job->span, TRACE_READ);
 
-int reader_count,                   // Count readers(GET), writers(PUT)
-    writer_count = 0;
+  // A session's request is tagged: "<id>|request".
+  if (c->session) {
+    if (!(sep = strchr(request_str, '|')) || sep - request_str > 10) {
+      free(job);
+      conn_close(c);                // Not a session request.
+      return -1;
+    }
+    *sep = '\0';
+    strcpy(job->tag, request_str);
+    body = sep + 1;
+  }
 
-// Definition of the database.
-KISSDB *db = NULL;
+  // parse the request.
+  job->request = parse_request(body);
+  trace_mark(&job->span, TRACE_PARSED);
+  c->busy = 1;
+  if (!job->request) {
+    // Send an Error reply to the client.
+    sprintf(job->response_str, "FORMAT ERROR\n");
+    trace_request(&job->span, "FORMAT ERROR", "");
+    return conn_reply(c, job);
+  }
+  trace_request(&job->span, op_names[job->request->operation], job->request->key);
 
-InQueue aithseis[QUEUE_SIZE];       // FIFO Queue's array.
+  switch (job->request->operation) {
+    case SESSION:                   // A client library connection: kept open for tagged requests.
+      if (c->session || c->watch) {
+        sprintf(job->response_str, "SESSION ERROR\n");
+      } else {
+        if (!c->local)
+          setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->session = 1;
+        sprintf(job->response_str, "SESSION OK\n");
+      }
+      return conn_reply(c, job);
+    case SHM:                       // A local client library connection, over shared memory.
+      return conn_shm(c, job);
+    case WATCH:                     // Told of changes: the connection is kept open for them (and more requests).
+    case UNWATCH:
+      conn_subscribe(c, job);
+      return conn_reply(c, job);
+    case SCAN:                      // Streams: needs a connection of its own, and a thread.
+    case RANGE:
+    case PREFIX:
+    case MGET:
+    case REPLICATE:
+      if (c->session || c->watch) {
+        sprintf(job->response_str, "%s ERROR: not available %s\n",
+                job->request->operation == PREFIX ? "RANGE" : op_names[job->request->operation],
+                c->session ? "in a session" : "while watching");
+        return conn_reply(c, job);
+      }
+      epoll_ctl(c->io->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+      __sync_fetch_and_sub(&c->io->num_conns, 1);
+      flags = fcntl(c->fd, F_GETFL);
+      fcntl(c->fd, F_SETFL, flags & ~O_NONBLOCK);
+      __sync_fetch_and_add(&num_streams, 1);
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      pin_attr(&attr, num_cpus > 1, num_cpus > 1 ? num_cpus - 1 : num_cpus);
+      if (pthread_create(&tid, &attr, stream_request, job)) {
+        __sync_fetch_and_sub(&num_streams, 1);
+        sprintf(job->response_str, "%s ERROR\n", op_names[job->request->operation]);
+        write_msg_to_socket(c->fd, job->response_str, strlen(job->response_str));
+        close(c->fd);
+        free(c->out);
+        free(c);
+        free_request(job->request);
+        free(job);
+      }
+      pthread_attr_destroy(&attr);
+      return -1;
+    default:                        // The DB workers' part.
+      enqueue(job);
+      return 0;
+  }
+}
 
 /**
- * @name parse_request - Parses a received message and generates a new request.
- * @param buffer: A pointer to the received message.
+ * @name conn_fill - Takes what a shared-memory client put in its ring, as much as 'in' has room for.
+ * @param c: The connection.
  *
- * @return Initialized request on Success. NULL on Error.
+ * @return 0 on Success. -1 if the client broke the ring.
  */
-Request *parse_request(char *buffer) {
-  char *token = NULL;
-  Request *req = NULL;
-  
-  // Check arguments.
-  if (!buffer)
-    return NULL;
-  
-  // Prepare the request.
-  req = (Request *) malloc(sizeof(Request));
-  memset(req->key, 0, KEY_SIZE);
-  memset(req->value, 0, VALUE_SIZE);
+int conn_fill(Conn *c) {
+  int n;
 
-  // Extract the operation type.
-  token = strtok(buffer, ":");    
-  if (!strcmp(token, "PUT")) {
-    req->operation = PUT;
-  } else if (!strcmp(token, "GET")) {
-    req->operation = GET;
+  if (c->in_len >= (int) sizeof(c->in))
+    return 0;
+  if ((n = shm_read(c->shm, c->in + c->in_len, sizeof(c->in) - c->in_len)) < 0)
+    return -1;
+  if (n && !c->in_len)
+    c->accptTime = trace_now_ns();
+  c->in_len += n;
+  return 0;
+}
+
+/**
+ * @name conn_hangup - The client is gone: closes the connection, or (busy) stops polling it until the reply comes back.
+ * @param c: The connection.
+ *
+ * @return
+ */
+void conn_hangup(Conn *c) {
+  if (c->busy) {
+    c->closed = 1;
+    epoll_ctl(c->io->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (c->shm)
+      epoll_ctl(c->io->epfd, EPOLL_CTL_DEL, shm_bell(c->shm), NULL);
+    c->events = 0;
   } else {
-    free(req);
-    return NULL;
+    conn_close(c);
   }
-  
-  // Extract the key.
-  token = strtok(NULL, ":");
-  if (token) {
-    strncpy(req->key, token, KEY_SIZE);
-  } else {
-    free(req);
-    return NULL;
+}
+
+/**
+ * @name conn_frame - Takes the requests received whole, one at a time (the next once the previous is answered).
+ * @param c: The connection.
+ *
+ * @return
+ */
+void conn_frame(Conn *c) {
+  char request_str[BUF_SIZE];
+  int len;
+
+  while (!c->busy && !c->closed && c->out_len - c->out_off <= IO_OUT_MAX) {
+    if (c->shm && conn_fill(c) < 0) {
+      conn_close(c);
+      return;
+    }
+    if (c->in_len < (int) sizeof(int))
+      break;
+    memcpy(&len, c->in, sizeof(int));
+    if (len < 0 || len >= BUF_SIZE) {
+      conn_close(c);                // Not our protocol.
+      return;
+    }
+    if (c->in_len < (int) sizeof(int) + len)
+      break;
+    memcpy(request_str, c->in + sizeof(int), len);
+    request_str[len] = '\0';
+    c->in_len -= sizeof(int) + len;
+    memmove(c->in, c->in + sizeof(int) + len, c->in_len);
+    if (conn_request(c, request_str) < 0)
+      return;                       // Closed, or handed to a stream thread.
+    if (c->in_len)
+      c->accptTime = trace_now_ns();
   }
-  
-  // Extract the value.
-  token = strtok(NULL, ":");
-  if (token) {
-    strncpy(req->value, token, VALUE_SIZE);
-  } else if (req->operation == PUT) {
-    free(req);
-    return NULL;
+  conn_events(c);
+}
+
+/**
+ * @name conn_read - Reads what a connection has sent and frames it.
+ * @param c: The connection.
+ *
+ * @return
+ */
+void conn_read(Conn *c) {
+  int n;
+
+  if (c->shm) {
+    // The doorbell rang: room for the pending replies, or requests in the ring (conn_frame() takes them).
+    shm_clear(c->shm);
+    if (conn_flush(c) < 0)
+      conn_hangup(c);
+    else
+      conn_frame(c);
+    return;
   }
-  return req;
+  while (c->in_len < (int) sizeof(c->in)) {
+    n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if (n > 0) {
+      if (!c->in_len && c->session)
+        c->accptTime = trace_now_ns();   // A session's request arrives (a new connection's was accepted).
+      c->in_len += n;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    // Closed by the client (or an error).
+    conn_hangup(c);
+    return;
+  }
+  conn_frame(c);
+}
+
+/**
+ * @name conn_change - Queues a change for a watching connection: "CHANGED key: value" or "DELETED key".
+ * @param arg: The connection.
+ * @param key: The key.
+ * @param value: Its value, or NULL if it was deleted.
+ *
+ * @return
+ */
+void conn_change(void *arg, const char *key, const char *value) {
+  Conn *c = (Conn *) arg;
+  char *out;
+  int len = value ? strlen("CHANGED : \n") + strlen(key) + strlen(value) : strlen("DELETED \n") + strlen(key);
+
+  if (!(out = conn_reserve(c, sizeof(int) + len + 1)))
+    return;
+  memcpy(out, &len, sizeof(int));
+  if (value)
+    sprintf(out + sizeof(int), "CHANGED %s: %s\n", key, value);
+  else
+    sprintf(out + sizeof(int), "DELETED %s\n", key);
+  c->out_len += sizeof(int) + len;
+}
+
+/**
+ * @name conn_watch - Writes the changes pending for a watching connection, unless its client is behind on reading.
+ * @param c: The connection.
+ *
+ * A client that is behind gets them once its socket drains (EPOLLOUT); its watcher holds them meanwhile, as many
+ * as WATCH_BUFFER allows.
+ * @return 0 on Success. -1 if the connection was closed.
+ */
+int conn_watch(Conn *c) {
+  if (c->closed)
+    return -1;
+  if (c->out_len - c->out_off > IO_OUT_MAX)
+    return 0;
+  if (watch_take(c->watch, conn_change, c) &&
+      conn_send(c, "", "WATCH OVERFLOW: changes were dropped, re-read the watched keys\n") < 0) {
+    conn_hangup(c);
+    return -1;
+  }
+  if (conn_flush(c) < 0) {
+    conn_hangup(c);
+    return -1;
+  }
+  conn_events(c);
+  return 0;
+}
+
+/**
+ * @name io_complete - Hands a served request back to its connection's I/O thread. Called by the DB workers.
+ * @param job: The request, with its reply.
+ *
+ * @return
+ */
+void io_complete(Job *job) {
+  IOThread *io = job->conn->io;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&io->reply_mutx);
+  job->next = NULL;
+  if (io->replies_tail)
+    io->replies_tail->next = job;
+  else
+    io->replies = job;
+  io->replies_tail = job;
+  if (++io->num_replies > io->max_replies)
+    io->max_replies = io->num_replies;
+  pthread_mutex_unlock(&io->reply_mutx);
+
+  if (write(io->wake_fd, &one, sizeof(one)) < 0)
+    fprintf(stderr, "(Error) io_complete: Cannot wake the I/O thread.\n");
+}
+
+/**
+ * @name io_thread - The network stage: reads and frames requests, writes replies, never blocks on a client.
+ * @param arg: The IOThread.
+ *
+ * @return
+ */
+void *io_thread(void *arg) {
+  IOThread *io = (IOThread *) arg;
+  struct epoll_event events[IO_EVENTS];
+  Job *job, *next;
+  Conn *c, *watch;
+  uint64_t count;
+  char name[16];
+  int n, k, woken;
+
+  snprintf(name, sizeof(name), "io %d", (int) (io - io_threads));
+  trace_thread_name(name);
+
+  while(1){
+    if ((n = epoll_wait(io->epfd, events, IO_EVENTS, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      ERROR("epoll_wait()");
+    }
+
+    // Connections first: a reply may close a connection that has an event further on.
+    woken = 0;
+    for (k = 0; k < n; k++) {
+      if (!events[k].data.ptr) {
+        woken = 1;
+        continue;
+      }
+
+      // The socket of a shared-memory connection (pointer tagged with 1): the client hung up.
+      if (events[k].data.u64 & 1) {
+        c = (Conn *) (uintptr_t) (events[k].data.u64 & ~(uint64_t) 1);
+        if (!c->dead)
+          conn_hangup(c);
+        continue;
+      }
+
+      c = (Conn *) events[k].data.ptr;
+      if (c->dead)
+        continue;                   // Closed by an earlier event of this batch.
+      if (events[k].events & EPOLLOUT) {
+        if (conn_flush(c) < 0 || (c->closed && c->out_off == c->out_len)) {
+          if (c->busy)
+            c->closed = 1;
+          else
+            conn_close(c);
+          continue;
+        }
+        // Room again: changes and requests held back meanwhile.
+        if (c->watch && conn_watch(c) < 0)
+          continue;
+        conn_frame(c);
+        continue;
+      }
+      if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        conn_read(c);
+    }
+
+    // Replies from the DB workers.
+    if (woken) {
+      if (read(io->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        ERROR("read(eventfd)");
+      pthread_mutex_lock(&io->reply_mutx);
+      job = io->replies;
+      io->replies = io->replies_tail = NULL;
+      io->num_replies = 0;
+      pthread_mutex_unlock(&io->reply_mutx);
+      for (; job; job = next) {
+        next = job->next;
+        c = job->conn;
+        if (c->closed) {            // The client is gone.
+          conn_close(c);
+          free_request(job->request);
+          free(job);
+        } else if (!conn_reply(c, job)) {
+          conn_frame(c);            // Requests the client pipelined meanwhile.
+        }
+      }
+
+      // Changes for the watching connections.
+      pthread_mutex_lock(&io->reply_mutx);
+      c = io->watching;
+      io->watching = NULL;
+      for (watch = c; watch; watch = watch->next_watch)
+        watch->watch_queued = 0;
+      pthread_mutex_unlock(&io->reply_mutx);
+      for (; c; c = watch) {
+        watch = c->next_watch;
+        conn_watch(c);
+      }
+    }
+
+    // Nothing names the connections closed meanwhile any more.
+    while ((c = io->dead)) {
+      io->dead = c->next_dead;
+      free(c);
+    }
+  }
+  return NULL;    // To pass warning.
 }
 
 /*
- * @name process_request - Process a client request.
- * @param socket_fd: The accept descriptor.
+ * @name execute_request - Runs a parsed request against the database (the DB workers' stage).
+ * @param request: The request.
+ * @param response_str: Buffer for the reply.
+ *
+ * @return
+ */
+void execute_request(Request *request, char *response_str) {
+  Table *t = NULL;
+  const char *map;
+  char outcome[256];
+  uint64_t offset;
+  size_t len = 0;
+  long spans;
+  int rc;
+
+  // The table of the requests that read or write one.
+  switch (request->operation) {
+    case GET:
+    case PUT:
+    case DELETE:
+    case COMPACT:
+    case INCR:
+    case DECR:
+    case CAS:
+    case APPEND:
+    case AGG:
+      if (open_table(request, response_str))
+        return;
+      t = request->table;
+      break;
+    default:
+      break;
+  }
+
+  switch (request->operation) {
+    case GET:                       // Readers      
+      
+      // Read the given key from the table: in place, if the file is mapped (a compaction may unmap it).
+      engine_read_lock(t->engine);
+      if ((map = engine_map(t->engine)) && !(rc = engine_locate(t->engine, request->key, &offset))) {
+        len = strnlen(map + offset, t->value_size - 1);
+        if (ZERO_COPY_GET && len >= ZERO_COPY_GET)
+          request->value_offset = offset;     // Left in the file: the I/O thread sends it from there.
+        else
+          memcpy(request->value, map + offset, len);
+      }
+      engine_read_unlock(t->engine);
+      if (!map)
+        rc = engine_get(t->engine, request->key, request->value);
+      if (rc)
+        sprintf(response_str, "GET ERROR\n");
+      else if (request->value_offset)
+        sprintf(response_str, "GET OK: (%lu bytes, sent from the DB file)\n", (unsigned long) len);
+      else
+        sprintf(response_str, "GET OK: %s\n", request->value);
+
+      break;
+    case PUT:                       // Writers
+      
+      if (follower) {
+        sprintf(response_str, "PUT ERROR: read-only follower\n");
+        break;
+      }
+      pthread_mutex_lock(&t->put_mutx);
+      // Write the given key/value pair to the table.
+      if (apply_put(t, request->key, request->value))
+        sprintf(response_str, "PUT ERROR\n");
+      else
+        sprintf(response_str, "PUT OK\n");
+      pthread_mutex_unlock(&t->put_mutx);
+
+      break;
+    case DELETE:                    // Writers
+
+      if (follower) {
+        sprintf(response_str, "DELETE ERROR: read-only follower\n");
+        break;
+      }
+      pthread_mutex_lock(&t->put_mutx);
+      rc = apply_delete(t, request->key);
+      pthread_mutex_unlock(&t->put_mutx);
+      if (rc < 0)
+        sprintf(response_str, "DELETE ERROR\n");
+      else if (rc)
+        sprintf(response_str, "DELETE ERROR: not found\n");
+      else
+        sprintf(response_str, "DELETE OK\n");
+
+      break;
+    case COMPACT:                   // Rewrites the file without dead records; GETs and PUTs go on meanwhile.
+
+      rc = engine_compact(t->engine, outcome);
+      sprintf(response_str, "COMPACT %s: %s\n", rc < 0 ? "ERROR" : (rc ? "NONE" : "OK"), outcome);
+
+      break;
+    case INCR:                      // Writers that read first.
+    case DECR:
+    case CAS:
+    case APPEND:
+
+      update_value(request, response_str);
+
+      break;
+    case TSAGG:                     // Readers of the time series.
+
+      aggregate_series(request, response_str);
+
+      break;
+    case AGG:                       // Readers, one per partition.
+
+      aggregate_database(request, response_str);
+
+      break;
+    case STATUS:
+
+      strcpy(response_str, "STATUS OK: ");
+      replication_status(response_str + strlen(response_str));
+      strcat(response_str, "\n");
+
+      break;
+    case TRACE:                     // Export the sampled requests' spans.
+
+      if (!trace_file[0])
+        sprintf(response_str, "TRACE ERROR: tracing is off (-t)\n");
+      else if ((spans = trace_export(trace_file)) < 0)
+        sprintf(response_str, "TRACE ERROR: cannot write %s\n", trace_file);
+      else
+        sprintf(response_str, "TRACE OK: %ld spans written to %s\n", spans, trace_file);
+
+      break;
+    case HOTKEYS:
+
+      strcpy(response_str, "HOTKEYS OK: ");
+      hot_keys_status(response_str + strlen(response_str));
+      strcat(response_str, "\n");
+
+      break;
+    case QUEUES:
+
+      strcpy(response_str, "QUEUES OK: ");
+      queues_status(response_str + strlen(response_str));
+      strcat(response_str, "\n");
+
+      break;
+    default:
+      // Unsupported operation.
+      sprintf(response_str, "UNKOWN OPERATION\n");
+  }
+}
+
+/*
+ * @name process_request - A DB worker: serves the parsed requests of the FIFO Queue.
+ * @param arg: The worker's number.
  *
+ * Only runs requests against the database; reading them and writing the replies is left to the I/O threads.
  * @return
  */
-void *process_request() {
-  char response_str[BUF_SIZE], request_str[BUF_SIZE];
-  int numbytes = 0;
-  Request *request = NULL;
+void *process_request(void *arg) {
+  int k = (int) (intptr_t) arg;
+  char name[16];
+  Job *job;
+  Request *request;
+  WorkerStats *my_stats = NULL;
+  char qkey[KEY_SIZE];
 
-  struct timeval temp,
-                 getTime1,
-                 getTime2;          // Time variables.
+  int64_t temp,
+          getTime1,
+          getTime2;                 // Time variables (monotonic, nsecs).
 
-  int socket_fd;                    
   double xronos_anamonhs,           // O xronos pou paremeine h aithsh mesa sth FIFO oura, mexri na ksekinhsei h anazhthsh (sthn KISSDB)
          xronos_eksyphrethshs;      // O xronos pou apaiththhke gia thn anazhthsh ths lekshs se ola ta arxeia (ths KISSDB)
 
+  // Statistics first touched here, on the worker's own cpu (and NUMA node).
+  if (posix_memalign((void **) &my_stats, CACHE_LINE, sizeof(WorkerStats)))
+    ERROR("posix_memalign()");
+  memset(my_stats, 0, sizeof(WorkerStats));
+  stats[k] = my_stats;
+  snprintf(name, sizeof(name), "worker %d", k);
+  trace_thread_name(name);
+
   // Note: Ta threads tha'Epanaxrhsimopoiountai'. Gia na mhn termatizoun otan oloklhrwsoun thn synarthh tous, tha trexoun se brogxo.
   while(1){
     pthread_mutex_lock(&fifo_mutx);
 
-    while(head==tail){              // FIFO Queue is empty.   Note: Always 'while' at Conditions here, to avoid unwanted problems.  (Never 'if')
-      state=EMPTY;
-
-      // Note: Wait mexri na erthei (h prwth)aithsh apo Master-Thread. (wait, wste na mhn trexoun askopa ta threads)
+    while(state==EMPTY || stopping){  // FIFO Queue is empty.   Note: Always 'while' at Conditions here, to avoid unwanted problems.  (Never 'if')
+      // Note: Wait mexri na erthei (h prwth)aithsh apo ta I/O threads. (wait, wste na mhn trexoun askopa ta threads)
       pthread_cond_wait(&emptyFifo, &fifo_mutx);  
     }
+    __sync_fetch_and_add(&busy, 1);
     
     // Extract from FIFO.
-    socket_fd = aithseis[head].accptFd;
+    job = aithseis[head].job;
     temp = aithseis[head].accptTime;
 
     // Move forward FIFO's Head, after extraction:
     head++;
-    if(head>QUEUE_SIZE){            // Reset head back at start of FIFO Queue.
+    if(head>=queue_size){            // Reset head back at start of FIFO Queue.
       head=0;
     }
+    state = (head==tail) ? EMPTY : LOADED;
 
     // Eyresh Xronou-Anamonhs:
-    gettimeofday(&getTime1, NULL);
-    xronos_anamonhs = (getTime1.tv_sec - temp.tv_sec)*1000000 +              // convert sec to μsec (1 sec = 10^6 usec),     //*1.0E-6
-                      (getTime1.tv_usec - temp.tv_usec);          
+    getTime1 = trace_now_ns();
+    xronos_anamonhs = (getTime1 - temp) / 1000.0;                            // convert nsec to μsec (1 sec = 10^6 usec)
     fprintf(stdout, "THREAD_in_func (id):: %ld\n", pthread_self());
 
-    pthread_cond_signal(&fullFifo);           // Signal Master-Thread that Fifo Queue is't Full. (New (waiting)accepts can finally come)
+    pthread_cond_signal(&fullFifo);           // Signal the I/O threads that Fifo Queue is't Full. (New requests can finally come)
     pthread_mutex_unlock(&fifo_mutx);
 
+    request = job->request;
+    trace_mark(&job->span, TRACE_DEQUEUED);
+    execute_request(request, job->response_str);
+    trace_mark(&job->span, TRACE_EXECUTED);
+    if (!__sync_sub_and_fetch(&busy, 1) && __atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&fifo_mutx);
+      pthread_cond_signal(&drained);
+      pthread_mutex_unlock(&fifo_mutx);
+    }
 
-    // Clean buffers.
-    memset(response_str, 0, BUF_SIZE);
-    memset(request_str, 0, BUF_SIZE);
-    
-    // receive message.
-    numbytes = read_str_from_socket(socket_fd, request_str, BUF_SIZE);
-    
-    // parse the request.
-    if (numbytes) {
-      request = parse_request(request_str);
-      if (request) {
-        switch (request->operation) {
-          case GET:                 // Readers      
-            
-            // Read the given key from the database.
-            if (KISSDB_get(db, request->key, request->value))
-              sprintf(response_str, "GET ERROR\n");
-            else
-              sprintf(response_str, "GET OK: %s\n", request->value);
-
-            break;
-          case PUT:                 // Writers
-            
-            pthread_mutex_lock(&put_critical);
-            // Write the given key/value pair to the database.
-            if (KISSDB_put(db, request->key, request->value)) 
-              sprintf(response_str, "PUT ERROR\n");
-            else
-              sprintf(response_str, "PUT OK\n");
-            pthread_mutex_unlock(&put_critical);
-  
-            break;
-          default:
-            // Unsupported operation.
-            sprintf(response_str, "UNKOWN OPERATION\n");
-        }
-        // Reply to the client.
-        write_str_to_socket(socket_fd, response_str, strlen(response_str));
-
-        // close fd:
-        close(socket_fd);
-
-        fprintf(stdout, "response: %s\n", response_str);
+    fprintf(stdout, "response: %s\n", job->response_str);
 
-        if (request)
-          free(request);
-        request = NULL;
+    // Eyresh Xronou-Eksyphrethshs:
+    getTime2 = trace_now_ns();
+    xronos_eksyphrethshs = (getTime2 - getTime1) / 1000.0;                     // convert nsec to μsec (1 sec = 10^6 usec)
 
-        // Eyresh Xronou-Eksyphrethshs:
-        gettimeofday(&getTime2, NULL);
-        xronos_eksyphrethshs = (getTime2.tv_sec - getTime1.tv_sec)*1000000 +        // convert sec to μsec (1 sec = 10^6 usec)
-                               (getTime2.tv_usec - getTime1.tv_usec);
+    switch (request->operation) {
+      case GET:
+      case PUT:
+      case DELETE:
+      case INCR:
+      case DECR:
+      case CAS:
+      case APPEND:
+        if (!qualify_key(request->table_name, request->key, qkey))
+          hotkeys_record(hot, k, qkey, request->operation != GET, getTime2 - getTime1);
+        break;
+      default:
+        break;
+    }
 
-        // Enhmerwsh koinoxrhstwn metablhtwn:
-        pthread_mutex_lock(&times_mutx);   
-        total_waiting_time += xronos_anamonhs;
-        total_service_time += xronos_eksyphrethshs;
-        completed_requests += 1;
-        pthread_mutex_unlock(&times_mutx);
-      }
-      else{                                                                     // When request (struct: Operation(PUT/GET), key, value) isn't at correct format. 
-        // Send an Error reply to the client.
-        sprintf(response_str, "FORMAT ERROR\n");
-        write_str_to_socket(socket_fd, response_str, strlen(response_str));
+    // Enhmerwsh koinoxrhstwn metablhtwn:
+    my_stats->total_waiting_time += xronos_anamonhs;
+    my_stats->total_service_time += xronos_eksyphrethshs;
+    my_stats->completed_requests += 1;
 
-        //closer fd:
-        close(socket_fd);
-      }
-    }
-    
+    // The reply goes out on the connection's I/O thread.
+    io_complete(job);
   }
   return NULL;    // To pass warning.
 }
 
 /*
- * @name threads_consumers - Creating threads.
+ * @name threads_consumers - Creating threads: the DB workers, then the I/O threads.
  * @return
  */
 void threads_consumers(){
+  pthread_attr_t attr;
+  struct epoll_event ev;
   int k, rc;
 
-  for(k=0; k<THREAD_NUM; k++){
-    rc = pthread_create(&id[k], NULL, process_request, NULL);
-    fprintf(stdout, "Thread(%d/%d) created \t[id: %ld]\n", k+1, THREAD_NUM, id[k]);
+  for(k=0; k<thread_num; k++){
+    // With -c, worker k runs on one of cpus[1..] (cpus[0] if that's the only one).
+    pthread_attr_init(&attr);
+    pin_attr(&attr, num_cpus > 1 ? 1 + k % (num_cpus - 1) : 0, 1);
+    rc = pthread_create(&id[k], &attr, process_request, (void *) (intptr_t) k);
+    pthread_attr_destroy(&attr);
+    fprintf(stdout, "Thread(%d/%d) created \t[id: %ld]\n", k+1, thread_num, id[k]);
+    if(rc){
+      fprintf(stdout, "ERROR; return code from pthread_create is: %d\n", rc);
+      exit(-1);
+    }
+  }
+
+  for(k=0; k<io_num; k++){
+    pthread_mutex_init(&io_threads[k].reply_mutx, NULL);
+    if ((io_threads[k].epfd = epoll_create1(0)) < 0 ||
+        (io_threads[k].wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+      ERROR("epoll_create1()");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;             // The wake-up eventfd.
+    if (epoll_ctl(io_threads[k].epfd, EPOLL_CTL_ADD, io_threads[k].wake_fd, &ev) < 0)
+      ERROR("epoll_ctl()");
+
+    // With -c, I/O threads share the cpus round robin, starting with the acceptor's.
+    pthread_attr_init(&attr);
+    pin_attr(&attr, num_cpus ? k % num_cpus : 0, 1);
+    rc = pthread_create(&io_threads[k].tid, &attr, io_thread, &io_threads[k]);
+    pthread_attr_destroy(&attr);
+    fprintf(stdout, "I/O thread(%d/%d) created \t[id: %ld]\n", k+1, io_num, io_threads[k].tid);
     if(rc){
       fprintf(stdout, "ERROR; return code from pthread_create is: %d\n", rc);
       exit(-1);
@@ -257,25 +2347,95 @@ void threads_consumers(){
 }
 
 /*
- * @name statistics_handler - Print statistics and terminate the program.
+ * @name statistics_handler - The Control+Z thread: waits for SIGTSTP, then prints statistics and terminates the program.
+ * @param arg: The signals it waits for (SIGTSTP, blocked in every thread).
+ *
+ * A thread, not a signal handler: exporting the trace, reading the queues and closing the tables take locks that
+ * the interrupted thread may hold.
  * @return
  */
-void statistics_handler(){
-  double avgWaitingTime, avgServiceTime;
-  //int t, rc;
+void *statistics_handler(void *arg) {
+  double avgWaitingTime, avgServiceTime,
+         total_waiting_time = 0.0,
+         total_service_time = 0.0;
+  int completed_requests = 0, k, sig;
+  char status[BUF_SIZE];
+
+  while (sigwait((sigset_t *) arg, &sig))
+    ;
 
+  // Stop accepting, and wait for the workers' running requests (the queued ones are dropped).
+  pthread_mutex_lock(&fifo_mutx);
+  __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+  for (k = 0; k < num_listeners; k++)
+    shutdown(listeners[k].fd, SHUT_RDWR);
+  while (__atomic_load_n(&busy, __ATOMIC_SEQ_CST))
+    pthread_cond_wait(&drained, &fifo_mutx);
+  pthread_mutex_unlock(&fifo_mutx);
+
+  for (k = 0; k < thread_num; k++) {
+    if (stats && stats[k]) {
+      total_waiting_time += stats[k]->total_waiting_time;
+      total_service_time += stats[k]->total_service_time;
+      completed_requests += stats[k]->completed_requests;
+    }
+  }
   avgWaitingTime = total_waiting_time/completed_requests;
   avgServiceTime = total_service_time/completed_requests;
 
   fprintf(stdout, "\nSignal-> 'Control+Z': program exit, print statistics:\n\tcompleted-requests: %5d\n\tavg-waiting-time: %5lf usecs\n\tavg-service-time: %5lf usecs\t (1sec = 10^6usecs)\n", completed_requests, avgWaitingTime, avgServiceTime);
+  replication_status(status);
+  fprintf(stdout, "\treplication: %s\n", status);
+  if (trace_file[0])
+    fprintf(stdout, "\ttrace: %ld spans written to %s\n", trace_export(trace_file), trace_file);
+  hot_keys_status(status);
+  fprintf(stdout, "\thot keys: %s\n", status);
+  queues_status(status);
+  fprintf(stdout, "\tqueues: %s\n", status);
+  engine_status(tables_default(tables)->engine, status);
+  fprintf(stdout, "\tengine: %s\n", status);
  
   // Destroy the database.
-  // Close the database.
-  KISSDB_close(db);
+  // Close the tables (the memory engine writes its last snapshots).
+  tables_close(tables);
+  if (ts)
+    tseries_close(ts);
 
   // Program exits normally.
   exit(0);
-  return;
+  return NULL;
+}
+
+/**
+ * @name print_usage - Prints usage information.
+ * @return
+ */
+void print_usage() {
+  fprintf(stderr, "Usage: server [OPTION]...\n\n");
+  fprintf(stderr, "Available Options:\n");
+  fprintf(stderr, "-h:             Print this help message.\n");
+  fprintf(stderr, "-P <port>:      Listen on this port (default %d).\n", MY_PORT);
+  fprintf(stderr, "-U <path>:      Also listen on this Unix domain socket, for local clients (default " SHM_UNIX_PATH ",\n", MY_PORT);
+  fprintf(stderr, "                with the port given).\n");
+  fprintf(stderr, "-d <file>:      Database file (default mydb.db).\n");
+  fprintf(stderr, "-e <engine>:    Storage engine: kissdb (default; the database file, updated in place), memory\n");
+  fprintf(stderr, "                (see -m; no RANGE/PREFIX) or lsm (a log and sorted runs named after the database file).\n");
+  fprintf(stderr, "-m <seconds>:   The memory engine, snapshotting the database to its file every <seconds> (default %d;\n", MEM_SNAPSHOT_SEC);
+  fprintf(stderr, "                0: only on exit, so a crash loses every PUT since the start).\n");
+  fprintf(stderr, "-n <tables>:    Named tables (<file>.table.<name>, \"@name:request\") open at once, at most (default %d);\n", TABLES_OPEN);
+  fprintf(stderr, "                the least recently used is closed to open another, and any unused for %d s.\n", TABLE_IDLE_SEC);
+  fprintf(stderr, "-N <name:key_size:value_size[:hash_size]>: Sizes of a named table's new file (at most %d:%d;\n", KEY_SIZE, VALUE_SIZE);
+  fprintf(stderr, "                default: the database file's). Repeat for more tables.\n");
+  fprintf(stderr, "-r:             Primary: log committed PUTs (<file>.rlog) and stream them to followers. A new\n");
+  fprintf(stderr, "                follower (or one too far behind the log, which is trimmed) first gets a copy of the tables.\n");
+  fprintf(stderr, "-f <host:port>: Follower: read-only replica of the primary at host:port.\n");
+  fprintf(stderr, "-c <cpulist>:   Pin the acceptor to the first cpu and the workers to the rest, e.g. 0,2,4-7.\n");
+  fprintf(stderr, "-w <workers>:   Worker threads (default %d).\n", THREAD_NUM);
+  fprintf(stderr, "-Q <size>:      FIFO queue size (default %d, at least 2).\n", QUEUE_SIZE);
+  fprintf(stderr, "-i <threads>:   I/O threads, which read requests and write replies for the workers (default %d).\n", IO_THREADS);
+  fprintf(stderr, "-t <rate>:      Trace this fraction (0..1] of the requests; spans go to <file>.trace.json\n");
+  fprintf(stderr, "                on Control+Z or a TRACE request (Chrome trace format).\n");
+  fprintf(stderr, "-T <file>:      Write the trace here instead.\n");
 }
 
 /*
@@ -283,14 +2443,120 @@ void statistics_handler(){
  *
  * @return 0 on success, 1 on error.
  */
-int main() {
-  struct timeval tv;
+int main(int argc, char **argv) {
+  char path[PATH_LEN + 8], *primary = NULL, *sep, *end, *sizes[TABLE_SIZES];
+  EngineConfig cfg;
+  unsigned long key_size, value_size, hash_size;
+  int num_sizes = 0;
+  int option, reuse = 1, next_io = 0, k;
+  double trace_rate = 0;
+  struct epoll_event ev;
+  Conn *c;
+  sigset_t sigtstp;
+  pthread_t stats_tid;
 
   int socket_fd,                    // listen on this socket for new connections
       new_fd;                       // use this socket to service a new connection
   socklen_t clen;
   struct sockaddr_in server_addr,   // my address information
                      client_addr;   // connector's address information
+  struct sockaddr_un unix_addr;
+
+  // When Control+Z is pressed, thread 'statistics_handler' takes the signal (blocked from the start, so in every
+  // thread; one pressed during startup waits for it instead of stopping the process).
+  sigemptyset(&sigtstp);
+  sigaddset(&sigtstp, SIGTSTP);
+  pthread_sigmask(SIG_BLOCK, &sigtstp, NULL);
+
+  // Parse user parameters.
+  while ((option = getopt(argc, argv, "hP:U:d:e:m:n:N:rf:c:w:Q:i:t:T:")) != -1) {
+    switch (option) {
+      case 'h':
+        print_usage();
+        exit(0);
+      case 'P':
+        port = atoi(optarg);
+        break;
+      case 'U':
+        strncpy(unix_path, optarg, PATH_LEN - 1);
+        break;
+      case 'd':
+        strncpy(db_file, optarg, PATH_LEN - 1);
+        break;
+      case 'e':
+        strncpy(engine_type, optarg, sizeof(engine_type) - 1);
+        break;
+      case 'm':
+        strcpy(engine_type, "memory");
+        mem_snapshot_sec = strtol(optarg, &end, 10);
+        if (*end || mem_snapshot_sec < 0) {
+          fprintf(stderr, "Error: -m expects a number of seconds (0: snapshot only on exit).\n\n");
+          print_usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'n':
+        max_tables = atoi(optarg);
+        break;
+      case 'N':
+        if (num_sizes == TABLE_SIZES) {
+          fprintf(stderr, "Error: -N at most %d times.\n\n", TABLE_SIZES);
+          exit(EXIT_FAILURE);
+        }
+        sizes[num_sizes++] = optarg;   // Set once the default table is open.
+        break;
+      case 'r':
+        rlog = (ReplLog *) 1;       // Opened once the database is.
+        break;
+      case 'f':
+        primary = optarg;
+        break;
+      case 'c':
+        if (parse_cpus(optarg) <= 0) {
+          fprintf(stderr, "Error: -c expects a list of available cpus, e.g. 0,2,4-7.\n\n");
+          print_usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'w':
+        thread_num = atoi(optarg);
+        break;
+      case 'Q':
+        queue_size = atoi(optarg);
+        break;
+      case 'i':
+        io_num = atoi(optarg);
+        break;
+      case 't':
+        trace_rate = atof(optarg);
+        break;
+      case 'T':
+        strncpy(trace_file, optarg, PATH_LEN - 1);
+        break;
+      default:
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (thread_num < 1 || queue_size < 2 || io_num < 1) {
+    fprintf(stderr, "Error: -w and -i expect at least 1 thread and -Q a queue of at least 2.\n\n");
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+  if (trace_rate && trace_init(trace_rate)) {
+    fprintf(stderr, "Error: -t expects a rate in (0, 1], e.g. 0.01.\n\n");
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
+  if (!trace_rate)
+    trace_file[0] = '\0';           // Tracing is off.
+  else if (!trace_file[0])
+    sprintf(trace_file, "%s.trace.json", db_file);
+  if (primary && (!(sep = strrchr(primary, ':')) || !atoi(sep + 1))) {
+    fprintf(stderr, "Error: -f expects <host:port>.\n\n");
+    print_usage();
+    exit(EXIT_FAILURE);
+  }
 
   fprintf(stdout, "\n\t~(help) Server's proc_id : '%d'\n\t\tuse: 'kill -9 -[proc_id]',  to teminate this process,\n", getpid());
   fprintf(stdout, "\t\t     'ps -f' to find it.\n");
@@ -299,18 +2565,18 @@ int main() {
   if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
     ERROR("socket()");
 
+  // Allow a restarted server to bind while old connections are in TIME_WAIT.
+  setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
   // Ignore the SIGPIPE signal in order to not crash when a
   // client closes the connection unexpectedly.
   signal(SIGPIPE, SIG_IGN);
 
-  // When Control+Z is pressed, handler 'statistics_handler' is called.
-  signal(SIGTSTP, statistics_handler);
-  
   // create socket adress of server (type, IP-adress and port number)
   bzero(&server_addr, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = htonl(INADDR_ANY);    // any local interface
-  server_addr.sin_port = htons(MY_PORT);
+  server_addr.sin_port = htons(port);
   
   // bind socket to address
   if (bind(socket_fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1)
@@ -318,78 +2584,174 @@ int main() {
   
   // start listening to socket for incomming connections
   listen(socket_fd, MAX_PENDING_CONNECTIONS);
-  fprintf(stderr, "(Info) main: Listening for new connections on port %d ...\n", MY_PORT);
+  fprintf(stderr, "(Info) main: Listening for new connections on port %d ...\n", port);
   clen = sizeof(client_addr);
+  listeners[0].fd = socket_fd;
+  listeners[0].events = POLLIN;
+
+  // Local clients skip the TCP stack on the Unix domain socket (the port owns its path: a stale one is removed).
+  if (!unix_path[0])
+    snprintf(unix_path, PATH_LEN, SHM_UNIX_PATH, port);
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  if (strlen(unix_path) >= sizeof(unix_addr.sun_path) ||
+      (listeners[1].fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    fprintf(stderr, "(Warning) main: Cannot listen on '%s'; local clients will use TCP.\n", unix_path);
+  } else {
+    strcpy(unix_addr.sun_path, unix_path);
+    unlink(unix_path);
+    if (bind(listeners[1].fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr)) == -1 ||
+        listen(listeners[1].fd, MAX_PENDING_CONNECTIONS) == -1) {
+      fprintf(stderr, "(Warning) main: Cannot listen on '%s'; local clients will use TCP.\n", unix_path);
+      close(listeners[1].fd);
+    } else {
+      fprintf(stderr, "(Info) main: Listening for local connections on %s ...\n", unix_path);
+      listeners[1].events = POLLIN;
+      num_listeners = 2;
+    }
+  }
 
   //fprintf(stdout, "\n\t~Listening fd (server's fd): \t%d\n", socket_fd);
 
-  // Allocate memory for the database.
-  if (!(db = (KISSDB *)malloc(sizeof(KISSDB)))) {
-    fprintf(stderr, "(Error) main: Cannot allocate memory for the database.\n");
+  // Open the database with its engine.
+  cfg.hash_table_size = HASH_SIZE;
+  cfg.key_size = KEY_SIZE;
+  cfg.value_size = VALUE_SIZE;
+  cfg.ordered_index = ORDERED_INDEX;
+  cfg.snapshot_sec = mem_snapshot_sec;
+  cfg.compact_sec = COMPACT_SEC;
+  if (!(tables = tables_open(db_file, engine_type, &cfg, max_tables, TABLE_IDLE_SEC))) {
+    fprintf(stderr, "(Error) main: Cannot open the database (engine %s).\n", engine_type);
     return 1;
   }
-  
-  // Open the database.
-  if (KISSDB_open(db, "mydb.db", KISSDB_OPEN_MODE_RWCREAT, HASH_SIZE, KEY_SIZE, VALUE_SIZE)) {
-    fprintf(stderr, "(Error) main: Cannot open the database.\n");
+  fprintf(stderr, "(Info) main: Storage engine: %s.\n", engine_name(tables_default(tables)->engine));
+  for (k = 0; k < num_sizes; k++) {
+    // -N name:key_size:value_size[:hash_size]
+    hash_size = 0;
+    if ((sep = strchr(sizes[k], ':')))
+      *sep = '\0';
+    if (!sep || sscanf(sep + 1, "%lu:%lu:%lu", &key_size, &value_size, &hash_size) < 2 ||
+        tables_size(tables, sizes[k], key_size, value_size, hash_size)) {
+      fprintf(stderr, "(Error) main: Bad sizes for table '%s' (-N name:key_size:value_size[:hash_size], at most %d:%d).\n",
+              sizes[k], KEY_SIZE, VALUE_SIZE);
+      return 1;
+    }
+  }
+#if TIME_SERIES
+  // Replay the time series log.
+  sprintf(path, "%s.ts", db_file);
+  if (!(ts = tseries_open(path, KEY_SIZE))) {
+    fprintf(stderr, "(Error) main: Cannot open the time series.\n");
+    return 1;
+  }
+#endif
+
+  // Replication: log committed PUTs for followers, and/or follow a primary.
+  if (rlog) {
+    sprintf(path, "%s.rlog", db_file);
+    if (!(rlog = repl_log_open(path, KEY_SIZE, VALUE_SIZE, replication_snapshot))) {
+      fprintf(stderr, "(Error) main: Cannot open the replication log.\n");
+      return 1;
+    }
+  }
+  if (primary) {
+    follower = 1;
+    sep = strrchr(primary, ':');
+    *sep = '\0';
+    sprintf(path, "%s.rpos", db_file);
+    if (repl_follow(primary, atoi(sep + 1), path, KEY_SIZE, VALUE_SIZE, replicate_put, replication_reset)) {
+      fprintf(stderr, "(Error) main: Cannot follow the primary.\n");
+      return 1;
+    }
+  }
+
+  // Workers, their FIFO Queue and the I/O threads.
+  id = (pthread_t *) calloc(thread_num, sizeof(pthread_t));
+  stats = (WorkerStats **) calloc(thread_num, sizeof(WorkerStats *));
+  aithseis = (InQueue *) calloc(queue_size, sizeof(InQueue));
+  if (posix_memalign((void **) &io_threads, CACHE_LINE, io_num * sizeof(IOThread)))
+    io_threads = NULL;
+  if (!id || !stats || !aithseis || !io_threads) {
+    fprintf(stderr, "(Error) main: Cannot allocate memory for the workers.\n");
+    return 1;
+  }
+
+#if HOT_KEYS
+  if (!(hot = hotkeys_open(thread_num, HOT_KEY_WINDOW, KEY_SIZE))) {
+    fprintf(stderr, "(Error) main: Cannot start the hot-key sketches.\n");
+    return 1;
+  }
+#endif
+  if (!(watch_hub = watch_open(KEY_SIZE, VALUE_SIZE))) {
+    fprintf(stderr, "(Error) main: Cannot start the change notifier.\n");
     return 1;
   }
+  memset(io_threads, 0, io_num * sizeof(IOThread));
 
   // Creating threads.
   threads_consumers();
 
-  state=EMPTY;
+  // Pin the acceptor (after the workers, which set their own cpus).
+  if (num_cpus) {
+    cpu_set_t set;
 
-  // main loop: wait for new connection/requests
-  while (1) { 
-    // wait for incomming connection
-    if ((new_fd = accept(socket_fd, (struct sockaddr *)&client_addr, &clen)) == -1) {
-      ERROR("accept()");
-    }
-    //fprintf(stdout, "\t~Server's 'new_fd' (for this client) : %d\n", new_fd);
-    
-    // got connection, serve request
-    fprintf(stderr, "(Info) main: Got connection from '%s'\n", inet_ntoa(client_addr.sin_addr));
+    CPU_ZERO(&set);
+    CPU_SET(cpus[0], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+      fprintf(stderr, "(Warning) main: Cannot pin the acceptor to cpu %d.\n", cpus[0]);
+  }
 
-    //lock tail
-    pthread_mutex_lock(&fifo_mutx);
-    if(state!=FULL){
-      // Apothkeysh stoixeiwn ths kathe Aithshs (pou hrthe me accept()) sthn FIFO. (struct: File-Descriptor, Time)
-      aithseis[tail].accptFd = new_fd;
-      gettimeofday(&tv, NULL);
-      aithseis[tail].accptTime = tv;
-      //fprintf(stdout, "\t~Nea Aithsh:  FileDescr: %d\n", aithseis[tail].accptFd);
-      
-      tail++;                       // Proxwrw to 'tail' mia thesh mprosta gia thn epomenh(available) apothhkeysh ths Aithshs.
-      state=LOADED;
-    }
+  state=EMPTY;
 
-    if(tail>QUEUE_SIZE){
-      tail=0;                       // Reset tail back at start of FIFO.
+  if (pthread_create(&stats_tid, NULL, statistics_handler, &sigtstp))
+    ERROR("pthread_create()");
+
+  // main loop: wait for new connection/requests, until Control+Z
+  while (!__atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+    // wait for incomming connection, on either socket
+    if (poll(listeners, num_listeners, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      ERROR("poll()");
     }
+    for (k = 0; k < num_listeners; k++) {
+      if (!listeners[k].revents)
+        continue;
+      clen = sizeof(client_addr);
+      if ((new_fd = accept(listeners[k].fd, k ? NULL : (struct sockaddr *)&client_addr, k ? NULL : &clen)) == -1) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EINVAL)
+          continue;                 // EINVAL: shut down by Control+Z.
+        ERROR("accept()");
+      }
+      //fprintf(stdout, "\t~Server's 'new_fd' (for this client) : %d\n", new_fd);
 
-    while(tail==head){              // FIFO is full.
-      state=FULL;
-      fprintf(stdout, "(FIFO is Full) waiting for empty slot in FIFO...\n");
+      // got connection, serve request
+      fprintf(stderr, "(Info) main: Got connection from '%s'\n", k ? "local" : inet_ntoa(client_addr.sin_addr));
 
-      // Note: To Master-Thread tha kanei Wait otan h FIFO einai Full, mexri na erthei Signal apo ta threads oti yparxei eleytheros xwros sth FIFO.
-      pthread_cond_wait(&fullFifo, &fifo_mutx);
+      // Hand it to an I/O thread (round robin), which reads its requests.
+      if (!(c = (Conn *) calloc(1, sizeof(Conn)))) {
+        close(new_fd);
+        continue;
+      }
+      fcntl(new_fd, F_SETFL, fcntl(new_fd, F_GETFL) | O_NONBLOCK);
+      c->fd = new_fd;
+      c->local = k;
+      c->accptTime = trace_now_ns();
+      c->io = &io_threads[next_io++ % io_num];
+      c->events = EPOLLIN;
+      __sync_fetch_and_add(&c->io->num_conns, 1);
+      ev.events = EPOLLIN;
+      ev.data.ptr = c;
+      if (epoll_ctl(c->io->epfd, EPOLL_CTL_ADD, new_fd, &ev) < 0) {
+        __sync_fetch_and_sub(&c->io->num_conns, 1);
+        close(new_fd);
+        free(c);
+      }
     }
-    // Signal threads to continue. (Not Empty Fifo now)
-    pthread_cond_signal(&emptyFifo);
-
-    //unlock tail
-    pthread_mutex_unlock(&fifo_mutx);
   }  
 
-  // Destroy the database.
-  // Close the database.
-  KISSDB_close(db);
-
-  // Free memory.
-  if (db)
-    free(db);
-  db = NULL;
+  // The statistics thread closes the database and exits.
+  pthread_join(stats_tid, NULL);
 
   return 0; 
 }
@@ -0,0 +1,269 @@
+/* shmring.c
+
+   Shared-memory transport: two single-producer, single-consumer byte
+   rings in a memfd, with eventfd doorbells. See shmring.h.
+
+*/
+
+#define _GNU_SOURCE                 // memfd_create().
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "shmring.h"
+
+#define SHM_MAGIC 0x6b767368u       // "kvsh"
+
+// Definition of a ring: positions only grow, the data is at position % SHM_RING_SIZE.
+typedef struct shmring {
+  uint64_t head __attribute__((aligned(64)));   // Consumer's position.
+  uint64_t tail __attribute__((aligned(64)));   // Producer's position.
+  char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} ShmRing;
+
+// Definition of the shared area (the memfd's contents).
+typedef struct shmarea {
+  uint32_t magic;
+  int sleeping[2] __attribute__((aligned(64)));  // Per side: SHM_WAIT_* it waits on its doorbell for.
+  ShmRing ring[2];                               // ring[side]: the one 'side' reads.
+} ShmArea;
+
+struct shmchannel {
+  ShmArea *area;
+  int side;
+  int memfd;
+  int bell[2];                      // Doorbells, per side.
+};
+
+// Rings the peer's doorbell if it sleeps for 'what'.
+static void shm_ring(ShmChannel *ch, int what) {
+  int peer = !ch->side;
+  uint64_t one = 1;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);      // Our position first, then its flag (it does the opposite).
+  if (!(__atomic_load_n(&ch->area->sleeping[peer], __ATOMIC_RELAXED) & what))
+    return;
+  if (__atomic_exchange_n(&ch->area->sleeping[peer], 0, __ATOMIC_SEQ_CST) &&
+      write(ch->bell[peer], &one, sizeof(one)) < 0 && errno != EAGAIN)
+    fprintf(stderr, "(Error) shm_ring: Cannot ring the doorbell.\n");
+}
+
+/**
+ * @name shm_create - Creates a channel: the memfd and both doorbells (server side).
+ * @return The channel on Success. NULL on Error.
+ */
+ShmChannel *shm_create() {
+  ShmChannel *ch;
+
+  if (!(ch = (ShmChannel *) calloc(1, sizeof(ShmChannel))))
+    return NULL;
+  ch->side = SHM_SERVER;
+  ch->bell[0] = ch->bell[1] = -1;
+  if ((ch->memfd = memfd_create("kvserver", MFD_CLOEXEC)) == -1)
+    goto error;
+  if (ftruncate(ch->memfd, sizeof(ShmArea)) ||
+      (ch->area = (ShmArea *) mmap(NULL, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0)) == MAP_FAILED) {
+    ch->area = NULL;
+    goto error;
+  }
+  if ((ch->bell[SHM_SERVER] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+      (ch->bell[SHM_CLIENT] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+    goto error;
+  ch->area->magic = SHM_MAGIC;      // The rest of a new memfd is zeros: empty rings.
+  return ch;
+
+error:
+  shm_close(ch);
+  return NULL;
+}
+
+/**
+ * @name shm_fds - The descriptors a client attaches with.
+ * @param ch: The channel.
+ * @param fds: Gets the memfd, the server's doorbell and the client's doorbell.
+ *
+ * @return
+ */
+void shm_fds(ShmChannel *ch, int fds[3]) {
+  fds[0] = ch->memfd;
+  fds[1] = ch->bell[SHM_SERVER];
+  fds[2] = ch->bell[SHM_CLIENT];
+}
+
+/**
+ * @name shm_attach - Maps a channel created by the server (client side).
+ * @param fds: The memfd, the server's doorbell and the client's doorbell; closed by shm_close() (or here, on Error).
+ *
+ * @return The channel on Success. NULL on Error.
+ */
+ShmChannel *shm_attach(int fds[3]) {
+  ShmChannel *ch;
+  struct stat st;
+
+  if (!(ch = (ShmChannel *) calloc(1, sizeof(ShmChannel)))) {
+    close(fds[0]);
+    close(fds[1]);
+    close(fds[2]);
+    return NULL;
+  }
+  ch->side = SHM_CLIENT;
+  ch->memfd = fds[0];
+  ch->bell[SHM_SERVER] = fds[1];
+  ch->bell[SHM_CLIENT] = fds[2];
+  if (fstat(ch->memfd, &st) || st.st_size != (off_t) sizeof(ShmArea) ||
+      (ch->area = (ShmArea *) mmap(NULL, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0)) == MAP_FAILED ||
+      ch->area->magic != SHM_MAGIC) {
+    if (ch->area == MAP_FAILED)
+      ch->area = NULL;
+    shm_close(ch);
+    return NULL;
+  }
+  return ch;
+}
+
+/**
+ * @name shm_close - Unmaps a channel and closes its descriptors.
+ * @param ch: The channel (may be NULL).
+ *
+ * @return
+ */
+void shm_close(ShmChannel *ch) {
+  if (!ch)
+    return;
+  if (ch->area)
+    munmap(ch->area, sizeof(ShmArea));
+  if (ch->memfd != -1)
+    close(ch->memfd);
+  if (ch->bell[0] != -1)
+    close(ch->bell[0]);
+  if (ch->bell[1] != -1)
+    close(ch->bell[1]);
+  free(ch);
+}
+
+int shm_bell(ShmChannel *ch) {
+  return ch->bell[ch->side];
+}
+
+/**
+ * @name shm_clear - Resets this side's doorbell after it rang.
+ * @param ch: The channel.
+ *
+ * @return
+ */
+void shm_clear(ShmChannel *ch) {
+  uint64_t count;
+
+  if (read(ch->bell[ch->side], &count, sizeof(count)) < 0 && errno != EAGAIN && errno != EINTR)
+    fprintf(stderr, "(Error) shm_clear: Cannot read the doorbell.\n");
+}
+
+/**
+ * @name shm_wake - Rings this side's own doorbell.
+ * @param ch: The channel.
+ *
+ * @return
+ */
+void shm_wake(ShmChannel *ch) {
+  uint64_t one = 1;
+
+  if (write(ch->bell[ch->side], &one, sizeof(one)) < 0 && errno != EAGAIN)
+    fprintf(stderr, "(Error) shm_wake: Cannot ring the doorbell.\n");
+}
+
+/**
+ * @name shm_write - Copies bytes into the peer's ring, and rings it if it waits for them.
+ * @param ch: The channel.
+ * @param buf: The bytes.
+ * @param len: How many.
+ *
+ * @return The number of bytes copied (0 if the ring is full). -1 if the peer broke the ring.
+ */
+int shm_write(ShmChannel *ch, const void *buf, int len) {
+  ShmRing *r = &ch->area->ring[!ch->side];
+  uint64_t head, tail;
+  unsigned long off, first;
+  int n;
+
+  tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);      // Ours.
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (tail - head > SHM_RING_SIZE)
+    return -1;
+  n = (int) (SHM_RING_SIZE - (tail - head));
+  if (n > len)
+    n = len;
+  if (n <= 0)
+    return 0;
+
+  off = tail % SHM_RING_SIZE;
+  first = (SHM_RING_SIZE - off < (unsigned long) n) ? SHM_RING_SIZE - off : (unsigned long) n;
+  memcpy(r->data + off, buf, first);
+  memcpy(r->data, (const char *) buf + first, n - first);
+  __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+  shm_ring(ch, SHM_WAIT_DATA);
+  return n;
+}
+
+/**
+ * @name shm_read - Copies bytes out of this side's ring, and rings the peer if it waits for room.
+ * @param ch: The channel.
+ * @param buf: Receives the bytes.
+ * @param len: At most this many.
+ *
+ * @return The number of bytes copied (0 if there are none). -1 if the peer broke the ring.
+ */
+int shm_read(ShmChannel *ch, void *buf, int len) {
+  ShmRing *r = &ch->area->ring[ch->side];
+  uint64_t head, tail;
+  unsigned long off, first;
+  int n;
+
+  head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);      // Ours.
+  tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (tail - head > SHM_RING_SIZE)
+    return -1;
+  n = (int) (tail - head);
+  if (n > len)
+    n = len;
+  if (n <= 0)
+    return 0;
+
+  off = head % SHM_RING_SIZE;
+  first = (SHM_RING_SIZE - off < (unsigned long) n) ? SHM_RING_SIZE - off : (unsigned long) n;
+  memcpy(buf, r->data + off, first);
+  memcpy((char *) buf + first, r->data, n - first);
+  __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+  shm_ring(ch, SHM_WAIT_ROOM);
+  return n;
+}
+
+int shm_readable(ShmChannel *ch) {
+  ShmRing *r = &ch->area->ring[ch->side];
+  uint64_t used = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+  return used > SHM_RING_SIZE ? 0 : (int) used;
+}
+
+int shm_writable(ShmChannel *ch) {
+  ShmRing *r = &ch->area->ring[!ch->side];
+  uint64_t used = __atomic_load_n(&r->tail, __ATOMIC_RELAXED) - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  return used > SHM_RING_SIZE ? 0 : (int) (SHM_RING_SIZE - used);
+}
+
+/**
+ * @name shm_sleep - Tells the peer this side is about to wait on its doorbell.
+ * @param ch: The channel.
+ * @param what: SHM_WAIT_DATA (something to read) and/or SHM_WAIT_ROOM (room to write).
+ *
+ * @return
+ */
+void shm_sleep(ShmChannel *ch, int what) {
+  __atomic_store_n(&ch->area->sleeping[ch->side], what, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);      // Our flag first, then the positions the caller checks again.
+}
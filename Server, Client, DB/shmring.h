@@ -0,0 +1,68 @@
+/* shmring.h
+
+   Shared-memory transport for clients on the server's host.
+
+   A channel is a memfd holding two byte rings, one per direction
+   (requests to the server, replies to the client), and an eventfd
+   "doorbell" per side. The rings carry the same length-prefixed,
+   tagged messages as a session socket, so each side frames them as it
+   would on a socket. Writing and reading only move the ring positions;
+   a side rings its peer's doorbell only if the peer said it was going
+   to sleep, for data to read or for room to write, so a busy channel
+   takes no system call at all.
+
+   The server creates the channel and passes its three descriptors to the
+   client over the Unix domain socket (SHM_UNIX_PATH) the client asked on;
+   that socket stays open, and its hangup tells either side the other one
+   is gone.
+
+*/
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#define SHM_UNIX_PATH   "/tmp/kvserver.%d.sock"   // Unix domain socket of the server on port %d.
+#define SHM_RING_SIZE   (256 * 1024)              // Bytes per direction (a power of 2).
+
+#define SHM_SERVER         0  // Sides of a channel.
+#define SHM_CLIENT         1
+
+#define SHM_WAIT_DATA      1  // What a side sleeps for (shm_sleep()).
+#define SHM_WAIT_ROOM      2
+
+typedef struct shmchannel ShmChannel;
+
+// create a channel (server side). NULL on error.
+ShmChannel *shm_create();
+
+// the descriptors to pass to the client: the memfd, the server's and the client's doorbells.
+void shm_fds(ShmChannel *ch, int fds[3]);
+
+// map a channel from the descriptors the server passed (client side; takes them over). NULL on error.
+ShmChannel *shm_attach(int fds[3]);
+
+// unmap the channel and close its descriptors.
+void shm_close(ShmChannel *ch);
+
+// this side's doorbell (an eventfd, non-blocking): poll it for reading, then shm_clear() it.
+int shm_bell(ShmChannel *ch);
+void shm_clear(ShmChannel *ch);
+
+// copy up to 'len' bytes to the peer. The number of bytes copied (0 if the ring is full), -1 if the channel is broken.
+int shm_write(ShmChannel *ch, const void *buf, int len);
+
+// copy up to 'len' bytes from the peer. The number of bytes copied (0 if there are none), -1 if the channel is broken.
+int shm_read(ShmChannel *ch, void *buf, int len);
+
+// bytes waiting to be read, and room to write.
+int shm_readable(ShmChannel *ch);
+int shm_writable(ShmChannel *ch);
+
+// about to wait on the doorbell for 'what' (SHM_WAIT_DATA and/or SHM_WAIT_ROOM): the peer rings it when that changes.
+// Check again after this call before waiting, in case it changed meanwhile.
+void shm_sleep(ShmChannel *ch, int what);
+
+// ring this side's own doorbell (there's work after all).
+void shm_wake(ShmChannel *ch);
+
+#endif
@@ -0,0 +1,436 @@
+/* tables.c
+
+   Named tables, opened on demand and closed once idle. See tables.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "tables.h"
+
+// Definition of a named table's own sizes.
+typedef struct tablesize {
+  char name[TABLE_NAME_LEN];
+  EngineConfig cfg;
+} TableSize;
+
+struct tables {
+  char *path;
+  char engine[16];
+  EngineConfig cfg;                    // The default table's; the named tables' too, unless in 'sizes'.
+  TableSize sizes[TABLE_SIZES];
+  int num_sizes;
+  int max_open;
+  int idle_sec;
+  Table main;                          // The default table.
+  pthread_mutex_t mutx;                // Guards the list, and the tables' 'refs', 'closing' and 'last_used'.
+  pthread_cond_t changed;              // A table was opened or closed.
+  Table *tables;                       // Named tables: open, being opened or being closed.
+  int num_open, open_max;              // In the list, and the most there were.
+  unsigned long opened, closed;
+  int stop;                            // Closing: no more tables handed out.
+  pthread_cond_t wake;                 // The janitor's.
+  pthread_t janitor;
+};
+
+// Monotonic clock in secs.
+static int64_t tables_now(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec;
+}
+
+/**
+ * @name tables_shut - Closes a table and takes it off the list.
+ * @param tt: The registry.
+ * @param t: The table, marked 'closing' with no request holding it (called without the lock).
+ *
+ * @return
+ */
+static void tables_shut(Tables *tt, Table *t) {
+  Table **prev;
+
+  engine_close(t->engine);
+  fprintf(stderr, "(Info) tables_shut: Closed table '%s'.\n", t->name);
+
+  pthread_mutex_lock(&tt->mutx);
+  for (prev = &tt->tables; *prev != t; prev = &(*prev)->next)
+    ;
+  *prev = t->next;
+  tt->num_open--;
+  tt->closed++;
+  pthread_cond_broadcast(&tt->changed);
+  pthread_mutex_unlock(&tt->mutx);
+
+  pthread_mutex_destroy(&t->put_mutx);
+  free(t);
+}
+
+// Janitor thread: closes the named tables left unused for 'idle_sec' seconds.
+static void *tables_janitor(void *arg) {
+  Tables *tt = (Tables *) arg;
+  struct timespec until;
+  Table *t;
+  int64_t now;
+
+  pthread_mutex_lock(&tt->mutx);
+  while (!tt->stop) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += (tt->idle_sec + 3) / 4;
+    while (!tt->stop && pthread_cond_timedwait(&tt->wake, &tt->mutx, &until) != ETIMEDOUT)
+      ;
+    do {
+      now = tables_now();
+      for (t = tt->tables; t && (!t->engine || t->refs || t->closing || now - t->last_used < tt->idle_sec);
+           t = t->next)
+        ;
+      if (t && !tt->stop) {
+        t->closing = 1;
+        pthread_mutex_unlock(&tt->mutx);
+        tables_shut(tt, t);
+        pthread_mutex_lock(&tt->mutx);
+      }
+    } while (t && !tt->stop);
+  }
+  pthread_mutex_unlock(&tt->mutx);
+  return NULL;
+}
+
+/*
+ * @name tables_sizes_ok - Checks the sizes of a table's opened file.
+ * @param name: The table ("": the default one).
+ * @param path: Its file.
+ * @param key_size: The file's key size.
+ * @param value_size: The file's value size.
+ * @param want: The sizes it was opened with.
+ * @param max: The most its sizes may be (the default table's: the requests' buffers).
+ *
+ * An existing file keeps the sizes it was created with, whatever 'want' says.
+ * @return 0 if they fit. -1 if they don't.
+ */
+static int tables_sizes_ok(const char *name, const char *path, unsigned long key_size, unsigned long value_size,
+                           const EngineConfig *want, const EngineConfig *max) {
+  if (key_size > max->key_size || value_size > max->value_size) {
+    fprintf(stderr, "(Error) tables: Table '%s' (%s) holds keys and values of %lu:%lu bytes, more than %lu:%lu.\n",
+            name, path, key_size, value_size, max->key_size, max->value_size);
+    return -1;
+  }
+  if (key_size != want->key_size || value_size != want->value_size)
+    fprintf(stderr, "(Warning) tables: Table '%s' (%s) keeps its file's sizes, %lu:%lu, not %lu:%lu.\n",
+            name, path, key_size, value_size, want->key_size, want->value_size);
+  return 0;
+}
+
+/**
+ * @name tables_open - Opens the default table and starts the janitor.
+ * @param path: The database file: the default table, and the prefix of the named tables' files.
+ * @param engine: The engine of all tables.
+ * @param cfg: Its settings (sizes: the default table's, and the most a named table's may be).
+ * @param max_open: Named tables open at once, at most.
+ * @param idle_sec: Seconds a named table may go unused before it's closed.
+ *
+ * @return The registry on Success. NULL on Error.
+ */
+Tables *tables_open(const char *path, const char *engine, const EngineConfig *cfg, int max_open, int idle_sec) {
+  Tables *tt;
+
+  if (max_open < 1 || idle_sec < 1 || !(tt = (Tables *) calloc(1, sizeof(Tables))))
+    return NULL;
+  if (!(tt->path = strdup(path)) || !(tt->main.engine = engine_open(engine, path, cfg))) {
+    free(tt->path);
+    free(tt);
+    return NULL;
+  }
+  engine_sizes(tt->main.engine, &tt->main.key_size, &tt->main.value_size);
+  if (tables_sizes_ok("", path, tt->main.key_size, tt->main.value_size, cfg, cfg)) {
+    engine_close(tt->main.engine);
+    free(tt->path);
+    free(tt);
+    return NULL;
+  }
+  snprintf(tt->engine, sizeof(tt->engine), "%s", engine);
+  tt->cfg = *cfg;
+  tt->max_open = max_open;
+  tt->idle_sec = idle_sec;
+  pthread_mutex_init(&tt->main.put_mutx, NULL);
+  pthread_mutex_init(&tt->mutx, NULL);
+  pthread_cond_init(&tt->changed, NULL);
+  pthread_cond_init(&tt->wake, NULL);
+  if (pthread_create(&tt->janitor, NULL, tables_janitor, tt)) {
+    fprintf(stderr, "(Error) tables_open: Cannot create the janitor thread.\n");
+    engine_close(tt->main.engine);
+    free(tt->path);
+    free(tt);
+    return NULL;
+  }
+  return tt;
+}
+
+/**
+ * @name tables_name_ok - Checks a table name: 1 to TABLE_NAME_LEN - 1 letters, digits, '_' or '-'.
+ * @param name: The name.
+ *
+ * Names are part of file names, and of the keys in the logs ("@name/key").
+ * @return 1 if it's valid. 0 if not.
+ */
+int tables_name_ok(const char *name) {
+  size_t len = strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-");
+
+  return len && len < TABLE_NAME_LEN && !name[len];
+}
+
+/**
+ * @name tables_size - Gives a named table sizes of its own.
+ * @param tt: The registry.
+ * @param name: The table.
+ * @param key_size: Key size (2 up to the default table's).
+ * @param value_size: Value size (2 up to the default table's).
+ * @param hash_table_size: Buckets per hash table (0: the default table's).
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int tables_size(Tables *tt, const char *name, unsigned long key_size, unsigned long value_size,
+                unsigned long hash_table_size) {
+  int k;
+
+  if (!tables_name_ok(name) || key_size < 2 || key_size > tt->cfg.key_size ||
+      value_size < 2 || value_size > tt->cfg.value_size)
+    return -1;
+  for (k = 0; k < tt->num_sizes && strcmp(tt->sizes[k].name, name); k++)
+    ;
+  if (k == TABLE_SIZES)
+    return -1;
+  if (k == tt->num_sizes)
+    tt->num_sizes++;
+  strcpy(tt->sizes[k].name, name);
+  tt->sizes[k].cfg = tt->cfg;
+  tt->sizes[k].cfg.key_size = key_size;
+  tt->sizes[k].cfg.value_size = value_size;
+  if (hash_table_size)
+    tt->sizes[k].cfg.hash_table_size = hash_table_size;
+  return 0;
+}
+
+/**
+ * @name tables_acquire - Finds a table, opening it if it isn't open, and holds it.
+ * @param tt: The registry.
+ * @param name: The table ("": the default one).
+ *
+ * Opening a table past 'max_open' first closes the least recently used one no request holds. The file is
+ * opened without the registry's lock, so requests to the open tables go on meanwhile; requests to the same
+ * table wait for it.
+ * @return The table on Success. NULL on Error.
+ */
+Table *tables_acquire(Tables *tt, const char *name) {
+  char path[strlen(tt->path) + TABLE_NAME_LEN + 8];
+  EngineConfig cfg;
+  Table *t, *lru, **prev;
+  Engine *e;
+  int k;
+
+  if (!name[0]) {
+    // Counted without the lock: tables_close() only needs to see it drop to 0.
+    __sync_fetch_and_add(&tt->main.refs, 1);
+    if (__atomic_load_n(&tt->stop, __ATOMIC_SEQ_CST)) {
+      tables_release(tt, &tt->main);
+      return NULL;
+    }
+    return &tt->main;
+  }
+  if (!tables_name_ok(name))
+    return NULL;
+
+  pthread_mutex_lock(&tt->mutx);
+  while (1) {
+    if (tt->stop) {
+      pthread_mutex_unlock(&tt->mutx);
+      return NULL;
+    }
+    for (t = tt->tables; t && strcmp(t->name, name); t = t->next)
+      ;
+    if (t && !t->closing) {
+      t->refs++;
+      while (!t->engine && !t->closing)
+        pthread_cond_wait(&tt->changed, &tt->mutx);   // Being opened by another request.
+      if (t->engine) {
+        pthread_mutex_unlock(&tt->mutx);
+        return t;
+      }
+      // It couldn't be opened (and is off the list): the last one to let go frees it.
+      if (!--t->refs) {
+        pthread_mutex_destroy(&t->put_mutx);
+        free(t);
+      }
+      pthread_mutex_unlock(&tt->mutx);
+      return NULL;
+    }
+    if (t) {
+      pthread_cond_wait(&tt->changed, &tt->mutx);     // Being closed: open it again once it is.
+      continue;
+    }
+    if (tt->num_open < tt->max_open)
+      break;
+
+    // Full: close the least recently used table no request holds, or wait for one that's closing.
+    lru = NULL;
+    for (t = tt->tables; t; t = t->next) {
+      if (t->engine && !t->refs && !t->closing && (!lru || t->last_used < lru->last_used))
+        lru = t;
+    }
+    if (lru) {
+      lru->closing = 1;
+      pthread_mutex_unlock(&tt->mutx);
+      tables_shut(tt, lru);
+      pthread_mutex_lock(&tt->mutx);
+      continue;
+    }
+    for (t = tt->tables; t && !t->closing; t = t->next)
+      ;
+    if (!t) {
+      pthread_mutex_unlock(&tt->mutx);
+      fprintf(stderr, "(Error) tables_acquire: %d tables open and in use; cannot open '%s'.\n", tt->max_open, name);
+      return NULL;
+    }
+    pthread_cond_wait(&tt->changed, &tt->mutx);
+  }
+
+  // Open it, holding its place on the list.
+  if (!(t = (Table *) calloc(1, sizeof(Table)))) {
+    pthread_mutex_unlock(&tt->mutx);
+    return NULL;
+  }
+  strcpy(t->name, name);
+  pthread_mutex_init(&t->put_mutx, NULL);
+  t->refs = 1;
+  t->next = tt->tables;
+  tt->tables = t;
+  if (++tt->num_open > tt->open_max)
+    tt->open_max = tt->num_open;
+  cfg = tt->cfg;
+  for (k = 0; k < tt->num_sizes; k++) {
+    if (!strcmp(tt->sizes[k].name, name))
+      cfg = tt->sizes[k].cfg;
+  }
+  pthread_mutex_unlock(&tt->mutx);
+
+  sprintf(path, "%s.table.%s", tt->path, name);
+  if ((e = engine_open(tt->engine, path, &cfg))) {
+    // Sized like its file, which may predate (or ignore) the sizes in 'cfg'.
+    engine_sizes(e, &t->key_size, &t->value_size);
+    if (tables_sizes_ok(name, path, t->key_size, t->value_size, &cfg, &tt->cfg)) {
+      engine_close(e);
+      e = NULL;
+    }
+  }
+
+  pthread_mutex_lock(&tt->mutx);
+  if (e) {
+    t->engine = e;
+    tt->opened++;
+    pthread_cond_broadcast(&tt->changed);
+    pthread_mutex_unlock(&tt->mutx);
+    fprintf(stderr, "(Info) tables_acquire: Opened table '%s' (%s).\n", name, path);
+    return t;
+  }
+  fprintf(stderr, "(Error) tables_acquire: Cannot open table '%s' (%s).\n", name, path);
+  t->closing = 1;
+  for (prev = &tt->tables; *prev != t; prev = &(*prev)->next)
+    ;
+  *prev = t->next;
+  tt->num_open--;
+  pthread_cond_broadcast(&tt->changed);
+  if (!--t->refs) {
+    pthread_mutex_destroy(&t->put_mutx);
+    free(t);
+  }
+  pthread_mutex_unlock(&tt->mutx);
+  return NULL;
+}
+
+/**
+ * @name tables_release - Lets go of a table from tables_acquire().
+ * @param tt: The registry.
+ * @param t: The table (NULL: none).
+ *
+ * @return
+ */
+void tables_release(Tables *tt, Table *t) {
+  if (!t)
+    return;
+  if (t == &tt->main) {
+    if (!__sync_sub_and_fetch(&t->refs, 1) && __atomic_load_n(&tt->stop, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock(&tt->mutx);
+      pthread_cond_broadcast(&tt->changed);
+      pthread_mutex_unlock(&tt->mutx);
+    }
+    return;
+  }
+  pthread_mutex_lock(&tt->mutx);
+  if (!--t->refs && tt->stop)
+    pthread_cond_broadcast(&tt->changed);
+  t->last_used = tables_now();
+  pthread_mutex_unlock(&tt->mutx);
+}
+
+Table *tables_default(Tables *tt) {
+  return &tt->main;
+}
+
+/**
+ * @name tables_stats - Reports the named tables open.
+ * @param tt: The registry.
+ * @param open: Gets the tables open (or being opened or closed).
+ * @param open_max: Gets the most there were.
+ * @param opened: Gets the tables opened so far.
+ * @param closed: Gets the tables closed so far (idle, or to make room).
+ *
+ * @return
+ */
+void tables_stats(Tables *tt, int *open, int *open_max, unsigned long *opened, unsigned long *closed) {
+  pthread_mutex_lock(&tt->mutx);
+  *open = tt->num_open;
+  *open_max = tt->open_max;
+  *opened = tt->opened;
+  *closed = tt->closed;
+  pthread_mutex_unlock(&tt->mutx);
+}
+
+/**
+ * @name tables_close - Stops the janitor and closes every table.
+ * @param tt: The registry.
+ *
+ * From now on tables_acquire() fails; the tables held (and those being opened or closed) are waited for first.
+ * @return
+ */
+void tables_close(Tables *tt) {
+  Table *t;
+
+  pthread_mutex_lock(&tt->mutx);
+  __atomic_store_n(&tt->stop, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&tt->wake);
+  while (1) {
+    for (t = tt->tables; t && !t->refs && !t->closing; t = t->next)
+      ;
+    if (!t && !__atomic_load_n(&tt->main.refs, __ATOMIC_SEQ_CST))
+      break;
+    pthread_cond_wait(&tt->changed, &tt->mutx);
+  }
+  pthread_mutex_unlock(&tt->mutx);
+  pthread_join(tt->janitor, NULL);
+
+  while ((t = tt->tables)) {
+    tt->tables = t->next;
+    if (t->engine)
+      engine_close(t->engine);
+    pthread_mutex_destroy(&t->put_mutx);
+    free(t);
+  }
+  engine_close(tt->main.engine);
+  pthread_mutex_destroy(&tt->main.put_mutx);
+  free(tt->path);
+  free(tt);
+}
@@ -0,0 +1,74 @@
+/* tables.h
+
+   Named tables: each one a database of its own (<path>.table.<name>, on
+   the server's engine), with its own key and value sizes and its own
+   writer lock, so a bulk load of one table doesn't hold up the others.
+
+   A table is opened by its first request and held by the requests that
+   use it (tables_acquire() / tables_release()). At most 'max_open' are
+   open at once: opening one more closes the least recently used table
+   no request holds, and a janitor thread closes the tables left unused
+   for 'idle_sec' seconds, so the server's open files stay bounded
+   however many tables its clients name. The default table ("") is the
+   database file itself; it's always open.
+
+*/
+
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "engine.h"
+
+#define TABLE_NAME_LEN    32  // Longest table name, plus 1: letters, digits, '_' and '-'.
+#define TABLES_OPEN       16  // Default: named tables open at once, at most.
+#define TABLE_IDLE_SEC    60  // Seconds a named table may go unused before it's closed.
+#define TABLE_SIZES       32  // Named tables given sizes of their own (tables_size()), at most.
+
+// Definition of a table.
+typedef struct table {
+  char name[TABLE_NAME_LEN];           // "" for the default table.
+  Engine *engine;                      // NULL while it's being opened.
+  unsigned long key_size;              // Its file's (engine_sizes()), which -N only sets for a new one.
+  unsigned long value_size;
+  pthread_mutex_t put_mutx;            // Its writers: PUTs, DELETEs and read-modify-writes.
+  // The registry's (under its lock).
+  int refs;                            // Requests holding it (the default table's: atomic, without the lock).
+  int closing;                         // Being closed (or failed to open): not handed out any more.
+  int64_t last_used;                   // Last released (secs, monotonic).
+  struct table *next;
+} Table;
+
+typedef struct tables Tables;
+
+// open the default table at 'path' with engine 'engine' and 'cfg', which the named tables get too unless
+// tables_size() gave them sizes of their own. NULL on error.
+Tables *tables_open(const char *path, const char *engine, const EngineConfig *cfg, int max_open, int idle_sec);
+
+// whether 'name' is a valid table name.
+int tables_name_ok(const char *name);
+
+// give table 'name' its own key, value and hash table sizes (at most the default table's), before it's first opened
+// (an existing file keeps the ones it was created with). 0 on success, -1 on error.
+int tables_size(Tables *tt, const char *name, unsigned long key_size, unsigned long value_size,
+                unsigned long hash_table_size);
+
+// table 'name' ("": the default table), opened if it isn't, held until tables_release(). NULL on error, if
+// 'max_open' tables are open and held, or once tables_close() started.
+Table *tables_acquire(Tables *tt, const char *name);
+
+// release a table from tables_acquire().
+void tables_release(Tables *tt, Table *t);
+
+// the default table, not held (for its status: a request uses tables_acquire()).
+Table *tables_default(Tables *tt);
+
+// named tables open (and the most there were), and how many were opened and closed so far.
+void tables_stats(Tables *tt, int *open, int *open_max, unsigned long *opened, unsigned long *closed);
+
+// stop handing out tables, wait until none is held, then stop the janitor and close every table (the memory engine
+// writes its last snapshots).
+void tables_close(Tables *tt);
+
+#endif
@@ -0,0 +1,287 @@
+/* trace.c
+
+   Per-request tracing spans, exported as Chrome trace-event JSON.
+   See trace.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#define TRACE_THREADS 1024  // Threads that can keep spans (and named threads).
+
+// Definition of a thread's ring of spans.
+typedef struct tracebuf {
+  pthread_mutex_t lock;                // Taken by the owner per kept span, and by trace_export().
+  unsigned long next;                  // Spans ever kept; the ring holds the last TRACE_SPANS.
+  int tid;
+  TraceSpan spans[TRACE_SPANS];
+} TraceBuf;
+
+// Definition of a named thread, for the tracks of the trace.
+typedef struct tracename {
+  int tid;
+  char name[24];
+} TraceName;
+
+// Slices, named after the stage that ends them.
+static const char *stage_names[TRACE_STAGES] = {
+  "", "read", "parse", "queued", "execute", "write", "close"
+};
+
+static uint64_t threshold = 0;         // Sample when a random 64-bit number is below this. 0: off.
+static TraceBuf *bufs[TRACE_THREADS];
+static int num_bufs = 0;
+static TraceName names[TRACE_THREADS];
+static int num_names = 0;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;   // Guards 'bufs' and 'names'.
+
+static __thread TraceBuf *my_buf = NULL;
+static __thread uint64_t rng = 0;
+static __thread int my_tid = 0;
+
+/**
+ * @name trace_init - Enables tracing.
+ * @param rate: Fraction of the requests to trace (0 < rate <= 1).
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int trace_init(double rate) {
+  if (rate <= 0 || rate > 1)
+    return -1;
+  threshold = (rate >= 1) ? UINT64_MAX : (uint64_t) (rate * 18446744073709551616.0);
+  return 0;
+}
+
+/**
+ * @name trace_now_ns - Monotonic time in nanoseconds.
+ * @return
+ */
+int64_t trace_now_ns() {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Kernel id of the calling thread.
+static int trace_tid() {
+  if (!my_tid)
+    my_tid = (int) syscall(SYS_gettid);
+  return my_tid;
+}
+
+/**
+ * @name trace_thread_name - Names the calling thread's track in the trace.
+ * @param name: The name (e.g. "worker 3").
+ *
+ * @return
+ */
+void trace_thread_name(const char *name) {
+  pthread_mutex_lock(&bufs_lock);
+  if (num_names < TRACE_THREADS) {
+    names[num_names].tid = trace_tid();
+    snprintf(names[num_names].name, sizeof(names[num_names].name), "%s", name);
+    num_names++;
+  }
+  pthread_mutex_unlock(&bufs_lock);
+}
+
+// The calling thread's ring, registered on its first kept span. NULL if there's no room.
+static TraceBuf *trace_buf() {
+  TraceBuf *b;
+
+  if (my_buf)
+    return my_buf;
+  pthread_mutex_lock(&bufs_lock);
+  if (num_bufs < TRACE_THREADS && (b = (TraceBuf *) calloc(1, sizeof(TraceBuf)))) {
+    pthread_mutex_init(&b->lock, NULL);
+    b->tid = trace_tid();
+    bufs[num_bufs++] = my_buf = b;
+  }
+  pthread_mutex_unlock(&bufs_lock);
+  return my_buf;
+}
+
+/**
+ * @name trace_begin - Starts a request's span, deciding whether it's sampled.
+ * @param s: The span.
+ * @param accepted_ns: When the request was accepted (trace_now_ns()).
+ *
+ * @return
+ */
+void trace_begin(TraceSpan *s, int64_t accepted_ns) {
+  s->sampled = 0;
+  if (!threshold)
+    return;
+
+  // xorshift64*, seeded per thread.
+  if (!rng)
+    rng = (uint64_t) trace_now_ns() ^ ((uint64_t) trace_tid() << 32) ^ 0x9E3779B97F4A7C15ULL;
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  if (threshold != UINT64_MAX && rng * 2685821657736338717ULL >= threshold)
+    return;
+
+  memset(s, 0, sizeof(TraceSpan));
+  s->sampled = 1;
+  s->at[TRACE_ACCEPTED] = accepted_ns;
+  s->tid[TRACE_ACCEPTED] = trace_tid();
+}
+
+/**
+ * @name trace_mark - Records that a request reached a stage.
+ * @param s: The request's span.
+ * @param stage: TRACE_READ .. TRACE_CLOSED.
+ *
+ * @return
+ */
+void trace_mark(TraceSpan *s, int stage) {
+  if (s->sampled && stage >= 0 && stage < TRACE_STAGES) {
+    s->at[stage] = trace_now_ns();
+    s->tid[stage] = trace_tid();
+  }
+}
+
+/**
+ * @name trace_request - Names a request.
+ * @param s: The request's span.
+ * @param op: The operation (e.g. "GET").
+ * @param key: The key (may be empty).
+ *
+ * @return
+ */
+void trace_request(TraceSpan *s, const char *op, const char *key) {
+  if (!s->sampled)
+    return;
+  snprintf(s->op, sizeof(s->op), "%s", op);
+  snprintf(s->key, sizeof(s->key), "%.*s", TRACE_KEY, key);
+}
+
+/**
+ * @name trace_end - Finishes a request and keeps its span in the calling thread's ring.
+ * @param s: The request's span.
+ *
+ * @return
+ */
+void trace_end(TraceSpan *s) {
+  TraceBuf *b;
+
+  if (!s->sampled)
+    return;
+  s->sampled = 0;
+  if (!(b = trace_buf()))
+    return;
+  pthread_mutex_lock(&b->lock);
+  b->spans[b->next % TRACE_SPANS] = *s;
+  b->spans[b->next % TRACE_SPANS].sampled = 1;
+  b->next++;
+  pthread_mutex_unlock(&b->lock);
+}
+
+// Writes 's' as a JSON string, escaping what needs it.
+static void json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(f, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf(f, "\\u%04x", (unsigned char) *s);
+    else
+      fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+// Writes one span: an async slice for the request ('id' tells them apart) with a child per stage
+// it went through, and the execute stage again on its worker's track.
+static void export_span(FILE *f, int pid, int tid, unsigned long id, const TraceSpan *s) {
+  int k, next;
+
+  fprintf(f, ",\n{\"name\":");
+  json_string(f, s->op[0] ? s->op : "request");
+  fprintf(f, ",\"cat\":\"request\",\"ph\":\"b\",\"id\":\"%d.%lu\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"key\":",
+          tid, id, pid, s->tid[TRACE_ACCEPTED], s->at[TRACE_ACCEPTED] / 1000.0);
+  json_string(f, s->key);
+  fprintf(f, "}}");
+
+  // Stage k runs from its predecessor's timestamp to its own; a stage not reached is skipped.
+  for (k = TRACE_ACCEPTED; k < TRACE_STAGES - 1; k = next) {
+    for (next = k + 1; next < TRACE_STAGES && !s->at[next]; next++)
+      ;
+    if (next == TRACE_STAGES)
+      break;
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"b\",\"id\":\"%d.%lu\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"thread\":%d}}",
+            stage_names[next], tid, id, pid, s->tid[next], s->at[k] / 1000.0, s->tid[next]);
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"e\",\"id\":\"%d.%lu\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+            stage_names[next], tid, id, pid, s->tid[next], s->at[next] / 1000.0);
+    if (next == TRACE_EXECUTED)
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"execute\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+              s->op[0] ? s->op : "execute", pid, s->tid[next], s->at[k] / 1000.0, (s->at[next] - s->at[k]) / 1000.0);
+  }
+  for (k = TRACE_STAGES - 1; k > 0 && !s->at[k]; k--)
+    ;
+  fprintf(f, ",\n{\"name\":");
+  json_string(f, s->op[0] ? s->op : "request");
+  fprintf(f, ",\"cat\":\"request\",\"ph\":\"e\",\"id\":\"%d.%lu\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+          tid, id, pid, s->tid[k], s->at[k] / 1000.0);
+}
+
+/**
+ * @name trace_export - Writes the kept spans as Chrome trace-event JSON.
+ * @param path: The output file (overwritten).
+ *
+ * Recording goes on meanwhile; each thread's ring is copied out under its lock.
+ * @return The number of spans written on Success. -1 on Error.
+ */
+long trace_export(const char *path) {
+  FILE *f;
+  TraceSpan *copy;
+  unsigned long first_span, n, i;
+  long total = 0;
+  int k, num, tid, pid = getpid();
+
+  if (!(f = fopen(path, "w")))
+    return -1;
+  if (!(copy = (TraceSpan *) malloc(TRACE_SPANS * sizeof(TraceSpan)))) {
+    fclose(f);
+    return -1;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"server\"}}", pid);
+  pthread_mutex_lock(&bufs_lock);
+  for (k = 0; k < num_names; k++) {
+    fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, names[k].tid);
+    json_string(f, names[k].name);
+    fprintf(f, "}}");
+  }
+  num = num_bufs;
+  pthread_mutex_unlock(&bufs_lock);
+
+  for (k = 0; k < num; k++) {
+    pthread_mutex_lock(&bufs[k]->lock);
+    n = bufs[k]->next < TRACE_SPANS ? bufs[k]->next : TRACE_SPANS;
+    first_span = bufs[k]->next - n;
+    for (i = 0; i < n; i++)
+      copy[i] = bufs[k]->spans[(first_span + i) % TRACE_SPANS];
+    tid = bufs[k]->tid;
+    pthread_mutex_unlock(&bufs[k]->lock);
+
+    for (i = 0; i < n; i++)
+      export_span(f, pid, tid, first_span + i, &copy[i]);
+    total += n;
+  }
+  fprintf(f, "\n]}\n");
+
+  free(copy);
+  if (fclose(f))
+    return -1;
+  return total;
+}
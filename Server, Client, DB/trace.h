@@ -0,0 +1,73 @@
+/* trace.h
+
+   Per-request tracing spans.
+
+   A sampled request records a monotonic timestamp (ns), and the thread
+   that got it there, at every stage it goes through on the server:
+   accepted, request read (framed), parsed, dequeued by a DB worker,
+   executed against the database, response written and connection closed
+   (or, for a session, ready for its next request). A request crosses
+   threads, so its span travels with it and is kept, when it ends, in a
+   ring of the thread that ends it: recording takes no shared lock.
+
+   Spans are exported as Chrome trace-event JSON (chrome://tracing,
+   Perfetto): each request is an async slice with one child per stage,
+   and the execute stage is also drawn on its DB worker's track.
+
+   Without trace_init(), or for a request that isn't sampled, the calls
+   return at once.
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_SPANS   8192  // Spans kept per thread (the oldest are overwritten).
+#define TRACE_KEY       32  // Key bytes kept per span.
+
+// Stages of a request, in order.
+#define TRACE_ACCEPTED   0
+#define TRACE_READ       1
+#define TRACE_PARSED     2
+#define TRACE_DEQUEUED   3
+#define TRACE_EXECUTED   4
+#define TRACE_WRITTEN    5
+#define TRACE_CLOSED     6
+#define TRACE_STAGES     7
+
+// Definition of a request's span.
+typedef struct tracespan {
+  int sampled;
+  int64_t at[TRACE_STAGES];    // ns, 0 if the stage wasn't reached.
+  int tid[TRACE_STAGES];       // Thread that reached it.
+  char op[12];
+  char key[TRACE_KEY + 1];
+} TraceSpan;
+
+// enable tracing of a fraction 'rate' (0..1] of the requests. 0 on success.
+int trace_init(double rate);
+
+// monotonic clock (ns).
+int64_t trace_now_ns();
+
+// name the calling thread's track (e.g. "worker 3").
+void trace_thread_name(const char *name);
+
+// start the span of a request accepted at 'accepted_ns'; samples it (or not).
+void trace_begin(TraceSpan *s, int64_t accepted_ns);
+
+// the request reached 'stage' now, on the calling thread.
+void trace_mark(TraceSpan *s, int stage);
+
+// name the request's operation and key (copied).
+void trace_request(TraceSpan *s, const char *op, const char *key);
+
+// finish the request and keep its span.
+void trace_end(TraceSpan *s);
+
+// write the kept spans to 'path' as Chrome trace-event JSON. The number of spans, -1 on error.
+long trace_export(const char *path);
+
+#endif
@@ -0,0 +1,284 @@
+/* tseries.c
+
+   Append-only time series of integer samples, one series per key.
+   See tseries.h for the block layout.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tseries.h"
+
+#define TS_BUCKETS 1024
+
+// Definition of a block: samples stored as offsets from the first one.
+typedef struct tsblock {
+  int64_t base_time;
+  int64_t base_value;
+  int64_t last_time;
+  AggResult summary;                   // Zone map of the whole block.
+  int count;
+  uint32_t dtime[TS_BLOCK_SAMPLES];    // time - base_time (ms), ascending.
+  int32_t dvalue[TS_BLOCK_SAMPLES];    // value - base_value.
+} TSBlock;
+
+// Definition of a series.
+typedef struct series {
+  char *key;
+  TSBlock **blocks;
+  int num_blocks;
+  int cap_blocks;
+  struct series *next;                 // Next series in the same bucket.
+} Series;
+
+struct tseries {
+  FILE *log;
+  unsigned long key_size;
+  unsigned long record_size;           // Log record: key, int64 time, int32 value.
+  pthread_rwlock_t lock;
+  Series *buckets[TS_BUCKETS];
+};
+
+static unsigned long tseries_hash(const char *key, unsigned long len) {
+  unsigned long hash = 5381, i;
+
+  for (i = 0; i < len && key[i]; i++)
+    hash = ((hash << 5) + hash) + (unsigned char) key[i];
+  return hash % TS_BUCKETS;
+}
+
+static Series *tseries_find(TSeries *ts, const char *key, int create) {
+  unsigned long b = tseries_hash(key, ts->key_size);
+  Series *s;
+
+  for (s = ts->buckets[b]; s; s = s->next) {
+    if (!strncmp(s->key, key, ts->key_size))
+      return s;
+  }
+  if (!create)
+    return NULL;
+
+  if (!(s = (Series *) calloc(1, sizeof(Series))))
+    return NULL;
+  if (!(s->key = (char *) calloc(1, ts->key_size + 1))) {
+    free(s);
+    return NULL;
+  }
+  strncpy(s->key, key, ts->key_size);
+  s->next = ts->buckets[b];
+  ts->buckets[b] = s;
+  return s;
+}
+
+// Adds a sample to the in-memory series. Starts a new block when the current one is full or the offsets don't fit.
+static int tseries_add(TSeries *ts, const char *key, int64_t time_ms, int32_t value) {
+  Series *s;
+  TSBlock *blk = NULL, **blocks;
+  int n;
+
+  if (!(s = tseries_find(ts, key, 1)))
+    return -1;
+
+  if (s->num_blocks) {
+    blk = s->blocks[s->num_blocks - 1];
+    if (time_ms < blk->last_time)      // Append-only: a clock step back doesn't reorder samples.
+      time_ms = blk->last_time;
+    if (blk->count == TS_BLOCK_SAMPLES ||
+        time_ms - blk->base_time > (int64_t) UINT32_MAX ||
+        (int64_t) value - blk->base_value > INT32_MAX ||
+        (int64_t) value - blk->base_value < INT32_MIN)
+      blk = NULL;
+  }
+
+  if (!blk) {
+    if (s->num_blocks == s->cap_blocks) {
+      n = s->cap_blocks ? s->cap_blocks * 2 : 4;
+      if (!(blocks = (TSBlock **) realloc(s->blocks, n * sizeof(TSBlock *))))
+        return -1;
+      s->blocks = blocks;
+      s->cap_blocks = n;
+    }
+    if (!(blk = (TSBlock *) malloc(sizeof(TSBlock))))
+      return -1;
+    blk->base_time = time_ms;
+    blk->base_value = value;
+    blk->count = 0;
+    agg_init(&blk->summary);
+    s->blocks[s->num_blocks++] = blk;
+  }
+
+  blk->dtime[blk->count] = (uint32_t) (time_ms - blk->base_time);
+  blk->dvalue[blk->count] = (int32_t) (value - blk->base_value);
+  blk->count++;
+  blk->last_time = time_ms;
+
+  blk->summary.count++;
+  blk->summary.sum += value;
+  if (value < blk->summary.min)
+    blk->summary.min = value;
+  if (value > blk->summary.max)
+    blk->summary.max = value;
+  return 0;
+}
+
+/**
+ * @name tseries_open - Opens the store and replays its log.
+ * @param path: The log file.
+ * @param key_size: Size of keys in bytes.
+ *
+ * @return The store on Success. NULL on Error.
+ */
+TSeries *tseries_open(const char *path, unsigned long key_size) {
+  TSeries *ts;
+  char *rec;
+  int64_t time_ms;
+  int32_t value;
+  long valid = 0;
+
+  if (!(ts = (TSeries *) calloc(1, sizeof(TSeries))))
+    return NULL;
+  ts->key_size = key_size;
+  ts->record_size = key_size + sizeof(int64_t) + sizeof(int32_t);
+  pthread_rwlock_init(&ts->lock, NULL);
+
+  if (!(ts->log = fopen(path, "r+b")) && !(ts->log = fopen(path, "w+b"))) {
+    free(ts);
+    return NULL;
+  }
+  if (!(rec = (char *) malloc(ts->record_size))) {
+    tseries_close(ts);
+    return NULL;
+  }
+
+  // Replay, then drop a torn record left by a crash so appends stay aligned.
+  while (fread(rec, ts->record_size, 1, ts->log) == 1) {
+    memcpy(&time_ms, rec + key_size, sizeof(int64_t));
+    memcpy(&value, rec + key_size + sizeof(int64_t), sizeof(int32_t));
+    if (tseries_add(ts, rec, time_ms, value)) {
+      free(rec);
+      tseries_close(ts);
+      return NULL;
+    }
+    valid += ts->record_size;
+  }
+  free(rec);
+  fflush(ts->log);
+  if (ftruncate(fileno(ts->log), valid) || fseek(ts->log, valid, SEEK_SET)) {
+    tseries_close(ts);
+    return NULL;
+  }
+  return ts;
+}
+
+/**
+ * @name tseries_append - Logs a sample and adds it to its series.
+ * @param ts: The store.
+ * @param key: The series key (up to key_size bytes).
+ * @param time_ms: The sample's time (ms). Earlier than the series' last sample counts as equal to it.
+ * @param value: The sample's value.
+ *
+ * @return 0 on Success. -1 on Error.
+ */
+int tseries_append(TSeries *ts, const char *key, int64_t time_ms, int32_t value) {
+  char *rec;
+  int rc = -1;
+
+  if (!(rec = (char *) calloc(1, ts->record_size)))
+    return -1;
+  strncpy(rec, key, ts->key_size);
+  memcpy(rec + ts->key_size, &time_ms, sizeof(int64_t));
+  memcpy(rec + ts->key_size + sizeof(int64_t), &value, sizeof(int32_t));
+
+  pthread_rwlock_wrlock(&ts->lock);
+  if (fwrite(rec, ts->record_size, 1, ts->log) == 1) {
+    fflush(ts->log);
+    rc = tseries_add(ts, key, time_ms, value);
+  }
+  pthread_rwlock_unlock(&ts->lock);
+
+  free(rec);
+  return rc;
+}
+
+/**
+ * @name tseries_aggregate - Aggregates the samples of a series inside a time window.
+ * @param ts: The store.
+ * @param key: The series key.
+ * @param from_ms: Start of the window (inclusive).
+ * @param to_ms: End of the window (inclusive).
+ * @param res: The aggregate, initialized here.
+ *
+ * @return 0 on Success. 1 if the series doesn't exist.
+ */
+int tseries_aggregate(TSeries *ts, const char *key, int64_t from_ms, int64_t to_ms, AggResult *res) {
+  Series *s;
+  TSBlock *blk;
+  int b, lo, hi, mid, first;
+
+  agg_init(res);
+  pthread_rwlock_rdlock(&ts->lock);
+  if (!(s = tseries_find(ts, key, 0))) {
+    pthread_rwlock_unlock(&ts->lock);
+    return 1;
+  }
+
+  for (b = 0; b < s->num_blocks; b++) {
+    blk = s->blocks[b];
+    if (blk->last_time < from_ms || blk->base_time > to_ms)
+      continue;
+    if (blk->base_time >= from_ms && blk->last_time <= to_ms) {
+      agg_merge(res, &blk->summary);   // Whole block inside the window.
+      continue;
+    }
+
+    // Times are ascending: the window is one contiguous run of samples [first, last).
+    for (lo = 0, hi = blk->count; lo < hi; ) {
+      mid = (lo + hi) / 2;
+      if (blk->base_time + blk->dtime[mid] < from_ms)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    first = lo;
+    for (hi = blk->count; lo < hi; ) {
+      mid = (lo + hi) / 2;
+      if (blk->base_time + blk->dtime[mid] <= to_ms)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    agg_reduce_i32(res, blk->dvalue + first, lo - first, blk->base_value);
+  }
+
+  pthread_rwlock_unlock(&ts->lock);
+  return 0;
+}
+
+/**
+ * @name tseries_close - Closes the log and frees the store.
+ * @param ts: The store.
+ *
+ * @return
+ */
+void tseries_close(TSeries *ts) {
+  Series *s, *next;
+  int b, k;
+
+  for (b = 0; b < TS_BUCKETS; b++) {
+    for (s = ts->buckets[b]; s; s = next) {
+      next = s->next;
+      for (k = 0; k < s->num_blocks; k++)
+        free(s->blocks[k]);
+      free(s->blocks);
+      free(s->key);
+      free(s);
+    }
+  }
+  if (ts->log)
+    fclose(ts->log);
+  pthread_rwlock_destroy(&ts->lock);
+  free(ts);
+}
@@ -0,0 +1,38 @@
+/* tseries.h
+
+   Append-only time series of integer samples, one series per key.
+
+   Samples are kept in columnar blocks of TS_BLOCK_SAMPLES: a column of
+   time offsets and a column of value offsets, both relative to the
+   block's first sample (frame-of-reference delta encoding). Every block
+   also keeps count/sum/min/max, so windows that cover whole blocks are
+   answered without touching the samples, and partial blocks are reduced
+   straight from the packed value column.
+
+   Appends are logged to a file and replayed when the store is opened.
+
+*/
+
+#ifndef TSERIES_H
+#define TSERIES_H
+
+#include <stdint.h>
+#include "agg.h"
+
+#define TS_BLOCK_SAMPLES 256
+
+typedef struct tseries TSeries;
+
+// open (or create) the store logged at 'path'. NULL on error.
+TSeries *tseries_open(const char *path, unsigned long key_size);
+
+// append sample (time_ms, value) to the series of 'key'. 0 on success.
+int tseries_append(TSeries *ts, const char *key, int64_t time_ms, int32_t value);
+
+// aggregate the samples of 'key' with from_ms <= time <= to_ms into 'res'. 0 on success, 1 if there's no such series.
+int tseries_aggregate(TSeries *ts, const char *key, int64_t from_ms, int64_t to_ms, AggResult *res);
+
+// close the log and free the store.
+void tseries_close(TSeries *ts);
+
+#endif
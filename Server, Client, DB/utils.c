@@ -92,3 +92,86 @@ int read_str_from_socket(const int socket_fd, char *buf, const int bufsize)
   return rsize;
 }
 
+
+/**
+ * @name write_msg_to_socket - Writes a message to the socket, reporting errors instead of exiting.
+ * @param socket_fd: The socket descriptor.
+ * @param buf: The buffer that contains the message.
+ * @param numbytes: The length of the message.
+ *
+ * @return Number of bytes written. -1 on Error.
+ */
+int write_msg_to_socket(const int socket_fd, const char *buf, const int numbytes) {
+  const char *ptr;
+  int nwritten, nleft;
+
+  // write the amount of data, then the data.
+  ptr = (const char *) &numbytes;
+  nleft = sizeof(numbytes);
+  while (nleft > 0) {
+    if ((nwritten = write(socket_fd, ptr, nleft)) <= 0) {
+      if (nwritten < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    nleft -= nwritten;
+    ptr += nwritten;
+  }
+
+  ptr = buf;
+  nleft = numbytes;
+  while (nleft > 0) {
+    if ((nwritten = write(socket_fd, ptr, nleft)) <= 0) {
+      if (nwritten < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    nleft -= nwritten;
+    ptr += nwritten;
+  }
+
+  return numbytes;
+}
+
+/**
+ * @name read_msg_from_socket - Reads a message from the socket, reporting errors instead of exiting.
+ * @param socket_fd: The socket descriptor.
+ * @param buf: The buffer that will hold the message, terminated with '\0'.
+ * @param bufsize: The size of the buffer.
+ *
+ * @return Number of bytes read. 0 on EOF. -1 on Error.
+ */
+int read_msg_from_socket(const int socket_fd, char *buf, const int bufsize) {
+  char *ptr;
+  int nread, nleft, rsize;
+
+  // read the amount of sent data.
+  ptr = (char *) &rsize;
+  nleft = sizeof(rsize);
+  while (nleft > 0) {
+    if ((nread = read(socket_fd, ptr, nleft)) <= 0) {
+      if (nread < 0 && errno == EINTR)
+        continue;
+      return (nread == 0 && nleft == sizeof(rsize)) ? 0 : -1;
+    }
+    nleft -= nread;
+    ptr += nread;
+  }
+  if (rsize < 0 || rsize >= bufsize)
+    return -1;
+
+  // read data.
+  ptr = buf;
+  nleft = rsize;
+  while (nleft > 0) {
+    if ((nread = read(socket_fd, ptr, nleft)) <= 0) {
+      if (nread < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    nleft -= nread;
+    ptr += nread;
+  }
+  *ptr = '\0';
+  return rsize;
+}
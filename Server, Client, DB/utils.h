@@ -31,3 +31,12 @@ int write_str_to_socket(const int socket_fd, char *buf, const int numbytes);
 // sent using write_to_socket(); terminate data with '\0'.
 int read_str_from_socket(const int socket_fd, char *buf, const int bufsize);
 
+
+// like write_str_to_socket(), but never exits the program: returns -1
+// if the peer is gone, so long-lived connections can be dropped.
+int write_msg_to_socket(const int socket_fd, const char *buf, const int numbytes);
+
+// like read_str_from_socket(), but never exits the program and never
+// writes past 'bufsize': returns the message length, 0 on EOF and -1
+// on error or if the message doesn't fit.
+int read_msg_from_socket(const int socket_fd, char *buf, const int bufsize);
@@ -0,0 +1,633 @@
+/* watch.c
+
+   Change subscriptions: a queue of committed changes, fanned out to the
+   matching watchers by a notifier thread. See watch.h.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "watch.h"
+
+#define WATCH_IDLE     0               // Nothing pending, or taken: the next change calls 'ready'.
+#define WATCH_DELAYED  1               // Pending until its window ends (on the notifier's delayed list).
+#define WATCH_READY    2               // 'ready' was called: up to watch_take().
+
+// Definition of a committed change, shared by the watchers it matches.
+typedef struct change {
+  struct change *next;                 // In the notifier's queue.
+  int refs;                            // Watchers holding it, plus the notifier while it fans it out.
+  uint64_t hash;                       // Of the whole key.
+  int key_len, value_len;              // value_len -1: a DELETE.
+  char data[];                         // The key, '\0', the value, '\0'.
+} Change;
+
+// Definition of a change pending for a watcher.
+typedef struct pending {
+  struct pending *next;
+  struct pending *hnext;               // In its slot (a watcher with a window).
+  Change *change;
+} Pending;
+
+// Definition of a subscription.
+typedef struct sub {
+  struct sub *next;                    // In its bucket.
+  struct sub *next_of;                 // Of its watcher.
+  Watcher *w;
+  uint64_t hash;                       // Of the key, or of the prefix.
+  int len;
+  int prefix;
+  char pattern[];                      // Without the '*'.
+} Sub;
+
+struct watcher {
+  WatchHub *hub;
+  pthread_mutex_t mutx;                // Guards the pending changes, 'state', 'window_ms' and 'dropped'.
+  Pending *head, **tail;
+  Pending **slots;                     // Once it had a window: its pending changes by key, to coalesce them.
+  long bytes;
+  int state;
+  int window_ms;
+  int64_t deadline;                    // WATCH_DELAYED: when its window ends (msecs).
+  unsigned long dropped;               // Since the last watch_take().
+  WatchReady ready;
+  void *arg;
+  Sub *subs;                           // Under the hub's lock.
+  struct watcher *prev, *next;         // All watchers, under the hub's lock.
+  struct watcher *next_delayed;        // Notifier (or the hub's write lock).
+  uint64_t seen;                       // Notifier: the last change it was matched to.
+};
+
+struct watchhub {
+  unsigned long key_size, value_size;
+  pthread_rwlock_t lock;               // Subscriptions and watchers: read by the notifier, written by the rest.
+  Sub *buckets[WATCH_BUCKETS];
+  int *prefix_subs;                    // Per prefix length: subscriptions.
+  int *lens;                           // Prefix lengths with subscriptions, ascending.
+  int num_lens;
+  Watcher *watchers;
+  int num_watchers;                    // Read by watch_publish() without the lock.
+  Watcher *delayed;                    // Notifier: watchers whose window runs.
+  int64_t next_deadline;               // Notifier: when the first of them ends (0: none).
+  uint64_t seq;                        // Notifier: changes fanned out.
+  pthread_mutex_t mutx;                // Guards the queue.
+  pthread_cond_t wake;
+  int sleeping;
+  Change *head, *tail;
+  int queued, queue_max;
+  unsigned long lost;                  // Changes not queued (full) since the notifier's last batch.
+  unsigned long dropped;               // Changes dropped, for the watchers (updated atomically).
+  pthread_t notifier;
+};
+
+// FNV-1a, continued over 'len' more bytes.
+static uint64_t watch_hash(uint64_t h, const char *s, int len) {
+  int i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+#define WATCH_HASH_INIT 14695981039346656037ULL
+
+// Wall clock in msecs (the notifier's timed waits are on CLOCK_REALTIME).
+static int64_t watch_now_ms(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (int64_t) t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void watch_unref(Change *ch) {
+  if (!__sync_sub_and_fetch(&ch->refs, 1))
+    free(ch);
+}
+
+/**
+ * @name watch_deliver - Appends a change to a watcher's pending ones (or, within its window, to the one of its key).
+ * @param h: The hub.
+ * @param w: A watcher it matched. Notifier only.
+ * @param ch: The change.
+ *
+ * @return
+ */
+static void watch_deliver(WatchHub *h, Watcher *w, Change *ch) {
+  Pending *p = NULL;
+  long size = ch->key_len + (ch->value_len > 0 ? ch->value_len : 0) + sizeof(Pending);
+  int signal = 0;
+
+  if (w->seen == h->seq)
+    return;                            // Matched by another of its patterns already.
+  w->seen = h->seq;
+
+  pthread_mutex_lock(&w->mutx);
+  if (w->window_ms && w->slots) {
+    for (p = w->slots[ch->hash & (WATCH_SLOTS - 1)]; p; p = p->hnext)
+      if (p->change->key_len == ch->key_len && !memcmp(p->change->data, ch->data, ch->key_len))
+        break;
+  }
+  if (p) {
+    // Coalesced: only the key's last change is told.
+    w->bytes += (ch->value_len > 0 ? ch->value_len : 0) - (p->change->value_len > 0 ? p->change->value_len : 0);
+    __sync_fetch_and_add(&ch->refs, 1);
+    watch_unref(p->change);
+    p->change = ch;
+  } else if (w->bytes + size > WATCH_BUFFER || !(p = (Pending *) malloc(sizeof(Pending)))) {
+    w->dropped++;                      // A slow watcher: told once it takes the rest.
+    __sync_fetch_and_add(&h->dropped, 1);
+  } else {
+    __sync_fetch_and_add(&ch->refs, 1);
+    p->change = ch;
+    p->next = NULL;
+    *w->tail = p;
+    w->tail = &p->next;
+    if (w->slots) {
+      p->hnext = w->slots[ch->hash & (WATCH_SLOTS - 1)];
+      w->slots[ch->hash & (WATCH_SLOTS - 1)] = p;
+    }
+    w->bytes += size;
+  }
+  if (w->state == WATCH_IDLE) {
+    if (w->window_ms) {
+      w->state = WATCH_DELAYED;
+      w->deadline = watch_now_ms() + w->window_ms;
+      w->next_delayed = h->delayed;
+      h->delayed = w;
+      if (!h->next_deadline || w->deadline < h->next_deadline)
+        h->next_deadline = w->deadline;
+    } else {
+      w->state = WATCH_READY;
+      signal = 1;
+    }
+  }
+  pthread_mutex_unlock(&w->mutx);
+  if (signal)
+    w->ready(w->arg);
+}
+
+/**
+ * @name watch_fan_out - Hands a change to the watchers of its key and of its prefixes. Notifier only, holding the read lock.
+ * @param h: The hub.
+ * @param ch: The change.
+ *
+ * @return
+ */
+static void watch_fan_out(WatchHub *h, Change *ch) {
+  Sub *s;
+  uint64_t hash = WATCH_HASH_INIT;
+  int k, done = 0;
+
+  h->seq++;
+  for (s = h->buckets[ch->hash & (WATCH_BUCKETS - 1)]; s; s = s->next)
+    if (!s->prefix && s->hash == ch->hash && s->len == ch->key_len && !memcmp(s->pattern, ch->data, s->len))
+      watch_deliver(h, s->w, ch);
+
+  // One lookup per prefix length watched, hashing the key as it goes.
+  for (k = 0; k < h->num_lens && h->lens[k] <= ch->key_len; k++) {
+    hash = watch_hash(hash, ch->data + done, h->lens[k] - done);
+    done = h->lens[k];
+    for (s = h->buckets[hash & (WATCH_BUCKETS - 1)]; s; s = s->next)
+      if (s->prefix && s->hash == hash && s->len == done && !memcmp(s->pattern, ch->data, done))
+        watch_deliver(h, s->w, ch);
+  }
+}
+
+/**
+ * @name watch_expire - Makes the watchers whose window ended ready. Notifier only, holding the read lock.
+ * @param h: The hub.
+ * @param now: The time (msecs).
+ *
+ * @return
+ */
+static void watch_expire(WatchHub *h, int64_t now) {
+  Watcher **prev = &h->delayed, *w;
+
+  h->next_deadline = 0;
+  while ((w = *prev)) {
+    pthread_mutex_lock(&w->mutx);
+    if (w->deadline <= now) {
+      *prev = w->next_delayed;
+      w->state = WATCH_READY;
+      pthread_mutex_unlock(&w->mutx);
+      w->ready(w->arg);
+      continue;
+    }
+    if (!h->next_deadline || w->deadline < h->next_deadline)
+      h->next_deadline = w->deadline;
+    pthread_mutex_unlock(&w->mutx);
+    prev = &w->next_delayed;
+  }
+}
+
+/**
+ * @name watch_notifier - The notifier thread: fans the queued changes out, ends the watchers' windows.
+ * @param arg: The hub.
+ *
+ * @return
+ */
+static void *watch_notifier(void *arg) {
+  WatchHub *h = (WatchHub *) arg;
+  Watcher *w;
+  Change *batch, *ch;
+  struct timespec until;
+  unsigned long lost;
+  int64_t deadline;
+  int signal;
+
+  pthread_mutex_lock(&h->mutx);
+  while (1) {
+    deadline = h->next_deadline;       // Only the notifier writes it.
+    while (!h->head && !h->lost) {
+      h->sleeping = 1;
+      if (!deadline) {
+        pthread_cond_wait(&h->wake, &h->mutx);
+      } else {
+        until.tv_sec = deadline / 1000;
+        until.tv_nsec = (deadline % 1000) * 1000000;
+        if (pthread_cond_timedwait(&h->wake, &h->mutx, &until) == ETIMEDOUT) {
+          h->sleeping = 0;
+          break;
+        }
+      }
+      h->sleeping = 0;
+    }
+    batch = h->head;
+    h->head = h->tail = NULL;
+    h->queued = 0;
+    lost = h->lost;
+    h->lost = 0;
+    pthread_mutex_unlock(&h->mutx);
+
+    pthread_rwlock_rdlock(&h->lock);
+    if (lost) {
+      // The queue overflowed: any watcher may have missed a change.
+      for (w = h->watchers; w; w = w->next) {
+        pthread_mutex_lock(&w->mutx);
+        w->dropped++;
+        if ((signal = (w->state == WATCH_IDLE)))
+          w->state = WATCH_READY;
+        pthread_mutex_unlock(&w->mutx);
+        if (signal)
+          w->ready(w->arg);
+      }
+      __sync_fetch_and_add(&h->dropped, lost);
+    }
+    for (ch = batch; ch; ch = batch) {
+      batch = ch->next;
+      watch_fan_out(h, ch);
+      watch_unref(ch);
+    }
+    if (h->next_deadline && h->next_deadline <= watch_now_ms())
+      watch_expire(h, watch_now_ms());
+    pthread_rwlock_unlock(&h->lock);
+
+    pthread_mutex_lock(&h->mutx);
+  }
+  return NULL;
+}
+
+/**
+ * @name watch_open - Starts the notifier.
+ * @param key_size: Key size.
+ * @param value_size: Value size.
+ *
+ * @return The hub on Success. NULL on Error.
+ */
+WatchHub *watch_open(unsigned long key_size, unsigned long value_size) {
+  WatchHub *h;
+
+  if (!(h = (WatchHub *) calloc(1, sizeof(WatchHub))))
+    return NULL;
+  h->key_size = key_size;
+  h->value_size = value_size;
+  if (!(h->prefix_subs = (int *) calloc(key_size + 1, sizeof(int))) ||
+      !(h->lens = (int *) calloc(key_size + 1, sizeof(int)))) {
+    free(h->prefix_subs);
+    free(h);
+    return NULL;
+  }
+  pthread_rwlock_init(&h->lock, NULL);
+  pthread_mutex_init(&h->mutx, NULL);
+  pthread_cond_init(&h->wake, NULL);
+  if (pthread_create(&h->notifier, NULL, watch_notifier, h)) {
+    fprintf(stderr, "(Error) watch_open: Cannot create the notifier thread.\n");
+    free(h->lens);
+    free(h->prefix_subs);
+    free(h);
+    return NULL;
+  }
+  return h;
+}
+
+/**
+ * @name watch_publish - Queues a committed change for the notifier.
+ * @param h: The hub.
+ * @param key: The key ('\0'-terminated, or key_size bytes).
+ * @param value: The value (likewise), or NULL for a DELETE.
+ *
+ * Called holding the commit lock, so the changes are queued (and told) in commit order.
+ * @return
+ */
+void watch_publish(WatchHub *h, const char *key, const char *value) {
+  Change *ch;
+  int key_len, value_len;
+
+  if (!h || !__atomic_load_n(&h->num_watchers, __ATOMIC_RELAXED))
+    return;                            // No one to tell.
+  key_len = strnlen(key, h->key_size);
+  value_len = value ? (int) strnlen(value, h->value_size) : -1;
+  if (!(ch = (Change *) malloc(sizeof(Change) + key_len + 1 + (value_len > 0 ? value_len : 0) + 1))) {
+    pthread_mutex_lock(&h->mutx);
+    h->lost++;
+    pthread_mutex_unlock(&h->mutx);
+    return;
+  }
+  ch->next = NULL;
+  ch->refs = 1;
+  ch->key_len = key_len;
+  ch->value_len = value_len;
+  memcpy(ch->data, key, key_len);
+  ch->data[key_len] = '\0';
+  if (value_len >= 0)
+    memcpy(ch->data + key_len + 1, value, value_len);
+  ch->data[key_len + 1 + (value_len > 0 ? value_len : 0)] = '\0';
+  ch->hash = watch_hash(WATCH_HASH_INIT, key, key_len);
+
+  pthread_mutex_lock(&h->mutx);
+  if (h->queued >= WATCH_QUEUE) {
+    h->lost++;                         // The notifier is behind: its watchers will be told.
+    free(ch);
+  } else {
+    if (h->tail)
+      h->tail->next = ch;
+    else
+      h->head = ch;
+    h->tail = ch;
+    if (++h->queued > h->queue_max)
+      h->queue_max = h->queued;
+  }
+  if (h->sleeping)
+    pthread_cond_signal(&h->wake);
+  pthread_mutex_unlock(&h->mutx);
+}
+
+/**
+ * @name watch_new - Creates a watcher, of nothing yet.
+ * @param h: The hub.
+ * @param ready: Called by the notifier once the watcher has changes to take.
+ * @param arg: Passed to 'ready'.
+ *
+ * @return The watcher on Success. NULL on Error.
+ */
+Watcher *watch_new(WatchHub *h, WatchReady ready, void *arg) {
+  Watcher *w;
+
+  if (!(w = (Watcher *) calloc(1, sizeof(Watcher))))
+    return NULL;
+  w->hub = h;
+  w->tail = &w->head;
+  w->ready = ready;
+  w->arg = arg;
+  pthread_mutex_init(&w->mutx, NULL);
+
+  pthread_rwlock_wrlock(&h->lock);
+  w->next = h->watchers;
+  if (h->watchers)
+    h->watchers->prev = w;
+  h->watchers = w;
+  __atomic_store_n(&h->num_watchers, h->num_watchers + 1, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&h->lock);
+  return w;
+}
+
+/**
+ * @name watch_parse - Splits a pattern into the key or prefix and whether it's a prefix.
+ * @param h: The hub.
+ * @param pattern: A key, or a prefix followed by '*'.
+ * @param len: Gets the length of the key or prefix.
+ *
+ * @return 1 for a prefix, 0 for a key.
+ */
+static int watch_parse(WatchHub *h, const char *pattern, int *len) {
+  *len = strnlen(pattern, h->key_size);
+  if (*len && pattern[*len - 1] == '*') {
+    (*len)--;
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @name watch_add - Subscribes a watcher to a key or a prefix.
+ * @param w: The watcher.
+ * @param pattern: A key, or a prefix followed by '*'.
+ *
+ * @return 0 on Success. 1 if it already watches it. -1 on Error.
+ */
+int watch_add(Watcher *w, const char *pattern) {
+  WatchHub *h = w->hub;
+  Sub *s;
+  int len, prefix, k;
+
+  prefix = watch_parse(h, pattern, &len);
+  if (!prefix && !len)
+    return -1;
+  for (s = w->subs; s; s = s->next_of)
+    if (s->prefix == prefix && s->len == len && !memcmp(s->pattern, pattern, len))
+      return 1;
+  if (!(s = (Sub *) malloc(sizeof(Sub) + len)))
+    return -1;
+  s->w = w;
+  s->len = len;
+  s->prefix = prefix;
+  memcpy(s->pattern, pattern, len);
+  s->hash = watch_hash(WATCH_HASH_INIT, pattern, len);
+
+  pthread_rwlock_wrlock(&h->lock);
+  s->next = h->buckets[s->hash & (WATCH_BUCKETS - 1)];
+  h->buckets[s->hash & (WATCH_BUCKETS - 1)] = s;
+  s->next_of = w->subs;
+  w->subs = s;
+  if (prefix && !h->prefix_subs[len]++) {
+    for (k = h->num_lens; k > 0 && h->lens[k - 1] > len; k--)
+      h->lens[k] = h->lens[k - 1];
+    h->lens[k] = len;
+    h->num_lens++;
+  }
+  pthread_rwlock_unlock(&h->lock);
+  return 0;
+}
+
+// Unlinks a subscription from its bucket and the prefix lengths. Holding the write lock.
+static void watch_unlink(WatchHub *h, Sub *s) {
+  Sub **prev;
+  int k;
+
+  for (prev = &h->buckets[s->hash & (WATCH_BUCKETS - 1)]; *prev != s; prev = &(*prev)->next)
+    ;
+  *prev = s->next;
+  if (s->prefix && !--h->prefix_subs[s->len]) {
+    for (k = 0; h->lens[k] != s->len; k++)
+      ;
+    memmove(h->lens + k, h->lens + k + 1, (h->num_lens - k - 1) * sizeof(int));
+    h->num_lens--;
+  }
+}
+
+/**
+ * @name watch_remove - Unsubscribes a watcher from a key or a prefix.
+ * @param w: The watcher.
+ * @param pattern: As given to watch_add().
+ *
+ * Changes already pending for it are still told.
+ * @return 0 on Success. 1 if it didn't watch it.
+ */
+int watch_remove(Watcher *w, const char *pattern) {
+  WatchHub *h = w->hub;
+  Sub **prev, *s;
+  int len, prefix;
+
+  prefix = watch_parse(h, pattern, &len);
+  pthread_rwlock_wrlock(&h->lock);
+  for (prev = &w->subs; (s = *prev); prev = &s->next_of)
+    if (s->prefix == prefix && s->len == len && !memcmp(s->pattern, pattern, len))
+      break;
+  if (s) {
+    *prev = s->next_of;
+    watch_unlink(h, s);
+  }
+  pthread_rwlock_unlock(&h->lock);
+  free(s);
+  return s ? 0 : 1;
+}
+
+/**
+ * @name watch_window - Sets the window a watcher's changes are coalesced over.
+ * @param w: The watcher.
+ * @param window_ms: Msecs (0: every change is told as soon as it's fanned out).
+ *
+ * @return
+ */
+void watch_window(Watcher *w, int window_ms) {
+  Pending **slots = NULL;
+
+  if (window_ms < 0)
+    window_ms = 0;
+  if (window_ms > WATCH_WINDOW_MAX)
+    window_ms = WATCH_WINDOW_MAX;
+  if (window_ms && !w->slots)
+    slots = (Pending **) calloc(WATCH_SLOTS, sizeof(Pending *));
+  pthread_mutex_lock(&w->mutx);
+  w->window_ms = window_ms;
+  if (slots)
+    w->slots = slots;                  // Changes pending already aren't in it: not coalesced.
+  pthread_mutex_unlock(&w->mutx);
+}
+
+/**
+ * @name watch_take - Takes a ready watcher's pending changes.
+ * @param w: The watcher.
+ * @param emit: Called for each change, in order.
+ * @param arg: Passed to 'emit'.
+ *
+ * Does nothing unless 'ready' was called; afterwards, the next change calls it again.
+ * @return Changes dropped since the last call.
+ */
+unsigned long watch_take(Watcher *w, WatchEmit emit, void *arg) {
+  Pending *p, *next;
+  unsigned long dropped;
+
+  pthread_mutex_lock(&w->mutx);
+  if (w->state != WATCH_READY) {
+    pthread_mutex_unlock(&w->mutx);
+    return 0;
+  }
+  p = w->head;
+  w->head = NULL;
+  w->tail = &w->head;
+  w->bytes = 0;
+  if (w->slots)
+    memset(w->slots, 0, WATCH_SLOTS * sizeof(Pending *));
+  dropped = w->dropped;
+  w->dropped = 0;
+  w->state = WATCH_IDLE;
+  pthread_mutex_unlock(&w->mutx);
+
+  for (; p; p = next) {
+    next = p->next;
+    emit(arg, p->change->data, p->change->value_len < 0 ? NULL : p->change->data + p->change->key_len + 1);
+    watch_unref(p->change);
+    free(p);
+  }
+  return dropped;
+}
+
+/**
+ * @name watch_close - Unsubscribes a watcher from everything and frees it.
+ * @param w: The watcher.
+ *
+ * @return
+ */
+void watch_close(Watcher *w) {
+  WatchHub *h = w->hub;
+  Watcher **prev;
+  Sub *s;
+  Pending *p;
+
+  // The write lock waits for the notifier: once it's held, 'ready' isn't running, and won't be called.
+  pthread_rwlock_wrlock(&h->lock);
+  while ((s = w->subs)) {
+    w->subs = s->next_of;
+    watch_unlink(h, s);
+    free(s);
+  }
+  if (w->prev)
+    w->prev->next = w->next;
+  else
+    h->watchers = w->next;
+  if (w->next)
+    w->next->prev = w->prev;
+  __atomic_store_n(&h->num_watchers, h->num_watchers - 1, __ATOMIC_RELAXED);
+  if (w->state == WATCH_DELAYED) {
+    for (prev = &h->delayed; *prev != w; prev = &(*prev)->next_delayed)
+      ;
+    *prev = w->next_delayed;
+  }
+  pthread_rwlock_unlock(&h->lock);
+
+  while ((p = w->head)) {
+    w->head = p->next;
+    watch_unref(p->change);
+    free(p);
+  }
+  free(w->slots);
+  pthread_mutex_destroy(&w->mutx);
+  free(w);
+}
+
+/**
+ * @name watch_stats - Reports the notifier's queue and the watchers.
+ * @param h: The hub.
+ * @param queued: Gets the changes queued for the notifier.
+ * @param queue_max: Gets the most there were.
+ * @param watchers: Gets the watchers.
+ * @param dropped: Gets the changes dropped so far (per watcher that missed them).
+ *
+ * @return
+ */
+void watch_stats(WatchHub *h, int *queued, int *queue_max, int *watchers, unsigned long *dropped) {
+  pthread_mutex_lock(&h->mutx);
+  *queued = h->queued;
+  *queue_max = h->queue_max;
+  pthread_mutex_unlock(&h->mutx);
+  *watchers = __atomic_load_n(&h->num_watchers, __ATOMIC_RELAXED);
+  *dropped = __sync_fetch_and_add(&h->dropped, 0);
+}
@@ -0,0 +1,68 @@
+/* watch.h
+
+   Change subscriptions: connections that watch keys, or key prefixes,
+   and are told of every PUT/DELETE committed to them.
+
+   A commit only queues its change for the notifier thread (nothing at all
+   while no one watches), so PUTs don't wait for the watchers. The
+   notifier matches a change against the subscriptions with one hash
+   lookup for its key plus one per distinct prefix length watched, and
+   appends it to each matching watcher's pending changes. A watcher with
+   a window gets them at most once per window, only the last change of
+   each key (coalesced); without one, every change in commit order.
+
+   A watcher's pending changes are bounded (WATCH_BUFFER bytes): past
+   that, a slow watcher's changes are dropped and it's told so once it
+   takes the rest, to re-read what it watches. So are all watchers' if
+   the notifier falls WATCH_QUEUE changes behind.
+
+*/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#define WATCH_QUEUE     65536  // Changes queued for the notifier, at most.
+#define WATCH_BUFFER    65536  // Pending bytes per watcher, at most.
+#define WATCH_BUCKETS    4096  // Subscription hash table buckets (a power of 2).
+#define WATCH_SLOTS       256  // Per watcher with a window: buckets of its pending keys (a power of 2).
+#define WATCH_WINDOW_MAX 60000 // Longest window, in msecs.
+
+typedef struct watchhub WatchHub;
+typedef struct watcher Watcher;
+
+// Called by the notifier when a watcher has changes to take (once, until watch_take() takes them).
+typedef void (*WatchReady)(void *arg);
+
+// Called by watch_take() for each change: 'value' is NULL for a DELETE.
+typedef void (*WatchEmit)(void *arg, const char *key, const char *value);
+
+// start the notifier for keys and values of up to 'key_size' and 'value_size' bytes. NULL on error.
+WatchHub *watch_open(unsigned long key_size, unsigned long value_size);
+
+// a committed change of 'key' ('value' NULL: a DELETE). Call it in commit order.
+void watch_publish(WatchHub *h, const char *key, const char *value);
+
+// a new watcher, of nothing yet; 'ready' is called with 'arg'. NULL on error.
+Watcher *watch_new(WatchHub *h, WatchReady ready, void *arg);
+
+// watch 'pattern': a key, or a prefix followed by '*' ("*" watches all keys). 0 on success, 1 if already watched,
+// -1 on error.
+int watch_add(Watcher *w, const char *pattern);
+
+// stop watching 'pattern'. 0 on success, 1 if it wasn't watched.
+int watch_remove(Watcher *w, const char *pattern);
+
+// coalesce the watcher's changes over 'window_ms' msecs (0: none).
+void watch_window(Watcher *w, int window_ms);
+
+// once 'ready' was called: pass the pending changes to 'emit', in order. The number of changes dropped since the
+// last call (0 if none).
+unsigned long watch_take(Watcher *w, WatchEmit emit, void *arg);
+
+// stop watching and free the watcher; 'ready' isn't called for it any more.
+void watch_close(Watcher *w);
+
+// changes queued for the notifier (and the most there were), watchers and changes dropped so far.
+void watch_stats(WatchHub *h, int *queued, int *queue_max, int *watchers, unsigned long *dropped);
+
+#endif